@@ -0,0 +1,130 @@
+#include "bench_util.h"
+
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+/*
+ * 连接风暴：在一秒内均匀地发起connections个非阻塞连接，每个连接收到欢迎消息后关闭，
+ * 统计从connect到收到欢迎消息的延迟；监听队列溢出时SYN被丢弃，客户端1秒后才重传，表现为超过100ms的停顿
+ * 分别测listen_backlog=10（原来的MAX_LISTEN_NUMBER）和默认配置
+ * 用法：make bench，或者 ./bench/accept_bench [连接数] [--key=value ...]
+ */
+
+static const long STALL_NS = 100 * 1000000L;
+/* 最后一个连接发起后最多再等这么久，没有收到欢迎消息的记为失败 */
+static const long SETTLE_NS = 5 * 1000000000L;
+
+static bool run_case(const char* program, const char* name, const std::vector<std::string>& options,
+                     const std::string& root, long connections)
+{
+    bench_server_t server;
+    if (!bench_start_server(program, options, root, server))
+        return false;
+
+    struct sockaddr_in addr;
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(server.control_port);
+    inet_pton(AF_INET, server.address.c_str(), &addr.sin_addr);
+
+    /* 同时未完成的连接数受fd上限限制，服务器在子进程中也有同样多的fd */
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    long fd_limit = static_cast<long>(std::min<rlim_t>(limit.rlim_cur, 1 << 20));
+    long window = std::max(16L, fd_limit - 64);
+    std::vector<long> started(fd_limit, 0);
+    std::vector<long> latencies;
+    latencies.reserve(connections);
+
+    int epollfd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event events[256];
+    long issued = 0, outstanding = 0, failed = 0;
+    long start = bench_now_ns();
+    long now = start;
+    long last_issue = start;
+    while ((issued < connections || outstanding > 0) && now - last_issue < SETTLE_NS)
+    {
+        long due = std::min(connections, (now - start) * connections / 1000000000L + 1);
+        for (; issued < due && outstanding < window; ++issued)
+        {
+            int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (fd < 0 || (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 && errno != EINPROGRESS))
+            {
+                if (fd >= 0)
+                    close(fd);
+                ++failed;
+                continue;
+            }
+            struct epoll_event event;
+            event.events = EPOLLIN;
+            event.data.fd = fd;
+            epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
+            started[fd] = bench_now_ns();
+            ++outstanding;
+            last_issue = started[fd];
+        }
+
+        int n = epoll_wait(epollfd, events, 256, 1);
+        now = bench_now_ns();
+        for (int i = 0; i < n; ++i)
+        {
+            int fd = events[i].data.fd;
+            char buffer[256];
+            if (recv(fd, buffer, sizeof(buffer), 0) > 0)
+                latencies.push_back(now - started[fd]);
+            else
+                ++failed;
+            close(fd);
+            --outstanding;
+        }
+    }
+    long elapsed = last_issue - start;
+    failed += outstanding;
+    close(epollfd);
+    bench_stop_server(server);
+    /* 剩下没有完成的连接随进程退出关闭 */
+
+    long stalls = 0;
+    for (size_t i = 0; i < latencies.size(); ++i)
+    {
+        if (latencies[i] > STALL_NS)
+            ++stalls;
+    }
+    long p50 = bench_percentile(latencies, 0.5);
+    long p99 = bench_percentile(latencies, 0.99);
+    long max = latencies.empty() ? 0 : latencies.back();
+    printf("%-16s %ld connects in %.2f s, welcome p50 %6.2f ms p99 %7.2f ms max %7.2f ms, stalls(>100ms) %ld, failed %ld\n",
+           name, connections, elapsed / 1e9, p50 / 1e6, p99 / 1e6, max / 1e6, stalls, failed);
+    fflush(stdout);
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    long connections = argc > 1 ? atol(argv[1]) : 20000;
+    if (connections <= 0)
+    {
+        std::cout << "usage: " << argv[0] << " [connections] [--key=value ...]" << std::endl;
+        return 1;
+    }
+
+    /* 提高到硬上限，服务器子进程继承 */
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+
+    std::vector<std::string> options = bench_options("ftp_accept_bench", 19995, 18884);
+    for (int i = 2; i < argc; ++i)
+    {
+        options.push_back(argv[i]);
+    }
+    std::vector<std::string> small = options;
+    small.push_back("--listen_backlog=10");
+
+    std::string root = bench_make_root("ftp_accept_bench");
+    bool ret = !root.empty() && run_case(argv[0], "listen_backlog=10", small, root, connections) &&
+               run_case(argv[0], "default", options, root, connections);
+    bench_remove_root(root);
+    return ret ? 0 : 1;
+}
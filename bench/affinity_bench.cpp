@@ -0,0 +1,175 @@
+#include "bench_util.h"
+#include "../threadpool/affinity.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <atomic>
+
+/*
+ * CPU绑定和NUMA放置对吞吐的影响：sessions个会话同时反复下载缓存中的文件，每个文件之间发一条SIZE，
+ * 报告下载吞吐和控制命令的p99延迟，比较三种放置：
+ *  unpinned 不绑定
+ *  local    主循环、命令线程、I/O线程都绑定在第一个节点的CPU上
+ *  remote   主循环在第一个节点，命令线程和I/O线程在第二个节点，每条命令和每次传输都跨节点
+ * 只有一个NUMA节点时把可用CPU分成两半当作两个节点模拟，只有一个CPU时三种放置相同
+ * 用法：make bench，或者 ./bench/affinity_bench [会话数] [秒数] [--key=value ...]
+ */
+
+static const off_t FILE_SIZE = 16LL << 20;
+
+struct affinity_flow_t
+{
+    bench_session_t session;
+    long bytes;
+    std::vector<long> latencies;
+    bool ret;
+    pthread_t thread;
+};
+
+static std::atomic<bool> g_is_stopping(false);
+
+static void* run_flow(void* arg)
+{
+    affinity_flow_t* flow = static_cast<affinity_flow_t*>(arg);
+    flow->ret = true;
+    std::string reply;
+    while (!g_is_stopping.load() && flow->ret)
+    {
+        long begin = bench_now_ns();
+        flow->ret = bench_command(flow->session.control, "SIZE affinity.bin", "", reply);
+        flow->latencies.push_back(bench_now_ns() - begin);
+        flow->ret = flow->ret && bench_retr(flow->session, "affinity.bin", FILE_SIZE);
+        flow->bytes += flow->ret ? FILE_SIZE : 0;
+    }
+    return NULL;
+}
+
+static std::string cpu_list(const std::vector<int>& cpus)
+{
+    std::string list;
+    for (size_t i = 0; i < cpus.size(); ++i)
+    {
+        list += (i == 0 ? "" : ",") + std::to_string(cpus[i]);
+    }
+    return list;
+}
+
+static bool run_case(const char* program, const char* name, const std::vector<std::string>& options,
+                     const std::string& root, int sessions, int seconds)
+{
+    bench_server_t server;
+    if (!bench_start_server(program, options, root, server))
+        return false;
+
+    std::vector<affinity_flow_t> flows(sessions);
+    bool ret = true;
+    for (int i = 0; i < sessions && ret; ++i)
+    {
+        flows[i].bytes = 0;
+        ret = bench_open_session(server, flows[i].session);
+    }
+
+    g_is_stopping = false;
+    int started = 0;
+    long start = bench_now_ns();
+    for (; started < sessions && ret; ++started)
+    {
+        pthread_create(&flows[started].thread, NULL, run_flow, &flows[started]);
+    }
+    if (ret)
+        sleep(seconds);
+    g_is_stopping = true;
+
+    long bytes = 0;
+    std::vector<long> latencies;
+    for (int i = 0; i < started; ++i)
+    {
+        pthread_join(flows[i].thread, NULL);
+        ret = ret && flows[i].ret;
+        bytes += flows[i].bytes;
+        latencies.insert(latencies.end(), flows[i].latencies.begin(), flows[i].latencies.end());
+    }
+    long elapsed = bench_now_ns() - start;
+    for (int i = 0; i < sessions; ++i)
+    {
+        bench_close_session(flows[i].session);
+    }
+    bench_stop_server(server);
+    if (!ret)
+    {
+        std::cout << name << ": transfer failed" << std::endl;
+        return false;
+    }
+
+    long p99 = bench_percentile(latencies, 0.99);
+    printf("%-9s RETR %8.1f MiB/s, SIZE p99 %6.2f ms\n", name, bytes / (elapsed / 1e9) / (1 << 20), p99 / 1e6);
+    fflush(stdout);
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    int sessions = argc > 1 ? atoi(argv[1]) : 4;
+    int seconds = argc > 2 ? atoi(argv[2]) : 3;
+    if (sessions <= 0 || seconds <= 0)
+    {
+        std::cout << "usage: " << argv[0] << " [sessions] [seconds] [--key=value ...]" << std::endl;
+        return 1;
+    }
+
+    /* 可用的CPU按节点分组，取前两个节点；只有一个节点时按CPU分成两半 */
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    sched_getaffinity(0, sizeof(set), &set);
+    std::vector<int> first, second;
+    int first_node = -1;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+    {
+        if (!CPU_ISSET(cpu, &set))
+            continue;
+        int node = CAffinity::cpu_node(cpu);
+        if (first_node == -1)
+            first_node = node;
+        if (node == first_node)
+            first.push_back(cpu);
+        else if (second.empty() || CAffinity::cpu_node(second[0]) == node)
+            second.push_back(cpu);
+    }
+    bool is_simulated = second.empty();
+    if (is_simulated)
+    {
+        size_t half = (first.size() + 1) / 2;
+        second.assign(first.begin() + std::min(half, first.size() - 1), first.end());
+        first.resize(half);
+    }
+    printf("%s topology: node A cpus %s, node B cpus %s%s\n", is_simulated ? "simulated" : "NUMA",
+           cpu_list(first).c_str(), cpu_list(second).c_str(),
+           first == second ? " (one CPU, all placements are the same)" : "");
+
+    std::string root = bench_make_root("ftp_affinity_bench");
+    bool ret = !root.empty() && bench_make_file(root + "/affinity.bin", FILE_SIZE);
+
+    std::vector<std::string> extra;
+    for (int i = 3; i < argc; ++i)
+    {
+        extra.push_back(argv[i]);
+    }
+    std::vector<std::string> unpinned = bench_options("ftp_affinity_bench", 19992, 18881);
+    std::vector<std::string> local = unpinned;
+    local.push_back("--main_cpu=" + std::to_string(first[0]));
+    local.push_back("--worker_cpus=" + cpu_list(first));
+    local.push_back("--io_cpus=" + cpu_list(first));
+    std::vector<std::string> remote = unpinned;
+    remote.push_back("--main_cpu=" + std::to_string(first[0]));
+    remote.push_back("--worker_cpus=" + cpu_list(second));
+    remote.push_back("--io_cpus=" + cpu_list(second));
+    unpinned.insert(unpinned.end(), extra.begin(), extra.end());
+    local.insert(local.end(), extra.begin(), extra.end());
+    remote.insert(remote.end(), extra.begin(), extra.end());
+
+    ret = ret && run_case(argv[0], "unpinned", unpinned, root, sessions, seconds) &&
+          run_case(argv[0], "local", local, root, sessions, seconds) &&
+          run_case(argv[0], "remote", remote, root, sessions, seconds);
+    bench_remove_root(root);
+    return ret ? 0 : 1;
+}
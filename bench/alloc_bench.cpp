@@ -0,0 +1,178 @@
+#include "../src/ftp_server.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+/*
+ * 控制命令的内存分配计数：在进程内启动服务器，用一个控制连接循环发送不涉及数据连接的命令，
+ * 预热之后统计整个进程（服务器主循环、工作线程、定时器）调用malloc的次数，除以命令数
+ * 用法：make bench，或者 ./bench/alloc_bench [命令数] [--key=value ...]，在仓库根目录运行，SIZE使用Makefile
+ */
+
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* ptr, size_t size);
+extern "C" void* __libc_memalign(size_t alignment, size_t size);
+
+static std::atomic<bool> g_is_counting(false);
+static std::atomic<long> g_allocations(0);
+
+static inline void count_allocation()
+{
+    if (g_is_counting.load(std::memory_order_relaxed))
+        g_allocations.fetch_add(1, std::memory_order_relaxed);
+}
+
+/* 替换glibc的分配函数，operator new和各个库的分配都经过这里 */
+extern "C" void* malloc(size_t size)
+{
+    count_allocation();
+    return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size)
+{
+    count_allocation();
+    return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* ptr, size_t size)
+{
+    count_allocation();
+    return __libc_realloc(ptr, size);
+}
+
+extern "C" int posix_memalign(void** ptr, size_t alignment, size_t size)
+{
+    count_allocation();
+    *ptr = __libc_memalign(alignment, size);
+    return *ptr == NULL ? ENOMEM : 0;
+}
+
+extern "C" void* aligned_alloc(size_t alignment, size_t size)
+{
+    count_allocation();
+    return __libc_memalign(alignment, size);
+}
+
+static const char* BENCH_COMMANDS[] = {"USER bench", "PASS bench", "PWD", "SIZE Makefile", "REST 0"};
+static const int BENCH_COMMAND_COUNT = sizeof(BENCH_COMMANDS) / sizeof(BENCH_COMMANDS[0]);
+static const long BENCH_WARMUP = 2000;
+
+static void* run_server(void* arg)
+{
+    static_cast<CFTPServer*>(arg)->run();
+    return NULL;
+}
+
+/* 发送一条命令并读取回复，命令和回复一问一答，一次recv读完 */
+static bool round_trip(int sockfd, const char* command)
+{
+    char buffer[512];
+    int n = snprintf(buffer, sizeof(buffer), "%s\r\n", command);
+    if (send(sockfd, buffer, n, MSG_NOSIGNAL) != n)
+    {
+        return false;
+    }
+    return recv(sockfd, buffer, sizeof(buffer), 0) > 0;
+}
+
+static bool run_commands(int sockfd, long count)
+{
+    for (long i = 0; i < count; ++i)
+    {
+        if (!round_trip(sockfd, BENCH_COMMANDS[i % BENCH_COMMAND_COUNT]))
+            return false;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    long commands = argc > 1 ? atol(argv[1]) : 20000;
+    if (commands <= 0)
+    {
+        std::cout << "usage: " << argv[0] << " [commands] [--key=value ...]" << std::endl;
+        return 1;
+    }
+
+    /* 固定线程数，线程池扩容创建线程的分配不计入 */
+    std::vector<std::string> options = {"--bind_address=127.0.0.1", "--control_port=19999", "--data_port=18888",
+                                        "--handoff_path=/tmp/ftp_alloc_bench.handoff", "--worker_threads=2",
+                                        "--worker_threads_max=2", "--io_threads=1", "--io_threads_max=1"};
+    for (int i = 2; i < argc; ++i)
+    {
+        options.push_back(argv[i]);
+    }
+    std::vector<char*> args(1, argv[0]);
+    for (size_t i = 0; i < options.size(); ++i)
+    {
+        args.push_back(&options[i][0]);
+    }
+
+    CConfig config;
+    if (!config.parse_args(static_cast<int>(args.size()), args.data()))
+    {
+        CConfig::usage(argv[0]);
+        return 1;
+    }
+    const ftp_config_t& ftp_config = config.get_config();
+
+    /* 服务器每条命令都打印日志，运行期间输出到/dev/null */
+    std::cout.flush();
+    int stdout_fd = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    close(null_fd);
+
+    CFTPServer ftp_server(config);
+    pthread_t server_thread;
+    pthread_create(&server_thread, NULL, run_server, &ftp_server);
+
+    struct sockaddr_in addr;
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(ftp_config.control_port);
+    inet_pton(AF_INET, ftp_config.bind_address.c_str(), &addr.sin_addr);
+
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    char welcome[256];
+    bool ret = sockfd >= 0 && connect(sockfd, (struct sockaddr*)&addr, sizeof(addr)) == 0 &&
+               recv(sockfd, welcome, sizeof(welcome), 0) > 0 && run_commands(sockfd, BENCH_WARMUP);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    g_is_counting = true;
+    ret = ret && run_commands(sockfd, commands);
+    g_is_counting = false;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    std::cout.flush();
+    dup2(stdout_fd, STDOUT_FILENO);
+    close(stdout_fd);
+    if (!ret)
+    {
+        std::cout << "cannot talk to the server on " << ftp_config.bind_address << ":" << ftp_config.control_port
+                  << std::endl;
+        _exit(1);
+    }
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    long allocations = g_allocations.load();
+    printf("%ld commands (USER/PASS/PWD/SIZE/REST), %.0f commands/s, %ld allocations, %.4f per command\n",
+           commands, commands / seconds, allocations, static_cast<double>(allocations) / commands);
+    fflush(stdout);
+    /* 服务器线程一直在主循环中，直接退出 */
+    _exit(0);
+}
@@ -0,0 +1,321 @@
+#pragma once
+
+#include "../src/ftp_server.h"
+#include "../src/tls.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+/*
+ * 吞吐和延迟基准测试的公共部分：服务器在子进程中运行，每种配置启动一次，测完直接杀掉
+ * 客户端用阻塞套接字按协议收发，回复没有行尾，一次recv读完；PASV按客户端地址排队，数据连接要逐个建立
+ */
+
+struct bench_server_t
+{
+    pid_t pid;
+    std::string address;
+    int control_port;
+    int data_port;
+};
+
+/* 控制连接和数据连接，ssl为NULL时是明文 */
+struct bench_conn_t
+{
+    int fd;
+    SSL* ssl;
+
+    bench_conn_t() : fd(-1), ssl(NULL)
+    {
+    }
+};
+
+struct bench_session_t
+{
+    bench_conn_t control;
+    bench_conn_t data;
+};
+
+static inline long bench_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* samples会被排序，p在0到1之间 */
+static inline long bench_percentile(std::vector<long>& samples, double p)
+{
+    if (samples.empty())
+        return 0;
+    std::sort(samples.begin(), samples.end());
+    size_t idx = static_cast<size_t>(p * samples.size());
+    return samples[std::min(idx, samples.size() - 1)];
+}
+
+/* 测试文件放在/var/tmp下，/tmp可能是tmpfs，测不出磁盘和页缓存的行为 */
+static inline std::string bench_make_root(const char* name)
+{
+    std::string path = std::string("/var/tmp/") + name + ".XXXXXX";
+    if (mkdtemp(&path[0]) == NULL)
+    {
+        std::cout << "cannot create " << path << ": " << strerror(errno) << std::endl;
+        return "";
+    }
+    return path;
+}
+
+static inline int bench_remove_entry(const char* path, const struct stat*, int, struct FTW*)
+{
+    remove(path);
+    return 0;
+}
+
+static inline void bench_remove_root(const std::string& root)
+{
+    if (!root.empty())
+        nftw(root.c_str(), bench_remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+static inline bool bench_make_file(const std::string& path, off_t size)
+{
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+    std::vector<char> buffer(1 << 20);
+    unsigned int seed = static_cast<unsigned int>(size);
+    for (size_t i = 0; i < buffer.size(); ++i)
+        buffer[i] = static_cast<char>(rand_r(&seed));
+    off_t written = 0;
+    while (written < size)
+    {
+        size_t length = static_cast<size_t>(std::min<off_t>(buffer.size(), size - written));
+        if (write(fd, buffer.data(), length) != static_cast<ssize_t>(length))
+        {
+            close(fd);
+            return false;
+        }
+        written += length;
+    }
+    return close(fd) == 0;
+}
+
+/* 每个基准测试用自己的端口和handoff路径，可以和正在运行的服务器共存 */
+static inline std::vector<std::string> bench_options(const char* name, int control_port, int data_port)
+{
+    return {"--bind_address=127.0.0.1", "--control_port=" + std::to_string(control_port),
+            "--data_port=" + std::to_string(data_port), std::string("--handoff_path=/tmp/") + name + ".handoff"};
+}
+
+static inline int bench_connect(const std::string& address, int port)
+{
+    struct sockaddr_in addr;
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, address.c_str(), &addr.sin_addr);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+    {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+static inline void bench_close(bench_conn_t& conn)
+{
+    if (conn.ssl != NULL)
+        SSL_free(conn.ssl);
+    if (conn.fd != -1)
+        close(conn.fd);
+    conn.fd = -1;
+    conn.ssl = NULL;
+}
+
+/*
+ * 服务器在root目录下运行，标准输出丢弃；启动失败或者5秒内控制端口不能连接时返回false
+ */
+static inline bool bench_start_server(const char* program, const std::vector<std::string>& options,
+                                      const std::string& root, bench_server_t& server)
+{
+    std::vector<std::string> strings = options;
+    std::vector<char*> args(1, const_cast<char*>(program));
+    for (size_t i = 0; i < strings.size(); ++i)
+    {
+        args.push_back(&strings[i][0]);
+    }
+    CConfig config;
+    if (!config.parse_args(static_cast<int>(args.size()), args.data()))
+    {
+        CConfig::usage(program);
+        return false;
+    }
+    server.address = config.get_config().bind_address;
+    server.control_port = config.get_config().control_port;
+    server.data_port = config.get_config().data_port;
+
+    std::cout.flush();
+    server.pid = fork();
+    if (server.pid < 0)
+    {
+        return false;
+    }
+    if (server.pid == 0)
+    {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        close(null_fd);
+        if (chdir(root.c_str()) != 0)
+            _exit(1);
+        CFTPServer ftp_server(config);
+        ftp_server.run();
+        _exit(0);
+    }
+
+    for (int i = 0; i < 500; ++i)
+    {
+        int fd = bench_connect(server.address, server.control_port);
+        if (fd >= 0)
+        {
+            close(fd);
+            return true;
+        }
+        if (waitpid(server.pid, NULL, WNOHANG) == server.pid)
+            break;
+        usleep(10000);
+    }
+    std::cout << "server did not start on " << server.address << ":" << server.control_port << std::endl;
+    kill(server.pid, SIGKILL);
+    waitpid(server.pid, NULL, 0);
+    return false;
+}
+
+static inline void bench_stop_server(bench_server_t& server)
+{
+    kill(server.pid, SIGKILL);
+    waitpid(server.pid, NULL, 0);
+}
+
+static inline bool bench_send_all(bench_conn_t& conn, const char* buffer, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t n = CTLSContext::send(conn.ssl, conn.fd, buffer, length);
+        if (n <= 0)
+            return false;
+        buffer += n;
+        length -= n;
+    }
+    return true;
+}
+
+/* 读取并丢弃length字节 */
+static inline bool bench_recv_exact(bench_conn_t& conn, off_t length)
+{
+    static __thread char buffer[1 << 18];
+    while (length > 0)
+    {
+        ssize_t n = CTLSContext::recv(conn.ssl, conn.fd, buffer, std::min<off_t>(sizeof(buffer), length));
+        if (n <= 0)
+            return false;
+        length -= n;
+    }
+    return true;
+}
+
+static inline bool bench_reply(bench_conn_t& conn, std::string& reply)
+{
+    char buffer[1024];
+    ssize_t n = CTLSContext::recv(conn.ssl, conn.fd, buffer, sizeof(buffer));
+    if (n <= 0)
+        return false;
+    reply.assign(buffer, n);
+    return true;
+}
+
+/* 发送一条命令并读取回复，回复不以prefix开头时返回false */
+static inline bool bench_command(bench_conn_t& conn, const std::string& command, const char* prefix,
+                                 std::string& reply)
+{
+    std::string line = command + "\r\n";
+    return bench_send_all(conn, line.data(), line.size()) && bench_reply(conn, reply) &&
+           reply.compare(0, strlen(prefix), prefix) == 0;
+}
+
+/*
+ * 建立控制连接和被动模式的数据连接，tls不为NULL时控制连接AUTH TLS，数据连接PROT P，数据连接在第一次传输时握手
+ */
+static inline bool bench_open_session(const bench_server_t& server, bench_session_t& session,
+                                      CTLSContext* tls = NULL)
+{
+    std::string reply;
+    session.control.fd = bench_connect(server.address, server.control_port);
+    if (session.control.fd < 0 || !bench_reply(session.control, reply))
+        return false;
+    if (tls != NULL)
+    {
+        if (!bench_command(session.control, "AUTH TLS", "234", reply))
+            return false;
+        session.control.ssl = tls->connect(session.control.fd);
+        if (session.control.ssl == NULL || !bench_command(session.control, "PBSZ 0", "200", reply) ||
+            !bench_command(session.control, "PROT P", "200", reply))
+            return false;
+    }
+    if (!bench_command(session.control, "PASV", "(", reply))
+        return false;
+    session.data.fd = bench_connect(server.address, server.data_port);
+    /* 等主循环把数据连接和会话对应起来，下一个会话的数据连接才不会错配 */
+    usleep(20000);
+    return session.data.fd >= 0;
+}
+
+static inline void bench_close_session(bench_session_t& session)
+{
+    bench_close(session.data);
+    bench_close(session.control);
+}
+
+static inline bool bench_secure_data(bench_session_t& session, CTLSContext* tls)
+{
+    if (tls == NULL || session.data.ssl != NULL)
+        return true;
+    session.data.ssl = tls->connect(session.data.fd);
+    return session.data.ssl != NULL;
+}
+
+/* 下载size字节的文件，数据连接在传输后保持打开 */
+static inline bool bench_retr(bench_session_t& session, const std::string& filename, off_t size,
+                              CTLSContext* tls = NULL)
+{
+    std::string reply;
+    return bench_command(session.control, "RETR " + filename, "retr parse success", reply) &&
+           bench_secure_data(session, tls) && bench_recv_exact(session.data, size);
+}
+
+/* 上传length字节，收到服务器的完成回复才返回 */
+static inline bool bench_stor(bench_session_t& session, const std::string& filename, const char* buffer,
+                              size_t length, CTLSContext* tls = NULL)
+{
+    std::string reply;
+    return bench_command(session.control, "STOR " + filename + "<" + std::to_string(length) + ">",
+                         "recv command success", reply) &&
+           bench_secure_data(session, tls) && bench_send_all(session.data, buffer, length) &&
+           bench_reply(session.control, reply) && reply.compare(0, 18, "store file success") == 0;
+}
@@ -0,0 +1,202 @@
+#include "bench_util.h"
+
+#include <sys/mman.h>
+#include <pthread.h>
+#include <atomic>
+
+/*
+ * 大文件传输对页缓存的影响：一个会话RETR一个不在缓存中的大文件、再STOR同样大小的文件，
+ * 另一个会话同时反复下载32个1MiB的热文件；每次下载前用mincore统计热文件在页缓存中的比例，作为命中率
+ * cache_bypass为off、dontneed、direct各测一次，报告热文件命中率和p99延迟、大文件吞吐以及传输后留在页缓存中的大文件字节数
+ * 大文件超过空闲内存时才会挤出热文件，默认1024MiB，可以用第一个参数调大
+ * 用法：make bench，或者 ./bench/cache_bench [大文件MiB] [--key=value ...]
+ */
+
+static const int HOT_FILES = 32;
+static const off_t HOT_FILE_SIZE = 1LL << 20;
+static const size_t SEND_CHUNK = 1 << 20;
+
+struct hot_reader_t
+{
+    bench_session_t session;
+    std::string root;
+    long resident;
+    long total;
+    std::vector<long> latencies;
+    bool ret;
+    pthread_t thread;
+};
+
+static std::atomic<bool> g_is_stopping(false);
+
+/* 文件在页缓存中的字节数 */
+static off_t resident_bytes(const std::string& path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat statinfo;
+    if (fd < 0 || fstat(fd, &statinfo) != 0 || statinfo.st_size == 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        return 0;
+    }
+    void* addr = mmap(NULL, statinfo.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+        return 0;
+    long page = sysconf(_SC_PAGESIZE);
+    std::vector<unsigned char> pages((statinfo.st_size + page - 1) / page);
+    off_t resident = 0;
+    if (mincore(addr, statinfo.st_size, pages.data()) == 0)
+    {
+        for (size_t i = 0; i < pages.size(); ++i)
+            resident += (pages[i] & 1) ? page : 0;
+    }
+    munmap(addr, statinfo.st_size);
+    return std::min(resident, statinfo.st_size);
+}
+
+/* 写回并丢弃文件的页缓存，每种配置从同样的状态开始 */
+static void drop_cache(const std::string& path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd >= 0)
+    {
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+static void warm_cache(const std::string& path)
+{
+    char buffer[1 << 16];
+    int fd = open(path.c_str(), O_RDONLY);
+    while (fd >= 0 && read(fd, buffer, sizeof(buffer)) > 0)
+    {
+    }
+    if (fd >= 0)
+        close(fd);
+}
+
+static std::string hot_name(int i)
+{
+    return "hot" + std::to_string(i) + ".bin";
+}
+
+static void* run_hot_reader(void* arg)
+{
+    hot_reader_t* reader = static_cast<hot_reader_t*>(arg);
+    reader->ret = true;
+    unsigned int seed = 1;
+    while (!g_is_stopping.load() && reader->ret)
+    {
+        std::string name = hot_name(rand_r(&seed) % HOT_FILES);
+        reader->resident += resident_bytes(reader->root + "/" + name);
+        reader->total += HOT_FILE_SIZE;
+        long begin = bench_now_ns();
+        reader->ret = bench_retr(reader->session, name, HOT_FILE_SIZE);
+        reader->latencies.push_back(bench_now_ns() - begin);
+    }
+    return NULL;
+}
+
+/* 上传size字节，数据为重复的chunk */
+static bool stor_stream(bench_session_t& session, const std::string& filename, const std::vector<char>& chunk,
+                        off_t size)
+{
+    std::string reply;
+    if (!bench_command(session.control, "STOR " + filename + "<" + std::to_string(size) + ">",
+                       "recv command success", reply))
+        return false;
+    for (off_t sent = 0; sent < size; sent += chunk.size())
+    {
+        if (!bench_send_all(session.data, chunk.data(), std::min<off_t>(chunk.size(), size - sent)))
+            return false;
+    }
+    return bench_reply(session.control, reply) && reply.compare(0, 18, "store file success") == 0;
+}
+
+static bool run_case(const char* program, const char* name, const std::vector<std::string>& options,
+                     const std::string& root, off_t bulk_size)
+{
+    drop_cache(root + "/bulk.bin");
+    drop_cache(root + "/upload.bin");
+    unlink((root + "/upload.bin").c_str());
+    for (int i = 0; i < HOT_FILES; ++i)
+        warm_cache(root + "/" + hot_name(i));
+
+    bench_server_t server;
+    if (!bench_start_server(program, options, root, server))
+        return false;
+
+    bench_session_t bulk;
+    hot_reader_t reader;
+    reader.root = root;
+    reader.resident = 0;
+    reader.total = 0;
+    bool ret = bench_open_session(server, bulk) && bench_open_session(server, reader.session);
+    g_is_stopping = false;
+    bool is_started = ret && pthread_create(&reader.thread, NULL, run_hot_reader, &reader) == 0;
+
+    std::vector<char> chunk(SEND_CHUNK, 'x');
+    long start = bench_now_ns();
+    ret = is_started && bench_retr(bulk, "bulk.bin", bulk_size) && stor_stream(bulk, "upload.bin", chunk, bulk_size);
+    long bulk_ns = bench_now_ns() - start;
+
+    g_is_stopping = true;
+    if (is_started)
+    {
+        pthread_join(reader.thread, NULL);
+        ret = ret && reader.ret;
+    }
+    bench_close_session(bulk);
+    bench_close_session(reader.session);
+    bench_stop_server(server);
+    if (!ret)
+    {
+        std::cout << name << ": transfer failed" << std::endl;
+        return false;
+    }
+
+    off_t polluted = resident_bytes(root + "/bulk.bin") + resident_bytes(root + "/upload.bin");
+    long p99 = bench_percentile(reader.latencies, 0.99);
+    printf("cache_bypass=%-8s hot hit rate %6.2f%% p99 %7.2f ms, bulk %7.1f MiB/s, bulk left in page cache %6.0f MiB\n",
+           name, reader.total > 0 ? 100.0 * reader.resident / reader.total : 0.0, p99 / 1e6,
+           2.0 * bulk_size / (bulk_ns / 1e9) / (1 << 20), polluted / 1048576.0);
+    fflush(stdout);
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    off_t bulk_size = (argc > 1 ? atol(argv[1]) : 1024) * (1LL << 20);
+    if (bulk_size <= 0)
+    {
+        std::cout << "usage: " << argv[0] << " [bulk MiB] [--key=value ...]" << std::endl;
+        return 1;
+    }
+
+    std::string root = bench_make_root("ftp_cache_bench");
+    bool ret = !root.empty() && bench_make_file(root + "/bulk.bin", bulk_size);
+    for (int i = 0; i < HOT_FILES && ret; ++i)
+    {
+        ret = bench_make_file(root + "/" + hot_name(i), HOT_FILE_SIZE);
+    }
+
+    /* 热文件低于阈值，大文件高于阈值 */
+    const char* modes[] = {"off", "dontneed", "direct"};
+    for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]) && ret; ++i)
+    {
+        std::vector<std::string> options = bench_options("ftp_cache_bench", 19993, 18882);
+        options.push_back(std::string("--cache_bypass=") + modes[i]);
+        options.push_back("--cache_bypass_size=" + std::to_string(64LL << 20));
+        for (int j = 2; j < argc; ++j)
+        {
+            options.push_back(argv[j]);
+        }
+        ret = run_case(argv[0], modes[i], options, root, bulk_size);
+    }
+    bench_remove_root(root);
+    return ret ? 0 : 1;
+}
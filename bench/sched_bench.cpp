@@ -0,0 +1,147 @@
+#include "bench_util.h"
+
+#include <pthread.h>
+#include <atomic>
+
+/*
+ * 混合负载下的调度公平性和尾延迟：bulk个会话不停下载大文件，另一个会话依次下载小文件
+ * 分别测空载、interactive_weight=1（小文件和大文件同权）和默认权重，报告小文件延迟的p50/p99/max、
+ * 大文件总吞吐以及各个大文件会话字节数的Jain公平指数（1表示完全均分）
+ * 用法：make bench，或者 ./bench/sched_bench [bulk会话数] [小文件次数] [--key=value ...]
+ */
+
+static const off_t BULK_FILE_SIZE = 64LL << 20;
+/* 默认sched_quantum的4倍：默认权重下一个时间片传完，同权时要排4轮 */
+static const off_t SMALL_FILE_SIZE = 1LL << 20;
+
+struct bulk_flow_t
+{
+    bench_session_t session;
+    std::atomic<long> bytes;
+    pthread_t thread;
+};
+
+static std::atomic<bool> g_is_stopping(false);
+
+/* 服务器被杀掉后recv失败，线程退出 */
+static void* run_bulk(void* arg)
+{
+    bulk_flow_t* flow = static_cast<bulk_flow_t*>(arg);
+    while (!g_is_stopping.load() && bench_retr(flow->session, "bulk.bin", BULK_FILE_SIZE))
+    {
+        flow->bytes.fetch_add(BULK_FILE_SIZE);
+    }
+    return NULL;
+}
+
+static bool run_case(const char* program, const char* name, const std::vector<std::string>& options,
+                     const std::string& root, int bulk, int requests)
+{
+    bench_server_t server;
+    if (!bench_start_server(program, options, root, server))
+        return false;
+
+    std::vector<bulk_flow_t> flows(bulk);
+    bench_session_t probe;
+    bool ret = bench_open_session(server, probe);
+    for (int i = 0; i < bulk && ret; ++i)
+    {
+        flows[i].bytes = 0;
+        ret = bench_open_session(server, flows[i].session);
+    }
+
+    g_is_stopping = false;
+    int started = 0;
+    for (; started < bulk && ret; ++started)
+    {
+        pthread_create(&flows[started].thread, NULL, run_bulk, &flows[started]);
+    }
+    /* 等大文件会话都进入轮转 */
+    usleep(200000);
+
+    std::vector<long> latencies;
+    long start = bench_now_ns();
+    for (int i = 0; i < requests && ret; ++i)
+    {
+        long begin = bench_now_ns();
+        ret = bench_retr(probe, "small.bin", SMALL_FILE_SIZE);
+        latencies.push_back(bench_now_ns() - begin);
+    }
+    long elapsed = bench_now_ns() - start;
+    std::vector<long> bytes(bulk);
+    for (int i = 0; i < bulk; ++i)
+    {
+        bytes[i] = flows[i].bytes.load();
+    }
+
+    g_is_stopping = true;
+    bench_stop_server(server);
+    for (int i = 0; i < started; ++i)
+    {
+        pthread_join(flows[i].thread, NULL);
+    }
+    for (int i = 0; i < bulk; ++i)
+    {
+        bench_close_session(flows[i].session);
+    }
+    bench_close_session(probe);
+    if (!ret)
+    {
+        std::cout << name << ": transfer failed" << std::endl;
+        return false;
+    }
+
+    /* 计数按整个文件累加，只下载了不到一个文件的会话记为0 */
+    double sum = 0, square = 0;
+    for (int i = 0; i < bulk; ++i)
+    {
+        sum += bytes[i];
+        square += static_cast<double>(bytes[i]) * bytes[i];
+    }
+    double seconds = elapsed / 1e9;
+    long p50 = bench_percentile(latencies, 0.5);
+    long p99 = bench_percentile(latencies, 0.99);
+    printf("%-22s small 1MiB p50 %7.2f ms p99 %7.2f ms max %7.2f ms", name, p50 / 1e6, p99 / 1e6,
+           latencies.back() / 1e6);
+    if (bulk > 0)
+        printf(", bulk %7.1f MiB/s, jain %.3f", sum / seconds / (1 << 20), square > 0 ? sum * sum / (bulk * square) : 0.0);
+    printf("\n");
+    fflush(stdout);
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    int bulk = argc > 1 ? atoi(argv[1]) : 8;
+    int requests = argc > 2 ? atoi(argv[2]) : 200;
+    if (bulk <= 0 || requests <= 0)
+    {
+        std::cout << "usage: " << argv[0] << " [bulk sessions] [small requests] [--key=value ...]" << std::endl;
+        return 1;
+    }
+
+    /* 一个I/O线程，所有传输都经过调度器轮转 */
+    std::vector<std::string> options = bench_options("ftp_sched_bench", 19997, 18886);
+    options.push_back("--io_threads=1");
+    options.push_back("--io_threads_max=1");
+    for (int i = 3; i < argc; ++i)
+    {
+        options.push_back(argv[i]);
+    }
+
+    std::string root = bench_make_root("ftp_sched_bench");
+    if (root.empty() || !bench_make_file(root + "/bulk.bin", BULK_FILE_SIZE) ||
+        !bench_make_file(root + "/small.bin", SMALL_FILE_SIZE))
+    {
+        bench_remove_root(root);
+        return 1;
+    }
+
+    std::vector<std::string> equal = options;
+    equal.push_back("--interactive_weight=1");
+    bool ret = run_case(argv[0], "idle", options, root, 0, requests) &&
+               run_case(argv[0], "interactive_weight=1", equal, root, bulk, requests) &&
+               run_case(argv[0], "default weights", options, root, bulk, requests);
+    bench_remove_root(root);
+    return ret ? 0 : 1;
+}
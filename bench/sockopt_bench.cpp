@@ -0,0 +1,120 @@
+#include "bench_util.h"
+
+#include <fstream>
+
+/*
+ * 套接字选项组合的对比：每种组合启动一次服务器，一个会话
+ *  控制连接：连续发送2000条SIZE，报告往返延迟的p50/p99
+ *  数据连接：单流RETR缓存中的文件和STOR同样大小的数据各rounds次，报告MiB/s
+ * 回环上没有传输延迟，缓冲区和拥塞控制的差别在高RTT的链路上才明显，这里主要看各组合的开销
+ * 用法：make bench，或者 ./bench/sockopt_bench [文件MiB] [次数] [--key=value ...]
+ */
+
+static const int COMMANDS = 2000;
+
+static bool run_case(const char* program, const char* name, const std::vector<std::string>& options,
+                     const std::string& root, const std::vector<char>& buffer, int rounds)
+{
+    bench_server_t server;
+    if (!bench_start_server(program, options, root, server))
+        return false;
+
+    bench_session_t session;
+    std::string reply;
+    std::vector<long> latencies;
+    bool ret = bench_open_session(server, session);
+    for (int i = 0; i < COMMANDS && ret; ++i)
+    {
+        long begin = bench_now_ns();
+        ret = bench_command(session.control, "SIZE sockopt.bin", "", reply);
+        latencies.push_back(bench_now_ns() - begin);
+    }
+
+    /* 第一次下载不计时 */
+    ret = ret && bench_retr(session, "sockopt.bin", buffer.size());
+    long start = bench_now_ns();
+    for (int i = 0; i < rounds && ret; ++i)
+        ret = bench_retr(session, "sockopt.bin", buffer.size());
+    long retr_ns = bench_now_ns() - start;
+    start = bench_now_ns();
+    for (int i = 0; i < rounds && ret; ++i)
+        ret = bench_stor(session, "upload.bin", buffer.data(), buffer.size());
+    long stor_ns = bench_now_ns() - start;
+
+    bench_close_session(session);
+    bench_stop_server(server);
+    if (!ret)
+    {
+        std::cout << name << ": transfer failed" << std::endl;
+        return false;
+    }
+
+    long p50 = bench_percentile(latencies, 0.5);
+    long p99 = bench_percentile(latencies, 0.99);
+    double mib = static_cast<double>(buffer.size()) * rounds / (1 << 20);
+    printf("%-30s SIZE p50 %6.3f ms p99 %6.3f ms, RETR %8.1f MiB/s, STOR %8.1f MiB/s\n", name, p50 / 1e6, p99 / 1e6,
+           mib / (retr_ns / 1e9), mib / (stor_ns / 1e9));
+    fflush(stdout);
+    return true;
+}
+
+/* 内核没有加载的拥塞控制算法设置会失败，只测可用的 */
+static bool is_congestion_available(const std::string& name)
+{
+    std::ifstream file("/proc/sys/net/ipv4/tcp_available_congestion_control");
+    std::string available;
+    while (file >> available)
+    {
+        if (available == name)
+            return true;
+    }
+    return false;
+}
+
+int main(int argc, char* argv[])
+{
+    size_t size = (argc > 1 ? atol(argv[1]) : 64) * (1UL << 20);
+    int rounds = argc > 2 ? atoi(argv[2]) : 4;
+    if (size == 0 || rounds <= 0)
+    {
+        std::cout << "usage: " << argv[0] << " [file MiB] [rounds] [--key=value ...]" << std::endl;
+        return 1;
+    }
+
+    std::vector<char> buffer(size);
+    unsigned int seed = 1;
+    for (size_t i = 0; i < buffer.size(); ++i)
+        buffer[i] = static_cast<char>(rand_r(&seed));
+
+    std::vector<std::vector<std::string> > profiles = {
+        {},
+        {"--control_nodelay=off"},
+        {"--data_send_buffer=65536", "--data_recv_buffer=65536"},
+        {"--data_send_buffer=4194304", "--data_recv_buffer=4194304", "--data_notsent_lowat=131072"},
+        {"--data_cork=on"},
+        {"--control_busy_poll=50", "--data_busy_poll=50"},
+    };
+    std::vector<std::string> names = {"default (control_nodelay=on)", "control_nodelay=off", "data buffers 64K",
+                                      "data buffers 4M, lowat 128K", "data_cork=on", "busy_poll=50us"};
+    if (is_congestion_available("bbr"))
+    {
+        profiles.push_back({"--data_congestion=bbr"});
+        names.push_back("data_congestion=bbr");
+    }
+
+    std::string root = bench_make_root("ftp_sockopt_bench");
+    bool ret = !root.empty() && bench_make_file(root + "/sockopt.bin", size);
+
+    for (size_t i = 0; i < profiles.size() && ret; ++i)
+    {
+        std::vector<std::string> options = bench_options("ftp_sockopt_bench", 19991, 18880);
+        options.insert(options.end(), profiles[i].begin(), profiles[i].end());
+        for (int j = 3; j < argc; ++j)
+        {
+            options.push_back(argv[j]);
+        }
+        ret = run_case(argv[0], names[i].c_str(), options, root, buffer, rounds);
+    }
+    bench_remove_root(root);
+    return ret ? 0 : 1;
+}
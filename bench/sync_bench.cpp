@@ -0,0 +1,141 @@
+#include "bench_util.h"
+
+#include <pthread.h>
+
+/*
+ * STOR持久性策略的延迟和吞吐：每种store_sync配置启动一次服务器
+ *  小文件：sessions个会话同时各上传files个64KiB的新文件，报告每秒文件数和从STOR到成功回复的p50/p99延迟
+ *  大文件：一个会话上传一个256MiB的文件，报告包括回复前同步在内的MiB/s
+ * 最后一种配置在fdatasync的基础上开启store_writebehind，上传过程中按段写回
+ * 用法：make bench，或者 ./bench/sync_bench [会话数] [每个会话的文件数] [--key=value ...]
+ */
+
+static const size_t SMALL_FILE_SIZE = 64 << 10;
+static const size_t BIG_FILE_SIZE = 256 << 20;
+
+struct uploader_t
+{
+    bench_session_t session;
+    std::string prefix;
+    int files;
+    const std::vector<char>* buffer;
+    std::vector<long> latencies;
+    bool ret;
+    pthread_t thread;
+};
+
+static void* run_uploader(void* arg)
+{
+    uploader_t* uploader = static_cast<uploader_t*>(arg);
+    uploader->ret = true;
+    for (int i = 0; i < uploader->files && uploader->ret; ++i)
+    {
+        long begin = bench_now_ns();
+        uploader->ret = bench_stor(uploader->session, uploader->prefix + std::to_string(i), uploader->buffer->data(),
+                                   SMALL_FILE_SIZE);
+        uploader->latencies.push_back(bench_now_ns() - begin);
+    }
+    return NULL;
+}
+
+static bool run_case(const char* program, const char* name, const std::vector<std::string>& options,
+                     const std::string& root, const std::string& dir, const std::vector<char>& buffer, int sessions,
+                     int files)
+{
+    if (mkdir((root + "/" + dir).c_str(), 0755) != 0)
+        return false;
+
+    bench_server_t server;
+    if (!bench_start_server(program, options, root, server))
+        return false;
+
+    std::vector<uploader_t> uploaders(sessions);
+    bool ret = true;
+    for (int i = 0; i < sessions && ret; ++i)
+    {
+        uploaders[i].prefix = dir + "/s" + std::to_string(i) + "_";
+        uploaders[i].files = files;
+        uploaders[i].buffer = &buffer;
+        ret = bench_open_session(server, uploaders[i].session);
+    }
+
+    int started = 0;
+    long start = bench_now_ns();
+    for (; started < sessions && ret; ++started)
+    {
+        pthread_create(&uploaders[started].thread, NULL, run_uploader, &uploaders[started]);
+    }
+    std::vector<long> latencies;
+    for (int i = 0; i < started; ++i)
+    {
+        pthread_join(uploaders[i].thread, NULL);
+        ret = ret && uploaders[i].ret;
+        latencies.insert(latencies.end(), uploaders[i].latencies.begin(), uploaders[i].latencies.end());
+    }
+    long small_ns = bench_now_ns() - start;
+
+    start = bench_now_ns();
+    ret = ret && bench_stor(uploaders[0].session, dir + "/big.bin", buffer.data(), BIG_FILE_SIZE);
+    long big_ns = bench_now_ns() - start;
+
+    for (int i = 0; i < sessions; ++i)
+    {
+        bench_close_session(uploaders[i].session);
+    }
+    bench_stop_server(server);
+    if (!ret)
+    {
+        std::cout << name << ": upload failed" << std::endl;
+        return false;
+    }
+
+    long p50 = bench_percentile(latencies, 0.5);
+    long p99 = bench_percentile(latencies, 0.99);
+    printf("%-26s small %7.0f files/s p50 %7.2f ms p99 %7.2f ms, big %7.1f MiB/s\n", name,
+           latencies.size() / (small_ns / 1e9), p50 / 1e6, p99 / 1e6, BIG_FILE_SIZE / (big_ns / 1e9) / (1 << 20));
+    fflush(stdout);
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    int sessions = argc > 1 ? atoi(argv[1]) : 8;
+    int files = argc > 2 ? atoi(argv[2]) : 100;
+    if (sessions <= 0 || files <= 0)
+    {
+        std::cout << "usage: " << argv[0] << " [sessions] [files per session] [--key=value ...]" << std::endl;
+        return 1;
+    }
+
+    /* 小文件用缓冲区的开头 */
+    std::vector<char> buffer(BIG_FILE_SIZE);
+    unsigned int seed = 1;
+    for (size_t i = 0; i < buffer.size(); ++i)
+        buffer[i] = static_cast<char>(rand_r(&seed));
+
+    const char* modes[][2] = {{"store_sync=none", NULL},
+                              {"store_sync=fdatasync", NULL},
+                              {"store_sync=group", NULL},
+                              {"store_sync=fdatasync", "store_writebehind=8388608"}};
+    const char* names[] = {"none", "fdatasync", "group", "fdatasync + writebehind 8M"};
+
+    std::string root = bench_make_root("ftp_sync_bench");
+    bool ret = !root.empty();
+    for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]) && ret; ++i)
+    {
+        std::vector<std::string> options = bench_options("ftp_sync_bench", 19994, 18883);
+        for (int j = 0; j < 2; ++j)
+        {
+            if (modes[i][j] != NULL)
+                options.push_back(std::string("--") + modes[i][j]);
+        }
+        for (int j = 3; j < argc; ++j)
+        {
+            options.push_back(argv[j]);
+        }
+        /* 每种配置上传到自己的目录，都是新建文件 */
+        ret = run_case(argv[0], names[i], options, root, "sync" + std::to_string(i), buffer, sessions, files);
+    }
+    bench_remove_root(root);
+    return ret ? 0 : 1;
+}
@@ -0,0 +1,135 @@
+#include "bench_util.h"
+
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+
+/*
+ * 回环上明文、用户态TLS和kTLS的RETR/STOR吞吐：三种配置各启动一次服务器，
+ * 同一个会话连续下载缓存中的文件rounds次、上传同样大小的文件rounds次，分别报告MiB/s
+ * kTLS时客户端也开启kTLS，内核不支持时两端都退回用户态，结果后面标出
+ * 用法：make bench，或者 ./bench/tls_bench [文件MiB] [次数] [--key=value ...]
+ */
+
+/* 自签名的P-256证书，SAN为127.0.0.1，客户端把它作为CA校验 */
+static bool write_certificate(const std::string& cert_file, const std::string& key_file)
+{
+    EVP_PKEY* pkey = NULL;
+    EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+    bool ret = ctx != NULL && EVP_PKEY_keygen_init(ctx) == 1 &&
+               EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx, NID_X9_62_prime256v1) == 1 && EVP_PKEY_keygen(ctx, &pkey) == 1;
+    EVP_PKEY_CTX_free(ctx);
+
+    X509* x509 = ret ? X509_new() : NULL;
+    X509_EXTENSION* extension = NULL;
+    if (x509 != NULL)
+    {
+        ASN1_INTEGER_set(X509_get_serialNumber(x509), 1);
+        X509_gmtime_adj(X509_getm_notBefore(x509), 0);
+        X509_gmtime_adj(X509_getm_notAfter(x509), 86400);
+        X509_set_pubkey(x509, pkey);
+        X509_NAME* name = X509_get_subject_name(x509);
+        X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char*)"127.0.0.1", -1, -1, 0);
+        X509_set_issuer_name(x509, name);
+        extension = X509V3_EXT_conf_nid(NULL, NULL, NID_subject_alt_name, const_cast<char*>("IP:127.0.0.1"));
+        ret = extension != NULL && X509_add_ext(x509, extension, -1) == 1 && X509_sign(x509, pkey, EVP_sha256()) > 0;
+    }
+
+    FILE* cert = ret ? fopen(cert_file.c_str(), "w") : NULL;
+    FILE* key = ret ? fopen(key_file.c_str(), "w") : NULL;
+    ret = cert != NULL && key != NULL && PEM_write_X509(cert, x509) == 1 &&
+          PEM_write_PrivateKey(key, pkey, NULL, NULL, 0, NULL, NULL) == 1;
+    if (cert != NULL)
+        ret = fclose(cert) == 0 && ret;
+    if (key != NULL)
+        ret = fclose(key) == 0 && ret;
+
+    X509_EXTENSION_free(extension);
+    X509_free(x509);
+    EVP_PKEY_free(pkey);
+    if (!ret)
+        ERR_print_errors_fp(stderr);
+    return ret;
+}
+
+static bool run_case(const char* program, const char* name, const std::vector<std::string>& options,
+                     const std::string& root, CTLSContext* tls, off_t size, int rounds)
+{
+    bench_server_t server;
+    if (!bench_start_server(program, options, root, server))
+        return false;
+
+    std::vector<char> buffer(size);
+    unsigned int seed = 1;
+    for (off_t i = 0; i < size; ++i)
+        buffer[i] = static_cast<char>(rand_r(&seed));
+
+    bench_session_t session;
+    /* 第一次下载包括数据连接的握手，不计时 */
+    bool ret = bench_open_session(server, session, tls) && bench_retr(session, "tls.bin", size, tls);
+    long start = bench_now_ns();
+    for (int i = 0; i < rounds && ret; ++i)
+        ret = bench_retr(session, "tls.bin", size, tls);
+    long retr_ns = bench_now_ns() - start;
+    start = bench_now_ns();
+    for (int i = 0; i < rounds && ret; ++i)
+        ret = bench_stor(session, "upload.bin", buffer.data(), buffer.size(), tls);
+    long stor_ns = bench_now_ns() - start;
+    bool is_ktls = session.data.ssl != NULL && CTLSContext::is_ktls_send(session.data.ssl) &&
+                   CTLSContext::is_ktls_recv(session.data.ssl);
+
+    bench_close_session(session);
+    bench_stop_server(server);
+    if (!ret)
+    {
+        std::cout << name << ": transfer failed" << std::endl;
+        return false;
+    }
+
+    double mib = static_cast<double>(size) * rounds / (1 << 20);
+    printf("%-14s RETR %8.1f MiB/s, STOR %8.1f MiB/s%s\n", name, mib / (retr_ns / 1e9), mib / (stor_ns / 1e9),
+           tls != NULL && !is_ktls && strcmp(name, "ktls") == 0 ? " (kTLS unavailable, userspace fallback)" : "");
+    fflush(stdout);
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    off_t size = (argc > 1 ? atol(argv[1]) : 128) * (1LL << 20);
+    int rounds = argc > 2 ? atoi(argv[2]) : 4;
+    if (size <= 0 || rounds <= 0)
+    {
+        std::cout << "usage: " << argv[0] << " [file MiB] [rounds] [--key=value ...]" << std::endl;
+        return 1;
+    }
+
+    std::string root = bench_make_root("ftp_tls_bench");
+    std::string cert_file = root + "/cert.pem";
+    std::string key_file = root + "/key.pem";
+    if (root.empty() || !bench_make_file(root + "/tls.bin", size) || !write_certificate(cert_file, key_file))
+    {
+        bench_remove_root(root);
+        return 1;
+    }
+
+    std::vector<std::string> options = bench_options("ftp_tls_bench", 19996, 18885);
+    options.push_back("--tls_certificate=" + cert_file);
+    options.push_back("--tls_private_key=" + key_file);
+    for (int i = 3; i < argc; ++i)
+    {
+        options.push_back(argv[i]);
+    }
+    std::vector<std::string> userspace = options;
+    userspace.push_back("--tls_ktls=off");
+    std::vector<std::string> ktls = options;
+    ktls.push_back("--tls_ktls=on");
+
+    CTLSContext userspace_tls, ktls_tls;
+    bool ret = userspace_tls.create_client(false, "127.0.0.1", cert_file, true) &&
+               ktls_tls.create_client(true, "127.0.0.1", cert_file, true) &&
+               run_case(argv[0], "plaintext", options, root, NULL, size, rounds) &&
+               run_case(argv[0], "userspace TLS", userspace, root, &userspace_tls, size, rounds) &&
+               run_case(argv[0], "ktls", ktls, root, &ktls_tls, size, rounds);
+    bench_remove_root(root);
+    return ret ? 0 : 1;
+}
@@ -0,0 +1,342 @@
+#include "ascii.h"
+
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <cerrno>
+#include <vector>
+#include <algorithm>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/* crlf_size()每次读取的字节数 */
+static const size_t ASCII_READ_BUFFER = 256 * 1024;
+
+/*
+ * 复制一个块，mask标记的LF之前插入CR，返回输出的结尾
+ */
+static inline char* expand_block(const char* in, size_t i, size_t width, uint32_t mask, char* p)
+{
+    size_t start = i;
+    while (mask != 0)
+    {
+        size_t pos = i + __builtin_ctz(mask);
+        memcpy(p, in + start, pos - start);
+        p += pos - start;
+        *p++ = '\r';
+        /* LF随下一段复制 */
+        start = pos;
+        mask &= mask - 1;
+    }
+    memcpy(p, in + start, i + width - start);
+    return p + (i + width - start);
+}
+
+/*
+ * 复制一个块，去掉mask标记的CR中后面紧跟LF的那些，块中最后一个CR的下一个字节在后面的块中；
+ * CR是整个输入的最后一个字节时留到下一次调用
+ */
+static inline char* collapse_block(const char* in, size_t i, size_t width, size_t length, uint32_t mask,
+                                   char* p, bool& pending_cr)
+{
+    size_t start = i;
+    while (mask != 0)
+    {
+        size_t pos = i + __builtin_ctz(mask);
+        if (pos + 1 == length || in[pos + 1] == '\n')
+        {
+            memcpy(p, in + start, pos - start);
+            p += pos - start;
+            start = pos + 1;
+            if (pos + 1 == length)
+            {
+                pending_cr = true;
+            }
+        }
+        mask &= mask - 1;
+    }
+    memcpy(p, in + start, i + width - start);
+    return p + (i + width - start);
+}
+
+size_t CAsciiConvert::to_crlf(const char* in, size_t length, char* out)
+{
+#if defined(__x86_64__)
+    static const bool is_avx2 = __builtin_cpu_supports("avx2");
+    if (is_avx2)
+    {
+        return to_crlf_avx2(in, length, out);
+    }
+    return to_crlf_sse2(in, length, out);
+#else
+    return to_crlf_software(in, length, out);
+#endif
+}
+
+/*
+ * 上一块留下的CR先和这一块的第一个字节一起处理
+ */
+size_t CAsciiConvert::to_lf(const char* in, size_t length, char* out, bool& pending_cr)
+{
+    size_t n = 0;
+    if (pending_cr && length > 0)
+    {
+        pending_cr = false;
+        if (in[0] == '\n')
+        {
+            out[n++] = '\n';
+            ++in;
+            --length;
+        }
+        else
+        {
+            out[n++] = '\r';
+        }
+    }
+#if defined(__x86_64__)
+    static const bool is_avx2 = __builtin_cpu_supports("avx2");
+    if (is_avx2)
+    {
+        return n + to_lf_avx2(in, length, out + n, pending_cr);
+    }
+    return n + to_lf_sse2(in, length, out + n, pending_cr);
+#else
+    return n + to_lf_software(in, length, out + n, pending_cr);
+#endif
+}
+
+size_t CAsciiConvert::finish_lf(char* out, bool& pending_cr)
+{
+    if (!pending_cr)
+    {
+        return 0;
+    }
+    pending_cr = false;
+    out[0] = '\r';
+    return 1;
+}
+
+size_t CAsciiConvert::count_lf(const char* data, size_t length)
+{
+#if defined(__x86_64__)
+    static const bool is_avx2 = __builtin_cpu_supports("avx2");
+    if (is_avx2)
+    {
+        return count_lf_avx2(data, length);
+    }
+    return count_lf_sse2(data, length);
+#else
+    return count_lf_software(data, length);
+#endif
+}
+
+bool CAsciiConvert::crlf_size(int fd, off_t length, off_t& size)
+{
+    std::vector<char> buffer(ASCII_READ_BUFFER);
+    off_t offset = 0;
+    size = length;
+    while (offset < length)
+    {
+        ssize_t n = pread(fd, buffer.data(), std::min<off_t>(length - offset, buffer.size()), offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0)
+        {
+            return false;
+        }
+        size += count_lf(buffer.data(), n);
+        offset += n;
+    }
+    return true;
+}
+
+size_t CAsciiConvert::to_crlf_software(const char* in, size_t length, char* out)
+{
+    char* p = out;
+    for (size_t i = 0; i < length; ++i)
+    {
+        if (in[i] == '\n')
+        {
+            *p++ = '\r';
+        }
+        *p++ = in[i];
+    }
+    return p - out;
+}
+
+size_t CAsciiConvert::to_lf_software(const char* in, size_t length, char* out, bool& pending_cr)
+{
+    char* p = out;
+    for (size_t i = 0; i < length; ++i)
+    {
+        if (in[i] == '\r' && i + 1 == length)
+        {
+            pending_cr = true;
+            break;
+        }
+        if (in[i] == '\r' && in[i + 1] == '\n')
+        {
+            continue;
+        }
+        *p++ = in[i];
+    }
+    return p - out;
+}
+
+size_t CAsciiConvert::count_lf_software(const char* data, size_t length)
+{
+    return std::count(data, data + length, '\n');
+}
+
+#if defined(__x86_64__)
+size_t CAsciiConvert::to_crlf_sse2(const char* in, size_t length, char* out)
+{
+    const __m128i lf = _mm_set1_epi8('\n');
+    char* p = out;
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(x, lf));
+        if (mask == 0)
+        {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(p), x);
+            p += 16;
+            continue;
+        }
+        p = expand_block(in, i, 16, mask, p);
+    }
+    return (p - out) + to_crlf_software(in + i, length - i, p);
+}
+
+size_t CAsciiConvert::to_lf_sse2(const char* in, size_t length, char* out, bool& pending_cr)
+{
+    const __m128i cr = _mm_set1_epi8('\r');
+    char* p = out;
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(x, cr));
+        if (mask == 0)
+        {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(p), x);
+            p += 16;
+            continue;
+        }
+        p = collapse_block(in, i, 16, length, mask, p, pending_cr);
+    }
+    return (p - out) + to_lf_software(in + i, length - i, p, pending_cr);
+}
+
+size_t CAsciiConvert::count_lf_sse2(const char* data, size_t length)
+{
+    const __m128i lf = _mm_set1_epi8('\n');
+    size_t count = 0;
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(x, lf)));
+    }
+    return count + count_lf_software(data + i, length - i);
+}
+
+__attribute__((target("avx2")))
+size_t CAsciiConvert::to_crlf_avx2(const char* in, size_t length, char* out)
+{
+    const __m256i lf = _mm256_set1_epi8('\n');
+    char* p = out;
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32)
+    {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, lf));
+        if (mask == 0)
+        {
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), x);
+            p += 32;
+            continue;
+        }
+        p = expand_block(in, i, 32, mask, p);
+    }
+    return (p - out) + to_crlf_sse2(in + i, length - i, p);
+}
+
+__attribute__((target("avx2")))
+size_t CAsciiConvert::to_lf_avx2(const char* in, size_t length, char* out, bool& pending_cr)
+{
+    const __m256i cr = _mm256_set1_epi8('\r');
+    char* p = out;
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32)
+    {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, cr));
+        if (mask == 0)
+        {
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), x);
+            p += 32;
+            continue;
+        }
+        p = collapse_block(in, i, 32, length, mask, p, pending_cr);
+    }
+    return (p - out) + to_lf_sse2(in + i, length - i, p, pending_cr);
+}
+
+/*
+ * 比较结果每个匹配字节为-1，按字节累加到计数向量中，最多255次后用psadbw求和，避免8位计数溢出
+ */
+__attribute__((target("avx2")))
+size_t CAsciiConvert::count_lf_avx2(const char* data, size_t length)
+{
+    const __m256i lf = _mm256_set1_epi8('\n');
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i total = zero;
+    size_t i = 0;
+    while (i + 32 <= length)
+    {
+        __m256i counts = zero;
+        for (int round = 0; round < 255 && i + 32 <= length; ++round, i += 32)
+        {
+            __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+            counts = _mm256_sub_epi8(counts, _mm256_cmpeq_epi8(x, lf));
+        }
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(counts, zero));
+    }
+    size_t count = _mm256_extract_epi64(total, 0) + _mm256_extract_epi64(total, 1) +
+                   _mm256_extract_epi64(total, 2) + _mm256_extract_epi64(total, 3);
+    return count + count_lf_sse2(data + i, length - i);
+}
+#else
+size_t CAsciiConvert::to_crlf_sse2(const char* in, size_t length, char* out)
+{
+    return to_crlf_software(in, length, out);
+}
+
+size_t CAsciiConvert::to_lf_sse2(const char* in, size_t length, char* out, bool& pending_cr)
+{
+    return to_lf_software(in, length, out, pending_cr);
+}
+
+size_t CAsciiConvert::count_lf_sse2(const char* data, size_t length)
+{
+    return count_lf_software(data, length);
+}
+
+size_t CAsciiConvert::to_crlf_avx2(const char* in, size_t length, char* out)
+{
+    return to_crlf_software(in, length, out);
+}
+
+size_t CAsciiConvert::to_lf_avx2(const char* in, size_t length, char* out, bool& pending_cr)
+{
+    return to_lf_software(in, length, out, pending_cr);
+}
+
+size_t CAsciiConvert::count_lf_avx2(const char* data, size_t length)
+{
+    return count_lf_software(data, length);
+}
+#endif
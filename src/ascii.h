@@ -0,0 +1,34 @@
+#pragma once
+
+#include <sys/types.h>
+#include <stddef.h>
+
+/*
+ * TYPE A的行尾转换：发送时每个LF变成CRLF，接收时CRLF变成LF，其他字节（包括单独的CR）不变，两个方向互为逆变换
+ * CPU支持AVX2时每次检查32字节，否则用SSE2每次16字节，块中没有LF/CR时整块复制，有时只在这些位置处理
+ * 数据按任意长度分块转换：to_crlf没有跨块的状态，to_lf把块末尾的CR留到下一块确定后面是否为LF
+ */
+class CAsciiConvert
+{
+public:
+    /* out至少2 * length字节，返回输出的字节数 */
+    static size_t to_crlf(const char* in, size_t length, char* out);
+    /* out至少length + 1字节，pending_cr为上一块末尾还没有输出的CR，每个流从false开始 */
+    static size_t to_lf(const char* in, size_t length, char* out, bool& pending_cr);
+    /* 流结束时输出留下的CR，out至少1字节 */
+    static size_t finish_lf(char* out, bool& pending_cr);
+    static size_t count_lf(const char* data, size_t length);
+    /* 文件[0, length)按TYPE A发送的字节数，即length加上LF的个数 */
+    static bool crlf_size(int fd, off_t length, off_t& size);
+
+private:
+    static size_t to_crlf_software(const char* in, size_t length, char* out);
+    static size_t to_crlf_sse2(const char* in, size_t length, char* out);
+    static size_t to_crlf_avx2(const char* in, size_t length, char* out);
+    static size_t to_lf_software(const char* in, size_t length, char* out, bool& pending_cr);
+    static size_t to_lf_sse2(const char* in, size_t length, char* out, bool& pending_cr);
+    static size_t to_lf_avx2(const char* in, size_t length, char* out, bool& pending_cr);
+    static size_t count_lf_software(const char* data, size_t length);
+    static size_t count_lf_sse2(const char* data, size_t length);
+    static size_t count_lf_avx2(const char* data, size_t length);
+};
@@ -0,0 +1,521 @@
+#include "checksum.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <strings.h>
+#include <string.h>
+#include <stdio.h>
+#include <cerrno>
+#include <vector>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+const size_t CHECKSUM_READ_BUFFER = 0x40000;
+
+namespace
+{
+struct crc_table_t
+{
+    uint32_t entry[256];
+
+    crc_table_t(uint32_t polynomial)
+    {
+        for (uint32_t i = 0; i < 256; ++i)
+        {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k)
+            {
+                c = (c & 1) ? (polynomial ^ (c >> 1)) : (c >> 1);
+            }
+            entry[i] = c;
+        }
+    }
+};
+
+const uint64_t XXH_PRIME64_1 = 0x9E3779B185EBCA87ULL;
+const uint64_t XXH_PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+const uint64_t XXH_PRIME64_3 = 0x165667B19E3779F9ULL;
+const uint64_t XXH_PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+const uint64_t XXH_PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+inline uint32_t rotr32(uint32_t x, int r)
+{
+    return (x >> r) | (x << (32 - r));
+}
+
+inline uint64_t read64(const unsigned char* p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint32_t read32(const unsigned char* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+inline uint64_t xxh64_merge_round(uint64_t acc, uint64_t val)
+{
+    acc ^= xxh64_round(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+const uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+void sha256_transform(uint32_t h[8], const unsigned char* block)
+{
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i)
+    {
+        w[i] = (uint32_t(block[i * 4]) << 24) | (uint32_t(block[i * 4 + 1]) << 16) |
+               (uint32_t(block[i * 4 + 2]) << 8) | uint32_t(block[i * 4 + 3]);
+    }
+    for (int i = 16; i < 64; ++i)
+    {
+        uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+    for (int i = 0; i < 64; ++i)
+    {
+        uint32_t s1 = rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25);
+        uint32_t ch = (e & f) ^ (~e & g);
+        uint32_t t1 = k + s1 + ch + SHA256_K[i] + w[i];
+        uint32_t s0 = rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22);
+        uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = s0 + maj;
+        k = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+    h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+}
+
+const uint32_t* CChecksum::crc32_table()
+{
+    static const crc_table_t table(0xEDB88320u);
+    return table.entry;
+}
+
+const uint32_t* CChecksum::crc32c_table()
+{
+    static const crc_table_t table(0x82F63B78u);
+    return table.entry;
+}
+
+/*
+ * 标准CRC32（与zlib一致），crc传入上一次的结果即可分段计算，初始值为0
+ */
+uint32_t CChecksum::crc32(uint32_t crc, const void* data, size_t length)
+{
+    const uint32_t* table = crc32_table();
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    crc = ~crc;
+    while (length--)
+    {
+        crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+/*
+ * CRC32C（Castagnoli），CPU支持SSE4.2时使用crc32指令，每次处理8字节
+ */
+uint32_t CChecksum::crc32c(uint32_t crc, const void* data, size_t length)
+{
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+#if defined(__x86_64__)
+    static const bool is_sse42 = __builtin_cpu_supports("sse4.2");
+    if (is_sse42)
+    {
+        return crc32c_hardware(crc, p, length);
+    }
+#endif
+    return crc32c_software(crc, p, length);
+}
+
+uint32_t CChecksum::crc32c_software(uint32_t crc, const unsigned char* p, size_t length)
+{
+    const uint32_t* table = crc32c_table();
+    crc = ~crc;
+    while (length--)
+    {
+        crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t CChecksum::crc32c_hardware(uint32_t crc, const unsigned char* p, size_t length)
+{
+    uint64_t c = ~crc;
+    while (length > 0 && (reinterpret_cast<uintptr_t>(p) & 7) != 0)
+    {
+        c = _mm_crc32_u8(static_cast<uint32_t>(c), *p++);
+        --length;
+    }
+    /* 四路展开，让crc32指令的流水线保持满载 */
+    while (length >= 32)
+    {
+        c = _mm_crc32_u64(c, read64(p));
+        c = _mm_crc32_u64(c, read64(p + 8));
+        c = _mm_crc32_u64(c, read64(p + 16));
+        c = _mm_crc32_u64(c, read64(p + 24));
+        p += 32;
+        length -= 32;
+    }
+    while (length >= 8)
+    {
+        c = _mm_crc32_u64(c, read64(p));
+        p += 8;
+        length -= 8;
+    }
+    while (length--)
+    {
+        c = _mm_crc32_u8(static_cast<uint32_t>(c), *p++);
+    }
+    return ~static_cast<uint32_t>(c);
+}
+#else
+uint32_t CChecksum::crc32c_hardware(uint32_t crc, const unsigned char* p, size_t length)
+{
+    return crc32c_software(crc, p, length);
+}
+#endif
+
+bool CChecksum::crc32_file(const std::string& filepath, off_t start, off_t end, uint32_t& crc)
+{
+    int fd = open(filepath.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    bool ret = crc32_fd(fd, start, end, crc);
+    close(fd);
+    return ret;
+}
+
+/*
+ * 计算文件[start, end)区间的CRC32，区间超出文件末尾时返回false
+ */
+bool CChecksum::crc32_fd(int fd, off_t start, off_t end, uint32_t& crc)
+{
+    if (start < 0 || end < start)
+    {
+        return false;
+    }
+    posix_fadvise(fd, start, end - start, POSIX_FADV_SEQUENTIAL);
+
+    std::vector<char> buffer(CHECKSUM_READ_BUFFER);
+    crc = 0;
+    while (start < end)
+    {
+        size_t want = end - start < static_cast<off_t>(buffer.size()) ? end - start : buffer.size();
+        ssize_t n = pread(fd, &buffer[0], want, start);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0)
+        {
+            return false;
+        }
+        crc = crc32(crc, &buffer[0], n);
+        start += n;
+    }
+    return true;
+}
+
+bool CChecksum::hash_file(const std::string& filepath, HASH_ALGORITHM algorithm, off_t start, off_t end, std::string& digest)
+{
+    int fd = open(filepath.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    bool ret = hash_fd(fd, algorithm, start, end, digest);
+    close(fd);
+    return ret;
+}
+
+/*
+ * 计算文件[start, end)区间的哈希
+ * 用pread分块读取并提示顺序预读；不用mmap，文件被并发的STOR截断时mmap访问会触发SIGBUS
+ */
+bool CChecksum::hash_fd(int fd, HASH_ALGORITHM algorithm, off_t start, off_t end, std::string& digest)
+{
+    if (start < 0 || end < start)
+    {
+        return false;
+    }
+
+    CHasher hasher(algorithm);
+    if (end == start)
+    {
+        digest = hasher.final_hex();
+        return true;
+    }
+
+    posix_fadvise(fd, start, end - start, POSIX_FADV_SEQUENTIAL);
+    std::vector<char> buffer(CHECKSUM_READ_BUFFER);
+    if (!hash_range(fd, hasher, start, end, buffer))
+    {
+        return false;
+    }
+    digest = hasher.final_hex();
+    return true;
+}
+
+/*
+ * buffer为空时使用CHECKSUM_READ_BUFFER大小，区间超出文件末尾时返回false
+ */
+bool CChecksum::hash_range(int fd, CHasher& hasher, off_t start, off_t end, std::vector<char>& buffer)
+{
+    if (buffer.empty())
+    {
+        buffer.resize(CHECKSUM_READ_BUFFER);
+    }
+    while (start < end)
+    {
+        size_t want = end - start < static_cast<off_t>(buffer.size()) ? end - start : buffer.size();
+        ssize_t n = pread(fd, &buffer[0], want, start);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0)
+        {
+            return false;
+        }
+        hasher.update(&buffer[0], n);
+        start += n;
+    }
+    return true;
+}
+
+bool CChecksum::parse_algorithm(const std::string& name, HASH_ALGORITHM& algorithm)
+{
+    if (strcasecmp(name.c_str(), "CRC32") == 0)
+        algorithm = HASH_CRC32;
+    else if (strcasecmp(name.c_str(), "CRC32C") == 0)
+        algorithm = HASH_CRC32C;
+    else if (strcasecmp(name.c_str(), "XXH64") == 0)
+        algorithm = HASH_XXH64;
+    else if (strcasecmp(name.c_str(), "SHA-256") == 0 || strcasecmp(name.c_str(), "SHA256") == 0)
+        algorithm = HASH_SHA256;
+    else
+        return false;
+    return true;
+}
+
+const char* CChecksum::algorithm_name(HASH_ALGORITHM algorithm)
+{
+    switch (algorithm)
+    {
+    case HASH_CRC32:
+        return "CRC32";
+    case HASH_CRC32C:
+        return "CRC32C";
+    case HASH_XXH64:
+        return "XXH64";
+    case HASH_SHA256:
+        return "SHA-256";
+    }
+    return "";
+}
+
+CHasher::CHasher(HASH_ALGORITHM algorithm) : m_algorithm(algorithm), m_crc(0)
+{
+    bzero(&m_xxh64, sizeof(m_xxh64));
+    m_xxh64.v[0] = XXH_PRIME64_1 + XXH_PRIME64_2;
+    m_xxh64.v[1] = XXH_PRIME64_2;
+    m_xxh64.v[2] = 0;
+    m_xxh64.v[3] = 0 - XXH_PRIME64_1;
+
+    bzero(&m_sha256, sizeof(m_sha256));
+    m_sha256.h[0] = 0x6a09e667; m_sha256.h[1] = 0xbb67ae85;
+    m_sha256.h[2] = 0x3c6ef372; m_sha256.h[3] = 0xa54ff53a;
+    m_sha256.h[4] = 0x510e527f; m_sha256.h[5] = 0x9b05688c;
+    m_sha256.h[6] = 0x1f83d9ab; m_sha256.h[7] = 0x5be0cd19;
+}
+
+void CHasher::update(const void* data, size_t length)
+{
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    switch (m_algorithm)
+    {
+    case HASH_CRC32:
+        m_crc = CChecksum::crc32(m_crc, p, length);
+        break;
+    case HASH_CRC32C:
+        m_crc = CChecksum::crc32c(m_crc, p, length);
+        break;
+    case HASH_XXH64:
+    {
+        xxh64_state_t& s = m_xxh64;
+        s.total_length += length;
+        if (s.buffer_size + length < 32)
+        {
+            memcpy(s.buffer + s.buffer_size, p, length);
+            s.buffer_size += length;
+            break;
+        }
+        if (s.buffer_size > 0)
+        {
+            size_t fill = 32 - s.buffer_size;
+            memcpy(s.buffer + s.buffer_size, p, fill);
+            for (int i = 0; i < 4; ++i)
+                s.v[i] = xxh64_round(s.v[i], read64(s.buffer + i * 8));
+            p += fill;
+            length -= fill;
+            s.buffer_size = 0;
+        }
+        /* 四条独立的累加链，编译器可以并行调度 */
+        uint64_t v0 = s.v[0], v1 = s.v[1], v2 = s.v[2], v3 = s.v[3];
+        while (length >= 32)
+        {
+            v0 = xxh64_round(v0, read64(p));
+            v1 = xxh64_round(v1, read64(p + 8));
+            v2 = xxh64_round(v2, read64(p + 16));
+            v3 = xxh64_round(v3, read64(p + 24));
+            p += 32;
+            length -= 32;
+        }
+        s.v[0] = v0; s.v[1] = v1; s.v[2] = v2; s.v[3] = v3;
+        memcpy(s.buffer, p, length);
+        s.buffer_size = length;
+        break;
+    }
+    case HASH_SHA256:
+    {
+        sha256_state_t& s = m_sha256;
+        s.total_length += length;
+        if (s.buffer_size > 0)
+        {
+            size_t fill = 64 - s.buffer_size < length ? 64 - s.buffer_size : length;
+            memcpy(s.buffer + s.buffer_size, p, fill);
+            s.buffer_size += fill;
+            p += fill;
+            length -= fill;
+            if (s.buffer_size < 64)
+                break;
+            sha256_transform(s.h, s.buffer);
+            s.buffer_size = 0;
+        }
+        while (length >= 64)
+        {
+            sha256_transform(s.h, p);
+            p += 64;
+            length -= 64;
+        }
+        memcpy(s.buffer, p, length);
+        s.buffer_size = length;
+        break;
+    }
+    }
+}
+
+/*
+ * XXH64的数值结果，用作分块的强校验时不需要转换成十六进制
+ */
+uint64_t CHasher::final_xxh64()
+{
+    xxh64_state_t& s = m_xxh64;
+    uint64_t h;
+    if (s.total_length >= 32)
+    {
+        h = rotl64(s.v[0], 1) + rotl64(s.v[1], 7) + rotl64(s.v[2], 12) + rotl64(s.v[3], 18);
+        for (int i = 0; i < 4; ++i)
+            h = xxh64_merge_round(h, s.v[i]);
+    }
+    else
+    {
+        h = s.v[2] + XXH_PRIME64_5;
+    }
+    h += s.total_length;
+
+    const unsigned char* p = s.buffer;
+    size_t length = s.buffer_size;
+    while (length >= 8)
+    {
+        h ^= xxh64_round(0, read64(p));
+        h = rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+        p += 8;
+        length -= 8;
+    }
+    if (length >= 4)
+    {
+        h ^= uint64_t(read32(p)) * XXH_PRIME64_1;
+        h = rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+        length -= 4;
+    }
+    while (length--)
+    {
+        h ^= (*p++) * XXH_PRIME64_5;
+        h = rotl64(h, 11) * XXH_PRIME64_1;
+    }
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+std::string CHasher::final_hex()
+{
+    char hex[72];
+    switch (m_algorithm)
+    {
+    case HASH_CRC32:
+    case HASH_CRC32C:
+        snprintf(hex, sizeof(hex), "%08X", m_crc);
+        break;
+    case HASH_XXH64:
+        snprintf(hex, sizeof(hex), "%016llX", static_cast<unsigned long long>(final_xxh64()));
+        break;
+    case HASH_SHA256:
+    {
+        sha256_state_t& s = m_sha256;
+        uint64_t bit_length = s.total_length * 8;
+        unsigned char pad = 0x80;
+        update(&pad, 1);
+        pad = 0;
+        while (s.buffer_size != 56)
+            update(&pad, 1);
+        unsigned char length_bytes[8];
+        for (int i = 0; i < 8; ++i)
+            length_bytes[i] = static_cast<unsigned char>(bit_length >> (56 - i * 8));
+        update(length_bytes, 8);
+        for (int i = 0; i < 8; ++i)
+            snprintf(hex + i * 8, sizeof(hex) - i * 8, "%08x", s.h[i]);
+        break;
+    }
+    }
+    return hex;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+enum HASH_ALGORITHM
+{
+    HASH_CRC32,
+    HASH_CRC32C,
+    HASH_XXH64,
+    HASH_SHA256
+};
+
+struct xxh64_state_t
+{
+    uint64_t total_length;
+    uint64_t v[4];
+    unsigned char buffer[32];
+    size_t buffer_size;
+};
+
+struct sha256_state_t
+{
+    uint64_t total_length;
+    uint32_t h[8];
+    unsigned char buffer[64];
+    size_t buffer_size;
+};
+
+/*
+ * 流式哈希，update()可以多次调用，最后final_hex()得到十六进制结果
+ */
+class CHasher
+{
+public:
+    CHasher(HASH_ALGORITHM algorithm);
+
+    void update(const void* data, size_t length);
+    std::string final_hex();
+    uint64_t final_xxh64();
+    HASH_ALGORITHM get_algorithm() const
+    {
+        return m_algorithm;
+    }
+
+private:
+    HASH_ALGORITHM m_algorithm;
+    uint32_t m_crc;
+    xxh64_state_t m_xxh64;
+    sha256_state_t m_sha256;
+};
+
+class CChecksum
+{
+public:
+    static uint32_t crc32(uint32_t crc, const void* data, size_t length);
+    static uint32_t crc32c(uint32_t crc, const void* data, size_t length);
+
+    static bool crc32_file(const std::string& filepath, off_t start, off_t end, uint32_t& crc);
+    static bool crc32_fd(int fd, off_t start, off_t end, uint32_t& crc);
+
+    static bool hash_file(const std::string& filepath, HASH_ALGORITHM algorithm, off_t start, off_t end, std::string& digest);
+    static bool hash_fd(int fd, HASH_ALGORITHM algorithm, off_t start, off_t end, std::string& digest);
+    /* 把文件[start, end)追加到hasher，分多次调用可以把一个文件的哈希拆开计算 */
+    static bool hash_range(int fd, CHasher& hasher, off_t start, off_t end, std::vector<char>& buffer);
+
+    static bool parse_algorithm(const std::string& name, HASH_ALGORITHM& algorithm);
+    static const char* algorithm_name(HASH_ALGORITHM algorithm);
+
+private:
+    static const uint32_t* crc32_table();
+    static const uint32_t* crc32c_table();
+    static uint32_t crc32c_software(uint32_t crc, const unsigned char* p, size_t length);
+    static uint32_t crc32c_hardware(uint32_t crc, const unsigned char* p, size_t length);
+};
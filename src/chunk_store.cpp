@@ -0,0 +1,183 @@
+#include "chunk_store.h"
+
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <cstdlib>
+#include <cerrno>
+#include <iostream>
+
+CChunkStore::CChunkStore() : m_root("")
+{
+
+}
+
+CChunkStore::~CChunkStore()
+{
+
+}
+
+bool CChunkStore::open_store(const std::string& root)
+{
+    if ((mkdir(root.c_str(), 0755) < 0 && errno != EEXIST) ||
+        (mkdir((root + "/chunks").c_str(), 0755) < 0 && errno != EEXIST))
+    {
+        perror(("open chunk store " + root).c_str());
+        return false;
+    }
+    m_root = root;
+    return true;
+}
+
+std::string CChunkStore::chunk_path(const std::string& digest)
+{
+    return m_root + "/chunks/" + digest.substr(0, 2) + "/" + digest;
+}
+
+bool CChunkStore::has_chunk(const std::string& digest)
+{
+    struct stat statinfo;
+    return stat(chunk_path(digest).c_str(), &statinfo) == 0;
+}
+
+/*
+ * 校验内容的SHA-256后写入分块库，先写临时文件再rename，并发写入同一个分块时不会看到不完整的文件
+ */
+bool CChunkStore::put_chunk(const std::string& digest, const char* data, size_t length)
+{
+    CHasher hasher(HASH_SHA256);
+    hasher.update(data, length);
+    if (hasher.final_hex() != digest)
+    {
+        return false;
+    }
+    if (has_chunk(digest))
+    {
+        return true;
+    }
+
+    std::string dirname = m_root + "/chunks/" + digest.substr(0, 2);
+    if (mkdir(dirname.c_str(), 0755) < 0 && errno != EEXIST)
+    {
+        return false;
+    }
+
+    std::string tmp = dirname + "/." + digest + ".XXXXXX";
+    int fd = mkstemp(&tmp[0]);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    size_t written = 0;
+    while (written < length)
+    {
+        ssize_t n = write(fd, data + written, length - written);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        written += n;
+    }
+    close(fd);
+
+    if (written != length || rename(tmp.c_str(), chunk_path(digest).c_str()) < 0)
+    {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+/*
+ * 数据在内核中用copy_file_range复制，支持reflink的文件系统上对齐的分块直接共享数据块
+ * 调用者按清单顺序逐个追加，可以分多次完成一个文件
+ */
+bool CChunkStore::append_chunk(const chunk_info_t& chunk, int filefd, off_t& offset)
+{
+    int chunkfd = open(chunk_path(chunk.digest).c_str(), O_RDONLY);
+    if (chunkfd < 0)
+    {
+        return false;
+    }
+    bool ret = copy_chunk(chunkfd, filefd, offset, chunk.length);
+    close(chunkfd);
+    return ret;
+}
+
+/*
+ * copy_file_range不支持时（跨文件系统或者内核太旧）退回sendfile，都不经过用户态缓冲区
+ */
+bool CChunkStore::copy_chunk(int chunkfd, int filefd, off_t& offset, size_t length)
+{
+    off_t chunk_offset = 0;
+    bool is_fallback = false;
+    while (length > 0)
+    {
+        ssize_t n;
+        if (!is_fallback)
+        {
+            n = copy_file_range(chunkfd, &chunk_offset, filefd, &offset, length, 0);
+            if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL))
+            {
+                is_fallback = true;
+                continue;
+            }
+        }
+        else
+        {
+            if (lseek(filefd, offset, SEEK_SET) < 0)
+                return false;
+            n = sendfile(filefd, chunkfd, &chunk_offset, length);
+            if (n > 0)
+                offset += n;
+        }
+
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        length -= n;
+    }
+    return true;
+}
+
+/*
+ * 清单每行为 分块SHA-256 分块长度
+ */
+bool CChunkStore::parse_manifest(const char* data, size_t length, std::vector<chunk_info_t>& chunks)
+{
+    chunks.clear();
+    off_t offset = 0;
+    const char* end = data + length;
+    while (data < end)
+    {
+        const char* line_end = static_cast<const char*>(memchr(data, '\n', end - data));
+        if (line_end == NULL)
+        {
+            line_end = end;
+        }
+
+        const char* space = static_cast<const char*>(memchr(data, ' ', line_end - data));
+        if (space == NULL || space - data != 64 || strspn(data, "0123456789abcdef") < 64)
+        {
+            return false;
+        }
+
+        std::string size_string(space + 1, line_end);
+        char* size_end = NULL;
+        unsigned long long chunk_length = strtoull(size_string.c_str(), &size_end, 10);
+        if (size_string.empty() || *size_end != '\0' || chunk_length == 0 || chunk_length > CHUNK_MAX_SIZE)
+        {
+            return false;
+        }
+
+        chunk_info_t chunk;
+        chunk.offset = offset;
+        chunk.length = chunk_length;
+        chunk.digest.assign(data, 64);
+        chunks.push_back(chunk);
+
+        offset += chunk_length;
+        data = line_end + 1;
+    }
+    return true;
+}
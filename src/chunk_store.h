@@ -0,0 +1,41 @@
+#pragma once
+
+#include "chunker.h"
+
+#include <sys/types.h>
+#include <string>
+#include <vector>
+
+/* 去重上传的清单最大字节数，每个分块一行 */
+const size_t CHUNK_MANIFEST_MAX = 16 * 1024 * 1024;
+
+/*
+ * 内容寻址的分块库，每个不同的分块只保存一次，路径为 根目录/chunks/哈希前两位/哈希
+ * 上传的文件由分块按清单顺序拼接成普通文件，RETR/SIZE/HASH等命令不需要知道分块库的存在
+ */
+class CChunkStore
+{
+public:
+    CChunkStore();
+    ~CChunkStore();
+
+    bool open_store(const std::string& root);
+    bool is_enabled() const
+    {
+        return !m_root.empty();
+    }
+
+    bool has_chunk(const std::string& digest);
+    bool put_chunk(const std::string& digest, const char* data, size_t length);
+    /* 把一个分块追加到filefd的offset处，offset移到分块之后 */
+    bool append_chunk(const chunk_info_t& chunk, int filefd, off_t& offset);
+
+    static bool parse_manifest(const char* data, size_t length, std::vector<chunk_info_t>& chunks);
+
+private:
+    std::string chunk_path(const std::string& digest);
+    static bool copy_chunk(int chunkfd, int filefd, off_t& offset, size_t length);
+
+private:
+    std::string m_root;
+};
@@ -0,0 +1,131 @@
+#include "chunker.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+/*
+ * 平均分块之前用较多的位判断边界（不容易切分），之后用较少的位（容易切分），分块大小集中在平均值附近
+ * Gear哈希每次左移一位，高位由最近的64个字节决定，所以用高位判断
+ */
+static const uint64_t CHUNK_MASK_SMALL = ~0ULL << (64 - 18);
+static const uint64_t CHUNK_MASK_LARGE = ~0ULL << (64 - 14);
+
+/*
+ * 用splitmix64生成固定的Gear表，两端只要使用同一份代码就能得到相同的分块
+ */
+struct gear_table_t
+{
+    uint64_t value[256];
+
+    gear_table_t()
+    {
+        uint64_t seed = 0x9e3779b97f4a7c15ULL;
+        for (int i = 0; i < 256; ++i)
+        {
+            seed += 0x9e3779b97f4a7c15ULL;
+            uint64_t z = seed;
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            value[i] = z ^ (z >> 31);
+        }
+    }
+};
+
+const uint64_t* CChunker::gear_table()
+{
+    static const gear_table_t table;
+    return table.value;
+}
+
+/*
+ * 返回从data开始的第一个分块的长度
+ */
+size_t CChunker::next_boundary(const unsigned char* data, size_t length)
+{
+    if (length <= CHUNK_MIN_SIZE)
+    {
+        return length;
+    }
+
+    const uint64_t* gear = gear_table();
+    size_t limit = std::min(length, CHUNK_MAX_SIZE);
+    size_t normal = std::min(limit, CHUNK_AVG_SIZE);
+    uint64_t hash = 0;
+
+    size_t i = CHUNK_MIN_SIZE;
+    for (; i < normal; ++i)
+    {
+        hash = (hash << 1) + gear[data[i]];
+        if ((hash & CHUNK_MASK_SMALL) == 0)
+        {
+            return i + 1;
+        }
+    }
+    for (; i < limit; ++i)
+    {
+        hash = (hash << 1) + gear[data[i]];
+        if ((hash & CHUNK_MASK_LARGE) == 0)
+        {
+            return i + 1;
+        }
+    }
+    return limit;
+}
+
+bool CChunker::chunk_file(const std::string& filepath, std::vector<chunk_info_t>& chunks)
+{
+    int fd = open(filepath.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    struct stat statinfo;
+    bool ret = fstat(fd, &statinfo) == 0 && S_ISREG(statinfo.st_mode) && chunk_fd(fd, statinfo.st_size, chunks);
+    close(fd);
+    return ret;
+}
+
+/*
+ * 把整个文件映射到内存中分块并计算每块的SHA-256
+ */
+bool CChunker::chunk_fd(int fd, off_t size, std::vector<chunk_info_t>& chunks)
+{
+    chunks.clear();
+    if (size == 0)
+    {
+        return true;
+    }
+
+    void* addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED)
+    {
+        return false;
+    }
+    madvise(addr, size, MADV_SEQUENTIAL);
+
+    const unsigned char* data = static_cast<const unsigned char*>(addr);
+    off_t offset = 0;
+    while (offset < size)
+    {
+        size_t length = next_boundary(data + offset, size - offset);
+
+        CHasher hasher(HASH_SHA256);
+        hasher.update(data + offset, length);
+
+        chunk_info_t chunk;
+        chunk.offset = offset;
+        chunk.length = length;
+        chunk.digest = hasher.final_hex();
+        chunks.push_back(chunk);
+
+        offset += length;
+    }
+
+    munmap(addr, size);
+    return true;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "checksum.h"
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/* 内容定义分块的大小范围，边界由滚动哈希决定，插入或删除数据只影响附近的分块 */
+const size_t CHUNK_MIN_SIZE = 16 * 1024;
+const size_t CHUNK_AVG_SIZE = 64 * 1024;
+const size_t CHUNK_MAX_SIZE = 256 * 1024;
+
+struct chunk_info_t
+{
+    off_t offset;
+    size_t length;
+    std::string digest;
+};
+
+/*
+ * Gear滚动哈希分块（FastCDC的归一化分块），分块以SHA-256标识
+ * 客户端和服务器使用同一个分块算法，相同的内容得到相同的分块
+ */
+class CChunker
+{
+public:
+    static size_t next_boundary(const unsigned char* data, size_t length);
+
+    static bool chunk_file(const std::string& filepath, std::vector<chunk_info_t>& chunks);
+    static bool chunk_fd(int fd, off_t size, std::vector<chunk_info_t>& chunks);
+
+private:
+    static const uint64_t* gear_table();
+};
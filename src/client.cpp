@@ -5,13 +5,35 @@
 
 int main(int argc, char *argv[])
 {
-    if(argc != 2)
+    /* ./client 地址 [--tls_ca=CA文件] [--tls_insecure] */
+    if(argc < 2)
     {
         std::cout << "Enter ip address\n";
         return 0;
     }
 
+    std::string tls_ca;
+    bool is_tls_verify = true;
+    for (int i = 2; i < argc; ++i)
+    {
+        std::string option = argv[i];
+        if (option.compare(0, 9, "--tls_ca=") == 0)
+        {
+            tls_ca = option.substr(9);
+        }
+        else if (option == "--tls_insecure")
+        {
+            is_tls_verify = false;
+        }
+        else
+        {
+            std::cout << "usage: " << argv[0] << " address [--tls_ca=file] [--tls_insecure]" << std::endl;
+            return 0;
+        }
+    }
+
     CFTPClient ftp;
+    ftp.set_tls_verify(tls_ca, is_tls_verify);
     ftp.login_server(argv[1]);
     std::cout << "connect successfully\n";
     std::string command;
@@ -74,6 +96,74 @@ int main(int argc, char *argv[])
         {
             ftp.store(argument);
         }
+        else if(command == "APPE")
+        {
+            ftp.append(argument);
+        }
+        else if(command == "XCRC")
+        {
+            ftp.get_checksum(argument);
+        }
+        else if(command == "HASH")
+        {
+            ftp.get_hash(argument);
+        }
+        else if(command == "VERIFY")
+        {
+            ftp.set_verify(argument);
+        }
+        else if(command == "AUTH")
+        {
+            ftp.auth_tls(argument);
+        }
+        else if(command == "PROT")
+        {
+            ftp.set_protection(argument);
+        }
+        else if(command == "MODE")
+        {
+            ftp.set_mode(argument);
+        }
+        else if(command == "TYPE")
+        {
+            ftp.set_type(argument);
+        }
+        else if(command == "XDEDUP")
+        {
+            ftp.dedup_store(argument);
+        }
+        else if(command == "XDELTA")
+        {
+            ftp.delta_download(argument);
+        }
+        else if(command == "MRETR")
+        {
+            ftp.multi_download(argument);
+        }
+        else if(command == "MSTOR")
+        {
+            ftp.multi_store(argument);
+        }
+        else if(command == "RETRDIR")
+        {
+            ftp.download_directory(argument);
+        }
+        else if(command == "STORDIR")
+        {
+            ftp.store_directory(argument);
+        }
+        else if(command == "SITE")
+        {
+            ftp.site_command(argument);
+        }
+        else if(command == "RNFR")
+        {
+            ftp.rename_from(argument);
+        }
+        else if(command == "RNTO")
+        {
+            ftp.rename_to(argument);
+        }
         else if(command == "SIZE")
         {
             ftp.get_filesize(argument);
@@ -0,0 +1,426 @@
+#include "config.h"
+#include "../threadpool/affinity.h"
+
+#include <arpa/inet.h>
+#include <string.h>
+#include <cstdlib>
+#include <cerrno>
+#include <iostream>
+#include <fstream>
+
+ftp_config_t::ftp_config_t() : bind_address("192.168.221.128"), control_port(9999), data_port(8888),
+                               listen_backlog(1024), epoll_events(64), handoff_path("/tmp/ftp_server.handoff"),
+                               control_socket(), data_socket(), tls_certificate(""), tls_private_key(""),
+                               is_ktls(true), tls_required(false), chunk_store(""),
+                               pasv_address(""), worker_threads(6), io_threads(4), io_queue_limit(256),
+                               worker_threads_max(32), io_threads_max(32), thread_grow_wait(20), thread_idle_timeout(60),
+                               sched_quantum(262144), interactive_weight(4), user_weights(),
+                               main_cpu(-1), worker_cpus(), io_cpus(), drain_timeout(60),
+                               idle_timeout(300), data_timeout(60), pasv_timeout(60),
+                               sendfile_chunk(4 * 1024 * 1024), recv_buffer(0xffff), hash_cache_capacity(4096),
+                               store_sync(FTP_SYNC_NONE), group_commit_wait(0), store_writebehind(0),
+                               cache_bypass(FTP_BYPASS_OFF), cache_bypass_size(1LL << 30), cache_bypass_paths()
+{
+    /* 控制连接都是短小的命令和应答，关闭Nagle算法 */
+    control_socket.is_nodelay = true;
+}
+
+/*
+ * 解析十进制整数，超出[min_value, max_value]时失败
+ */
+template <typename T>
+static bool parse_number(const std::string& value, long long min_value, long long max_value, T& result)
+{
+    if (value.empty())
+    {
+        return false;
+    }
+
+    char* end = NULL;
+    errno = 0;
+    long long number = strtoll(value.c_str(), &end, 10);
+    if (errno != 0 || *end != '\0' || number < min_value || number > max_value)
+    {
+        return false;
+    }
+    result = static_cast<T>(number);
+    return true;
+}
+
+static bool parse_address(const std::string& value, std::string& result)
+{
+    struct in_addr addr;
+    if (inet_pton(AF_INET, value.c_str(), &addr) != 1)
+    {
+        return false;
+    }
+    result = value;
+    return true;
+}
+
+static bool parse_bool(const std::string& value, bool& result)
+{
+    if (value == "1" || value == "on" || value == "yes" || value == "true")
+        result = true;
+    else if (value == "0" || value == "off" || value == "no" || value == "false")
+        result = false;
+    else
+        return false;
+    return true;
+}
+
+static std::string trim(const std::string& str)
+{
+    std::string::size_type begin = str.find_first_not_of(" \t\r\n");
+    if (begin == std::string::npos)
+    {
+        return "";
+    }
+    std::string::size_type end = str.find_last_not_of(" \t\r\n");
+    return str.substr(begin, end - begin + 1);
+}
+
+static bool parse_store_sync(const std::string& value, FTP_STORE_SYNC& result)
+{
+    if (value == "none")
+        result = FTP_SYNC_NONE;
+    else if (value == "fdatasync")
+        result = FTP_SYNC_DATA;
+    else if (value == "group")
+        result = FTP_SYNC_GROUP;
+    else
+        return false;
+    return true;
+}
+
+static bool parse_cache_bypass(const std::string& value, FTP_CACHE_BYPASS& result)
+{
+    if (value == "off")
+        result = FTP_BYPASS_OFF;
+    else if (value == "dontneed")
+        result = FTP_BYPASS_DONTNEED;
+    else if (value == "direct")
+        result = FTP_BYPASS_DIRECT;
+    else
+        return false;
+    return true;
+}
+
+/*
+ * 逗号分隔的绝对路径目录，去掉末尾的/，为空时清空
+ */
+static bool parse_paths(const std::string& value, std::vector<std::string>& result)
+{
+    std::vector<std::string> paths;
+    std::string::size_type begin = 0;
+    while (begin < value.size())
+    {
+        std::string::size_type end = value.find(',', begin);
+        if (end == std::string::npos)
+        {
+            end = value.size();
+        }
+        std::string path = trim(value.substr(begin, end - begin));
+        while (path.size() > 1 && path[path.size() - 1] == '/')
+        {
+            path.erase(path.size() - 1);
+        }
+        if (path.empty() || path[0] != '/')
+        {
+            return false;
+        }
+        paths.push_back(path);
+        begin = end + 1;
+    }
+    result.swap(paths);
+    return true;
+}
+
+/*
+ * 解析 用户名:权重,用户名:权重，为空时清空
+ */
+static bool parse_weights(const std::string& value, std::map<std::string, int>& result)
+{
+    std::map<std::string, int> weights;
+    std::string::size_type begin = 0;
+    while (begin < value.size())
+    {
+        std::string::size_type end = value.find(',', begin);
+        if (end == std::string::npos)
+        {
+            end = value.size();
+        }
+        std::string item = trim(value.substr(begin, end - begin));
+        std::string::size_type idx = item.find(':');
+        int weight;
+        if (idx == std::string::npos || idx == 0 || !parse_number(trim(item.substr(idx + 1)), 1, 64, weight))
+        {
+            return false;
+        }
+        weights[trim(item.substr(0, idx))] = weight;
+        begin = end + 1;
+    }
+    result.swap(weights);
+    return true;
+}
+
+CConfig::CConfig() : m_config(), m_path(""), m_overrides()
+{
+
+}
+
+CConfig::~CConfig()
+{
+
+}
+
+/*
+ * 命令行格式：-c 配置文件 或 --config=配置文件，其余参数为 --key=value
+ */
+bool CConfig::parse_args(int argc, char* argv[])
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "-h" || arg == "--help")
+        {
+            return false;
+        }
+        if (arg == "-c")
+        {
+            if (i + 1 >= argc)
+            {
+                std::cout << "option -c requires a config file" << std::endl;
+                return false;
+            }
+            m_path = argv[++i];
+            continue;
+        }
+        if (arg.compare(0, 2, "--") != 0 || arg.find('=') == std::string::npos)
+        {
+            std::cout << "unknown option " << arg << std::endl;
+            return false;
+        }
+
+        std::string::size_type idx = arg.find('=');
+        std::string key = arg.substr(2, idx - 2);
+        std::string value = arg.substr(idx + 1);
+        if (key == "config")
+        {
+            m_path = value;
+        }
+        else
+        {
+            m_overrides.push_back(std::make_pair(key, value));
+        }
+    }
+
+    return reload();
+}
+
+/*
+ * 从默认值开始重新读取配置文件并应用命令行参数，任何一项出错都保留当前配置
+ */
+bool CConfig::reload()
+{
+    ftp_config_t config;
+    if (!m_path.empty() && !load_file(m_path, config))
+    {
+        return false;
+    }
+    if (!apply_overrides(config))
+    {
+        return false;
+    }
+    m_config = config;
+    return true;
+}
+
+const ftp_config_t& CConfig::get_config() const
+{
+    return m_config;
+}
+
+const std::string& CConfig::get_path() const
+{
+    return m_path;
+}
+
+bool CConfig::load_file(const std::string& path, ftp_config_t& config)
+{
+    std::ifstream file(path.c_str());
+    if (!file)
+    {
+        std::cout << "cannot open config file " << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    std::string line;
+    int line_number = 0;
+    while (getline(file, line))
+    {
+        ++line_number;
+        std::string::size_type comment = line.find('#');
+        if (comment != std::string::npos)
+        {
+            line.erase(comment);
+        }
+        line = trim(line);
+        if (line.empty())
+        {
+            continue;
+        }
+
+        std::string::size_type idx = line.find('=');
+        if (idx == std::string::npos || !set_value(trim(line.substr(0, idx)), trim(line.substr(idx + 1)), config))
+        {
+            std::cout << path << ":" << line_number << ": invalid setting " << line << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool CConfig::apply_overrides(ftp_config_t& config)
+{
+    for (size_t i = 0; i < m_overrides.size(); ++i)
+    {
+        if (!set_value(m_overrides[i].first, m_overrides[i].second, config))
+        {
+            std::cout << "invalid option --" << m_overrides[i].first << "=" << m_overrides[i].second << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool CConfig::set_value(const std::string& key, const std::string& value, ftp_config_t& config)
+{
+    if (key == "bind_address")
+        return parse_address(value, config.bind_address);
+    else if (key == "control_port")
+        return parse_number(value, 1, 65535, config.control_port);
+    else if (key == "data_port")
+        return parse_number(value, 1, 65535, config.data_port);
+    else if (key == "listen_backlog")
+        return parse_number(value, 1, 65535, config.listen_backlog);
+    else if (key == "epoll_events")
+        return parse_number(value, 1, 65536, config.epoll_events);
+    else if (key == "handoff_path")
+    {
+        config.handoff_path = value;
+        return !value.empty();
+    }
+    else if (key == "pasv_address")
+    {
+        /* 为空时使用控制连接的本端地址 */
+        if (value.empty())
+        {
+            config.pasv_address.clear();
+            return true;
+        }
+        return parse_address(value, config.pasv_address);
+    }
+    else if (key == "worker_threads")
+        return parse_number(value, 1, 1024, config.worker_threads);
+    else if (key == "io_threads")
+        return parse_number(value, 1, 1024, config.io_threads);
+    else if (key == "worker_threads_max")
+        return parse_number(value, 1, 1024, config.worker_threads_max);
+    else if (key == "io_threads_max")
+        return parse_number(value, 1, 1024, config.io_threads_max);
+    else if (key == "thread_grow_wait")
+        return parse_number(value, 0, 60000, config.thread_grow_wait);
+    else if (key == "thread_idle_timeout")
+        return parse_number(value, 0, 86400, config.thread_idle_timeout);
+    else if (key == "io_queue_limit")
+        return parse_number(value, 1, 1LL << 20, config.io_queue_limit);
+    else if (key == "sched_quantum")
+        return parse_number(value, 4096, 1LL << 30, config.sched_quantum);
+    else if (key == "interactive_weight")
+        return parse_number(value, 1, 64, config.interactive_weight);
+    else if (key == "user_weights")
+        return parse_weights(value, config.user_weights);
+    else if (key == "main_cpu")
+        return parse_number(value, -1, 1023, config.main_cpu);
+    else if (key == "worker_cpus")
+        return CAffinity::parse_cpu_list(value, config.worker_cpus);
+    else if (key == "io_cpus")
+        return CAffinity::parse_cpu_list(value, config.io_cpus);
+    else if (key == "drain_timeout")
+        return parse_number(value, 1, 86400, config.drain_timeout);
+    else if (key == "idle_timeout")
+        return parse_number(value, 1, 86400, config.idle_timeout);
+    else if (key == "data_timeout")
+        return parse_number(value, 1, 86400, config.data_timeout);
+    else if (key == "pasv_timeout")
+        return parse_number(value, 1, 86400, config.pasv_timeout);
+    else if (key == "sendfile_chunk")
+        return parse_number(value, 4096, 1LL << 30, config.sendfile_chunk);
+    else if (key == "recv_buffer")
+        return parse_number(value, 4096, 64LL << 20, config.recv_buffer);
+    else if (key == "hash_cache_capacity")
+        return parse_number(value, 0, 1LL << 24, config.hash_cache_capacity);
+    else if (key == "store_sync")
+        return parse_store_sync(value, config.store_sync);
+    else if (key == "group_commit_wait")
+        return parse_number(value, 0, 1000, config.group_commit_wait);
+    else if (key == "cache_bypass")
+        return parse_cache_bypass(value, config.cache_bypass);
+    else if (key == "cache_bypass_size")
+        return parse_number(value, 0, 1LL << 50, config.cache_bypass_size);
+    else if (key == "cache_bypass_paths")
+        return parse_paths(value, config.cache_bypass_paths);
+    else if (key == "store_writebehind")
+    {
+        /* 0表示关闭，否则至少一页 */
+        return parse_number(value, 0, 1LL << 30, config.store_writebehind) &&
+               (config.store_writebehind == 0 || config.store_writebehind >= 4096);
+    }
+    else if (key == "tls_certificate")
+    {
+        config.tls_certificate = value;
+        return true;
+    }
+    else if (key == "tls_private_key")
+    {
+        config.tls_private_key = value;
+        return true;
+    }
+    else if (key == "tls_ktls")
+        return parse_bool(value, config.is_ktls);
+    else if (key == "tls_required")
+        return parse_bool(value, config.tls_required);
+    else if (key == "chunk_store")
+    {
+        config.chunk_store = value;
+        return true;
+    }
+    else if (key.compare(0, 8, "control_") == 0)
+        return CSocketOption::set_value(key.substr(8), value, config.control_socket);
+    else if (key.compare(0, 5, "data_") == 0)
+        return CSocketOption::set_value(key.substr(5), value, config.data_socket);
+
+    return false;
+}
+
+void CConfig::usage(const char* program)
+{
+    std::cout << "usage: " << program << " [-c config_file] [--key=value ...]\n"
+              << "  --bind_address=IP        --control_port=N       --data_port=N\n"
+              << "  --listen_backlog=N       --epoll_events=N       --handoff_path=PATH\n"
+              << "  --pasv_address=IP        --worker_threads=N     --drain_timeout=SEC\n"
+              << "  --io_threads=N           --io_queue_limit=N\n"
+              << "  --worker_threads_max=N   --io_threads_max=N     --thread_grow_wait=MS  --thread_idle_timeout=SEC\n"
+              << "  --sched_quantum=BYTES    --interactive_weight=N --user_weights=USER:N,...\n"
+              << "  --main_cpu=N             --worker_cpus=LIST     --io_cpus=LIST\n"
+              << "  --idle_timeout=SEC       --data_timeout=SEC     --pasv_timeout=SEC\n"
+              << "  --sendfile_chunk=BYTES   --recv_buffer=BYTES    --hash_cache_capacity=N\n"
+              << "  --store_sync=none|fdatasync|group  --group_commit_wait=MS  --store_writebehind=BYTES\n"
+              << "  --cache_bypass=off|dontneed|direct --cache_bypass_size=BYTES --cache_bypass_paths=DIR,...\n"
+              << "  --{control,data}_{send_buffer,recv_buffer,notsent_lowat,busy_poll,defer_accept}=N\n"
+              << "  --{control,data}_{nodelay,cork}=on|off  --{control,data}_congestion=NAME\n"
+              << "  --tls_certificate=PEM    --tls_private_key=PEM  --tls_ktls=on|off  --tls_required=on|off\n"
+              << "  --chunk_store=DIR\n"
+              << "send SIGHUP to reload pasv_address, thread pool sizes, scheduler weights, cpu affinity, timeouts, buffer and cache sizes, store sync and cache bypass policy" << std::endl;
+}
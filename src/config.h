@@ -0,0 +1,133 @@
+#pragma once
+
+#include "sockopt.h"
+
+#include <sys/types.h>
+#include <string>
+#include <vector>
+#include <utility>
+#include <map>
+
+/* STOR/APPE接收完成后、回复客户端之前的同步方式 */
+enum FTP_STORE_SYNC
+{
+    FTP_SYNC_NONE,
+    FTP_SYNC_DATA,
+    FTP_SYNC_GROUP
+};
+
+/* 大文件传输绕过页缓存的方式 */
+enum FTP_CACHE_BYPASS
+{
+    FTP_BYPASS_OFF,
+    FTP_BYPASS_DONTNEED,
+    FTP_BYPASS_DIRECT
+};
+
+/*
+ * 服务器运行参数，默认值就是原来的编译期常量
+ * 优先级：默认值 < 配置文件 < 命令行
+ */
+struct ftp_config_t
+{
+    /* 以下参数只在启动时生效，修改后需要重启 */
+    std::string bind_address;
+    int control_port;
+    int data_port;
+    int listen_backlog;
+    int epoll_events;
+    std::string handoff_path;
+    /* 控制连接和数据连接的套接字选项，配置项为control_xxx和data_xxx */
+    socket_profile_t control_socket;
+    socket_profile_t data_socket;
+    /* AUTH TLS使用的证书和私钥（PEM），没有配置证书时不支持TLS，私钥为空时从证书文件中读取 */
+    std::string tls_certificate;
+    std::string tls_private_key;
+    bool is_ktls;
+    /* 要求控制连接和数据连接都加密 */
+    bool tls_required;
+    /* XDEDUP去重上传的分块库目录，为空时不支持XDEDUP */
+    std::string chunk_store;
+
+    /* 以下参数收到SIGHUP时重新加载 */
+    std::string pasv_address;
+    int worker_threads;
+    /* 磁盘I/O线程数和排队上限，RETR/STOR/LIST等读写文件的命令在这些线程中执行 */
+    int io_threads;
+    size_t io_queue_limit;
+    /*
+     * worker_threads和io_threads是线程数下限，xxx_max是上限，小于下限时线程数固定
+     * 队头任务等待超过thread_grow_wait毫秒并且没有空闲线程时增加线程，超过下限的线程空闲thread_idle_timeout秒后退出
+     */
+    int worker_threads_max;
+    int io_threads_max;
+    long thread_grow_wait;
+    long thread_idle_timeout;
+    /*
+     * I/O线程按会话做加权赤字轮转，每轮每个会话传输sched_quantum * 权重字节
+     * 小文件和LIST的权重乘以interactive_weight，user_weights按USER指定的用户名设置权重，格式为 用户名:权重,...
+     */
+    size_t sched_quantum;
+    int interactive_weight;
+    std::map<std::string, int> user_weights;
+    /*
+     * CPU绑定，main_cpu为主循环(epoll)线程，-1表示不绑定；worker_cpus和io_cpus为CPU列表，线程依次绑定，为空时不绑定
+     * 命令交给控制连接的数据包到达的CPU(SO_INCOMING_CPU)所在NUMA节点的工作线程优先执行
+     */
+    int main_cpu;
+    std::vector<int> worker_cpus;
+    std::vector<int> io_cpus;
+    long drain_timeout;
+    long idle_timeout;
+    long data_timeout;
+    long pasv_timeout;
+    off_t sendfile_chunk;
+    size_t recv_buffer;
+    size_t hash_cache_capacity;
+    /*
+     * store_sync为none时不同步；fdatasync时每个文件在回复前fdatasync；group时由组提交线程收集
+     * group_commit_wait毫秒内完成的上传一起同步，同步完成后才回复
+     * store_writebehind：上传过程中每写入这么多字节发起一次sync_file_range写回，限制脏页数量，0表示不发起
+     */
+    FTP_STORE_SYNC store_sync;
+    long group_commit_wait;
+    off_t store_writebehind;
+    /*
+     * 不少于cache_bypass_size字节（0表示不按大小）或者位于cache_bypass_paths中的目录下的文件，RETR/STOR时不占用页缓存：
+     * dontneed传输后用POSIX_FADV_DONTNEED丢弃已经传输的页，direct用O_DIRECT和对齐的缓冲区直接读写磁盘
+     */
+    FTP_CACHE_BYPASS cache_bypass;
+    off_t cache_bypass_size;
+    std::vector<std::string> cache_bypass_paths;
+
+    ftp_config_t();
+};
+
+/*
+ * 配置文件格式为每行 key = value，#开始的行是注释，key和命令行的--key=value相同
+ */
+class CConfig
+{
+public:
+    CConfig();
+    ~CConfig();
+
+    bool parse_args(int argc, char* argv[]);
+    bool reload();
+
+    const ftp_config_t& get_config() const;
+    const std::string& get_path() const;
+
+    static void usage(const char* program);
+
+private:
+    bool load_file(const std::string& path, ftp_config_t& config);
+    bool apply_overrides(ftp_config_t& config);
+    static bool set_value(const std::string& key, const std::string& value, ftp_config_t& config);
+
+private:
+    ftp_config_t m_config;
+    std::string m_path;
+    /* 命令行参数，重新加载配置文件之后再次覆盖 */
+    std::vector<std::pair<std::string, std::string> > m_overrides;
+};
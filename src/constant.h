@@ -2,10 +2,6 @@
 
 #include <string>
 
-static const int FTP_PTHREAD_NUMBER = 10;
-
-static std::string SERVER_BIND_ADDRESS = "192.168.221.128";
-
 enum FTP_COMMAND
 {
     FTP_COMMAND_USERNAME,
@@ -19,8 +15,21 @@ enum FTP_COMMAND
     FTP_COMMAND_LIST,
     FTP_COMMAND_QUIT,
     FTP_COMMAND_REST,
-    FTP_COMMAND_PORT
+    FTP_COMMAND_PORT,
+    FTP_COMMAND_APPE,
+    FTP_COMMAND_XCRC,
+    FTP_COMMAND_HASH,
+    FTP_COMMAND_AUTH,
+    FTP_COMMAND_PBSZ,
+    FTP_COMMAND_PROT,
+    FTP_COMMAND_XDEDUP,
+    FTP_COMMAND_XDELTA,
+    FTP_COMMAND_SITE,
+    FTP_COMMAND_RNFR,
+    FTP_COMMAND_RNTO,
+    FTP_COMMAND_XUNTAR,
+    FTP_COMMAND_MODE,
+    FTP_COMMAND_TYPE
 };
 
 static const int MAX_LISTEN_NUMBER = 10;
-static const int MAX_EPOLL_NUMBER = 10;
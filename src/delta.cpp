@@ -0,0 +1,614 @@
+#include "delta.h"
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <cerrno>
+#include <cmath>
+#include <unordered_map>
+#include <algorithm>
+
+#if defined(__x86_64__)
+#include <tmmintrin.h>
+#endif
+
+/* 一条L指令携带的最大数据量，更长的不匹配区间拆成多条 */
+static const size_t DELTA_LITERAL_MAX = 1024 * 1024;
+/* 增量流输出缓冲区的最小字节数 */
+static const size_t DELTA_BUFFER_MIN = 64 * 1024;
+/* 编码时读文件的窗口大小，要能容纳一条L指令的数据加一个最大的块 */
+static const size_t DELTA_WINDOW = 4 * 1024 * 1024;
+
+static void put32(char* p, uint32_t value)
+{
+    for (int i = 0; i < 4; ++i)
+        p[i] = static_cast<char>(value >> (i * 8));
+}
+
+static void put64(char* p, uint64_t value)
+{
+    for (int i = 0; i < 8; ++i)
+        p[i] = static_cast<char>(value >> (i * 8));
+}
+
+static uint32_t get32(const char* p)
+{
+    uint32_t value = 0;
+    for (int i = 0; i < 4; ++i)
+        value |= uint32_t(static_cast<unsigned char>(p[i])) << (i * 8);
+    return value;
+}
+
+static uint64_t get64(const char* p)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < 8; ++i)
+        value |= uint64_t(static_cast<unsigned char>(p[i])) << (i * 8);
+    return value;
+}
+
+/*
+ * 块大小取文件大小的平方根，签名总量和匹配粒度之间折中，按16字节对齐方便向量化计算
+ */
+size_t CDelta::block_size(off_t filesize)
+{
+    size_t block = static_cast<size_t>(std::sqrt(static_cast<double>(filesize)));
+    block = (block + 15) & ~static_cast<size_t>(15);
+    return std::min(std::max(block, DELTA_MIN_BLOCK), DELTA_MAX_BLOCK);
+}
+
+/*
+ * 整块的弱校验，CPU支持SSSE3时每次处理16字节
+ */
+rolling_checksum_t CDelta::checksum(const unsigned char* data, size_t length)
+{
+    rolling_checksum_t sum;
+    sum.s1 = 0;
+    sum.s2 = 0;
+#if defined(__x86_64__)
+    static const bool is_ssse3 = __builtin_cpu_supports("ssse3");
+    if (is_ssse3)
+    {
+        checksum_ssse3(data, length, sum.s1, sum.s2);
+        return sum;
+    }
+#endif
+    checksum_software(data, length, sum.s1, sum.s2);
+    return sum;
+}
+
+/*
+ * 窗口向后滑动一个字节，移出out，移入in
+ */
+void CDelta::roll(rolling_checksum_t& sum, unsigned char out, unsigned char in, size_t length)
+{
+    sum.s1 += in - out;
+    sum.s2 += sum.s1 - static_cast<uint32_t>(length) * out;
+}
+
+uint64_t CDelta::strong_checksum(const unsigned char* data, size_t length)
+{
+    CHasher hasher(HASH_XXH64);
+    hasher.update(data, length);
+    return hasher.final_xxh64();
+}
+
+void CDelta::checksum_software(const unsigned char* data, size_t length, uint32_t& s1, uint32_t& s2)
+{
+    while (length >= 4)
+    {
+        s2 += 4 * s1 + 4 * data[0] + 3 * data[1] + 2 * data[2] + data[3];
+        s1 += data[0] + data[1] + data[2] + data[3];
+        data += 4;
+        length -= 4;
+    }
+    while (length--)
+    {
+        s1 += *data++;
+        s2 += s1;
+    }
+}
+
+/*
+ * 16字节一组：psadbw求字节和，pmaddubsw按16..1加权求和
+ * 每组开始前的s1对s2的贡献为16 * s1，循环中累加各组之前的s1，结束后统一乘16
+ * 累加都按32位回绕，结果只使用低16位，不影响正确性
+ */
+#if defined(__x86_64__)
+__attribute__((target("ssse3")))
+void CDelta::checksum_ssse3(const unsigned char* data, size_t length, uint32_t& s1, uint32_t& s2)
+{
+    const __m128i weights = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+    const __m128i ones = _mm_set1_epi16(1);
+    const __m128i zero = _mm_setzero_si128();
+
+    size_t groups = length / 16;
+    __m128i sum = zero;
+    __m128i prefix = zero;
+    __m128i weighted = zero;
+    for (size_t i = 0; i < groups; ++i)
+    {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i * 16));
+        prefix = _mm_add_epi32(prefix, sum);
+        sum = _mm_add_epi32(sum, _mm_sad_epu8(x, zero));
+        weighted = _mm_add_epi32(weighted, _mm_madd_epi16(_mm_maddubs_epi16(x, weights), ones));
+    }
+
+    /* psadbw的结果在第0和第2个32位元素中 */
+    uint32_t group_sum = _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+    uint32_t group_prefix = _mm_cvtsi128_si32(prefix) + _mm_cvtsi128_si32(_mm_srli_si128(prefix, 8));
+    weighted = _mm_add_epi32(weighted, _mm_shuffle_epi32(weighted, 0x4e));
+    weighted = _mm_add_epi32(weighted, _mm_shuffle_epi32(weighted, 0xb1));
+
+    s2 += static_cast<uint32_t>(groups) * 16 * s1 + 16 * group_prefix + static_cast<uint32_t>(_mm_cvtsi128_si32(weighted));
+    s1 += group_sum;
+    checksum_software(data + groups * 16, length - groups * 16, s1, s2);
+}
+#else
+void CDelta::checksum_ssse3(const unsigned char* data, size_t length, uint32_t& s1, uint32_t& s2)
+{
+    checksum_software(data, length, s1, s2);
+}
+#endif
+
+/*
+ * 计算文件每个完整块的签名，末尾不足一块的部分不参与匹配
+ */
+bool CDelta::make_signatures(int fd, off_t size, size_t block, std::string& signatures)
+{
+    signatures.clear();
+    size_t count = size / block;
+    if (count == 0)
+    {
+        return true;
+    }
+
+    size_t length = count * block;
+    void* addr = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED)
+    {
+        return false;
+    }
+    madvise(addr, length, MADV_SEQUENTIAL);
+
+    const unsigned char* data = static_cast<const unsigned char*>(addr);
+    signatures.resize(count * DELTA_SIGNATURE_SIZE);
+    for (size_t i = 0; i < count; ++i)
+    {
+        char* p = &signatures[i * DELTA_SIGNATURE_SIZE];
+        put32(p, checksum(data + i * block, block).value());
+        put64(p + 4, strong_checksum(data + i * block, block));
+    }
+
+    munmap(addr, length);
+    return true;
+}
+
+bool CDelta::parse_signatures(const char* data, size_t length, std::vector<delta_signature_t>& signatures)
+{
+    if (length % DELTA_SIGNATURE_SIZE != 0 || length / DELTA_SIGNATURE_SIZE > DELTA_MAX_BLOCKS)
+    {
+        return false;
+    }
+
+    signatures.resize(length / DELTA_SIGNATURE_SIZE);
+    for (size_t i = 0; i < signatures.size(); ++i)
+    {
+        signatures[i].weak = get32(data + i * DELTA_SIGNATURE_SIZE);
+        signatures[i].strong = get64(data + i * DELTA_SIGNATURE_SIZE + 4);
+    }
+    return true;
+}
+
+/*
+ * 增量流的输出缓冲，满了之后调用write发送
+ */
+struct delta_output_t
+{
+    std::vector<char>& buffer;
+    size_t used;
+    delta_write_t write;
+    void* arg;
+
+    delta_output_t(std::vector<char>& output, delta_write_t write_function, void* write_arg)
+        : buffer(output), used(0), write(write_function), arg(write_arg)
+    {
+        if (buffer.size() < DELTA_BUFFER_MIN)
+        {
+            buffer.resize(DELTA_BUFFER_MIN);
+        }
+    }
+
+    bool flush()
+    {
+        bool ret = used == 0 || write(arg, buffer.data(), used);
+        used = 0;
+        return ret;
+    }
+
+    bool append(const char* data, size_t length)
+    {
+        while (length > 0)
+        {
+            if (used == buffer.size() && !flush())
+            {
+                return false;
+            }
+            size_t n = std::min(length, buffer.size() - used);
+            memcpy(buffer.data() + used, data, n);
+            used += n;
+            data += n;
+            length -= n;
+        }
+        return true;
+    }
+
+    bool literal(const unsigned char* data, size_t length)
+    {
+        while (length > 0)
+        {
+            size_t n = std::min(length, DELTA_LITERAL_MAX);
+            char header[5];
+            header[0] = DELTA_OP_LITERAL;
+            put32(header + 1, static_cast<uint32_t>(n));
+            if (!append(header, sizeof(header)) || !append(reinterpret_cast<const char*>(data), n))
+            {
+                return false;
+            }
+            data += n;
+            length -= n;
+        }
+        return true;
+    }
+
+    bool match(uint32_t index, uint32_t count)
+    {
+        char op[9];
+        op[0] = DELTA_OP_MATCH;
+        put32(op + 1, index);
+        put32(op + 5, count);
+        return append(op, sizeof(op));
+    }
+};
+
+/*
+ * 从文件按顺序读入的窗口，保留[keep, 文件末尾)中还要访问的数据，不把整个文件放进内存
+ * 文件的每个字节按顺序只读入一次，读入时交给hasher
+ */
+struct delta_window_t
+{
+    int fd;
+    off_t size;
+    std::vector<unsigned char> data;
+    off_t start;
+    off_t end;
+    CHasher& hasher;
+
+    delta_window_t(int file, off_t filesize, CHasher& file_hasher)
+        : fd(file), size(filesize), data(DELTA_WINDOW), start(0), end(0), hasher(file_hasher)
+    {
+    }
+
+    /* 保证[keep, need)在窗口内，keep之前的数据可以丢弃；文件被截断读不到时返回false */
+    bool fill(off_t keep, off_t need)
+    {
+        if (need <= end)
+        {
+            return true;
+        }
+        if (keep > start)
+        {
+            memmove(data.data(), data.data() + (keep - start), end - keep);
+            start = keep;
+        }
+        while (end < size && end - start < static_cast<off_t>(data.size()))
+        {
+            size_t want = std::min(static_cast<off_t>(data.size()) - (end - start), size - end);
+            ssize_t n = pread(fd, data.data() + (end - start), want, end);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0)
+            {
+                break;
+            }
+            hasher.update(data.data() + (end - start), n);
+            end += n;
+        }
+        return need <= end;
+    }
+
+    const unsigned char* at(off_t position) const
+    {
+        return data.data() + (position - start);
+    }
+};
+
+CDeltaEncoder::CDeltaEncoder(int fd, off_t size, size_t block, std::vector<delta_signature_t>& signatures,
+                             delta_write_t write, void* arg)
+    : m_size(size), m_block(block), m_hasher(HASH_SHA256), m_window(NULL), m_output(NULL),
+      m_literal_start(0), m_offset(0), m_match_start(0), m_match_count(0),
+      m_is_primed(false), m_is_finished(false)
+{
+    m_signatures.swap(signatures);
+    m_next.assign(m_signatures.size(), UINT32_MAX);
+    m_head.reserve(m_signatures.size());
+    for (size_t i = m_signatures.size(); i-- > 0; )
+    {
+        std::unordered_map<uint32_t, uint32_t>::iterator it = m_head.find(m_signatures[i].weak);
+        if (it != m_head.end())
+        {
+            m_next[i] = it->second;
+            it->second = static_cast<uint32_t>(i);
+        }
+        else
+        {
+            m_head[m_signatures[i].weak] = static_cast<uint32_t>(i);
+        }
+    }
+
+    m_sum.s1 = 0;
+    m_sum.s2 = 0;
+    m_is_scanning = !m_signatures.empty() && size >= static_cast<off_t>(block);
+    m_stat.literal_bytes = 0;
+    m_stat.matched_bytes = 0;
+    m_stat.matched_blocks = 0;
+
+    posix_fadvise(fd, 0, size, POSIX_FADV_SEQUENTIAL);
+    m_window = new delta_window_t(fd, size, m_hasher);
+    m_output = new delta_output_t(m_buffer, write, arg);
+}
+
+CDeltaEncoder::~CDeltaEncoder()
+{
+    delete m_window;
+    delete m_output;
+}
+
+/*
+ * 先在新文件上滚动查找匹配块，之后发出剩余的不匹配数据和结束指令
+ */
+bool CDeltaEncoder::encode(size_t budget, size_t& used)
+{
+    used = 0;
+    if (m_is_finished)
+    {
+        return true;
+    }
+
+    if (m_is_scanning)
+    {
+        off_t start = m_offset;
+        if (!scan(m_offset + budget))
+        {
+            return false;
+        }
+        used = m_offset - start;
+        if (m_is_scanning)
+        {
+            return m_output->flush();
+        }
+    }
+
+    bool ret = true;
+    while (ret && m_literal_start < m_size && used < budget)
+    {
+        off_t length = std::min(m_size - m_literal_start, static_cast<off_t>(DELTA_LITERAL_MAX));
+        ret = m_window->fill(m_literal_start, m_literal_start + length) &&
+              (m_match_count == 0 || m_output->match(m_match_start, m_match_count)) &&
+              m_output->literal(m_window->at(m_literal_start), length);
+        m_stat.literal_bytes += length;
+        m_match_count = 0;
+        m_literal_start += length;
+        used += length;
+    }
+    if (ret && m_literal_start < m_size)
+    {
+        return m_output->flush();
+    }
+    if (ret && m_match_count > 0)
+    {
+        ret = m_output->match(m_match_start, m_match_count);
+        m_match_count = 0;
+    }
+
+    char end = DELTA_OP_END;
+    m_is_finished = ret && m_output->append(&end, 1) && m_output->flush();
+    return m_is_finished;
+}
+
+/*
+ * 在新文件上滚动弱校验，弱校验命中后再比较强校验，连续的匹配块合并成一条M指令
+ * 滚动到limit或者剩余不足一块时返回，后者m_is_scanning变为false
+ */
+bool CDeltaEncoder::scan(off_t limit)
+{
+    delta_window_t& window = *m_window;
+    delta_output_t& output = *m_output;
+    off_t block = m_block;
+    bool ret = true;
+
+    if (!m_is_primed)
+    {
+        m_is_primed = true;
+        ret = window.fill(0, block);
+        m_sum = CDelta::checksum(window.at(0), ret ? block : 0);
+    }
+    while (ret && m_offset + block <= m_size && m_offset < limit)
+    {
+        /* 不匹配的数据积累太多时先发出去，窗口只需要容纳DELTA_LITERAL_MAX加一个块 */
+        if (m_offset - m_literal_start >= static_cast<off_t>(DELTA_LITERAL_MAX))
+        {
+            ret = (m_match_count == 0 || output.match(m_match_start, m_match_count)) &&
+                  output.literal(window.at(m_literal_start), m_offset - m_literal_start);
+            m_stat.literal_bytes += m_offset - m_literal_start;
+            m_match_count = 0;
+            m_literal_start = m_offset;
+        }
+        if (!ret || !window.fill(m_literal_start, std::min(m_size, m_offset + block + 1)))
+        {
+            ret = false;
+            break;
+        }
+
+        std::unordered_map<uint32_t, uint32_t>::iterator it = m_head.find(m_sum.value());
+        if (it != m_head.end())
+        {
+            uint64_t strong = CDelta::strong_checksum(window.at(m_offset), block);
+            uint32_t found = UINT32_MAX;
+            for (uint32_t i = it->second; i != UINT32_MAX; i = m_next[i])
+            {
+                if (m_signatures[i].strong != strong)
+                    continue;
+                /* 优先选择能和上一个匹配连续的块 */
+                if (found == UINT32_MAX || (m_match_count > 0 && i == m_match_start + m_match_count))
+                    found = i;
+            }
+
+            if (found != UINT32_MAX)
+            {
+                if (m_literal_start < m_offset)
+                {
+                    ret = (m_match_count == 0 || output.match(m_match_start, m_match_count)) &&
+                          output.literal(window.at(m_literal_start), m_offset - m_literal_start);
+                    m_stat.literal_bytes += m_offset - m_literal_start;
+                    m_match_count = 0;
+                }
+                if (m_match_count > 0 && found != m_match_start + m_match_count)
+                {
+                    ret = ret && output.match(m_match_start, m_match_count);
+                    m_match_count = 0;
+                }
+                if (m_match_count == 0)
+                {
+                    m_match_start = found;
+                }
+                ++m_match_count;
+                ++m_stat.matched_blocks;
+                m_stat.matched_bytes += block;
+
+                m_offset += block;
+                m_literal_start = m_offset;
+                if (m_offset + block <= m_size)
+                {
+                    ret = ret && window.fill(m_offset, m_offset + block);
+                    m_sum = CDelta::checksum(window.at(m_offset), ret ? block : 0);
+                }
+                continue;
+            }
+        }
+
+        if (m_offset + block < m_size)
+        {
+            CDelta::roll(m_sum, *window.at(m_offset), *window.at(m_offset + block), block);
+        }
+        ++m_offset;
+    }
+    if (m_offset + block > m_size)
+    {
+        m_is_scanning = false;
+    }
+    return ret;
+}
+
+/*
+ * 文件的每个字节都经过窗口之后才有结果，没有读完时返回空字符串
+ */
+std::string CDeltaEncoder::sha256()
+{
+    if (!m_is_finished || m_window->end != m_size)
+    {
+        return "";
+    }
+    return m_hasher.final_hex();
+}
+
+static bool pwrite_all(int fd, const char* buffer, size_t length, off_t offset)
+{
+    while (length > 0)
+    {
+        ssize_t n = pwrite(fd, buffer, length, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        buffer += n;
+        length -= n;
+        offset += n;
+    }
+    return true;
+}
+
+/*
+ * 读取增量流，用旧文件basisfd的块和流中的数据写出新文件outfd
+ */
+bool CDelta::apply(int basisfd, off_t basis_size, size_t block, int outfd, std::vector<char>& buffer,
+                   delta_read_t read, void* arg, delta_stat_t& stat)
+{
+    stat.literal_bytes = 0;
+    stat.matched_bytes = 0;
+    stat.matched_blocks = 0;
+    if (buffer.size() < DELTA_BUFFER_MIN)
+    {
+        buffer.resize(DELTA_BUFFER_MIN);
+    }
+
+    uint64_t basis_blocks = basis_size / block;
+    off_t offset = 0;
+    while (true)
+    {
+        char op[9];
+        if (!read(arg, op, 1))
+        {
+            return false;
+        }
+
+        if (op[0] == DELTA_OP_END)
+        {
+            return ftruncate(outfd, offset) == 0;
+        }
+        else if (op[0] == DELTA_OP_MATCH)
+        {
+            if (!read(arg, op + 1, 8))
+                return false;
+            uint64_t index = get32(op + 1);
+            uint64_t count = get32(op + 5);
+            if (count == 0 || index + count > basis_blocks)
+                return false;
+
+            off_t source = index * block;
+            off_t length = count * block;
+            while (length > 0)
+            {
+                ssize_t n = pread(basisfd, buffer.data(), std::min<off_t>(length, buffer.size()), source);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0 || !pwrite_all(outfd, buffer.data(), n, offset))
+                    return false;
+                source += n;
+                offset += n;
+                length -= n;
+            }
+            stat.matched_blocks += count;
+            stat.matched_bytes += count * block;
+        }
+        else if (op[0] == DELTA_OP_LITERAL)
+        {
+            if (!read(arg, op + 1, 4))
+                return false;
+            size_t length = get32(op + 1);
+            if (length > DELTA_LITERAL_MAX)
+                return false;
+
+            stat.literal_bytes += length;
+            while (length > 0)
+            {
+                size_t n = std::min(length, buffer.size());
+                if (!read(arg, buffer.data(), n) || !pwrite_all(outfd, buffer.data(), n, offset))
+                    return false;
+                offset += n;
+                length -= n;
+            }
+        }
+        else
+        {
+            return false;
+        }
+    }
+}
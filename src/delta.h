@@ -0,0 +1,130 @@
+#pragma once
+
+#include "checksum.h"
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+/* 增量同步的块大小范围，客户端按本地文件大小选择，服务器拒绝范围之外的块大小 */
+const size_t DELTA_MIN_BLOCK = 1024;
+const size_t DELTA_MAX_BLOCK = 128 * 1024;
+/* 每个块的签名在数据连接上占12字节：弱校验4字节 + XXH64 8字节，小端 */
+const size_t DELTA_SIGNATURE_SIZE = 12;
+const size_t DELTA_MAX_BLOCKS = 4 * 1024 * 1024;
+
+/* 增量流的指令，M 起始块号 块数 引用本地文件的连续块，L 长度 数据 为新内容，E 结束 */
+const char DELTA_OP_MATCH = 'M';
+const char DELTA_OP_LITERAL = 'L';
+const char DELTA_OP_END = 'E';
+
+struct delta_signature_t
+{
+    uint32_t weak;
+    uint64_t strong;
+};
+
+/* 滚动校验和，s1为字节之和，s2为按到窗口末尾距离加权的和，都只使用低16位 */
+struct rolling_checksum_t
+{
+    uint32_t s1;
+    uint32_t s2;
+
+    uint32_t value() const
+    {
+        return (s1 & 0xffff) | (s2 << 16);
+    }
+};
+
+struct delta_stat_t
+{
+    off_t literal_bytes;
+    off_t matched_bytes;
+    long matched_blocks;
+};
+
+/* 增量流的输出和输入，返回false时停止 */
+typedef bool (*delta_write_t)(void* arg, const char* buffer, size_t length);
+typedef bool (*delta_read_t)(void* arg, char* buffer, size_t length);
+
+/*
+ * rsync算法：接收方发送本地旧文件每个块的签名，发送方在新文件上逐字节滚动弱校验查找相同的块，
+ * 只发送块引用和不匹配的数据，接收方用旧文件的块和这些数据重建新文件
+ */
+class CDelta
+{
+public:
+    static size_t block_size(off_t filesize);
+
+    static rolling_checksum_t checksum(const unsigned char* data, size_t length);
+    static void roll(rolling_checksum_t& sum, unsigned char out, unsigned char in, size_t length);
+    static uint64_t strong_checksum(const unsigned char* data, size_t length);
+
+    static bool make_signatures(int fd, off_t size, size_t block, std::string& signatures);
+    static bool parse_signatures(const char* data, size_t length, std::vector<delta_signature_t>& signatures);
+
+    static bool apply(int basisfd, off_t basis_size, size_t block, int outfd, std::vector<char>& buffer,
+                      delta_read_t read, void* arg, delta_stat_t& stat);
+
+private:
+    static void checksum_software(const unsigned char* data, size_t length, uint32_t& s1, uint32_t& s2);
+    static void checksum_ssse3(const unsigned char* data, size_t length, uint32_t& s1, uint32_t& s2);
+};
+
+struct delta_window_t;
+struct delta_output_t;
+
+/*
+ * 发送方的增量编码，状态保存在对象中，每次encode()最多处理新文件的budget字节，产生的输出在返回前全部写出
+ * 读入窗口的数据顺带计算整个文件的SHA-256，编码结束后不用再读一遍文件
+ */
+class CDeltaEncoder
+{
+public:
+    /* signatures被取走，调用者的数组变为空 */
+    CDeltaEncoder(int fd, off_t size, size_t block, std::vector<delta_signature_t>& signatures,
+                  delta_write_t write, void* arg);
+    ~CDeltaEncoder();
+
+    /* 输出或者读文件失败时返回false，used为这次处理的文件字节数 */
+    bool encode(size_t budget, size_t& used);
+    bool is_finished() const
+    {
+        return m_is_finished;
+    }
+    const delta_stat_t& get_stat() const
+    {
+        return m_stat;
+    }
+    /* 结束后整个文件的SHA-256 */
+    std::string sha256();
+
+private:
+    bool scan(off_t limit);
+
+private:
+    off_t m_size;
+    size_t m_block;
+    std::vector<delta_signature_t> m_signatures;
+    /* 弱校验 -> 第一个块号，相同弱校验的块通过m_next串成链表，块号从小到大 */
+    std::unordered_map<uint32_t, uint32_t> m_head;
+    std::vector<uint32_t> m_next;
+
+    CHasher m_hasher;
+    std::vector<char> m_buffer;
+    delta_window_t* m_window;
+    delta_output_t* m_output;
+
+    /* 还没有发出的不匹配数据的起点、滚动到的位置和正在合并的连续匹配块 */
+    off_t m_literal_start;
+    off_t m_offset;
+    uint32_t m_match_start;
+    uint32_t m_match_count;
+    rolling_checksum_t m_sum;
+    bool m_is_scanning;
+    bool m_is_primed;
+    bool m_is_finished;
+    delta_stat_t m_stat;
+};
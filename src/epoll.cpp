@@ -1,21 +1,22 @@
 #include "epoll.h"
 
-CEpoll::CEpoll() : m_fd_number(0)
+CEpoll::CEpoll() : m_fd_number(0), m_epollfd(-1), m_epoll_events()
 {
 
 }
 
 CEpoll::~CEpoll()
 {
-    if (m_epollfd)
+    if (m_epollfd != -1)
     {
         close_epoll();
     }
 }
 
-bool CEpoll::create_epoll()
+bool CEpoll::create_epoll(int max_events)
 {
-    m_epollfd = epoll_create(MAX_EPOLL_NUMBER);
+    m_epoll_events.resize(max_events);
+    m_epollfd = epoll_create(max_events);
     if (m_epollfd < 0)
     {
         return false;
@@ -92,7 +93,7 @@ bool CEpoll::delete_event(int fd, unsigned int events)
 
 int CEpoll::epoll_wait(int timeout)
 {
-    return ::epoll_wait(m_epollfd, m_epoll_events, m_fd_number, timeout);
+    return ::epoll_wait(m_epollfd, m_epoll_events.data(), static_cast<int>(m_epoll_events.size()), timeout);
 }
 
 int CEpoll::get_fd(int idx)
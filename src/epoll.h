@@ -3,8 +3,15 @@
 #include <unistd.h>
 #include <sys/epoll.h>
 #include <sys/types.h>
+#include <vector>
 
-const int MAX_EPOLL_NUMBER = 10;
+/* 旧的头文件中没有EPOLLEXCLUSIVE（Linux 4.5） */
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE (1u << 28)
+#endif
+
+/* 每次epoll_wait最多返回的事件数的默认值 */
+const int MAX_EPOLL_NUMBER = 64;
 
 class CEpoll
 {
@@ -20,11 +27,11 @@ public:
 
     int get_fd(int idx);
     int get_events(int idx);
-    bool create_epoll();
+    bool create_epoll(int max_events = MAX_EPOLL_NUMBER);
     bool close_epoll();
 
 private:
     int m_fd_number;
     int m_epollfd;
-    struct epoll_event m_epoll_events[MAX_EPOLL_NUMBER];
+    std::vector<struct epoll_event> m_epoll_events;
 };
\ No newline at end of file
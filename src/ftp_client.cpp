@@ -1,12 +1,16 @@
 #include "ftp_client.h"
 
-CFTPClient::CFTPClient() : m_filename(""), m_filesize(-1), m_is_rest(false), m_file_offset(0)
+CFTPClient::CFTPClient() : m_filename(""), m_filesize(-1), m_is_rest(false), m_file_offset(0), m_is_verify(false),
+                           m_tls(), m_is_prot_private(false), m_tls_ca(""), m_is_tls_verify(true),
+                           m_is_sparse(false), m_is_ascii(false),
+                           m_host("")
 {
 
 }
 
 CFTPClient::~CFTPClient()
 {
+    m_pool.stop();
 
 }
 
@@ -15,8 +19,15 @@ bool CFTPClient::is_continue_download()
     return m_is_rest;
 }
 
+void CFTPClient::set_tls_verify(const std::string& ca_file, bool is_verify)
+{
+    m_tls_ca = ca_file;
+    m_is_tls_verify = is_verify;
+}
+
 void CFTPClient::login_server(const std::string& host)
 {
+    m_host = host;
     m_control_socket.create_socket();
     if (!m_control_socket.connect_socket(host, CONTROL_PORT))
     {
@@ -24,6 +35,11 @@ void CFTPClient::login_server(const std::string& host)
         m_control_socket.close_socket();
         return;
     }
+    /* 命令都很短，关闭Nagle算法避免等待上一个报文段的确认 */
+    socket_profile_t control_profile;
+    control_profile.is_nodelay = true;
+    CSocketOption::apply_connection(m_control_socket.get_fd(), control_profile);
+
     std::string response;
     int recv_ret = m_control_socket.recv_message(response);
     if (recv_ret <= 0)
@@ -51,6 +67,7 @@ void CFTPClient::input_password(const std::string& password)
 
 void CFTPClient::quit_server(void)
 {
+    m_pool.stop();
     std::string control = parse_command(FTP_COMMAND_QUIT, "");
     send_recv_message(control);
     if (m_data_socket.get_fd() != -1)
@@ -236,9 +253,9 @@ bool CFTPClient::set_port_mode()
 
 bool CFTPClient::continue_download(const std::string& offset)
 {
-    m_is_rest = true;
     std::stringstream oss(offset);
     oss >> m_file_offset;
+    m_is_rest = m_file_offset > 0;
     std::string control = parse_command(FTP_COMMAND_REST, offset);
     return send_recv_message(control);
 }
@@ -251,6 +268,13 @@ bool CFTPClient::download(std::string& argument)
     std::string filename = argument.substr(0, idx);
     std::string path = argument.substr(idx + 1);
 
+    /* TYPE A时本地文件和网络上的字节数不同，不能续传，SIZE的结果为网络上的字节数 */
+    if (m_is_ascii && is_continue_download())
+    {
+        std::cout << "REST not supported in ASCII mode, download from 0" << std::endl;
+        reset_restart_offset();
+    }
+
     std::string control = parse_command(FTP_COMMAND_SIZE, filename);
     send_command(control);
     std::string response;
@@ -265,12 +289,34 @@ bool CFTPClient::download(std::string& argument)
         return false;
     }
 
+    /* 续传前先校验本地已有部分和服务器文件的前缀是否一致，不一致则从头下载 */
+    if (is_continue_download() && !verify_remote_prefix(filename, path + "/" + filename, m_file_offset))
+    {
+        std::cout << "local file differs from server, restart download from 0" << std::endl;
+        reset_restart_offset();
+    }
+
+    /* 校验开启时先取服务器端哈希，下载线程结束后和本地文件比较 */
+    m_expected_hash.clear();
+    if (m_is_verify && !query_remote_hash(filename, FTP_VERIFY_ALGORITHM, m_expected_hash))
+    {
+        std::cout << "fail to get server hash, download without verify" << std::endl;
+    }
+
     control = parse_command(FTP_COMMAND_RETR, filename);
 
 //    std::cout << control << std::endl;
 
-    if (send_recv_message(control) == false)
+    if (send_command(control) == false || recv_response(response) == false)
+        return false;
+    std::cout << response << std::endl;
+    if (response != "retr parse success")
+        return false;
+    if (!secure_data_socket())
+    {
+        std::cout << "TLS handshake on data connection failed" << std::endl;
         return false;
+    }
 
     m_filename = path + "/" + filename;
     std::cout << m_filename << std::endl;
@@ -284,6 +330,11 @@ bool CFTPClient::download(std::string& argument)
     return true;
 }
 
+/*
+ * 下载线程
+ * 大文件默认使用splice把数据从数据套接字经过管道直接搬到文件，不经过用户态
+ * 小文件或者splice不可用时（例如文件系统不支持）退回到缓冲区接收的方式
+ */
 void* CFTPClient::process_download(void* arg)
 {
     std::cout << "in process download" << std::endl;
@@ -291,128 +342,1335 @@ void* CFTPClient::process_download(void* arg)
     std::string filename = ftp_client->m_filename;
     off_t file_size = ftp_client->m_filesize;
 
-    char buffer[FTP_DEFAULT_BUFFER];
-    bzero(buffer, sizeof(buffer));
-
-    std::ofstream out;
-
+    /* 断点续传时不能用O_APPEND，splice不支持追加模式的文件，改用显式偏移量 */
+    int flags = O_WRONLY | O_CREAT;
+    off_t offset = 0;
     if (ftp_client->is_continue_download())
     {
-        out.open(filename.c_str(), std::ios_base::binary | std::ios_base::out | std::ios_base::app);
+        offset = ftp_client->m_file_offset;
     }
     else
     {
-        out.open(filename.c_str(), std::ios_base::binary | std::ios_base::out);
+        flags |= O_TRUNC;
     }
 
-    if (!out.is_open())
+    int filefd = open(filename.c_str(), flags, 0644);
+    if (filefd < 0)
     {
         std::cout << "can't open file : " << filename << std::endl;
         ftp_client->m_is_rest = false;
         pthread_exit(NULL);
     }
 
-    long long int recv_size = ftp_client->m_filesize;
-    std::string message;
-    while (true)
+    /*
+     * 根据SIZE的结果预先分配磁盘空间，减少碎片，KEEP_SIZE保证中断后文件大小仍是真实接收的字节数；
+     * 稀疏传输时不分配，保留空洞；TYPE A时文件比SIZE小，也不分配
+     */
+    if (file_size > offset && !ftp_client->m_is_sparse && !ftp_client->m_is_ascii)
+    {
+        fallocate(filefd, FALLOC_FL_KEEP_SIZE, offset, file_size - offset);
+    }
+
+    download_progress_t progress;
+    progress.total_size = file_size;
+    progress.recv_size = offset;
+    progress.start_size = offset;
+    clock_gettime(CLOCK_MONOTONIC, &progress.start_time);
+    progress.last_report = progress.start_time;
+
+    /* 用户态TLS的数据要经过OpenSSL解密，不能splice */
+    SSL* ssl = ftp_client->m_data_socket.get_tls();
+    bool is_done = false;
+    if (ftp_client->m_is_ascii)
+    {
+        ftp_client->download_ascii(filefd, progress);
+        is_done = true;
+    }
+    else if (ftp_client->m_is_sparse)
+    {
+        ftp_client->download_sparse(filefd, progress);
+        is_done = true;
+    }
+    else if (file_size - offset >= FTP_SPLICE_THRESHOLD && (ssl == NULL || CTLSContext::is_ktls_recv(ssl)))
+    {
+        is_done = ftp_client->download_by_splice(filefd, progress);
+    }
+    if (!is_done)
+    {
+        ftp_client->download_by_buffer(filefd, progress);
+    }
+    struct stat statinfo;
+    off_t local_size = fstat(filefd, &statinfo) == 0 ? statinfo.st_size : file_size;
+    close(filefd);
+
+    report_progress(progress, true);
+    if (!ftp_client->m_expected_hash.empty() && progress.recv_size == file_size)
+    {
+        std::string local_hash;
+        CChecksum::hash_file(filename, FTP_VERIFY_ALGORITHM, 0, local_size, local_hash);
+        std::cout << (local_hash == ftp_client->m_expected_hash ? "verify ok " : "verify failed ")
+                  << CChecksum::algorithm_name(FTP_VERIFY_ALGORITHM) << " " << local_hash << std::endl;
+    }
+    std::cout << "download over" << std::endl;
+    ftp_client->m_is_rest = false;
+    pthread_exit(NULL);
+}
+
+/*
+ * splice零拷贝下载，socket -> pipe -> file
+ * 返回false表示splice不可用且还没有搬运任何数据，调用者应退回缓冲区方式
+ */
+bool CFTPClient::download_by_splice(int filefd, download_progress_t& progress)
+{
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) < 0)
+    {
+        return false;
+    }
+    fcntl(pipefd[1], F_SETPIPE_SZ, FTP_RECV_BUFFER);
+
+    off_t file_offset = progress.recv_size;
+    bool is_spliced = false;
+    while (progress.recv_size < progress.total_size)
     {
-        int n = ftp_client->m_data_socket.recv_message(message);
+        size_t want = std::min<off_t>(progress.total_size - progress.recv_size, FTP_RECV_BUFFER);
+        ssize_t n = splice(m_data_socket.get_fd(), NULL, pipefd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
         if (n < 0)
         {
+            if (errno == EINTR) continue;
+            if (!is_spliced && (errno == EINVAL || errno == ENOSYS))
+            {
+                close(pipefd[0]);
+                close(pipefd[1]);
+                return false;
+            }
             std::cout << "recv error" << std::endl;
             break;
         }
         else if (n == 0)
         {
             std::cout << "disconnect from server" << std::endl;
-            ftp_client->m_data_socket.close_socket();
+            m_data_socket.close_socket();
             break;
         }
-        else
+
+        /* 管道中的数据必须全部写进文件，否则下次splice会和旧数据混在一起 */
+        ssize_t left = n;
+        while (left > 0)
+        {
+            ssize_t m = splice(pipefd[0], NULL, filefd, &file_offset, left, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (m < 0 && errno == EINTR) continue;
+            if (m <= 0)
+            {
+                if (!is_spliced && (errno == EINVAL || errno == ENOSYS))
+                {
+                    /* 数据已经从socket读进管道，取回来写入文件后再退回缓冲区方式 */
+                    char* buffer = acquire_recv_buffer();
+                    ssize_t r = read(pipefd[0], buffer, left);
+                    if (r == left && pwrite_all(filefd, buffer, r, file_offset))
+                    {
+                        progress.recv_size += r;
+                        close(pipefd[0]);
+                        close(pipefd[1]);
+                        return false;
+                    }
+                }
+                std::cout << "write error" << std::endl;
+                close(pipefd[0]);
+                close(pipefd[1]);
+                return true;
+            }
+            is_spliced = true;
+            left -= m;
+        }
+        progress.recv_size += n;
+        report_progress(progress, false);
+    }
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return true;
+}
+
+/*
+ * 普通下载方式，数据接收到复用的m_recv_buffer中再写到文件
+ */
+void CFTPClient::download_by_buffer(int filefd, download_progress_t& progress)
+{
+    char* buffer = acquire_recv_buffer();
+    size_t buffer_size = m_recv_buffer.size();
+
+    while (progress.recv_size < progress.total_size)
+    {
+        int n = m_data_socket.recv_buffer(buffer, buffer_size);
+        if (n < 0)
+        {
+            std::cout << "recv error" << std::endl;
+            break;
+        }
+        else if (n == 0)
         {
-            out.write(message.c_str(), n);
-            recv_size += n;
+            std::cout << "disconnect from server" << std::endl;
+            m_data_socket.close_socket();
+            break;
+        }
 
-            if (recv_size >= file_size) break;
+        if (!pwrite_all(filefd, buffer, n, progress.recv_size))
+        {
+            std::cout << "write error" << std::endl;
+            break;
         }
+        progress.recv_size += n;
+        report_progress(progress, false);
     }
-    out.close();
+}
 
-    std::cout << "download over" << std::endl;
-    ftp_client->m_is_rest = false;
-    pthread_exit(NULL);
+/*
+ * 稀疏下载：按段头部的偏移写入数据，段之间的空洞不写；续传时落在本地已有内容中的空洞打洞，以空洞结尾时扩展到文件大小
+ */
+void CFTPClient::download_sparse(int filefd, download_progress_t& progress)
+{
+    char* buffer = acquire_recv_buffer();
+    size_t buffer_size = m_recv_buffer.size();
+    off_t record_left = 0;
+
+    while (progress.recv_size < progress.total_size)
+    {
+        if (record_left == 0)
+        {
+            char header[SPARSE_HEADER_SIZE];
+            off_t offset;
+            if (!recv_data(header, sizeof(header)) ||
+                !CSparse::decode_header(header, progress.recv_size, progress.total_size, offset, record_left))
+            {
+                std::cout << "sparse stream error" << std::endl;
+                break;
+            }
+            struct stat statinfo;
+            if (offset > progress.recv_size && fstat(filefd, &statinfo) == 0 && statinfo.st_size > progress.recv_size &&
+                !CSparse::punch_hole(filefd, progress.recv_size, std::min<off_t>(offset, statinfo.st_size) - progress.recv_size))
+            {
+                std::cout << "write error" << std::endl;
+                break;
+            }
+            progress.recv_size = offset;
+            continue;
+        }
+
+        int n = m_data_socket.recv_buffer(buffer, std::min<off_t>(buffer_size, record_left));
+        if (n <= 0)
+        {
+            std::cout << (n < 0 ? "recv error" : "disconnect from server") << std::endl;
+            if (n == 0)
+                m_data_socket.close_socket();
+            break;
+        }
+        if (!pwrite_all(filefd, buffer, n, progress.recv_size))
+        {
+            std::cout << "write error" << std::endl;
+            break;
+        }
+        progress.recv_size += n;
+        record_left -= n;
+        report_progress(progress, false);
+    }
+
+    struct stat statinfo;
+    if (progress.recv_size == progress.total_size && fstat(filefd, &statinfo) == 0 &&
+        statinfo.st_size < progress.total_size && ftruncate(filefd, progress.total_size) < 0)
+    {
+        std::cout << "write error" << std::endl;
+    }
+}
+
+/*
+ * TYPE A下载：接收的数据CRLF转换成LF后顺序写入，块末尾的CR留到下一块，progress按网络上的字节数计算
+ */
+void CFTPClient::download_ascii(int filefd, download_progress_t& progress)
+{
+    char* buffer = acquire_recv_buffer();
+    size_t buffer_size = m_recv_buffer.size();
+    m_ascii_buffer.resize(buffer_size + 1);
+    off_t written = 0;
+    bool pending_cr = false;
+
+    while (progress.recv_size < progress.total_size)
+    {
+        int n = m_data_socket.recv_buffer(buffer, std::min<off_t>(buffer_size, progress.total_size - progress.recv_size));
+        if (n <= 0)
+        {
+            std::cout << (n < 0 ? "recv error" : "disconnect from server") << std::endl;
+            if (n == 0)
+                m_data_socket.close_socket();
+            break;
+        }
+        progress.recv_size += n;
+        size_t length = CAsciiConvert::to_lf(buffer, n, &m_ascii_buffer[0], pending_cr);
+        if (progress.recv_size == progress.total_size)
+        {
+            length += CAsciiConvert::finish_lf(&m_ascii_buffer[length], pending_cr);
+        }
+        if (!pwrite_all(filefd, &m_ascii_buffer[0], length, written))
+        {
+            std::cout << "write error" << std::endl;
+            break;
+        }
+        written += length;
+        report_progress(progress, false);
+    }
+}
+
+char* CFTPClient::acquire_recv_buffer()
+{
+    if (m_recv_buffer.size() < static_cast<size_t>(FTP_RECV_BUFFER))
+    {
+        m_recv_buffer.resize(FTP_RECV_BUFFER);
+    }
+    return &m_recv_buffer[0];
+}
+
+bool CFTPClient::pwrite_all(int fd, const char* buffer, size_t length, off_t offset)
+{
+    while (length > 0)
+    {
+        ssize_t n = pwrite(fd, buffer, length, offset);
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        buffer += n;
+        length -= n;
+        offset += n;
+    }
+    return true;
+}
+
+/*
+ * 打印下载进度和速率，每秒最多打印一次，is_final为true时打印总结
+ */
+void CFTPClient::report_progress(download_progress_t& progress, bool is_final)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (!is_final && now.tv_sec - progress.last_report.tv_sec < 1)
+    {
+        return;
+    }
+    progress.last_report = now;
+
+    double elapsed = (now.tv_sec - progress.start_time.tv_sec) + (now.tv_nsec - progress.start_time.tv_nsec) / 1e9;
+    double rate = elapsed > 0 ? (progress.recv_size - progress.start_size) / elapsed / (1024 * 1024) : 0;
+    double percent = progress.total_size > 0 ? 100.0 * progress.recv_size / progress.total_size : 100.0;
+
+    std::cout << "download " << progress.recv_size << "/" << progress.total_size
+              << " (" << static_cast<int>(percent) << "%) " << rate << " MB/s" << std::endl;
 }
 
 bool CFTPClient::store(const std::string& filename)
+{
+    return upload(filename, false);
+}
+
+bool CFTPClient::append(const std::string& filename)
+{
+    return upload(filename, true);
+}
+
+/*
+ * 上传文件，REST之后先用XCRC校验服务器上已有的部分，一致时只上传缺失的尾部
+ */
+bool CFTPClient::upload(const std::string& filename, bool is_append)
 {
     struct stat statinfo;
     if (lstat(filename.c_str(), &statinfo) < 0)
     {
         std::cout << "fail to store file, lstat error" << std::endl;
+        if (is_continue_download())
+            reset_restart_offset();
         return false;
     }
+
+    off_t offset = 0;
+    if (m_is_ascii && is_continue_download())
+    {
+        std::cout << "REST not supported in ASCII mode, store from 0" << std::endl;
+        reset_restart_offset();
+    }
+    if (!is_append && is_continue_download())
+    {
+        std::string::size_type idx = filename.find_last_of('/');
+        std::string remote_name = (idx == std::string::npos) ? filename : filename.substr(idx + 1);
+        if (m_file_offset <= statinfo.st_size && verify_remote_prefix(remote_name, filename, m_file_offset))
+        {
+            offset = m_file_offset;
+        }
+        else
+        {
+            std::cout << "server file differs from local, restart store from 0" << std::endl;
+            reset_restart_offset();
+        }
+    }
+    m_is_rest = false;
+    m_file_offset = 0;
+
+    /* TYPE A时参数中为转换成CRLF之后的字节数 */
+    off_t left = statinfo.st_size - offset;
+    if (m_is_ascii)
+    {
+        int countfd = open(filename.c_str(), O_RDONLY);
+        bool is_counted = countfd >= 0 && CAsciiConvert::crlf_size(countfd, statinfo.st_size, left);
+        if (countfd >= 0)
+            close(countfd);
+        if (!is_counted)
+        {
+            std::cout << "fail to store file, read error" << std::endl;
+            return false;
+        }
+    }
+
     std::stringstream oss;
-    oss << filename << "<" << statinfo.st_size << ">";
-    std::string control = parse_command(FTP_COMMAND_STOR, oss.str());
-    if (send_recv_message(control) == false)
-        return true;
+    oss << filename << "<" << left << ">";
+    std::string control = parse_command(is_append ? FTP_COMMAND_APPE : FTP_COMMAND_STOR, oss.str());
+    if (send_command(control) == false)
+        return false;
+
+    std::string response;
+    if (recv_response(response) == false)
+        return false;
+    std::cout << response << std::endl;
+    if (response.compare(0, 20, "recv command success") != 0)
+        return false;
+    if (!secure_data_socket())
+    {
+        std::cout << "TLS handshake on data connection failed" << std::endl;
+        return false;
+    }
 
+    /*
+     * 明文和kTLS时sendfile，用户态TLS时读到缓冲区再加密发送，TYPE A时转换后从缓冲区发送
+     * 用户态TLS的数据连接上不能sendfile，明文会混进TLS记录流；任何一种方式中途失败都关闭数据连接，
+     * 服务器收到EOF后回复未完成，没有发出的数据也不会留给下一次传输
+     */
     int filefd = open(filename.c_str(), O_RDONLY);
-    sendfile(m_data_socket.get_fd(), filefd, NULL, statinfo.st_size);
-    close(filefd);
+    SSL* ssl = m_data_socket.get_tls();
+    if (filefd >= 0 && m_is_ascii)
+    {
+        send_file_ascii(filefd, left);
+    }
+    else if (filefd >= 0 && m_is_sparse)
+    {
+        send_file_sparse(filefd, offset, left);
+    }
+    else if (filefd >= 0 && ssl != NULL && !CTLSContext::is_ktls_send(ssl))
+    {
+        send_file_by_buffer(filefd, offset, left);
+    }
+    else
+    {
+        while (filefd >= 0 && left > 0)
+        {
+            ssize_t n = sendfile(m_data_socket.get_fd(), filefd, &offset, left);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            left -= n;
+        }
+    }
+    if (filefd >= 0)
+        close(filefd);
+    if (left > 0)
+        m_data_socket.close_socket();
+
+    if (recv_response(response))
+        std::cout << response << std::endl;
 
+    if (m_is_verify && left == 0)
+    {
+        std::string::size_type idx = filename.find_last_of('/');
+        std::string remote_name = (idx == std::string::npos) ? filename : filename.substr(idx + 1);
+        std::string local_hash, remote_hash;
+        CChecksum::hash_file(filename, FTP_VERIFY_ALGORITHM, 0, statinfo.st_size, local_hash);
+        bool is_same = query_remote_hash(remote_name, FTP_VERIFY_ALGORITHM, remote_hash) && remote_hash == local_hash;
+        std::cout << (is_same ? "verify ok " : "verify failed ")
+                  << CChecksum::algorithm_name(FTP_VERIFY_ALGORITHM) << " " << local_hash << std::endl;
+    }
     std::cout << "store file over" << std::endl;
-    return true;
+    return left == 0;
 }
 
-bool CFTPClient::print_work_directory()
+/*
+ * 经过用户态TLS发送文件[offset, offset + left)，返回时left为没有发送的字节数
+ */
+bool CFTPClient::send_file_by_buffer(int filefd, off_t offset, off_t& left)
 {
-    std::string control = parse_command(FTP_COMMAND_PWD, "");
-    return send_recv_message(control);
+    char* buffer = acquire_recv_buffer();
+    size_t buffer_size = m_recv_buffer.size();
+    while (left > 0)
+    {
+        ssize_t n = pread(filefd, buffer, std::min<off_t>(left, buffer_size), offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        if (m_data_socket.send_buffer(buffer, n) != n) return false;
+        offset += n;
+        left -= n;
+    }
+    return true;
 }
 
-bool CFTPClient::change_work_directory(const std::string& dirname)
+/*
+ * TYPE A上传整个文件：每块LF转换成CRLF后发送，left为转换后的总字节数，返回时为没有发送的字节数
+ */
+bool CFTPClient::send_file_ascii(int filefd, off_t& left)
 {
-    std::string control = parse_command(FTP_COMMAND_CWD, dirname);
-    return send_recv_message(control);
+    char* buffer = acquire_recv_buffer();
+    size_t buffer_size = m_recv_buffer.size();
+    m_ascii_buffer.resize(buffer_size * 2);
+    off_t offset = 0;
+    while (left > 0)
+    {
+        ssize_t n = pread(filefd, buffer, buffer_size, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        size_t length = CAsciiConvert::to_crlf(buffer, n, &m_ascii_buffer[0]);
+        if (static_cast<off_t>(length) > left || !send_data(&m_ascii_buffer[0], length)) return false;
+        offset += n;
+        left -= length;
+    }
+    return true;
 }
 
-bool CFTPClient::get_filesize(const std::string& filename)
+/*
+ * 稀疏上传[offset, offset + left)：用SEEK_DATA/SEEK_HOLE找出数据段，每段发送头部和数据，空洞只体现在下一段的偏移中
+ * 返回时left为没有发送的字节数，跳过的空洞算作已发送
+ */
+bool CFTPClient::send_file_sparse(int filefd, off_t offset, off_t& left)
 {
-    std::string control = parse_command(FTP_COMMAND_SIZE, filename);
-    return send_recv_message(control);
+    off_t end = offset + left;
+    SSL* ssl = m_data_socket.get_tls();
+    bool is_sendfile = (ssl == NULL || CTLSContext::is_ktls_send(ssl));
+    while (offset < end)
+    {
+        off_t data, hole;
+        CSparse::next_extent(filefd, offset, end, data, hole);
+        char header[SPARSE_HEADER_SIZE];
+        CSparse::encode_header(header, data, hole - data);
+        if (!send_data(header, sizeof(header)))
+            return false;
+        left -= data - offset;
+        offset = data;
+
+        off_t length = hole - data;
+        if (!is_sendfile)
+        {
+            off_t unsent = length;
+            bool is_sent = send_file_by_buffer(filefd, offset, unsent);
+            left -= length - unsent;
+            offset += length - unsent;
+            if (!is_sent)
+                return false;
+            continue;
+        }
+        while (length > 0)
+        {
+            ssize_t n = sendfile(m_data_socket.get_fd(), filefd, &offset, length);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            length -= n;
+            left -= n;
+        }
+    }
+    return true;
 }
 
-bool CFTPClient::send_recv_message(const std::string& control)
+/*
+ * 去重上传：先发送分块清单，服务器返回分块库中缺失的分块序号，只上传这些分块
+ * 分块算法和服务器相同，内容没有变化的分块不再传输
+ */
+bool CFTPClient::dedup_store(const std::string& filename)
 {
-    if (send_command(control) == false)
+    std::vector<chunk_info_t> chunks;
+    if (!CChunker::chunk_file(filename, chunks))
     {
-        std::cerr << "send command to server error" << std::endl;
+        std::cout << "fail to chunk file " << filename << std::endl;
         return false;
     }
 
+    std::stringstream manifest_stream;
+    for (size_t i = 0; i < chunks.size(); ++i)
+    {
+        manifest_stream << chunks[i].digest << " " << chunks[i].length << "\n";
+    }
+    std::string manifest = manifest_stream.str();
+
+    std::stringstream oss;
+    oss << filename << "<" << manifest.size() << ">";
+    std::string control = parse_command(FTP_COMMAND_XDEDUP, oss.str());
+    if (send_command(control) == false)
+        return false;
+
     std::string response;
     if (recv_response(response) == false)
+        return false;
+    std::cout << response << std::endl;
+    if (response.compare(0, 20, "recv command success") != 0)
+        return false;
+    if (!secure_data_socket())
     {
-        return true;
+        std::cout << "TLS handshake on data connection failed" << std::endl;
+        return false;
     }
+    if (!send_data(manifest.data(), manifest.size()) || recv_response(response) == false)
+        return false;
 
-    std::cout << response << std::endl;
-    return true;
-}
+    /* missing 缺失分块数 列表字节数，列表在数据连接上 */
+    std::stringstream missing_stream(response);
+    std::string tag;
+    size_t missing_count = 0;
+    size_t list_size = 0;
+    missing_stream >> tag >> missing_count >> list_size;
+    if (tag != "missing")
+    {
+        std::cout << response << std::endl;
+        return false;
+    }
+    std::string list(list_size, '\0');
+    if (list_size > 0 && !recv_data(&list[0], list_size))
+        return false;
 
-std::string CFTPClient::parse_command(int control, const std::string& argument)
-{
-    std::string command("");
+    int filefd = open(filename.c_str(), O_RDONLY);
+    if (filefd < 0)
+        return false;
 
-    switch(control)
+    char* buffer = acquire_recv_buffer();
+    std::stringstream list_stream(list);
+    size_t index;
+    size_t sent = 0;
+    off_t sent_size = 0;
+    while (list_stream >> index && index < chunks.size())
     {
-    case FTP_COMMAND_USERNAME:
-        command = "USER " + argument + "\r\n";
-        break;
-    case FTP_COMMAND_PASSWORD:
-        command = "PASS " + argument + "\r\n";
-        break;
+        const chunk_info_t& chunk = chunks[index];
+        if (pread(filefd, buffer, chunk.length, chunk.offset) != static_cast<ssize_t>(chunk.length) ||
+            !send_data(buffer, chunk.length))
+        {
+            break;
+        }
+        ++sent;
+        sent_size += chunk.length;
+    }
+    close(filefd);
+
+    if (recv_response(response))
+        std::cout << response << std::endl;
+    std::cout << "dedup store over, sent " << sent << " chunks " << sent_size << " bytes" << std::endl;
+    return sent == missing_count;
+}
+
+/*
+ * 增量下载，参数和RETR相同：服务器文件名 本地目录
+ * 发送本地旧文件的块签名，服务器只返回变化的数据，重建到临时文件，SHA-256和服务器一致后替换旧文件
+ * 本地文件不存在时所有数据都作为新数据传输
+ */
+bool CFTPClient::delta_download(const std::string& argument)
+{
+    std::string::size_type idx = argument.find_first_of(' ', 0);
+    std::string filename = argument.substr(0, idx);
+    std::string path = idx == std::string::npos ? "." : argument.substr(idx + 1);
+    if (!path.empty() && path[path.size() - 1] == '/') path.pop_back();
+    std::string local_name = path + "/" + filename;
+
+    long cpu_start = cpu_milliseconds();
+    struct stat statinfo;
+    int basisfd = open(local_name.c_str(), O_RDONLY);
+    off_t basis_size = (basisfd >= 0 && fstat(basisfd, &statinfo) == 0 && S_ISREG(statinfo.st_mode)) ? statinfo.st_size : 0;
+    size_t block = CDelta::block_size(basis_size);
+    std::string signatures;
+    if (basisfd >= 0 && !CDelta::make_signatures(basisfd, basis_size, block, signatures))
+    {
+        std::cout << "fail to compute signatures of " << local_name << std::endl;
+        close(basisfd);
+        return false;
+    }
+    long signature_cpu = cpu_milliseconds() - cpu_start;
+
+    std::stringstream oss;
+    oss << filename << "<" << signatures.size() << "> " << block;
+    std::string control = parse_command(FTP_COMMAND_XDELTA, oss.str());
+    std::string response;
+    if (send_command(control) == false || recv_response(response) == false)
+    {
+        if (basisfd >= 0) close(basisfd);
+        return false;
+    }
+    std::cout << response << std::endl;
+    if (response.compare(0, 20, "recv command success") != 0 || !secure_data_socket() ||
+        !send_data(signatures.data(), signatures.size()))
+    {
+        if (basisfd >= 0) close(basisfd);
+        return false;
+    }
+
+    std::string tmp = local_name + ".XXXXXX";
+    int outfd = mkstemp(&tmp[0]);
+    if (outfd < 0)
+    {
+        std::cout << "fail to create " << tmp << std::endl;
+        if (basisfd >= 0) close(basisfd);
+        /* 服务器已经开始发送增量流，关闭数据连接丢弃，再读取服务器的错误回复 */
+        m_data_socket.close_socket();
+        if (recv_response(response))
+            std::cout << response << std::endl;
+        return false;
+    }
+
+    cpu_start = cpu_milliseconds();
+    m_recv_buffer.resize(std::max<size_t>(m_recv_buffer.size(), FTP_RECV_BUFFER));
+    delta_stat_t stat;
+    bool ret = CDelta::apply(basisfd, basis_size, block, outfd, m_recv_buffer, on_delta_read, this, stat);
+    long apply_cpu = cpu_milliseconds() - cpu_start;
+    if (basisfd >= 0) close(basisfd);
+    if (!ret)
+    {
+        m_data_socket.close_socket();
+    }
+
+    /* delta success 文件大小 literal 数据字节数 matched 引用字节数 sha256 哈希 */
+    std::string tag, literal_tag, matched_tag, hash_tag, digest;
+    long long file_size = -1, literal = 0, matched = 0;
+    if (recv_response(response))
+    {
+        std::cout << response << std::endl;
+        std::stringstream result(response);
+        result >> tag >> tag >> file_size >> literal_tag >> literal >> matched_tag >> matched >> hash_tag >> digest;
+    }
+
+    std::string local_hash;
+    if (ret && file_size >= 0 && CChecksum::hash_file(tmp, HASH_SHA256, 0, file_size, local_hash) && local_hash == digest &&
+        fchmod(outfd, basis_size > 0 ? (statinfo.st_mode & 07777) : 0644) == 0 && rename(tmp.c_str(), local_name.c_str()) == 0)
+    {
+        close(outfd);
+        double saved = file_size > 0 ? 100.0 * (file_size - stat.literal_bytes) / file_size : 0;
+        std::cout << "delta over, " << local_name << " " << file_size << " bytes, received " << stat.literal_bytes
+                  << " reused " << stat.matched_bytes << " (saved " << static_cast<int>(saved) << "%), signatures "
+                  << signatures.size() << " bytes, cpu signature " << signature_cpu << " ms rebuild " << apply_cpu << " ms" << std::endl;
+        return true;
+    }
+
+    close(outfd);
+    unlink(tmp.c_str());
+    std::cout << "delta failed, " << local_name << " unchanged, use RETR to download the whole file" << std::endl;
+    return false;
+}
+
+bool CFTPClient::on_delta_read(void* arg, char* buffer, size_t length)
+{
+    return static_cast<CFTPClient*>(arg)->recv_data(buffer, length);
+}
+
+long CFTPClient::cpu_milliseconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*
+ * 下载服务器目录，参数为 服务器目录 本地目录，服务器把目录打包成tar流，保存为 本地目录/目录名.tar
+ * 流的长度事先不知道，按tar的块结构读：头部给出内容长度，连续两个全0块表示结束，不会多读数据连接上的数据
+ */
+bool CFTPClient::download_directory(const std::string& argument)
+{
+    std::stringstream oss(argument);
+    std::string dirname, path;
+    oss >> dirname >> path;
+    while (dirname.size() > 1 && dirname[dirname.size() - 1] == '/')
+        dirname.erase(dirname.size() - 1);
+    if (dirname.empty())
+    {
+        std::cout << "usage: RETRDIR directory [local directory]" << std::endl;
+        return false;
+    }
+    if (path.empty())
+        path = ".";
+    std::string::size_type idx = dirname.find_last_of('/');
+    std::string local_name = path + "/" + (idx == std::string::npos ? dirname : dirname.substr(idx + 1)) + ".tar";
+
+    int filefd = open(local_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (filefd < 0)
+    {
+        std::cout << "can't open file : " << local_name << std::endl;
+        return false;
+    }
+
+    std::string response;
+    if (!send_command(parse_command(FTP_COMMAND_RETR, dirname)) || !recv_response(response))
+    {
+        close(filefd);
+        return false;
+    }
+    std::cout << response << std::endl;
+    if (response != "retr archive" || !secure_data_socket())
+    {
+        close(filefd);
+        unlink(local_name.c_str());
+        return false;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    char* buffer = acquire_recv_buffer();
+    off_t total = 0;
+    long files = 0;
+    int zero_blocks = 0;
+    bool is_success = true;
+    /* 结尾的两个全0块之后读到TAR_RECORD的边界，记录中剩余的填充也保存 */
+    while (is_success && (zero_blocks < 2 || total % TAR_RECORD != 0))
+    {
+        if (!recv_data(buffer, TAR_BLOCK) || !pwrite_all(filefd, buffer, TAR_BLOCK, total))
+        {
+            is_success = false;
+            break;
+        }
+        total += TAR_BLOCK;
+        if (zero_blocks >= 2)
+        {
+            continue;
+        }
+        if (CTarStream::is_zero_block(buffer))
+        {
+            ++zero_blocks;
+            continue;
+        }
+        zero_blocks = 0;
+
+        off_t size;
+        if (!CTarStream::parse_size(buffer, size))
+        {
+            std::cout << "invalid archive header" << std::endl;
+            is_success = false;
+            break;
+        }
+        if (buffer[156] == '0' || buffer[156] == '\0')
+            ++files;
+
+        off_t left = (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+        while (left > 0)
+        {
+            size_t length = std::min<off_t>(left, FTP_RECV_BUFFER);
+            if (!recv_data(buffer, length) || !pwrite_all(filefd, buffer, length, total))
+            {
+                is_success = false;
+                break;
+            }
+            total += length;
+            left -= length;
+        }
+    }
+    close(filefd);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    std::cout << (is_success ? "archive saved to " : "archive incomplete: ") << local_name << ", " << files << " files, "
+              << total << " bytes in " << seconds << " s" << std::endl;
+    return is_success;
+}
+
+/*
+ * 上传整个本地目录，边遍历边生成tar流在一个数据连接上发送，服务器解包到当前目录，结束时回复一次汇总结果
+ * 文件内容和STOR一样用sendfile发送，用户态TLS时读到缓冲区加密发送
+ */
+bool CFTPClient::store_directory(const std::string& dirname)
+{
+    CTarStream archive;
+    if (dirname.empty() || !archive.open_stream(dirname))
+    {
+        std::cout << "usage: STORDIR local directory" << std::endl;
+        return false;
+    }
+
+    std::string response;
+    if (!send_command(parse_command(FTP_COMMAND_XUNTAR, "")) || !recv_response(response))
+        return false;
+    std::cout << response << std::endl;
+    if (response.compare(0, 20, "recv command success") != 0)
+        return false;
+    if (!secure_data_socket())
+    {
+        std::cout << "TLS handshake on data connection failed" << std::endl;
+        return false;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    /* 头部和小文件交替发送，开启TCP_CORK避免发出不满的报文段 */
+    bool is_cork = CSocketOption::set_cork(m_data_socket.get_fd(), true);
+    SSL* ssl = m_data_socket.get_tls();
+    bool is_buffered = ssl != NULL && !CTLSContext::is_ktls_send(ssl);
+    tar_segment_t segment;
+    off_t total = 0;
+    bool is_success = true;
+    while (archive.peek(segment))
+    {
+        ssize_t n;
+        if (segment.data != NULL)
+        {
+            n = send_data(segment.data, segment.length) ? static_cast<ssize_t>(segment.length) : -1;
+        }
+        else if (is_buffered)
+        {
+            off_t left = segment.length;
+            send_file_by_buffer(segment.filefd, segment.offset, left);
+            n = segment.length - left;
+        }
+        else
+        {
+            off_t offset = segment.offset;
+            n = sendfile(m_data_socket.get_fd(), segment.filefd, &offset, segment.length);
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n == 0 && segment.data == NULL)
+        {
+            /* 文件在发送过程中变短，剩余部分补0 */
+            archive.fill_zero();
+            continue;
+        }
+        if (n <= 0)
+        {
+            is_success = false;
+            break;
+        }
+        archive.consume(n);
+        total += n;
+    }
+    if (is_cork)
+        CSocketOption::set_cork(m_data_socket.get_fd(), false);
+    if (!is_success)
+        m_data_socket.close_socket();
+
+    if (recv_response(response))
+        std::cout << response << std::endl;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    std::cout << "store directory over, " << archive.get_file_count() << " files, " << total << " bytes in "
+              << seconds << " s" << std::endl;
+    return is_success && response.compare(0, 21, "store archive success") == 0;
+}
+
+/*
+ * 并发下载多个文件，参数为 本地目录 文件名...，由会话池中已登录的会话执行
+ */
+bool CFTPClient::multi_download(const std::string& argument)
+{
+    std::stringstream oss(argument);
+    std::string path, filename;
+    oss >> path;
+    if (path.empty() || !start_pool())
+        return false;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    std::vector<ftp_transfer_t> results;
+    while (oss >> filename)
+    {
+        m_pool.retrieve(filename, path + "/" + filename, on_transfer_done, &results);
+    }
+    return wait_pool(results, start);
+}
+
+/*
+ * 并发上传多个本地文件，参数为 文件名...
+ */
+bool CFTPClient::multi_store(const std::string& argument)
+{
+    std::stringstream oss(argument);
+    std::string filename;
+    if (!start_pool())
+        return false;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    std::vector<ftp_transfer_t> results;
+    while (oss >> filename)
+    {
+        std::string::size_type idx = filename.find_last_of('/');
+        m_pool.store(filename, idx == std::string::npos ? filename : filename.substr(idx + 1), on_transfer_done, &results);
+    }
+    return wait_pool(results, start);
+}
+
+/*
+ * 会话池使用和交互会话相同的服务器，交互会话已经AUTH TLS时池中的会话也加密
+ */
+bool CFTPClient::start_pool()
+{
+    if (m_pool.is_running())
+        return true;
+
+    ftp_pool_config_t config;
+    config.host = m_host;
+    config.port = CONTROL_PORT;
+    config.sessions = FTP_POOL_SESSIONS;
+    config.is_tls = m_control_socket.get_tls() != NULL;
+    config.tls_ca = m_tls_ca;
+    config.is_tls_verify = m_is_tls_verify;
+    if (!m_pool.start(config))
+    {
+        std::cout << "fail to create session pool" << std::endl;
+        return false;
+    }
+    std::cout << "session pool ready, " << config.sessions << " sessions" << std::endl;
+    return true;
+}
+
+bool CFTPClient::wait_pool(std::vector<ftp_transfer_t>& results, const struct timespec& start)
+{
+    m_pool.wait();
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+    size_t success = 0;
+    off_t bytes = 0;
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        success += results[i].is_success;
+        bytes += results[i].bytes;
+    }
+    std::cout << success << "/" << results.size() << " transfers succeeded, " << bytes << " bytes in " << elapsed << " s, "
+              << (elapsed > 0 ? results.size() / elapsed : 0) << " files/s" << std::endl;
+    return success == results.size();
+}
+
+/*
+ * 在会话池的工作线程中调用，arg为结果数组
+ */
+void CFTPClient::on_transfer_done(const ftp_transfer_t& transfer, void* arg)
+{
+    static pthread_mutex_t print_mutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_lock(&print_mutex);
+    static_cast<std::vector<ftp_transfer_t>*>(arg)->push_back(transfer);
+    std::cout << (transfer.type == FTP_COMMAND_RETR ? "RETR " : "STOR ") << transfer.remote_name << " "
+              << (transfer.is_success ? "ok " : "failed ") << transfer.bytes << " bytes " << transfer.message << std::endl;
+    pthread_mutex_unlock(&print_mutex);
+}
+
+bool CFTPClient::send_data(const char* buffer, size_t length)
+{
+    while (length > 0)
+    {
+        int n = m_data_socket.send_buffer(buffer, length);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        buffer += n;
+        length -= n;
+    }
+    return true;
+}
+
+bool CFTPClient::recv_data(char* buffer, size_t length)
+{
+    while (length > 0)
+    {
+        int n = m_data_socket.recv_buffer(buffer, length);
+        if (n <= 0) return false;
+        buffer += n;
+        length -= n;
+    }
+    return true;
+}
+
+/*
+ * 比较服务器文件remote_name和本地文件local_name前length字节的CRC32
+ */
+bool CFTPClient::verify_remote_prefix(const std::string& remote_name, const std::string& local_name, off_t length)
+{
+    uint32_t local_crc;
+    if (!CChecksum::crc32_file(local_name, 0, length, local_crc))
+        return false;
+
+    std::stringstream oss;
+    oss << remote_name << " " << 0 << " " << length;
+    std::string control = parse_command(FTP_COMMAND_XCRC, oss.str());
+    if (send_command(control) == false)
+        return false;
+
+    std::string response;
+    if (recv_response(response) == false)
+        return false;
+
+    /* 出错时回复-1，%8X会把它解析成0xFFFFFFFF，只接受8位十六进制数，后面可能带有 partial */
+    if (response.size() < 8 || response.find_first_not_of("0123456789ABCDEFabcdef") < 8 ||
+        (response.size() > 8 && response[8] != ' '))
+        return false;
+    uint32_t remote_crc = static_cast<uint32_t>(strtoul(response.substr(0, 8).c_str(), NULL, 16));
+    return remote_crc == local_crc;
+}
+
+/*
+ * 取消续传，同时把服务器记录的偏移量清零
+ */
+void CFTPClient::reset_restart_offset()
+{
+    m_is_rest = false;
+    m_file_offset = 0;
+    std::string control = parse_command(FTP_COMMAND_REST, "0");
+    std::string response;
+    if (send_command(control))
+        recv_response(response);
+}
+
+/*
+ * 向服务器请求整个文件的哈希，回复格式为 算法 起始-结束 哈希值
+ */
+bool CFTPClient::query_remote_hash(const std::string& remote_name, HASH_ALGORITHM algorithm, std::string& digest)
+{
+    std::string control = parse_command(FTP_COMMAND_HASH, std::string(CChecksum::algorithm_name(algorithm)) + " " + remote_name);
+    if (send_command(control) == false)
+        return false;
+
+    std::string response;
+    if (recv_response(response) == false || response == "-1")
+        return false;
+
+    std::string::size_type idx = response.find_last_of(' ');
+    if (idx == std::string::npos)
+        return false;
+    digest = response.substr(idx + 1);
+    return true;
+}
+
+/*
+ * VERIFY ON/OFF，开启后RETR/STOR完成时自动比较两端的哈希
+ */
+bool CFTPClient::set_verify(const std::string& argument)
+{
+    m_is_verify = (argument == "ON" || argument == "on");
+    std::cout << "verify " << (m_is_verify ? "on" : "off") << std::endl;
+    return true;
+}
+
+/*
+ * AUTH TLS，服务器回复234后在控制连接上握手，之后的命令和回复都经过TLS
+ */
+bool CFTPClient::auth_tls(const std::string& argument)
+{
+    if (m_control_socket.get_tls() != NULL)
+    {
+        std::cout << "control connection already secured" << std::endl;
+        return true;
+    }
+    if (!m_tls.is_enabled() && !m_tls.create_client(true, m_host, m_tls_ca, m_is_tls_verify))
+    {
+        std::cout << "fail to create TLS context" << std::endl;
+        return false;
+    }
+
+    std::string control = parse_command(FTP_COMMAND_AUTH, argument.empty() ? "TLS" : argument);
+    std::string response;
+    if (send_command(control) == false || recv_response(response) == false)
+        return false;
+    std::cout << response << std::endl;
+    if (response.compare(0, 3, "234") != 0)
+        return false;
+
+    SSL* ssl = m_tls.connect(m_control_socket.get_fd());
+    if (ssl == NULL)
+    {
+        std::cout << "TLS handshake on control connection failed" << std::endl;
+        return false;
+    }
+    m_control_socket.set_tls(ssl);
+    std::cout << "control connection secured, " << SSL_get_version(ssl) << " " << SSL_get_cipher(ssl)
+              << ", ktls send " << CTLSContext::is_ktls_send(ssl) << " recv " << CTLSContext::is_ktls_recv(ssl) << std::endl;
+    return true;
+}
+
+/*
+ * PROT P/C，先发送PBSZ 0
+ * 保护级别改变后服务器会关闭已有的数据连接，需要重新PASV/PORT
+ */
+bool CFTPClient::set_protection(const std::string& argument)
+{
+    std::string response;
+    if (send_command(parse_command(FTP_COMMAND_PBSZ, "0")) == false || recv_response(response) == false)
+        return false;
+    if (response.compare(0, 3, "200") != 0)
+    {
+        std::cout << response << std::endl;
+        return false;
+    }
+
+    if (send_command(parse_command(FTP_COMMAND_PROT, argument)) == false || recv_response(response) == false)
+        return false;
+    std::cout << response << std::endl;
+    if (response.compare(0, 3, "200") != 0)
+        return false;
+
+    bool is_private = (argument == "P");
+    if (is_private != m_is_prot_private)
+    {
+        m_data_socket.close_socket();
+        m_is_prot_private = is_private;
+    }
+    return true;
+}
+
+/*
+ * MODE S/H，H为稀疏传输，之后的RETR/STOR/APPE只传输数据段
+ */
+bool CFTPClient::set_mode(const std::string& argument)
+{
+    std::string mode(argument);
+    std::transform(mode.begin(), mode.end(), mode.begin(), ::toupper);
+    std::string response;
+    if (send_command(parse_command(FTP_COMMAND_MODE, mode)) == false || recv_response(response) == false)
+        return false;
+    std::cout << response << std::endl;
+    if (response.compare(0, 3, "200") != 0)
+        return false;
+    m_is_sparse = (mode == "H");
+    return true;
+}
+
+/*
+ * TYPE A/I，A时RETR/STOR/APPE在数据连接上使用CRLF行尾，本地文件为LF
+ */
+bool CFTPClient::set_type(const std::string& argument)
+{
+    std::string type(argument);
+    std::transform(type.begin(), type.end(), type.begin(), ::toupper);
+    std::string response;
+    if (send_command(parse_command(FTP_COMMAND_TYPE, type)) == false || recv_response(response) == false)
+        return false;
+    std::cout << response << std::endl;
+    if (response.compare(0, 3, "200") != 0)
+        return false;
+    m_is_ascii = (type[0] == 'A');
+    return true;
+}
+
+/*
+ * PROT P时在第一次传输前和服务器握手，同一个数据连接之后的传输复用
+ */
+bool CFTPClient::secure_data_socket()
+{
+    if (!m_is_prot_private || m_data_socket.get_tls() != NULL)
+        return true;
+
+    SSL* ssl = m_tls.connect(m_data_socket.get_fd());
+    if (ssl == NULL)
+        return false;
+    m_data_socket.set_tls(ssl);
+    return true;
+}
+
+bool CFTPClient::get_hash(const std::string& argument)
+{
+    std::string control = parse_command(FTP_COMMAND_HASH, argument);
+    return send_recv_message(control);
+}
+
+bool CFTPClient::get_checksum(const std::string& argument)
+{
+    std::string control = parse_command(FTP_COMMAND_XCRC, argument);
+    return send_recv_message(control);
+}
+
+bool CFTPClient::print_work_directory()
+{
+    std::string control = parse_command(FTP_COMMAND_PWD, "");
+    return send_recv_message(control);
+}
+
+bool CFTPClient::change_work_directory(const std::string& dirname)
+{
+    std::string control = parse_command(FTP_COMMAND_CWD, dirname);
+    return send_recv_message(control);
+}
+
+bool CFTPClient::get_filesize(const std::string& filename)
+{
+    std::string control = parse_command(FTP_COMMAND_SIZE, filename);
+    return send_recv_message(control);
+}
+
+/*
+ * SITE CPTO在复制完成之前会回复多条150进度，和其他回复一样没有换行，多条可能在一次接收中连在一起，
+ * 150进度固定以"bytes"结尾，据此拆开，读到不是150开头的最终回复为止
+ */
+bool CFTPClient::site_command(const std::string& argument)
+{
+    std::string control = parse_command(FTP_COMMAND_SITE, argument);
+    if (!send_command(control))
+    {
+        std::cerr << "send command to server error" << std::endl;
+        return false;
+    }
+
+    std::string pending;
+    while (true)
+    {
+        std::string response;
+        if (!recv_response(response))
+        {
+            std::cerr << "connection closed by server" << std::endl;
+            return false;
+        }
+        pending += response;
+
+        std::string::size_type idx;
+        while (pending.compare(0, 4, "150 ") == 0 && (idx = pending.find("bytes")) != std::string::npos)
+        {
+            std::cout << pending.substr(0, idx + 5) << std::endl;
+            pending.erase(0, idx + 5);
+        }
+        if (!pending.empty() && pending.compare(0, 4, "150 ") != 0)
+        {
+            std::cout << pending << std::endl;
+            return pending.compare(0, 1, "2") == 0 || pending.compare(0, 1, "3") == 0;
+        }
+    }
+}
+
+bool CFTPClient::rename_from(const std::string& filename)
+{
+    return send_recv_message(parse_command(FTP_COMMAND_RNFR, filename));
+}
+
+bool CFTPClient::rename_to(const std::string& filename)
+{
+    return send_recv_message(parse_command(FTP_COMMAND_RNTO, filename));
+}
+
+bool CFTPClient::send_recv_message(const std::string& control)
+{
+    if (send_command(control) == false)
+    {
+        std::cerr << "send command to server error" << std::endl;
+        return false;
+    }
+
+    std::string response;
+    if (recv_response(response) == false)
+    {
+        return true;
+    }
+
+    std::cout << response << std::endl;
+    return true;
+}
+
+std::string CFTPClient::parse_command(int control, const std::string& argument)
+{
+    std::string command("");
+
+    switch(control)
+    {
+    case FTP_COMMAND_USERNAME:
+        command = "USER " + argument + "\r\n";
+        break;
+    case FTP_COMMAND_PASSWORD:
+        command = "PASS " + argument + "\r\n";
+        break;
     case FTP_COMMAND_PASV:
         command = "PASV\r\n";
         break;
@@ -443,6 +1701,48 @@ std::string CFTPClient::parse_command(int control, const std::string& argument)
     case FTP_COMMAND_REST:
         command = "REST " + argument + "\r\n";
         break;
+    case FTP_COMMAND_APPE:
+        command = "APPE " + argument + "\r\n";
+        break;
+    case FTP_COMMAND_XCRC:
+        command = "XCRC " + argument + "\r\n";
+        break;
+    case FTP_COMMAND_HASH:
+        command = "HASH " + argument + "\r\n";
+        break;
+    case FTP_COMMAND_AUTH:
+        command = "AUTH " + argument + "\r\n";
+        break;
+    case FTP_COMMAND_PBSZ:
+        command = "PBSZ " + argument + "\r\n";
+        break;
+    case FTP_COMMAND_PROT:
+        command = "PROT " + argument + "\r\n";
+        break;
+    case FTP_COMMAND_XDEDUP:
+        command = "XDEDUP " + argument + "\r\n";
+        break;
+    case FTP_COMMAND_XDELTA:
+        command = "XDELTA " + argument + "\r\n";
+        break;
+    case FTP_COMMAND_SITE:
+        command = "SITE " + argument + "\r\n";
+        break;
+    case FTP_COMMAND_RNFR:
+        command = "RNFR " + argument + "\r\n";
+        break;
+    case FTP_COMMAND_RNTO:
+        command = "RNTO " + argument + "\r\n";
+        break;
+    case FTP_COMMAND_XUNTAR:
+        command = "XUNTAR " + argument + "\r\n";
+        break;
+    case FTP_COMMAND_MODE:
+        command = "MODE " + argument + "\r\n";
+        break;
+    case FTP_COMMAND_TYPE:
+        command = "TYPE " + argument + "\r\n";
+        break;
     default:
         break;
     }
@@ -2,6 +2,14 @@
 
 #include "constant.h"
 #include "socket.h"
+#include "checksum.h"
+#include "sockopt.h"
+#include "chunker.h"
+#include "delta.h"
+#include "tar_stream.h"
+#include "sparse.h"
+#include "ascii.h"
+#include "ftp_client_pool.h"
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -12,6 +20,8 @@
 
 #include <sys/sendfile.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
 
 #include <termios.h>
 #include <unistd.h>
@@ -23,12 +33,31 @@
 #include <fstream>
 #include <sstream>
 #include <utility>
+#include <algorithm>
 #include <map>
 #include <vector>
 
 const int CONTROL_PORT = 9999;
 const int DATA_PORT = 8888;
 
+/* VERIFY ON时传输完成后比较两端哈希所用的算法 */
+const HASH_ALGORITHM FTP_VERIFY_ALGORITHM = HASH_CRC32C;
+
+/* MRETR/MSTOR使用的会话池大小 */
+const int FTP_POOL_SESSIONS = 4;
+
+/* 剩余字节数不小于该值时使用splice下载 */
+const off_t FTP_SPLICE_THRESHOLD = 1024 * 1024;
+
+struct download_progress_t
+{
+    off_t total_size;
+    off_t recv_size;
+    off_t start_size;
+    struct timespec start_time;
+    struct timespec last_report;
+};
+
 class CFTPClient 
 {
 public:
@@ -36,6 +65,7 @@ public:
     ~CFTPClient();
 
     void login_server(const std::string& host);
+    void set_tls_verify(const std::string& ca_file, bool is_verify);
     void input_username(const std::string& username);
     void input_password(const std::string& password);
     void quit_server(void);
@@ -44,11 +74,28 @@ public:
     bool set_port_mode();
     bool download(std::string& filename);
     bool store(const std::string& filename);
+    bool append(const std::string& filename);
     bool continue_download(const std::string& offset);
     bool print_work_directory();
     bool change_work_directory(const std::string& dirname);
     bool get_filesize(const std::string& filename);
     bool list_file(const std::string& dirname);    
+    bool get_checksum(const std::string& argument);
+    bool get_hash(const std::string& argument);
+    bool set_verify(const std::string& argument);
+    bool auth_tls(const std::string& argument);
+    bool set_protection(const std::string& argument);
+    bool set_mode(const std::string& argument);
+    bool set_type(const std::string& argument);
+    bool dedup_store(const std::string& filename);
+    bool delta_download(const std::string& argument);
+    bool multi_download(const std::string& argument);
+    bool multi_store(const std::string& argument);
+    bool download_directory(const std::string& argument);
+    bool store_directory(const std::string& dirname);
+    bool site_command(const std::string& argument);
+    bool rename_from(const std::string& filename);
+    bool rename_to(const std::string& filename);
 
 private:
     std::string parse_command(int comCode, const std::string& comArg);
@@ -57,7 +104,31 @@ private:
     bool send_command(const std::string& command);
     bool recv_response(std::string& response);
 
+    bool upload(const std::string& filename, bool is_append);
+    bool verify_remote_prefix(const std::string& remote_name, const std::string& local_name, off_t length);
+    void reset_restart_offset();
+    bool query_remote_hash(const std::string& remote_name, HASH_ALGORITHM algorithm, std::string& digest);
+    bool secure_data_socket();
+    bool send_file_by_buffer(int filefd, off_t offset, off_t& left);
+    bool send_file_sparse(int filefd, off_t offset, off_t& left);
+    bool send_file_ascii(int filefd, off_t& left);
+    bool send_data(const char* buffer, size_t length);
+    bool recv_data(char* buffer, size_t length);
+    static bool on_delta_read(void* arg, char* buffer, size_t length);
+    static long cpu_milliseconds();
+    bool start_pool();
+    bool wait_pool(std::vector<ftp_transfer_t>& results, const struct timespec& start);
+    static void on_transfer_done(const ftp_transfer_t& transfer, void* arg);
+
     static void* process_download(void* arg);
+    bool download_by_splice(int filefd, download_progress_t& progress);
+    void download_by_buffer(int filefd, download_progress_t& progress);
+    void download_sparse(int filefd, download_progress_t& progress);
+    void download_ascii(int filefd, download_progress_t& progress);
+    char* acquire_recv_buffer();
+
+    static bool pwrite_all(int fd, const char* buffer, size_t length, off_t offset);
+    static void report_progress(download_progress_t& progress, bool is_final);
 
 private:
     bool is_continue_download();
@@ -73,4 +144,26 @@ private:
 
     bool m_is_rest;
     off_t m_file_offset;
+
+    std::vector<char> m_recv_buffer;
+
+    bool m_is_verify;
+    std::string m_expected_hash;
+
+    CTLSContext m_tls;
+    bool m_is_prot_private;
+    /* 服务器证书用m_tls_ca（为空时用系统默认的CA）校验，--tls_insecure时不校验 */
+    std::string m_tls_ca;
+    bool m_is_tls_verify;
+
+    /* MODE H之后RETR/STOR/APPE按稀疏格式传输 */
+    bool m_is_sparse;
+
+    /* TYPE A之后RETR/STOR/APPE转换行尾，m_ascii_buffer为转换的输出缓冲区 */
+    bool m_is_ascii;
+    std::vector<char> m_ascii_buffer;
+
+    /* MRETR/MSTOR的会话池，第一次使用时建立，QUIT时关闭 */
+    std::string m_host;
+    CFTPClientPool m_pool;
 };
\ No newline at end of file
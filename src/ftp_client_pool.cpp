@@ -0,0 +1,201 @@
+#include "ftp_client_pool.h"
+
+CFTPClientPool::CFTPClientPool() : m_running(0), m_done(false)
+{
+    pthread_mutex_init(&m_mutex, NULL);
+    pthread_cond_init(&m_job_cond, NULL);
+    pthread_cond_init(&m_idle_cond, NULL);
+    pthread_mutex_init(&m_connect_mutex, NULL);
+}
+
+CFTPClientPool::~CFTPClientPool()
+{
+    stop();
+    pthread_mutex_destroy(&m_mutex);
+    pthread_cond_destroy(&m_job_cond);
+    pthread_cond_destroy(&m_idle_cond);
+    pthread_mutex_destroy(&m_connect_mutex);
+}
+
+/*
+ * 依次建立所有会话，任何一个会话连接或登录失败时返回false并关闭已经建立的会话
+ */
+bool CFTPClientPool::start(const ftp_pool_config_t& config)
+{
+    if (is_running())
+    {
+        return true;
+    }
+    m_config = config;
+    if (m_config.is_tls && !m_tls.is_enabled() &&
+        !m_tls.create_client(true, m_config.host, m_config.tls_ca, m_config.is_tls_verify))
+    {
+        return false;
+    }
+
+    m_done = false;
+    for (int i = 0; i < m_config.sessions; ++i)
+    {
+        ftp_worker_t* worker = new ftp_worker_t;
+        worker->pool = this;
+        if (!connect_session(worker->session) ||
+            pthread_create(&worker->thread_id, NULL, process_transfer, static_cast<void*>(worker)) != 0)
+        {
+            delete worker;
+            stop();
+            return false;
+        }
+        m_workers.push_back(worker);
+    }
+    return true;
+}
+
+/*
+ * 队列中还没有开始的传输被丢弃，正在执行的传输完成后工作线程退出，会话发送QUIT后关闭
+ */
+void CFTPClientPool::stop()
+{
+    pthread_mutex_lock(&m_mutex);
+    m_done = true;
+    while (!m_jobs.empty())
+    {
+        m_jobs.pop();
+    }
+    pthread_cond_broadcast(&m_job_cond);
+    pthread_cond_broadcast(&m_idle_cond);
+    pthread_mutex_unlock(&m_mutex);
+
+    for (size_t i = 0; i < m_workers.size(); ++i)
+    {
+        pthread_join(m_workers[i]->thread_id, NULL);
+        delete m_workers[i];
+    }
+    m_workers.clear();
+}
+
+void CFTPClientPool::retrieve(const std::string& remote_name, const std::string& local_path, ftp_transfer_callback_t callback, void* arg)
+{
+    ftp_job_t job;
+    job.transfer.type = FTP_COMMAND_RETR;
+    job.transfer.remote_name = remote_name;
+    job.transfer.local_path = local_path;
+    job.callback = callback;
+    job.arg = arg;
+    submit(job);
+}
+
+void CFTPClientPool::store(const std::string& local_path, const std::string& remote_name, ftp_transfer_callback_t callback, void* arg)
+{
+    ftp_job_t job;
+    job.transfer.type = FTP_COMMAND_STOR;
+    job.transfer.remote_name = remote_name;
+    job.transfer.local_path = local_path;
+    job.callback = callback;
+    job.arg = arg;
+    submit(job);
+}
+
+void CFTPClientPool::submit(const ftp_job_t& job)
+{
+    pthread_mutex_lock(&m_mutex);
+    m_jobs.push(job);
+    pthread_cond_signal(&m_job_cond);
+    pthread_mutex_unlock(&m_mutex);
+}
+
+/*
+ * 等待已经提交的传输全部完成
+ */
+void CFTPClientPool::wait()
+{
+    pthread_mutex_lock(&m_mutex);
+    while ((!m_jobs.empty() || m_running > 0) && !m_done)
+    {
+        pthread_cond_wait(&m_idle_cond, &m_mutex);
+    }
+    pthread_mutex_unlock(&m_mutex);
+}
+
+/*
+ * 连接登录不需要串行，PASV和数据连接在m_connect_mutex中成对执行，保证服务器把数据连接交给这个会话
+ */
+bool CFTPClientPool::connect_session(CFTPSession& session)
+{
+    if (!session.is_open() &&
+        !session.open(m_config.host, m_config.port, m_config.username, m_config.password, m_config.is_tls ? &m_tls : NULL))
+    {
+        return false;
+    }
+    if (session.has_data_channel())
+    {
+        return true;
+    }
+
+    pthread_mutex_lock(&m_connect_mutex);
+    bool ret = session.open_data_channel();
+    pthread_mutex_unlock(&m_connect_mutex);
+    return ret;
+}
+
+/*
+ * 连接断开导致的失败重新连接后重试一次，文件不存在等服务器拒绝的请求不重试
+ */
+bool CFTPClientPool::run_transfer(CFTPSession& session, ftp_transfer_t& transfer)
+{
+    for (int attempt = 0; attempt < 2; ++attempt)
+    {
+        if (!connect_session(session))
+        {
+            transfer.is_success = false;
+            transfer.message = "cannot connect to server";
+            continue;
+        }
+
+        bool ret = transfer.type == FTP_COMMAND_RETR ? session.retrieve(transfer) : session.store(transfer);
+        if (ret || (session.is_open() && session.has_data_channel()))
+        {
+            return ret;
+        }
+    }
+    return false;
+}
+
+void* CFTPClientPool::process_transfer(void* arg)
+{
+    ftp_worker_t* worker = static_cast<ftp_worker_t*>(arg);
+    CFTPClientPool* pool = worker->pool;
+    while (true)
+    {
+        pthread_mutex_lock(&pool->m_mutex);
+        while (pool->m_jobs.empty() && !pool->m_done)
+        {
+            pthread_cond_wait(&pool->m_job_cond, &pool->m_mutex);
+        }
+        if (pool->m_done)
+        {
+            pthread_mutex_unlock(&pool->m_mutex);
+            break;
+        }
+        ftp_job_t job = pool->m_jobs.front();
+        pool->m_jobs.pop();
+        ++pool->m_running;
+        pthread_mutex_unlock(&pool->m_mutex);
+
+        pool->run_transfer(worker->session, job.transfer);
+        if (job.callback != NULL)
+        {
+            job.callback(job.transfer, job.arg);
+        }
+
+        pthread_mutex_lock(&pool->m_mutex);
+        --pool->m_running;
+        if (pool->m_jobs.empty() && pool->m_running == 0)
+        {
+            pthread_cond_broadcast(&pool->m_idle_cond);
+        }
+        pthread_mutex_unlock(&pool->m_mutex);
+    }
+
+    worker->session.close();
+    return NULL;
+}
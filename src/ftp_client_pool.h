@@ -0,0 +1,90 @@
+#pragma once
+
+#include "ftp_session.h"
+#include "tls.h"
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <queue>
+
+/* 传输完成后在工作线程中调用，回调中不能再调用wait()和stop() */
+typedef void (*ftp_transfer_callback_t)(const ftp_transfer_t& transfer, void* arg);
+
+struct ftp_pool_config_t
+{
+    std::string host;
+    int port;
+    std::string username;
+    std::string password;
+    /* 会话数，也是同时进行的传输数 */
+    int sessions;
+    /* 控制连接AUTH TLS，数据连接PROT P，证书校验的设置和交互会话相同 */
+    bool is_tls;
+    std::string tls_ca;
+    bool is_tls_verify;
+
+    ftp_pool_config_t() : host(""), port(9999), username("anonymous"), password(""), sessions(4), is_tls(false),
+                          tls_ca(""), is_tls_verify(true)
+    {
+    }
+};
+
+/*
+ * 客户端会话池，启动时建立sessions个已登录的会话和数据连接，之后的传输复用这些连接
+ * retrieve()/store()只把请求放入队列立即返回，空闲会话取出执行，完成后调用回调
+ * 会话断开时由所在的工作线程重新连接登录，失败的传输重试一次
+ */
+class CFTPClientPool
+{
+public:
+    CFTPClientPool();
+    ~CFTPClientPool();
+
+    bool start(const ftp_pool_config_t& config);
+    void stop();
+    bool is_running() const
+    {
+        return !m_workers.empty();
+    }
+
+    void retrieve(const std::string& remote_name, const std::string& local_path, ftp_transfer_callback_t callback, void* arg);
+    void store(const std::string& local_path, const std::string& remote_name, ftp_transfer_callback_t callback, void* arg);
+    void wait();
+
+private:
+    struct ftp_job_t
+    {
+        ftp_transfer_t transfer;
+        ftp_transfer_callback_t callback;
+        void* arg;
+    };
+
+    struct ftp_worker_t
+    {
+        CFTPClientPool* pool;
+        CFTPSession session;
+        pthread_t thread_id;
+    };
+
+    void submit(const ftp_job_t& job);
+    bool connect_session(CFTPSession& session);
+    bool run_transfer(CFTPSession& session, ftp_transfer_t& transfer);
+    static void* process_transfer(void* arg);
+
+private:
+    ftp_pool_config_t m_config;
+    CTLSContext m_tls;
+    std::vector<ftp_worker_t*> m_workers;
+
+    /* 等待执行的传输和正在执行的传输数，受m_mutex保护 */
+    std::queue<ftp_job_t> m_jobs;
+    size_t m_running;
+    bool m_done;
+    pthread_mutex_t m_mutex;
+    pthread_cond_t m_job_cond;
+    pthread_cond_t m_idle_cond;
+
+    /* 同一地址的数据连接按PASV的顺序匹配，建立数据连接时串行 */
+    pthread_mutex_t m_connect_mutex;
+};
@@ -1,9 +1,13 @@
 #pragma once
 
 #include "socket.h"
+#include "timer_wheel.h"
 #include <string>
+#include <atomic>
+#include <pthread.h>
 
 class CFTPServer;
+struct ftp_io_job_t;
 
 struct ftp_client_t
 {
@@ -13,6 +17,63 @@ struct ftp_client_t
     off_t file_offset;
     std::string current_workdir;
     std::string control_argument;
+    std::string ip_address;
+    /* USER命令的用户名，用于查找user_weights中的调度权重 */
+    std::string username;
+    /* SITE CPFR和RNFR记录的源文件完整路径，CPTO和RNTO使用后清空 */
+    std::string copy_from;
+    std::string rename_from;
+    /* 控制连接的数据包到达的CPU所在的NUMA节点，命令优先交给这个节点的工作线程，-1表示不限 */
+    int node;
+
+    /*
+     * AUTH TLS之后控制连接的TLS状态，PROT P时数据连接在第一次传输前握手，data_ssl跟随data_fd释放
+     * 只在执行该会话命令的工作线程中使用，会话删除时释放
+     */
+    SSL* control_ssl;
+    SSL* data_ssl;
+    bool is_prot_private;
+    /* MODE H之后RETR/STOR/APPE按稀疏格式传输，只发送数据段，空洞用段的偏移表示 */
+    bool is_sparse;
+    /* TYPE A之后RETR/STOR/APPE在数据连接上使用CRLF行尾，文件中保存为LF */
+    bool is_ascii;
+    /*
+     * 有使用数据连接的I/O任务在排队或者执行，受m_pthread_mutex保护
+     * 这时到达的下一个传输命令保存在waiting_transfer中，当前任务结束后再交给调度器，
+     * 客户端收完数据马上发出的命令不会因为服务器还没有结束任务而被拒绝
+     */
+    bool is_transferring;
+    ftp_io_job_t* waiting_transfer;
+
+    /*
+     * 边缘触发下同一个控制连接可能同时分发给多个工作线程，I/O线程也会在控制连接上回复，
+     * 同一个SSL不能被多个线程同时读写，控制连接的接收和发送都在control_mutex中进行
+     */
+    pthread_mutex_t control_mutex;
+
+    /*
+     * 以下用于回收空闲会话、停滞的数据传输和没有应答的PASV
+     * timer只在主循环中访问，pending_tasks和is_closed受m_pthread_mutex保护
+     * 时间戳由工作线程写、主循环读，单位为CLOCK_MONOTONIC秒，0表示没有
+     */
+    timer_node_t timer;
+    int pending_tasks;
+    bool is_closed;
+    std::atomic<long> last_active;
+    std::atomic<long> data_progress;
+    std::atomic<long> pasv_time;
+
+    ftp_client_t() : control_fd(-1), data_fd(-1), data_listen_fd(-1), file_offset(0), node(-1),
+                     control_ssl(NULL), data_ssl(NULL), is_prot_private(false), is_sparse(false), is_ascii(false),
+                     is_transferring(false), waiting_transfer(NULL), pending_tasks(0), is_closed(false), last_active(0), data_progress(0), pasv_time(0)
+    {
+        pthread_mutex_init(&control_mutex, NULL);
+    }
+
+    ~ftp_client_t()
+    {
+        pthread_mutex_destroy(&control_mutex);
+    }
 };
 
 struct pthread_argument_t
@@ -1,25 +1,138 @@
 #include "ftp_server.h"
 
-CFTPServer::CFTPServer() : m_control_listen_fd(-1), m_data_listen_fd(-1), m_epoll(), m_current_workdir(""),
-                            m_client_map(), m_address_map(), m_pthread_pool()
+CFTPServer::CFTPServer(const CConfig& config) : m_control_listen_fd(-1), m_data_listen_fd(-1), m_timer_fd(-1), m_signal_fd(-1),
+                            m_reserve_fd(open("/dev/null", O_RDONLY | O_CLOEXEC)), m_accept_dropped(0),
+                            m_config_loader(config), m_config(config.get_config()),
+                            m_sendfile_chunk(m_config.sendfile_chunk), m_recv_buffer(m_config.recv_buffer),
+                            m_store_sync(m_config.store_sync), m_store_writebehind(m_config.store_writebehind), m_epoll(),
+                            m_current_workdir(""), m_client_map(), m_address_map(), m_hash_cache(m_config.hash_cache_capacity),
+                            m_reaped_idle(0), m_reaped_stalled(0), m_reaped_pasv(0),
+                            m_handoff(), m_is_handed_off(false), m_is_running(false), m_is_draining(false), m_drain_deadline(0),
+                            m_pthread_pool(), m_io_pool(), m_io_queue_limit(m_config.io_queue_limit), m_scheduler(),
+                            m_group_commit()
 {
     m_pthread_mutex = PTHREAD_MUTEX_INITIALIZER;
+    m_scheduler.set_quantum(m_config.sched_quantum);
+    m_group_commit.set_wait(m_config.group_commit_wait);
 
-    create_control_listen_socket();
+    /* 信号屏蔽必须在创建线程池之前，工作线程继承屏蔽字 */
+    create_signal();
+    if (!inherit_listen_sockets())
+    {
+        create_control_listen_socket();
+    }
+    m_handoff.listen_handoff(m_config.handoff_path);
     create_epoll();
+    create_timer();
+    create_tls();
+    create_chunk_store();
     init_current_workdir();
 }
 
+/*
+ * 配置了证书时支持AUTH TLS，否则AUTH回复534
+ */
+bool CFTPServer::create_tls()
+{
+    if (m_config.tls_certificate.empty())
+    {
+        return false;
+    }
+
+    const std::string& key_file = m_config.tls_private_key.empty() ? m_config.tls_certificate : m_config.tls_private_key;
+    if (!m_tls.create_server(m_config.tls_certificate, key_file, m_config.is_ktls))
+    {
+        std::cout << "fail to load TLS certificate " << m_config.tls_certificate << ", AUTH TLS disabled" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * 配置了分块库目录时支持XDEDUP去重上传，否则XDEDUP回复502
+ */
+bool CFTPServer::create_chunk_store()
+{
+    if (m_config.chunk_store.empty())
+    {
+        return false;
+    }
+    if (!m_chunk_store.open_store(m_config.chunk_store))
+    {
+        std::cout << "fail to open chunk store " << m_config.chunk_store << ", XDEDUP disabled" << std::endl;
+        return false;
+    }
+    return true;
+}
+
 CFTPServer::~CFTPServer()
 {
     if (m_control_listen_fd != -1)
         close(m_control_listen_fd);
     if (m_data_listen_fd != -1)
         close(m_data_listen_fd);
+    if (m_timer_fd != -1)
+        close(m_timer_fd);
+    if (m_signal_fd != -1)
+        close(m_signal_fd);
+    if (m_reserve_fd != -1)
+        close(m_reserve_fd);
 
     close_epoll();
 }
 
+/*
+ * SIGINT/SIGTERM通过signalfd交给主循环处理，触发优雅退出，SIGHUP重新加载配置
+ * 传输中对端关闭时sendfile会产生SIGPIPE，忽略它
+ */
+bool CFTPServer::create_signal()
+{
+    signal(SIGPIPE, SIG_IGN);
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGHUP);
+    if (pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0)
+    {
+        return false;
+    }
+
+    m_signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    return m_signal_fd >= 0;
+}
+
+/*
+ * 热重启：如果旧进程还在运行，从它那里接收控制和数据监听套接字
+ */
+bool CFTPServer::inherit_listen_sockets()
+{
+    int fds[HANDOFF_MAX_FDS];
+    int count = CHandoff::request_listen_fds(m_config.handoff_path, fds, HANDOFF_MAX_FDS);
+    if (count <= 0)
+    {
+        return false;
+    }
+
+    /* 继承的监听套接字使用本进程的套接字选项，对之后accept的连接生效，再次listen()更新队列长度 */
+    m_control_listen_fd = fds[0];
+    CSocketOption::apply_listen(m_control_listen_fd, m_config.control_socket);
+    listen(m_control_listen_fd, m_config.listen_backlog);
+    if (count > 1)
+    {
+        m_data_listen_fd = fds[1];
+        CSocketOption::apply_listen(m_data_listen_fd, m_config.data_socket);
+        listen(m_data_listen_fd, m_config.listen_backlog);
+    }
+    for (int i = 2; i < count; ++i)
+    {
+        close(fds[i]);
+    }
+    std::cout << "inherit listen sockets from running server" << std::endl;
+    return true;
+}
+
 void CFTPServer::init_current_workdir()
 {
     char current_workdir[1024];
@@ -39,8 +152,10 @@ bool CFTPServer::create_control_listen_socket()
     struct sockaddr_in servaddr;
     bzero(&servaddr, sizeof(servaddr));
     servaddr.sin_family = AF_INET;
-    servaddr.sin_port = htons(PORT);
-    inet_pton(AF_INET, IP.c_str(), &servaddr.sin_addr);
+    servaddr.sin_port = htons(m_config.control_port);
+    inet_pton(AF_INET, m_config.bind_address.c_str(), &servaddr.sin_addr);
+
+    CSocketOption::apply_listen(m_control_listen_fd, m_config.control_socket);
 
     if (bind(m_control_listen_fd, (struct sockaddr*)&servaddr, sizeof(servaddr)) < 0)
     {
@@ -48,7 +163,7 @@ bool CFTPServer::create_control_listen_socket()
         return false;
     }
 
-    if (listen(m_control_listen_fd, MAX_LISTEN_NUMBER) < 0)
+    if (listen(m_control_listen_fd, m_config.listen_backlog) < 0)
     {
         close(m_control_listen_fd);
         return false;
@@ -68,12 +183,10 @@ bool CFTPServer::create_data_listen_socket()
     struct sockaddr_in servaddr;
     bzero(&servaddr, sizeof(servaddr));
     servaddr.sin_family = AF_INET;
-    servaddr.sin_port = htons(DATA_PORT);
-    inet_pton(AF_INET, IP.c_str(), &servaddr.sin_addr);
+    servaddr.sin_port = htons(m_config.data_port);
+    inet_pton(AF_INET, m_config.bind_address.c_str(), &servaddr.sin_addr);
 
-    int flag = fcntl(m_data_listen_fd, F_GETFL);
-    flag |= O_NONBLOCK;
-    fcntl(m_data_listen_fd, F_SETFL, flag);
+    CSocketOption::apply_listen(m_data_listen_fd, m_config.data_socket);
 
     if (bind(m_data_listen_fd, (struct sockaddr*)&servaddr, sizeof(servaddr)) < 0)
     {
@@ -81,29 +194,48 @@ bool CFTPServer::create_data_listen_socket()
         return false;
     }
 
-    if (listen(m_data_listen_fd, MAX_LISTEN_NUMBER) < 0)
+    if (listen(m_data_listen_fd, m_config.listen_backlog) < 0)
     {
         close(m_data_listen_fd);
         return false;
     }
 
-    m_epoll.add_event(m_data_listen_fd, EPOLLIN | EPOLLET);
+    m_epoll.add_event(m_data_listen_fd, FTP_LISTEN_EVENTS);
     return true;
 }
 
 bool CFTPServer::create_epoll()
 {
-    return m_epoll.create_epoll();
+    return m_epoll.create_epoll(m_config.epoll_events);
 }
 
-bool CFTPServer::close_epoll()
+/*
+ * 每秒触发一次的timerfd，驱动会话时间轮
+ */
+bool CFTPServer::create_timer()
 {
-    return m_epoll.close_epoll();
+    m_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (m_timer_fd < 0)
+    {
+        return false;
+    }
+
+    struct itimerspec spec;
+    bzero(&spec, sizeof(spec));
+    spec.it_value.tv_sec = 1;
+    spec.it_interval.tv_sec = 1;
+    if (timerfd_settime(m_timer_fd, 0, &spec, NULL) < 0)
+    {
+        close(m_timer_fd);
+        m_timer_fd = -1;
+        return false;
+    }
+    return true;
 }
 
-void CFTPServer::handle(int)
+bool CFTPServer::close_epoll()
 {
-    exit(0);
+    return m_epoll.close_epoll();
 }
 
 /* 
@@ -114,21 +246,36 @@ void CFTPServer::handle(int)
  */
 void CFTPServer::run()
 {
-    struct sigaction act;
-    act.sa_handler = CFTPServer::handle;
-    if (sigaction(SIGINT, &act, NULL) < 0)
+    m_epoll.add_event(m_control_listen_fd, FTP_LISTEN_EVENTS);
+    if (m_data_listen_fd != -1)
     {
-        return;
+        m_epoll.add_event(m_data_listen_fd, FTP_LISTEN_EVENTS);
+    }
+    if (m_timer_fd != -1)
+    {
+        m_epoll.add_event(m_timer_fd, EPOLLIN | EPOLLET);
+    }
+    if (m_signal_fd != -1)
+    {
+        m_epoll.add_event(m_signal_fd, EPOLLIN | EPOLLET);
+    }
+    if (m_handoff.get_fd() != -1)
+    {
+        m_epoll.add_event(m_handoff.get_fd(), EPOLLIN | EPOLLET);
     }
-    
-    m_epoll.add_event(m_control_listen_fd, EPOLLIN | EPOLLET);
 
-    m_pthread_pool.run(FTP_PTHREAD_NUMBER);
+    apply_affinity();
+    m_pthread_pool.set_timeout(m_config.thread_grow_wait, m_config.thread_idle_timeout * 1000);
+    m_io_pool.set_timeout(m_config.thread_grow_wait, m_config.thread_idle_timeout * 1000);
+    m_pthread_pool.run(m_config.worker_threads, m_config.worker_threads_max);
+    m_io_pool.run(m_config.io_threads, m_config.io_threads_max);
+    m_group_commit.start(&CFTPServer::on_store_commit, this);
 
-    std::stringstream oss;
-    while (true)
+    m_is_running = true;
+    while (m_is_running)
     {
         int n = m_epoll.epoll_wait(-1);
+        if (n < 0 && errno == EINTR) continue;
         if (n <= 0) break;
         for (int i = 0; i < n; ++i)
         {
@@ -137,464 +284,3562 @@ void CFTPServer::run()
 
             if ((events & EPOLLHUP) || (events & EPOLLERR) || !(events & EPOLLIN))
             {
-                m_epoll.delete_event(fd, events);
-                close(fd);
+                close_session(fd);
                 continue;
             }
 
             if (fd == m_control_listen_fd)
             {
-                struct sockaddr_in clientaddr;
-                socklen_t len = sizeof(clientaddr);
-                int clientfd = accept(m_control_listen_fd, (struct sockaddr*)&clientaddr, &len);
-
-                m_epoll.add_event(clientfd, EPOLLIN | EPOLLET);
-
-                /*
-                 * ftp_client_t中包含
-                 * 客户端控制套接字：用于接收命令
-                 * 数据传输套接字：用于上传，下载
-                 * 当前工作目录：客户端在服务器中设置的当前工作目录，不能真正改变服务器的工作目录，因为
-                 *      如果有多个客户端请求，工作目录会乱掉，所以只是记录每个客户端的工作目录
-                 * 命令参数：客户端发送命令时带有的参数
-                 * 偏移量：用于断点续传，客户端发送REST时传入的参数
-                 */
-                ftp_client_t ftp_client;
-                ftp_client.control_fd = clientfd;
-                ftp_client.current_workdir = m_current_workdir;
-                ftp_client.control_argument = "";
-                ftp_client.file_offset = 0;
-                m_client_map[clientfd] = ftp_client;
-
-                /*
-                 * 为了可以同时满足多个客户端，而又因为客户端的控制请求和数据传输请求不是同时发送的
-                 * 为了找到当前数据传输请求属于哪个客户端，需要存储客户端的地址
-                 * 根据地址找到控制请求
-                 * 这也就造成了一台机器中只能运行一个FTP客户端
-                 */
-                std::string ip_string = parse_ip_address(clientaddr);
-                m_address_map[ip_string] = clientfd;
-
-                send(clientfd, WELCOME_CLIENT.c_str(), WELCOME_CLIENT.size(), MSG_NOSIGNAL);
+                accept_control_connection();
             }
             else if (fd == m_data_listen_fd)
             {
-                struct sockaddr_in clientaddr;
-                socklen_t len = sizeof(clientaddr);
-                int clientfd = accept(m_data_listen_fd, (struct sockaddr*)&clientaddr, &len);
-
-                std::string ip_string = parse_ip_address(clientaddr);
-                int control_fd = m_address_map[ip_string];
-                m_client_map[control_fd].data_fd = clientfd;
+                accept_data_connection();
+            }
+            else if (fd == m_timer_fd)
+            {
+                process_timer();
+            }
+            else if (fd == m_signal_fd)
+            {
+                process_signal();
+            }
+            else if (fd == m_handoff.get_fd())
+            {
+                process_handoff();
             }
             else
             {
-                /*
-                 * 创建线程池任务，添加到线程池中，参数
-                 * void (*process_command)(std::vector<void*>);回调函数地址
-                 * std::vector<void*>;给回调函数的参数
-                 */
-                CTask* task = new CTask(&CFTPServer::process_command, {static_cast<void*>(this), static_cast<void*>(&fd)});
-                m_pthread_pool.add_task(task);
+                dispatch_command(fd);
             }
         }
     }
-}
 
-std::string CFTPServer::parse_ip_address(struct sockaddr_in& addr)
-{
-    char ip_address[128];
-    bzero(ip_address, sizeof(ip_address));
-    inet_ntop(addr.sin_family, &addr.sin_addr, ip_address, sizeof(ip_address));
-    return ip_address;
+    stop_pools();
+    std::cout << "server exit" << std::endl;
 }
 
-void CFTPServer::process_command(std::vector<void*> args)
+/*
+ * accept一个连接，监听队列为空或者出错时返回-1
+ * 进程的fd用完时(EMFILE/ENFILE)关闭预留的fd，accept之后马上关闭，否则边缘触发的监听套接字不会再有事件，
+ * 队列中的连接一直得不到处理；调用者循环到返回-1，队列中的连接这样全部被拒绝
+ */
+int CFTPServer::accept_client(int listen_fd, struct sockaddr_in& clientaddr)
 {
-    CFTPServer* ftp_server = static_cast<CFTPServer*>(args[0]);
-    int fd = *static_cast<int*>(args[1]);
-
-    std::string message = ftp_server->recv_client_command(fd);
-
-//    std::cout << message << std::endl;
-
-    if (message == "")
-    {
-        ftp_server->m_epoll.delete_event(fd, EPOLLIN | EPOLLET);
-        close(fd);
-        return;
-    }
-    std::string::size_type back_idx = message.find_first_of("\r\n", 0);
-    if (back_idx == std::string::npos)
+    while (true)
     {
-        return;
+        socklen_t len = sizeof(clientaddr);
+        int clientfd = accept4(listen_fd, (struct sockaddr*)&clientaddr, &len, SOCK_CLOEXEC);
+        if (clientfd >= 0)
+        {
+            return clientfd;
+        }
+        if (errno == EINTR || errno == ECONNABORTED)
+        {
+            continue;
+        }
+        if ((errno == EMFILE || errno == ENFILE) && m_reserve_fd >= 0)
+        {
+            close(m_reserve_fd);
+            clientfd = accept(listen_fd, NULL, NULL);
+            if (clientfd >= 0)
+            {
+                close(clientfd);
+                ++m_accept_dropped;
+            }
+            m_reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+            if (clientfd >= 0)
+            {
+                continue;
+            }
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            perror("accept");
+        }
+        return -1;
     }
-    message = message.substr(0, back_idx);
-
-    std::string command;
-    std::string argument;
+}
 
-    std::string::size_type split_idx = message.find_first_of(" ", 0);
-    if (split_idx == std::string::npos)
+/*
+ * 边缘触发，一次事件之后把监听队列中的连接全部accept
+ */
+void CFTPServer::accept_control_connection()
+{
+    struct sockaddr_in clientaddr;
+    int clientfd;
+    long dropped = m_accept_dropped;
+    while (m_control_listen_fd != -1 && (clientfd = accept_client(m_control_listen_fd, clientaddr)) >= 0)
     {
-        command = message;
-        argument = "";
+        add_control_connection(clientfd, clientaddr);
     }
-    else
+    if (m_accept_dropped != dropped)
     {
-        command = message.substr(0, split_idx);
-        argument = message.substr(split_idx + 1);
+        std::cout << "too many open files, dropped " << m_accept_dropped - dropped << " connections" << std::endl;
     }
-    std::cout << command << " " << argument << std::endl;
-    ftp_server->m_client_map[fd].control_argument = argument;
-
-    /* 分发任务 */
-    if(command == "USER")
-        ftp_server->process_user_command(fd);
-    else if(command == "PASS")
-        ftp_server->process_pass_command(fd);
-    else if(command == "CWD")
-        ftp_server->process_cwd_command(fd);
-    else if(command == "PWD")
-        ftp_server->process_pwd_command(fd);
-    else if(command == "PASV")
-        ftp_server->process_pasv_command(fd);
-    else if(command == "PORT")
-        ftp_server->process_port_command(fd);
-    else if(command == "SIZE")
-        ftp_server->process_size_command(fd);
-    else if (command == "RETR")
-        ftp_server->process_retr_command(fd);
-    else if(command == "STOR")
-        ftp_server->process_stor_command(fd);
-    else if(command == "QUIT")
-        ftp_server->process_quit_command(fd);
-    else if(command == "LIST")
-        ftp_server->process_list_command(fd);
-    else if(command == "REST")
-        ftp_server->process_rest_command(fd);
-    else
-        ftp_server->process_other_command(fd);
 }
 
-std::string CFTPServer::recv_client_command(int fd)
+void CFTPServer::add_control_connection(int clientfd, struct sockaddr_in& clientaddr)
 {
-    char message[1024];
-    int recv_ret = recv(fd, message, sizeof(message), 0);
-    if (recv_ret <= 0)
-        return "";
-    else
-    {
-        message[recv_ret] = '\0';
-        return message;
-    }
-}
+    CSocketOption::apply_connection(clientfd, m_config.control_socket);
 
-void CFTPServer::process_other_command(int fd)
-{
-    std::string response = "cannot parse command, please enter correct command";
-    send(fd, response.c_str(), response.size(), MSG_NOSIGNAL);
+    m_epoll.add_event(clientfd, EPOLLIN | EPOLLET);
+
+    std::string ip_string = parse_ip_address(clientaddr);
+    pthread_mutex_lock(&m_pthread_mutex);
+    init_session(clientfd, ip_string);
+    pthread_mutex_unlock(&m_pthread_mutex);
+
+    send(clientfd, WELCOME_CLIENT.c_str(), WELCOME_CLIENT.size(), MSG_NOSIGNAL);
 }
 
 /*
- * 断电续传命令只是将偏移量简单记录在ftp_client_t中
- * 当客户端使用RETR下载时再偏移
+ * ftp_client_t中包含
+ * 客户端控制套接字：用于接收命令
+ * 数据传输套接字：用于上传，下载
+ * 当前工作目录：客户端在服务器中设置的当前工作目录，不能真正改变服务器的工作目录，因为
+ *      如果有多个客户端请求，工作目录会乱掉，所以只是记录每个客户端的工作目录
+ * 命令参数：客户端发送命令时带有的参数
+ * 偏移量：用于断点续传，客户端发送REST时传入的参数
+ * 定时器：空闲超时后回收会话
+ * 调用者持有m_pthread_mutex
  */
-void CFTPServer::process_rest_command(int fd)
+ftp_client_t& CFTPServer::init_session(int clientfd, const std::string& ip_string)
 {
-    std::stringstream oss(m_client_map[fd].control_argument);
-    oss >> m_client_map[fd].file_offset;
-    std::string response = "350 Restarting at <" + m_client_map[fd].control_argument + ">. Send STORE or RETRIEVE to initiate transfer.";
-    send(fd, response.c_str(), response.size(), MSG_NOSIGNAL);
+    long now = monotonic_seconds();
+
+    ftp_client_t& ftp_client = m_client_map[clientfd];
+    ftp_client.control_fd = clientfd;
+    ftp_client.data_fd = -1;
+    ftp_client.data_listen_fd = -1;
+    ftp_client.current_workdir.assign(m_current_workdir);
+    ftp_client.control_argument.clear();
+    ftp_client.copy_from.clear();
+    ftp_client.rename_from.clear();
+    ftp_client.ip_address = ip_string;
+    ftp_client.file_offset = 0;
+    ftp_client.control_ssl = NULL;
+    ftp_client.data_ssl = NULL;
+    ftp_client.is_prot_private = false;
+    ftp_client.is_transferring = false;
+    ftp_client.waiting_transfer = NULL;
+    ftp_client.pending_tasks = 0;
+    ftp_client.is_closed = false;
+    ftp_client.last_active = now;
+    ftp_client.data_progress = 0;
+    ftp_client.pasv_time = 0;
+    ftp_client.node = incoming_node(clientfd);
+    ftp_client.timer.fd = clientfd;
+    m_timer_wheel.add_timer(&ftp_client.timer, m_config.idle_timeout);
+
+    /*
+     * 为了可以同时满足多个客户端，而又因为客户端的控制请求和数据传输请求不是同时发送的
+     * 为了找到当前数据传输请求属于哪个客户端，需要存储客户端的地址
+     * 根据地址找到控制请求
+     * 这也就造成了一台机器中只能运行一个FTP客户端
+     * PASV之后的数据连接按m_pasv_queue的顺序匹配，同一台机器上的多个会话使用PASV时不受这个限制
+     */
+    m_address_map[ip_string] = clientfd;
+    return ftp_client;
 }
 
-void CFTPServer::process_user_command(int fd)
+void CFTPServer::accept_data_connection()
 {
-    std::string message = "welcome to use";
-    send(fd, message.c_str(), message.size(), MSG_NOSIGNAL);
+    struct sockaddr_in clientaddr;
+    int clientfd;
+    long dropped = m_accept_dropped;
+    while (m_data_listen_fd != -1 && (clientfd = accept_client(m_data_listen_fd, clientaddr)) >= 0)
+    {
+        add_data_connection(clientfd, clientaddr);
+    }
+    if (m_accept_dropped != dropped)
+    {
+        std::cout << "too many open files, dropped " << m_accept_dropped - dropped << " data connections" << std::endl;
+    }
 }
 
-void CFTPServer::process_pass_command(int fd)
+void CFTPServer::add_data_connection(int clientfd, struct sockaddr_in& clientaddr)
 {
-    std::string message = "welcome to use";
-    send(fd, message.c_str(), message.size(), MSG_NOSIGNAL);
-}
+    CSocketOption::apply_connection(clientfd, m_config.data_socket);
 
-/*
- * 被动模式，服务器发送地址和端口给客户端，客户端链接
- */
-void CFTPServer::process_pasv_command(int fd)
-{
-    std::string response;
-    if (m_data_listen_fd == -1)
+    std::string ip_string = parse_ip_address(clientaddr);
+
+    pthread_mutex_lock(&m_pthread_mutex);
+    client_map_t::iterator client_it = m_client_map.end();
+    std::map<std::string, std::deque<int> >::iterator pasv_it = m_pasv_queue.find(ip_string);
+    while (pasv_it != m_pasv_queue.end() && !pasv_it->second.empty() && client_it == m_client_map.end())
     {
-        if (!create_data_listen_socket())
-        {
-            response = "fail to convert to pasv mode, please retry";
-            send(fd, response.c_str(), response.size(), MSG_NOSIGNAL);
-            return;
-        }
+        client_it = m_client_map.find(pasv_it->second.front());
+        pasv_it->second.pop_front();
+        if (client_it != m_client_map.end() && client_it->second.is_closed)
+            client_it = m_client_map.end();
     }
-
-    std::stringstream oss;
-    int p1, p2;
-    p1 = DATA_PORT / 256;
-    p2 = DATA_PORT % 256;
-    oss << "(" << "192,168,221,128," << p1 << "," << p2 << ")";
-    response = oss.str();
-
-    send(fd, response.c_str(), response.size(), MSG_NOSIGNAL);
+    if (pasv_it != m_pasv_queue.end() && pasv_it->second.empty())
+    {
+        m_pasv_queue.erase(pasv_it);
+    }
+    if (client_it == m_client_map.end())
+    {
+        /* 没有等待中的PASV时交给该地址最近的控制连接 */
+        std::map<std::string, int>::iterator it = m_address_map.find(ip_string);
+        client_it = (it == m_address_map.end()) ? m_client_map.end() : m_client_map.find(it->second);
+    }
+    if (client_it == m_client_map.end() || client_it->second.is_closed)
+    {
+        /* 没有对应的控制连接，或者PASV已经超时 */
+        pthread_mutex_unlock(&m_pthread_mutex);
+        close(clientfd);
+        return;
+    }
+    /*
+     * 传输正在使用的数据连接不能更换，新连接直接关闭；
+     * 传输命令先于数据连接到达时会话的data_fd为-1，这个连接由传输开始时取得
+     */
+    ftp_client_t& ftp_client = client_it->second;
+    ftp_client.pasv_time = 0;
+    if (ftp_client.is_transferring && ftp_client.data_fd != -1)
+    {
+        pthread_mutex_unlock(&m_pthread_mutex);
+        close(clientfd);
+        return;
+    }
+    close_data_connection(ftp_client);
+    ftp_client.data_fd = clientfd;
+    pthread_mutex_unlock(&m_pthread_mutex);
 }
 
-/* 
- * 主动模式，需要服务器链接客户端地址和端口
+/*
+ * 创建线程池任务，添加到线程池中，参数
+ * void (*process_command)(void**);回调函数地址
+ * this和fd;给回调函数的参数，fd按值传递，不能传循环变量的地址
+ * CTask从内存池分配
+ * 任务执行期间会话不会被回收，定时器改为较短的检查间隔以便发现停滞的传输
  */
-void CFTPServer::process_port_command(int fd)
+void CFTPServer::dispatch_command(int fd)
 {
-    int h1, h2, h3, h4, p1, p2;
-    char ch;
-
-    std::stringstream oss(m_client_map[fd].control_argument);
-    oss >> h1 >> ch >> h2 >> ch >> h3 >> ch >> h4 >> ch >> p1 >> ch >> p2 >> ch;
-
-    std::cout << h1 << h2 << h3 << h4 << ":" << p1 * 256 + p2 << std::endl;
-
-    int port = p1 * 256 + p2;
-    oss.str("");
-    oss.clear();
-    oss << h1 << "." << h2 << "." << h3 << "." << h4;
-    std::string ip_address = oss.str();
-
-    struct sockaddr_in servaddr;
-    bzero(&servaddr, sizeof(servaddr));
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_port = htons(port);
-    inet_pton(AF_INET, ip_address.c_str(), &servaddr.sin_addr);
-
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0)
+    pthread_mutex_lock(&m_pthread_mutex);
+    client_map_t::iterator it = m_client_map.find(fd);
+    if (it == m_client_map.end() || it->second.is_closed)
     {
-        std::string response = "fail to convert to port pattern, create data socket error";
-        send(fd, response.c_str(), response.size(), MSG_NOSIGNAL);
+        pthread_mutex_unlock(&m_pthread_mutex);
         return;
     }
-
-    if (connect(sockfd, (struct sockaddr*)&servaddr, sizeof(servaddr)) < 0)
+    if (m_is_draining)
     {
-        close(sockfd);
-        std::string response = "fail to connect to port pattern, connect to client error";
-        send(sockfd, response.c_str(), response.size(), MSG_NOSIGNAL);
+        /*
+         * 热重启时空闲会话连同还没有读取的命令交给新进程
+         * 执行任务中的会话和新进程还没有准备好时命令留在套接字中，由drain_sessions()稍后交接
+         * pending_tasks只在主循环中增加，释放锁之后空闲会话仍然没有任务在执行，交接和回复都在锁外进行
+         */
+        bool is_idle = it->second.pending_tasks == 0;
+        bool is_failed = !is_idle && (!m_is_handed_off || it->second.control_ssl != NULL);
+        SSL* control_ssl = it->second.control_ssl;
+        pthread_mutex_unlock(&m_pthread_mutex);
+
+        FTP_HANDOFF_RESULT result = is_failed ? FTP_HANDOFF_FAILED : FTP_HANDOFF_RETRY;
+        if (is_idle)
+        {
+            result = handoff_session(fd);
+        }
+        if (result == FTP_HANDOFF_DONE)
+        {
+            m_epoll.delete_event(fd, EPOLLIN | EPOLLET);
+            pthread_mutex_lock(&m_pthread_mutex);
+            erase_session(m_client_map.find(fd));
+            pthread_mutex_unlock(&m_pthread_mutex);
+        }
+        if (result != FTP_HANDOFF_FAILED)
+        {
+            return;
+        }
+        /* 退出过程中不再接受新命令，正在执行的任务不受影响 */
+        if (is_idle)
+            CTLSContext::send(control_ssl, fd, "421 server shutting down", 24);
+        close_session(fd);
         return;
     }
+    ++it->second.pending_tasks;
+    it->second.last_active = monotonic_seconds();
+    m_timer_wheel.add_timer(&it->second.timer, FTP_SESSION_CHECK);
+    int node = it->second.node;
+    pthread_mutex_unlock(&m_pthread_mutex);
+
+    CTask* task = new CTask(&CFTPServer::process_command, {static_cast<void*>(this), reinterpret_cast<void*>(static_cast<intptr_t>(fd))});
+    m_pthread_pool.add_task(task, node);
+}
 
-    if (m_client_map[fd].data_fd != -1)
+/*
+ * 工作线程执行完一个命令，会话已经被标记关闭时由最后一个任务关闭套接字
+ * 会话表中的节点留给主循环在定时器中删除
+ */
+void CFTPServer::finish_task(int fd)
+{
+    pthread_mutex_lock(&m_pthread_mutex);
+    ftp_client_t& ftp_client = m_client_map[fd];
+    --ftp_client.pending_tasks;
+    if (ftp_client.is_closed && ftp_client.pending_tasks == 0 && ftp_client.control_fd != -1)
     {
-        close(m_client_map[fd].data_fd);
+        CTLSContext::release(ftp_client.control_ssl);
+        ftp_client.control_ssl = NULL;
+        close(ftp_client.control_fd);
+        ftp_client.control_fd = -1;
+        close_data_connection(ftp_client);
     }
-    m_client_map[fd].data_fd = sockfd;
+    pthread_mutex_unlock(&m_pthread_mutex);
+}
 
-    std::string response = "convert port pattern success";
-    send(fd, response.c_str(), response.size(), MSG_NOSIGNAL);
+/*
+ * 工作线程发现对端关闭或者收到QUIT时调用，不再接收这个连接的事件
+ */
+void CFTPServer::mark_session_closed(int fd)
+{
+    m_epoll.delete_event(fd, EPOLLIN | EPOLLET);
+    pthread_mutex_lock(&m_pthread_mutex);
+    m_client_map[fd].is_closed = true;
+    pthread_mutex_unlock(&m_pthread_mutex);
 }
 
-/* 
- * 改变当前工作目录，没有实际改变，只是将工作目录存在ftp_client_t中
- * 解决多个客户端的问题，因为每个客户端都可能改变工作目录，如果直接改变服务器的，会乱掉
+/*
+ * 主循环中关闭会话，还有任务在执行时只做标记，由finish_task()关闭
  */
-void CFTPServer::process_cwd_command(int fd)
+void CFTPServer::close_session(int fd)
 {
-    std::string change_dir = m_client_map[fd].control_argument;
-    struct stat statinfo;
-    if (lstat(change_dir.c_str(), &statinfo) < 0 || !S_ISDIR(statinfo.st_mode))
+    m_epoll.delete_event(fd, EPOLLIN | EPOLLET);
+
+    pthread_mutex_lock(&m_pthread_mutex);
+    client_map_t::iterator it = m_client_map.find(fd);
+    if (it == m_client_map.end())
+    {
+        pthread_mutex_unlock(&m_pthread_mutex);
+        close(fd);
+        return;
+    }
+    if (it->second.pending_tasks > 0)
     {
-        std::string response = "change work dir error, current workdir is " + m_client_map[fd].current_workdir;
-        send(fd, response.c_str(), response.size(), MSG_NOSIGNAL);
+        it->second.is_closed = true;
     }
     else
     {
-        m_client_map[fd].current_workdir = change_dir;
-        std::string response = "change workdir success workdir is " + change_dir;
-        send(fd, response.c_str(), response.size(), MSG_NOSIGNAL);
+        erase_session(it);
     }
+    pthread_mutex_unlock(&m_pthread_mutex);
 }
 
 /*
- * 打印当前工作目录，直接输出ftp_client_t中记录的工作目录
+ * 关闭会话的套接字并删除会话和地址映射，调用者持有m_pthread_mutex且会话没有任务在执行
  */
-void CFTPServer::process_pwd_command(int fd)
+void CFTPServer::erase_session(client_map_t::iterator it)
 {
-    std::string response = "current workdir is " + m_client_map[fd].current_workdir;
-    send(fd, response.c_str(), response.size(), MSG_NOSIGNAL);
+    ftp_client_t& ftp_client = it->second;
+    CTLSContext::release(ftp_client.control_ssl);
+    ftp_client.control_ssl = NULL;
+    if (ftp_client.control_fd != -1)
+        close(ftp_client.control_fd);
+    close_data_connection(ftp_client);
+
+    std::map<std::string, int>::iterator addr_it = m_address_map.find(ftp_client.ip_address);
+    if (addr_it != m_address_map.end() && addr_it->second == it->first)
+    {
+        m_address_map.erase(addr_it);
+    }
+    remove_pasv(ftp_client.ip_address, it->first);
+
+    m_timer_wheel.cancel_timer(&ftp_client.timer);
+    m_client_map.erase(it);
 }
 
 /*
- * 获得文件大小
+ * 从等待数据连接的队列中删除会话，调用者持有m_pthread_mutex
  */
-void  CFTPServer::process_size_command(int fd)
+void CFTPServer::remove_pasv(const std::string& ip_address, int fd)
 {
-    std::string filepath = m_client_map[fd].current_workdir + "/" + m_client_map[fd].control_argument;
-    struct stat fileinfo;
-    if (lstat(filepath.c_str(), &fileinfo) < 0 || !S_ISREG(fileinfo.st_mode))
+    std::map<std::string, std::deque<int> >::iterator it = m_pasv_queue.find(ip_address);
+    if (it == m_pasv_queue.end())
     {
-        std::string response = "-1";
-        send(fd, response.c_str(), response.size(), MSG_NOSIGNAL);
+        return;
     }
-    else
+    it->second.erase(std::remove(it->second.begin(), it->second.end(), fd), it->second.end());
+    if (it->second.empty())
     {
-        std::stringstream oss;
-        oss << fileinfo.st_size;
-        std::string response = oss.str();
-        send(fd, response.c_str(), response.size(), MSG_NOSIGNAL);
+        m_pasv_queue.erase(it);
     }
 }
 
-/*
- * 列出当前目录下的所有文件/目录等
- */ 
-void CFTPServer::process_list_command(int fd)
+void CFTPServer::process_timer()
 {
-    std::string dirname = m_client_map[fd].control_argument;
+    uint64_t expirations = 0;
+    while (read(m_timer_fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+    {
+        m_timer_wheel.tick(expirations, &CFTPServer::on_session_timer, static_cast<void*>(this));
+    }
 
-    if (dirname.size() == 0)
+    if (m_is_draining && (drain_sessions() || monotonic_seconds() >= m_drain_deadline))
     {
-        dirname = m_client_map[fd].current_workdir;
+        m_is_running = false;
     }
+}
 
-    std::string response;
-    struct stat statinfo;
-    if (lstat(dirname.c_str(), &statinfo) < 0)
+void CFTPServer::process_signal()
+{
+    struct signalfd_siginfo info;
+    while (read(m_signal_fd, &info, sizeof(info)) == sizeof(info))
+    {
+        if (info.ssi_signo == SIGHUP)
+        {
+            reload_config();
+            continue;
+        }
+        std::cout << "receive signal " << info.ssi_signo << ", shutting down" << std::endl;
+        m_handoff.close_handoff(true);
+        start_drain();
+    }
+}
+
+/*
+ * 重新读取配置文件，只应用可以在运行中修改的参数
+ * 监听地址、端口等已经在使用中，修改后需要重启，热重启时新进程会继承旧的监听套接字，所以要完全重启
+ * 已经在定时器中的会话在下一次检查时使用新的超时时间
+ */
+void CFTPServer::reload_config()
+{
+    if (!m_config_loader.reload())
     {
-        response = "fail to parse LIST command, please check argument";
-        send(fd, response.c_str(), response.size(), MSG_NOSIGNAL);
+        std::cout << "reload config failed, keep current settings" << std::endl;
         return;
     }
 
-    if (!S_ISDIR(statinfo.st_mode))
+    const ftp_config_t& config = m_config_loader.get_config();
+    if (config.bind_address != m_config.bind_address || config.control_port != m_config.control_port ||
+        config.data_port != m_config.data_port || config.listen_backlog != m_config.listen_backlog ||
+        config.epoll_events != m_config.epoll_events || config.handoff_path != m_config.handoff_path)
     {
-        std::stringstream oss;
-        oss << dirname << '\t' << statinfo.st_size;
-        response = oss.str();
+        std::cout << "bind_address, ports, listen_backlog, epoll_events and handoff_path take effect after restart" << std::endl;
     }
-    else
+
+    /* pasv_address由工作线程在PASV中读取，调度权重和cache_bypass由工作线程在分发和开始I/O命令时读取 */
+    pthread_mutex_lock(&m_pthread_mutex);
+    m_config.pasv_address = config.pasv_address;
+    m_config.interactive_weight = config.interactive_weight;
+    m_config.user_weights = config.user_weights;
+    m_config.cache_bypass = config.cache_bypass;
+    m_config.cache_bypass_size = config.cache_bypass_size;
+    m_config.cache_bypass_paths = config.cache_bypass_paths;
+    pthread_mutex_unlock(&m_pthread_mutex);
+    m_config.sched_quantum = config.sched_quantum;
+    m_scheduler.set_quantum(config.sched_quantum);
+    m_config.drain_timeout = config.drain_timeout;
+    m_config.idle_timeout = config.idle_timeout;
+    m_config.data_timeout = config.data_timeout;
+    m_config.pasv_timeout = config.pasv_timeout;
+    m_config.sendfile_chunk = config.sendfile_chunk;
+    m_config.recv_buffer = config.recv_buffer;
+    m_config.hash_cache_capacity = config.hash_cache_capacity;
+    m_sendfile_chunk = config.sendfile_chunk;
+    m_recv_buffer = config.recv_buffer;
+    m_hash_cache.set_capacity(config.hash_cache_capacity);
+    m_config.store_sync = config.store_sync;
+    m_config.group_commit_wait = config.group_commit_wait;
+    m_config.store_writebehind = config.store_writebehind;
+    m_store_sync = config.store_sync;
+    m_store_writebehind = config.store_writebehind;
+    m_group_commit.set_wait(config.group_commit_wait);
+
+    if (config.worker_threads != m_config.worker_threads || config.worker_threads_max != m_config.worker_threads_max)
+    {
+        m_config.worker_threads = config.worker_threads;
+        m_config.worker_threads_max = config.worker_threads_max;
+        m_pthread_pool.resize(config.worker_threads, config.worker_threads_max);
+    }
+    if (config.io_threads != m_config.io_threads || config.io_threads_max != m_config.io_threads_max)
+    {
+        m_config.io_threads = config.io_threads;
+        m_config.io_threads_max = config.io_threads_max;
+        m_io_pool.resize(config.io_threads, config.io_threads_max);
+    }
+    if (config.thread_grow_wait != m_config.thread_grow_wait || config.thread_idle_timeout != m_config.thread_idle_timeout)
+    {
+        m_config.thread_grow_wait = config.thread_grow_wait;
+        m_config.thread_idle_timeout = config.thread_idle_timeout;
+        m_pthread_pool.set_timeout(config.thread_grow_wait, config.thread_idle_timeout * 1000);
+        m_io_pool.set_timeout(config.thread_grow_wait, config.thread_idle_timeout * 1000);
+    }
+    m_config.io_queue_limit = config.io_queue_limit;
+    m_io_queue_limit = config.io_queue_limit;
+    /* 线程池的列表没有变化时不重新绑定；main_cpu改为-1时主循环线程解除绑定 */
+    if (config.main_cpu != m_config.main_cpu)
+    {
+        m_config.main_cpu = config.main_cpu;
+        CAffinity::pin_thread(pthread_self(), m_config.main_cpu);
+    }
+    m_config.worker_cpus = config.worker_cpus;
+    m_config.io_cpus = config.io_cpus;
+    m_pthread_pool.set_cpus(m_config.worker_cpus);
+    m_io_pool.set_cpus(m_config.io_cpus);
+
+    std::cout << "config reloaded: worker_threads " << m_config.worker_threads << "-" << m_config.worker_threads_max
+              << ", io_threads " << m_config.io_threads << "-" << m_config.io_threads_max
+              << ", sched_quantum " << m_config.sched_quantum << ", interactive_weight " << m_config.interactive_weight
+              << ", idle_timeout " << m_config.idle_timeout
+              << ", sendfile_chunk " << m_config.sendfile_chunk << ", recv_buffer " << m_config.recv_buffer
+              << ", hash_cache_capacity " << m_config.hash_cache_capacity
+              << ", store_sync " << m_config.store_sync << ", store_writebehind " << m_config.store_writebehind << std::endl;
+}
+
+/*
+ * 启动线程池之前调用，主循环线程在这里绑定，线程池的线程在创建时绑定
+ * 会话对象和收发缓冲区由主循环和工作线程首次写入，绑定之后落在它们所在的NUMA节点
+ */
+void CFTPServer::apply_affinity()
+{
+    if (m_config.main_cpu >= 0)
     {
-        DIR* dp;
-        if ((dp = opendir(dirname.c_str())) == NULL)
+        CAffinity::pin_thread(pthread_self(), m_config.main_cpu);
+    }
+    m_pthread_pool.set_cpus(m_config.worker_cpus);
+    m_io_pool.set_cpus(m_config.io_cpus);
+}
+
+/*
+ * 退出时仍然打开的会话（drain_timeout超时）的套接字先shutdown，阻塞在收发中的线程马上返回，
+ * 之后等待两个线程池的线程全部结束
+ */
+void CFTPServer::stop_pools()
+{
+    pthread_mutex_lock(&m_pthread_mutex);
+    for (client_map_t::iterator it = m_client_map.begin(); it != m_client_map.end(); ++it)
+    {
+        shutdown(it->second.control_fd, SHUT_RDWR);
+        if (it->second.data_fd != -1)
         {
-            response = "fail to parse LIST command, please check argument";
+            shutdown(it->second.data_fd, SHUT_RDWR);
         }
-        else
+    }
+    pthread_mutex_unlock(&m_pthread_mutex);
+
+    m_pthread_pool.stop();
+    m_io_pool.stop();
+    /* 已经接收完的上传同步后回复 */
+    m_group_commit.stop();
+
+    thread_pool_stats_t worker = m_pthread_pool.get_stats();
+    thread_pool_stats_t io = m_io_pool.get_stats();
+    group_commit_stats_t commit = m_group_commit.get_stats();
+    std::cout << "worker threads spawned " << worker.spawned << ", retired " << worker.retired
+              << "; io threads spawned " << io.spawned << ", retired " << io.retired
+              << "; group commit " << commit.files << " files in " << commit.batches << " batches" << std::endl;
+}
+
+/*
+ * 网卡队列的中断所在的CPU，连接还没有收到数据或内核不支持时返回-1
+ */
+int CFTPServer::incoming_node(int fd)
+{
+    int cpu = -1;
+    socklen_t length = sizeof(cpu);
+    if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &length) == -1 || cpu < 0)
+    {
+        return -1;
+    }
+    return CAffinity::cpu_node(cpu);
+}
+
+/*
+ * 交接套接字上的请求：新进程请求监听套接字，交出后本进程优雅退出；旧进程交来空闲会话，由本进程接管
+ */
+void CFTPServer::process_handoff()
+{
+    handoff_request_t request;
+    while (m_handoff.accept_request(request))
+    {
+        if (request.type == HANDOFF_LISTEN)
         {
-            struct dirent* entry;
-            while ((entry = readdir(dp)) != NULL)
+            int fds[2];
+            int count = 0;
+            if (m_control_listen_fd != -1)
             {
-                response += entry->d_name;
-                response += '\t';
+                fds[count++] = m_control_listen_fd;
+                if (m_data_listen_fd != -1)
+                    fds[count++] = m_data_listen_fd;
             }
-
-            closedir(dp);
+            bool is_sent = m_handoff.send_listen_fds(request, fds, count);
+            m_handoff.finish_request(request);
+            if (is_sent)
+            {
+                std::cout << "listen sockets handed off to new server" << std::endl;
+                m_handoff.close_handoff(false);
+                m_is_handed_off = true;
+                start_drain();
+                return;
+            }
+            continue;
+        }
+        if (request.type == HANDOFF_SESSION)
+        {
+            m_handoff.reply_session(request, adopt_session(request));
         }
+        m_handoff.finish_request(request);
     }
-    send(fd, response.c_str(), response.size(), MSG_NOSIGNAL);
 }
 
 /*
- * 下载文件，使用sendfile领拷贝传文件到客户端
+ * 把没有任务在执行的会话交给新进程，交接成功后由调用者删除本进程中的会话
+ * 状态依次为工作目录、地址、用户名、CPFR和RNFR的源文件、REST偏移、MODE H、TYPE A，每项以'\0'结尾
+ * TLS会话的状态在本进程的OpenSSL中，不能交接；新进程启动完成前稍后重试，直到drain_timeout
+ * 只在m_pthread_mutex中复制会话状态，等待新进程应答时不持有锁，不阻塞工作线程
+ */
+FTP_HANDOFF_RESULT CFTPServer::handoff_session(int fd)
+{
+    pthread_mutex_lock(&m_pthread_mutex);
+    ftp_client_t& ftp_client = m_client_map[fd];
+    if (!m_is_handed_off || ftp_client.control_ssl != NULL || ftp_client.data_ssl != NULL)
+    {
+        pthread_mutex_unlock(&m_pthread_mutex);
+        return FTP_HANDOFF_FAILED;
+    }
+
+    const std::string fields[] = {ftp_client.current_workdir, ftp_client.ip_address, ftp_client.username,
+                                  ftp_client.copy_from, ftp_client.rename_from, std::to_string(ftp_client.file_offset),
+                                  ftp_client.is_sparse ? "1" : "0", ftp_client.is_ascii ? "1" : "0"};
+    std::string state;
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i)
+    {
+        state.append(fields[i]);
+        state.push_back('\0');
+    }
+
+    int fds[2];
+    int count = 0;
+    fds[count++] = fd;
+    if (ftp_client.data_fd != -1)
+    {
+        fds[count++] = ftp_client.data_fd;
+    }
+    std::string handoff_path = m_config.handoff_path;
+    pthread_mutex_unlock(&m_pthread_mutex);
+
+    int ret = CHandoff::send_session(handoff_path, fds, count, state);
+    if (ret > 0)
+    {
+        return FTP_HANDOFF_DONE;
+    }
+    if (ret < 0 && monotonic_seconds() < m_drain_deadline)
+    {
+        return FTP_HANDOFF_RETRY;
+    }
+    /* 新进程拒绝或者没有响应，剩下的会话不再尝试，按普通退出关闭 */
+    m_is_handed_off = false;
+    return FTP_HANDOFF_FAILED;
+}
+
+/*
+ * 接管旧进程交来的会话，控制连接上还没有读取的命令在加入epoll后马上产生事件
  */
-void CFTPServer::process_retr_command(int fd)
+bool CFTPServer::adopt_session(handoff_request_t& request)
 {
-    std::string filename = m_client_map[fd].control_argument;
-    std::string filepath = m_client_map[fd].current_workdir + "/" + filename;
+    std::vector<std::string> fields;
+    std::string::size_type start = 0, end;
+    while ((end = request.state.find('\0', start)) != std::string::npos)
+    {
+        fields.push_back(request.state.substr(start, end - start));
+        start = end + 1;
+    }
+    if (request.count < 1 || fields.size() != 8)
+    {
+        return false;
+    }
 
-    std::cout << filepath << std::endl;
-    
-    struct stat statinof;
-    if (lstat(filepath.c_str(), &statinof) < 0)
+    int clientfd = request.fds[0];
+    request.fds[0] = -1;
+    CSocketOption::apply_connection(clientfd, m_config.control_socket);
+
+    pthread_mutex_lock(&m_pthread_mutex);
+    ftp_client_t& ftp_client = init_session(clientfd, fields[1]);
+    ftp_client.current_workdir = fields[0];
+    ftp_client.username = fields[2];
+    ftp_client.copy_from = fields[3];
+    ftp_client.rename_from = fields[4];
+    ftp_client.file_offset = strtoll(fields[5].c_str(), NULL, 10);
+    ftp_client.is_sparse = fields[6] == "1";
+    ftp_client.is_ascii = fields[7] == "1";
+    if (request.count > 1)
     {
-        std::string response = "RETR error, please check argument";
-        send(fd, response.c_str(), response.size(), MSG_NOSIGNAL);
+        ftp_client.data_fd = request.fds[1];
+        request.fds[1] = -1;
+        CSocketOption::apply_connection(ftp_client.data_fd, m_config.data_socket);
+    }
+    pthread_mutex_unlock(&m_pthread_mutex);
 
-        m_client_map[fd].file_offset = 0;
+    m_epoll.add_event(clientfd, EPOLLIN | EPOLLET);
+    return true;
+}
+
+/*
+ * 开始优雅退出：不再accept，关闭空闲会话（热重启时交给新进程），等正在执行的传输在drain_timeout内完成
+ * 监听套接字可能已经交给新进程，这里只关闭本进程的副本，内核中的监听队列仍然有效
+ */
+void CFTPServer::start_drain()
+{
+    if (m_is_draining)
+    {
+        return;
     }
-    int filefd = open(filepath.c_str(), O_RDONLY);
-//    std::cout << "open success" << std::endl;
+    m_is_draining = true;
+    m_drain_deadline = monotonic_seconds() + m_config.drain_timeout;
 
-    if (filefd < 0)
+    m_epoll.delete_event(m_control_listen_fd, FTP_LISTEN_EVENTS);
+    close(m_control_listen_fd);
+    m_control_listen_fd = -1;
+    if (m_data_listen_fd != -1)
+    {
+        m_epoll.delete_event(m_data_listen_fd, FTP_LISTEN_EVENTS);
+        close(m_data_listen_fd);
+        m_data_listen_fd = -1;
+    }
+
+    if (drain_sessions())
+    {
+        m_is_running = false;
+    }
+}
+
+/*
+ * 关闭所有没有任务在执行的会话，热重启时先尝试交给新进程，全部关闭时返回true
+ * 在锁中选出空闲会话，交接和回复在锁外逐个进行，主循环之外不会给空闲会话增加任务
+ */
+bool CFTPServer::drain_sessions()
+{
+    long handed_off = 0;
+    std::vector<int> idle_fds;
+    pthread_mutex_lock(&m_pthread_mutex);
+    client_map_t::iterator it = m_client_map.begin();
+    while (it != m_client_map.end())
+    {
+        client_map_t::iterator cur = it++;
+        if (cur->second.pending_tasks > 0)
+            continue;
+        if (cur->second.is_closed)
+            erase_session(cur);
+        else
+            idle_fds.push_back(cur->first);
+    }
+    pthread_mutex_unlock(&m_pthread_mutex);
+
+    for (size_t i = 0; i < idle_fds.size(); ++i)
+    {
+        int fd = idle_fds[i];
+        FTP_HANDOFF_RESULT result = handoff_session(fd);
+        if (result == FTP_HANDOFF_RETRY)
+            continue;
+        if (result == FTP_HANDOFF_DONE)
+            ++handed_off;
+        else
+            CTLSContext::send(get_client(fd).control_ssl, fd, "421 server shutting down", 24);
+        m_epoll.delete_event(fd, EPOLLIN | EPOLLET);
+        pthread_mutex_lock(&m_pthread_mutex);
+        erase_session(m_client_map.find(fd));
+        pthread_mutex_unlock(&m_pthread_mutex);
+    }
+
+    pthread_mutex_lock(&m_pthread_mutex);
+    bool is_empty = m_client_map.empty();
+    pthread_mutex_unlock(&m_pthread_mutex);
+    if (handed_off > 0)
     {
-        std::string response = "RETR error, cannot open file";
-        send(fd, response.c_str(), response.size(), MSG_NOSIGNAL);
-        m_client_map[fd].file_offset = 0;
+        std::cout << "handed off " << handed_off << " idle sessions to new server" << std::endl;
     }
-    std::string s = "retr parse success";
-    send(fd, s.c_str(), s.size(), MSG_NOSIGNAL);
-    sendfile(m_client_map[fd].data_fd, filefd, &m_client_map[fd].file_offset, statinof.st_size - m_client_map[fd].file_offset);
-    close(filefd);
+    return is_empty;
+}
 
-    m_client_map[fd].file_offset = 0;
+void CFTPServer::on_session_timer(timer_node_t* node, void* arg)
+{
+    static_cast<CFTPServer*>(arg)->check_session(node->fd);
 }
 
 /*
- * 上传文件，服务器接受数据
+ * 会话定时器到期
+ *  已关闭的会话：没有任务在执行时删除
+ *  数据传输超过data_timeout没有进展：shutdown数据连接，阻塞在sendfile/recv上的工作线程随之返回
+ *  PASV之后超过pasv_timeout没有数据连接：删除地址映射，之后该地址的数据连接会被拒绝
+ *  控制连接超过idle_timeout没有命令：关闭会话
  */
-void CFTPServer::process_stor_command(int fd)
+void CFTPServer::check_session(int fd)
 {
-    std::string response = "recv command success, start store file";
-    send(m_client_map[fd].control_fd, response.c_str(), response.size(), MSG_NOSIGNAL);
+    long now = monotonic_seconds();
+    bool is_reaped = false;
 
-    std::string filename_with_size = m_client_map[fd].control_argument;
-//    std::cout << filename_with_size << std::endl;
-    std::string::size_type front_idx = filename_with_size.find_first_of("<", 0);
-    std::string::size_type back_idx = filename_with_size.find_first_of(">", 0);
-    std::string::size_type tmp = filename_with_size.find_last_of('/');
-    if (front_idx == std::string::npos || back_idx == std::string::npos || tmp == std::string::npos)
+    pthread_mutex_lock(&m_pthread_mutex);
+    client_map_t::iterator it = m_client_map.find(fd);
+    if (it == m_client_map.end())
     {
+        pthread_mutex_unlock(&m_pthread_mutex);
         return;
     }
-//    std::string filename = filename_with_size.substr(0, front_idx);
-    std::string filename = filename_with_size.substr(tmp + 1, front_idx - tmp - 1);
-    std::cout << filename << std::endl;
-    std::stringstream oss;
-    off_t filesize;
-    oss << filename_with_size.substr(front_idx + 1, back_idx - front_idx - 1);
-    oss >> filesize;
+    ftp_client_t& ftp_client = it->second;
 
-    std::string filepath = m_client_map[fd].current_workdir + "/" + filename;
-    std::ofstream out(filepath.c_str(), std::ios_base::out | std::ios_base::binary);
-    if (!out.is_open())
+    if (ftp_client.is_closed)
     {
+        if (ftp_client.pending_tasks == 0)
+            erase_session(it);
+        else
+            m_timer_wheel.add_timer(&ftp_client.timer, FTP_SESSION_CHECK);
+        pthread_mutex_unlock(&m_pthread_mutex);
         return;
     }
 
-    char message[1024];
-    off_t recvsize = 0;
-    while (true)
+    long data_progress = ftp_client.data_progress;
+    if (ftp_client.pending_tasks > 0 && data_progress != 0 && now - data_progress >= m_config.data_timeout &&
+        ftp_client.data_fd != -1)
     {
-        int n = recv(m_client_map[fd].data_fd, message, sizeof(message), 0);
-        if (n < 0)
-        {
-            break;
-        }
-        else if (n == 0)
+        shutdown(ftp_client.data_fd, SHUT_RDWR);
+        ftp_client.data_progress = 0;
+        ++m_reaped_stalled;
+        is_reaped = true;
+    }
+
+    long pasv_time = ftp_client.pasv_time;
+    if (pasv_time != 0 && now - pasv_time >= m_config.pasv_timeout)
+    {
+        std::map<std::string, int>::iterator addr_it = m_address_map.find(ftp_client.ip_address);
+        if (addr_it != m_address_map.end() && addr_it->second == fd)
         {
-            close(m_client_map[fd].data_fd);
-            m_client_map[fd].data_fd = -1;
+            m_address_map.erase(addr_it);
         }
-        else
+        remove_pasv(ftp_client.ip_address, fd);
+        ftp_client.pasv_time = 0;
+        ++m_reaped_pasv;
+        is_reaped = true;
+    }
+
+    long idle = now - ftp_client.last_active;
+    if (ftp_client.pending_tasks == 0 && idle >= m_config.idle_timeout)
+    {
+        CTLSContext::send(ftp_client.control_ssl, fd, "421 idle timeout, closing control connection", 44);
+        m_epoll.delete_event(fd, EPOLLIN | EPOLLET);
+        erase_session(it);
+        ++m_reaped_idle;
+        is_reaped = true;
+    }
+    else if (ftp_client.pending_tasks > 0 || ftp_client.pasv_time != 0)
+    {
+        m_timer_wheel.add_timer(&ftp_client.timer, FTP_SESSION_CHECK);
+    }
+    else
+    {
+        m_timer_wheel.add_timer(&ftp_client.timer, m_config.idle_timeout - idle);
+    }
+    pthread_mutex_unlock(&m_pthread_mutex);
+
+    if (is_reaped)
+    {
+        std::cout << "reaped sessions: idle " << m_reaped_idle << ", stalled transfers " << m_reaped_stalled
+                  << ", unanswered pasv " << m_reaped_pasv << std::endl;
+    }
+}
+
+long CFTPServer::monotonic_seconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+ftp_client_t& CFTPServer::get_client(int fd)
+{
+    pthread_mutex_lock(&m_pthread_mutex);
+    ftp_client_t& ftp_client = m_client_map[fd];
+    pthread_mutex_unlock(&m_pthread_mutex);
+    return ftp_client;
+}
+
+std::string CFTPServer::parse_ip_address(struct sockaddr_in& addr)
+{
+    char ip_address[128];
+    bzero(ip_address, sizeof(ip_address));
+    inet_ntop(addr.sin_family, &addr.sin_addr, ip_address, sizeof(ip_address));
+    return ip_address;
+}
+
+void CFTPServer::process_command(void** args)
+{
+    CFTPServer* ftp_server = static_cast<CFTPServer*>(args[0]);
+    int fd = static_cast<int>(reinterpret_cast<intptr_t>(args[1]));
+
+    ftp_server->execute_command(fd);
+    ftp_server->finish_task(fd);
+}
+
+/*
+ * 读写文件的命令交给磁盘I/O线程池，工作线程立即返回处理其他会话的命令
+ * 任务计入pending_tasks，执行完之前会话不会被回收，和工作线程中的任务一样由finish_task()结束
+ * 等待和正在执行的I/O任务超过io_queue_limit时直接回复450，不再排队
+ * 命令参数和会话状态在这里复制到任务中，使用数据连接的任务同一时间每个会话只有一个，之后的传输命令回复450
+ */
+void CFTPServer::dispatch_io(int fd, FTP_IO_TASK io_task)
+{
+    if (m_scheduler.size() >= m_io_queue_limit)
+    {
+        send_response(fd, "450 server busy, try again later");
+        return;
+    }
+
+    ftp_io_job_t* job = new ftp_io_job_t(fd, io_task);
+    pthread_mutex_lock(&m_pthread_mutex);
+    ftp_client_t& ftp_client = m_client_map[fd];
+    if (job->is_transfer && ftp_client.waiting_transfer != NULL)
+    {
+        pthread_mutex_unlock(&m_pthread_mutex);
+        delete job;
+        send_response(fd, "450 data transfer in progress, try again later");
+        return;
+    }
+    ++ftp_client.pending_tasks;
+    job->client = &ftp_client;
+    job->argument = ftp_client.control_argument;
+    job->workdir = ftp_client.current_workdir;
+    job->is_ascii = ftp_client.is_ascii;
+    job->is_sparse = ftp_client.is_sparse;
+    std::map<std::string, int>::const_iterator it = m_config.user_weights.find(ftp_client.username);
+    job->user_weight = it == m_config.user_weights.end() ? 1 : it->second;
+    if (io_task == FTP_IO_COPY)
+    {
+        job->source.swap(ftp_client.copy_from);
+    }
+    bool is_waiting = false;
+    if (job->is_transfer)
+    {
+        /* REST只对紧接着的一个传输命令有效 */
+        job->restart = ftp_client.file_offset;
+        ftp_client.file_offset = 0;
+        /* 前一个传输还没有结束时等它结束，数据连接到那时再取得 */
+        is_waiting = ftp_client.is_transferring;
+        ftp_client.is_transferring = true;
+        job->data_fd = ftp_client.data_fd;
+        job->data_ssl = ftp_client.data_ssl;
+        if (is_waiting)
+            ftp_client.waiting_transfer = job;
+    }
+    pthread_mutex_unlock(&m_pthread_mutex);
+    if (is_waiting)
+    {
+        return;
+    }
+
+    classify_io(*job);
+    if (m_scheduler.push(job))
+    {
+        schedule_io();
+    }
+}
+
+/*
+ * 一个时间片能传完的RETR/STOR/APPE/CPTO和LIST是交互类任务，权重乘以interactive_weight并且排到轮转最前面
+ * 哈希、去重和增量命令要读完整个文件，按批量任务处理
+ * 在命令线程上只使用命令参数中的大小，不访问文件系统；RETR/CPTO的大小要打开文件后才知道，
+ * 先按交互类任务排队，I/O线程打开文件后用set_io_class()按实际大小调整，大文件只有第一个时间片优先
+ */
+void CFTPServer::classify_io(ftp_io_job_t& job)
+{
+    off_t size = -1;
+    if (job.task == FTP_IO_RETR || job.task == FTP_IO_COPY || job.task == FTP_IO_LIST)
+    {
+        size = 0;
+    }
+    else if (job.task == FTP_IO_STOR || job.task == FTP_IO_APPE)
+    {
+        std::string filename;
+        if (!parse_store_argument(job.argument, filename, size))
+            size = -1;
+    }
+    set_io_class(job, size);
+}
+
+/*
+ * size小于0表示大小未知，按批量任务处理；调度器在下一次pop()时使用新的权重
+ */
+void CFTPServer::set_io_class(ftp_io_job_t& job, off_t size)
+{
+    pthread_mutex_lock(&m_pthread_mutex);
+    int interactive_weight = m_config.interactive_weight;
+    pthread_mutex_unlock(&m_pthread_mutex);
+
+    job.is_interactive = size >= 0 && static_cast<size_t>(size) <= m_scheduler.get_quantum() * interactive_weight;
+    job.weight = job.is_interactive ? job.user_weight * interactive_weight : job.user_weight;
+}
+
+/*
+ * 调度器中每有一个队列进入轮转，线程池中就放入一个任务，任务执行时取出的不一定是这个队列
+ */
+void CFTPServer::schedule_io()
+{
+    CTask* task = new CTask(&CFTPServer::process_io_command, {static_cast<void*>(this)});
+    m_io_pool.add_task(task);
+}
+
+/*
+ * 执行调度器选出的任务的一个时间片，没有结束的任务放回调度器
+ */
+void CFTPServer::process_io_command(void** args)
+{
+    CFTPServer* ftp_server = static_cast<CFTPServer*>(args[0]);
+    size_t budget = 0;
+    ftp_io_job_t* job = static_cast<ftp_io_job_t*>(ftp_server->m_scheduler.pop(budget));
+    if (job == NULL)
+    {
+        return;
+    }
+
+    /* 排队期间会话已经关闭时不再执行，进行中的传输直接结束 */
+    pthread_mutex_lock(&ftp_server->m_pthread_mutex);
+    bool is_closed = ftp_server->m_client_map[job->fd].is_closed;
+    pthread_mutex_unlock(&ftp_server->m_pthread_mutex);
+
+    size_t used = budget;
+    bool is_done = true;
+    if (!is_closed)
+    {
+        is_done = ftp_server->execute_io_command(*job, budget, used);
+    }
+    else if (job->is_started)
+    {
+        ftp_server->get_client(job->fd).data_progress = 0;
+    }
+
+    int fd = job->fd;
+    bool is_deferred = is_done && job->is_deferred;
+    ftp_io_job_t* waiting = NULL;
+    if (is_done && job->is_transfer)
+    {
+        pthread_mutex_lock(&ftp_server->m_pthread_mutex);
+        ftp_client_t& ftp_client = *job->client;
+        waiting = ftp_client.waiting_transfer;
+        ftp_client.waiting_transfer = NULL;
+        ftp_client.is_transferring = waiting != NULL;
+        if (waiting != NULL)
         {
-            out.write(message, n);
-            recvsize += n;
-            if (recvsize >= filesize) break;
+            waiting->data_fd = ftp_client.data_fd;
+            waiting->data_ssl = ftp_client.data_ssl;
         }
+        pthread_mutex_unlock(&ftp_server->m_pthread_mutex);
+    }
+    bool is_active = ftp_server->m_scheduler.complete(job, used, is_done);
+    if (waiting != NULL)
+    {
+        ftp_server->classify_io(*waiting);
+        if (ftp_server->m_scheduler.push(waiting))
+            ftp_server->schedule_io();
+    }
+    if (is_deferred)
+    {
+        /* 离开调度器之后才交给组提交线程，之后job由on_store_commit()释放 */
+        ftp_server->m_group_commit.add(job->filefd,
+                                       job->is_created ? CGroupCommit::parent_directory(job->filepath) : "", job);
+    }
+    else if (is_done)
+    {
+        delete job;
+        ftp_server->finish_task(fd);
     }
+    if (is_active)
+    {
+        ftp_server->schedule_io();
+    }
+}
 
-    out.close();
+/*
+ * 返回true表示任务结束，used为这次传输的字节数
+ */
+bool CFTPServer::execute_io_command(ftp_io_job_t& job, size_t budget, size_t& used)
+{
+    switch (job.task)
+    {
+    case FTP_IO_RETR:
+        return process_retr_command(job, budget, used);
+    case FTP_IO_STOR:
+        return process_stor_command(job, budget, used);
+    case FTP_IO_APPE:
+        return process_appe_command(job, budget, used);
+    case FTP_IO_LIST:
+        return process_list_command(job, budget, used);
+    case FTP_IO_XCRC:
+        return process_xcrc_command(job, budget, used);
+    case FTP_IO_HASH:
+        return process_hash_command(job, budget, used);
+    case FTP_IO_XSHA256:
+        return process_xsha256_command(job, budget, used);
+    case FTP_IO_XDEDUP:
+        return process_xdedup_command(job, budget, used);
+    case FTP_IO_XDELTA:
+        return process_xdelta_command(job, budget, used);
+    case FTP_IO_COPY:
+        return process_copy_command(job, budget, used);
+    case FTP_IO_UNTAR:
+        return process_untar_command(job, budget, used);
+    case FTP_IO_SIZE:
+        return process_ascii_size(job, budget, used);
+    }
+    return true;
 }
 
-void CFTPServer::process_quit_command(int fd)
+/*
+ * 命令的接收和解析都在工作线程的ftp_command_buffer_t中完成，不构造临时字符串
+ */
+void CFTPServer::execute_command(int fd)
 {
-    close(fd);
-    if (m_client_map[fd].data_fd != -1)
-        close(m_client_map[fd].data_fd);
+    CFTPServer* ftp_server = this;
+    ftp_command_buffer_t& buffer = command_buffer();
+    int length = ftp_server->recv_client_command(fd, buffer.message, sizeof(buffer.message));
+
+//    std::cout << buffer.message << std::endl;
+
+    if (length == FTP_RECV_NONE)
+    {
+        return;
+    }
+    if (length <= 0)
+    {
+        ftp_server->mark_session_closed(fd);
+        return;
+    }
+    char* back = strpbrk(buffer.message, "\r\n");
+    if (back == NULL)
+    {
+        return;
+    }
+    *back = '\0';
+
+    const char* argument = "";
+    char* split = strchr(buffer.message, ' ');
+    if (split != NULL)
+    {
+        *split = '\0';
+        argument = split + 1;
+    }
+    std::string& command = buffer.command;
+    command.assign(buffer.message);
+
+    std::cout << command << " " << argument << std::endl;
+    ftp_server->get_client(fd).control_argument.assign(argument);
+
+    /* tls_required时控制连接加密之前只接受AUTH和QUIT */
+    if (m_config.tls_required && get_client(fd).control_ssl == NULL && command != "AUTH" && command != "QUIT")
+    {
+        send_response(fd, "530 please secure the control connection with AUTH TLS");
+        return;
+    }
 
-    std::string message = "Quit success!";
-    send(fd, message.c_str(), message.size(), MSG_NOSIGNAL);
+    /* 分发任务 */
+    if(command == "USER")
+        ftp_server->process_user_command(fd);
+    else if(command == "PASS")
+        ftp_server->process_pass_command(fd);
+    else if(command == "CWD")
+        ftp_server->process_cwd_command(fd);
+    else if(command == "PWD")
+        ftp_server->process_pwd_command(fd);
+    else if(command == "PASV")
+        ftp_server->process_pasv_command(fd);
+    else if(command == "PORT")
+        ftp_server->process_port_command(fd);
+    else if(command == "SIZE" && get_client(fd).is_ascii)
+        ftp_server->dispatch_io(fd, FTP_IO_SIZE);
+    else if(command == "SIZE")
+        ftp_server->process_size_command(fd);
+    else if (command == "RETR")
+        ftp_server->dispatch_io(fd, FTP_IO_RETR);
+    else if(command == "STOR")
+        ftp_server->dispatch_io(fd, FTP_IO_STOR);
+    else if(command == "QUIT")
+        ftp_server->process_quit_command(fd);
+    else if(command == "LIST")
+        ftp_server->dispatch_io(fd, FTP_IO_LIST);
+    else if(command == "REST")
+        ftp_server->process_rest_command(fd);
+    else if(command == "APPE")
+        ftp_server->dispatch_io(fd, FTP_IO_APPE);
+    else if(command == "XCRC")
+        ftp_server->dispatch_io(fd, FTP_IO_XCRC);
+    else if(command == "HASH")
+        ftp_server->dispatch_io(fd, FTP_IO_HASH);
+    else if(command == "XSHA256")
+        ftp_server->dispatch_io(fd, FTP_IO_XSHA256);
+    else if(command == "AUTH")
+        ftp_server->process_auth_command(fd);
+    else if(command == "PBSZ")
+        ftp_server->process_pbsz_command(fd);
+    else if(command == "PROT")
+        ftp_server->process_prot_command(fd);
+    else if(command == "MODE")
+        ftp_server->process_mode_command(fd);
+    else if(command == "TYPE")
+        ftp_server->process_type_command(fd);
+    else if(command == "XDEDUP")
+        ftp_server->dispatch_io(fd, FTP_IO_XDEDUP);
+    else if(command == "XDELTA")
+        ftp_server->dispatch_io(fd, FTP_IO_XDELTA);
+    else if(command == "SITE")
+        ftp_server->process_site_command(fd);
+    else if(command == "RNFR")
+        ftp_server->process_rnfr_command(fd);
+    else if(command == "RNTO")
+        ftp_server->process_rnto_command(fd);
+    else if(command == "XUNTAR")
+        ftp_server->dispatch_io(fd, FTP_IO_UNTAR);
+    else
+        ftp_server->process_other_command(fd);
+}
+
+/*
+ * 接收命令到调用者的缓冲区，保证以'\0'结尾
+ * TLS记录分成多个TCP段到达时会产生多次事件，多出来的任务拿到锁之后已经没有数据可读，
+ * 返回FTP_RECV_NONE，不能阻塞在SSL_read中
+ */
+int CFTPServer::recv_client_command(int fd, char* message, size_t length)
+{
+    ftp_client_t& ftp_client = get_client(fd);
+    pthread_mutex_lock(&ftp_client.control_mutex);
+    int recv_ret = FTP_RECV_NONE;
+    if (CTLSContext::is_readable(ftp_client.control_ssl, fd))
+    {
+        recv_ret = CTLSContext::recv(ftp_client.control_ssl, fd, message, length - 1);
+    }
+    pthread_mutex_unlock(&ftp_client.control_mutex);
+    if (recv_ret <= 0)
+        return recv_ret;
+
+    message[recv_ret] = '\0';
+    return recv_ret;
+}
+
+ftp_command_buffer_t& CFTPServer::command_buffer()
+{
+    static thread_local ftp_command_buffer_t buffer;
+    return buffer;
+}
+
+/*
+ * 格式化回复到工作线程的回复缓冲区再发送，不经过std::string拼接
+ */
+void CFTPServer::send_response(int fd, const char* format, ...)
+{
+    ftp_command_buffer_t& buffer = command_buffer();
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(buffer.response, sizeof(buffer.response), format, args);
+    va_end(args);
+
+    if (n < 0)
+        return;
+    if (n >= static_cast<int>(sizeof(buffer.response)))
+        n = sizeof(buffer.response) - 1;
+    send_control(fd, buffer.response, n);
+}
+
+/*
+ * 控制连接的发送，AUTH TLS之后经过TLS
+ */
+ssize_t CFTPServer::send_control(int fd, const char* buffer, size_t length)
+{
+    ftp_client_t& ftp_client = get_client(fd);
+    pthread_mutex_lock(&ftp_client.control_mutex);
+    ssize_t n = CTLSContext::send(ftp_client.control_ssl, fd, buffer, length);
+    pthread_mutex_unlock(&ftp_client.control_mutex);
+    return n;
+}
+
+/*
+ * 释放数据连接的TLS状态并关闭数据连接
+ */
+void CFTPServer::close_data_connection(ftp_client_t& ftp_client)
+{
+    CTLSContext::release(ftp_client.data_ssl);
+    ftp_client.data_ssl = NULL;
+    if (ftp_client.data_fd != -1)
+    {
+        close(ftp_client.data_fd);
+        ftp_client.data_fd = -1;
+    }
+}
+
+/*
+ * I/O任务关闭它使用的数据连接，数据连接属于会话，在m_pthread_mutex中关闭会话的数据连接
+ */
+void CFTPServer::close_data_connection(ftp_io_job_t& job)
+{
+    pthread_mutex_lock(&m_pthread_mutex);
+    if (job.client->data_fd == job.data_fd)
+    {
+        close_data_connection(*job.client);
+    }
+    pthread_mutex_unlock(&m_pthread_mutex);
+    job.data_fd = -1;
+    job.data_ssl = NULL;
+}
+
+/*
+ * 更换会话的数据连接，data_fd为-1时只关闭；有传输在使用数据连接时不更换，返回false
+ * 调用者持有m_pthread_mutex
+ */
+bool CFTPServer::replace_data_connection(ftp_client_t& ftp_client, int data_fd)
+{
+    if (ftp_client.is_transferring)
+    {
+        return false;
+    }
+    close_data_connection(ftp_client);
+    ftp_client.data_fd = data_fd;
+    return true;
+}
+
+/*
+ * PASV/PORT/PROT会更换或者关闭数据连接，有传输在进行时回复425，返回false
+ */
+bool CFTPServer::check_data_idle(int fd)
+{
+    pthread_mutex_lock(&m_pthread_mutex);
+    bool is_transferring = m_client_map[fd].is_transferring;
+    pthread_mutex_unlock(&m_pthread_mutex);
+    if (is_transferring)
+    {
+        send_response(fd, "425 data connection in use by a transfer, try again later");
+        return false;
+    }
+    return true;
+}
+
+/*
+ * 拼接 当前工作目录/文件名 到工作线程复用的字符串中
+ */
+const std::string& CFTPServer::make_filepath(int fd, const std::string& filename)
+{
+    std::string& filepath = command_buffer().filepath;
+    filepath.assign(get_client(fd).current_workdir);
+    filepath.append("/");
+    filepath.append(filename);
+    return filepath;
+}
+
+/*
+ * I/O任务使用分发时的工作目录
+ */
+const std::string& CFTPServer::make_filepath(const ftp_io_job_t& job, const std::string& filename)
+{
+    std::string& filepath = command_buffer().filepath;
+    filepath.assign(job.workdir);
+    filepath.append("/");
+    filepath.append(filename);
+    return filepath;
+}
+
+void CFTPServer::process_other_command(int fd)
+{
+    send_response(fd, "cannot parse command, please enter correct command");
+}
+
+/*
+ * 断电续传命令只是将偏移量简单记录在ftp_client_t中
+ * 当客户端使用RETR下载或者STOR上传时再偏移
+ */
+void CFTPServer::process_rest_command(int fd)
+{
+    ftp_client_t& client = get_client(fd);
+    client.file_offset = strtoll(client.control_argument.c_str(), NULL, 10);
+    send_response(fd, "350 Restarting at <%s>. Send STORE or RETRIEVE to initiate transfer.", client.control_argument.c_str());
+}
+
+void CFTPServer::process_user_command(int fd)
+{
+    ftp_client_t& ftp_client = get_client(fd);
+    ftp_client.username = ftp_client.control_argument;
+    send_response(fd, "welcome to use");
+}
+
+void CFTPServer::process_pass_command(int fd)
+{
+    send_response(fd, "welcome to use");
+}
+
+/*
+ * AUTH TLS，回复234之后在控制连接上握手
+ * 握手期间从epoll中移除控制连接，避免主循环把客户端的握手消息当作命令分发给其他线程
+ */
+void CFTPServer::process_auth_command(int fd)
+{
+    ftp_client_t& ftp_client = get_client(fd);
+    const std::string& mechanism = ftp_client.control_argument;
+    if (!m_tls.is_enabled())
+    {
+        send_response(fd, "534 TLS not available");
+        return;
+    }
+    if (mechanism != "TLS" && mechanism != "TLS-C" && mechanism != "SSL")
+    {
+        send_response(fd, "504 AUTH %s not supported", mechanism.c_str());
+        return;
+    }
+    if (ftp_client.control_ssl != NULL)
+    {
+        send_response(fd, "503 control connection already secured");
+        return;
+    }
+
+    m_epoll.delete_event(fd, EPOLLIN | EPOLLET);
+    send_response(fd, "234 AUTH TLS successful");
+
+    CSocketOption::set_timeout(fd, FTP_TLS_HANDSHAKE_TIMEOUT);
+    SSL* ssl = m_tls.accept(fd);
+    CSocketOption::set_timeout(fd, 0);
+    if (ssl == NULL)
+    {
+        std::cout << "TLS handshake on control connection failed" << std::endl;
+        mark_session_closed(fd);
+        return;
+    }
+
+    pthread_mutex_lock(&m_pthread_mutex);
+    ftp_client.control_ssl = ssl;
+    pthread_mutex_unlock(&m_pthread_mutex);
+    std::cout << "control connection secured, " << SSL_get_version(ssl) << " " << SSL_get_cipher(ssl)
+              << ", ktls send " << CTLSContext::is_ktls_send(ssl) << " recv " << CTLSContext::is_ktls_recv(ssl) << std::endl;
+
+    m_epoll.add_event(fd, EPOLLIN | EPOLLET);
+}
+
+/*
+ * 数据连接的TLS不分块，缓冲区大小只能是0
+ */
+void CFTPServer::process_pbsz_command(int fd)
+{
+    if (get_client(fd).control_ssl == NULL)
+    {
+        send_response(fd, "503 PBSZ requires AUTH TLS");
+        return;
+    }
+    send_response(fd, "200 PBSZ=0");
+}
+
+/*
+ * PROT P数据连接加密，PROT C明文
+ * 保护级别改变后关闭已有的数据连接，客户端需要重新PASV/PORT；传输中的数据连接不能关闭，回复425
+ */
+void CFTPServer::process_prot_command(int fd)
+{
+    ftp_client_t& ftp_client = get_client(fd);
+    const std::string& level = ftp_client.control_argument;
+    if (ftp_client.control_ssl == NULL)
+    {
+        send_response(fd, "503 PROT requires AUTH TLS");
+        return;
+    }
+
+    bool is_private;
+    if (level == "P")
+    {
+        is_private = true;
+    }
+    else if (level == "C" && !m_config.tls_required)
+    {
+        is_private = false;
+    }
+    else if (level == "C")
+    {
+        send_response(fd, "534 data connection must be protected");
+        return;
+    }
+    else
+    {
+        send_response(fd, "504 PROT %s not supported", level.c_str());
+        return;
+    }
+
+    if (is_private != ftp_client.is_prot_private)
+    {
+        pthread_mutex_lock(&m_pthread_mutex);
+        bool is_replaced = replace_data_connection(ftp_client, -1);
+        if (is_replaced)
+            ftp_client.is_prot_private = is_private;
+        pthread_mutex_unlock(&m_pthread_mutex);
+        if (!is_replaced)
+        {
+            send_response(fd, "425 data connection in use by a transfer, try again later");
+            return;
+        }
+    }
+    send_response(fd, "200 protection level %s", is_private ? "private" : "clear");
+}
+
+/*
+ * MODE S为普通的流模式，MODE H为稀疏传输：RETR/STOR/APPE只传输数据段，空洞不经过网络，接收方重建空洞
+ */
+void CFTPServer::process_mode_command(int fd)
+{
+    ftp_client_t& ftp_client = get_client(fd);
+    std::string mode = ftp_client.control_argument;
+    std::transform(mode.begin(), mode.end(), mode.begin(), ::toupper);
+    if (mode != "S" && mode != "H")
+    {
+        send_response(fd, "504 MODE %s not supported", mode.c_str());
+        return;
+    }
+    ftp_client.is_sparse = mode == "H";
+    send_response(fd, "200 mode %s", ftp_client.is_sparse ? "sparse" : "stream");
+}
+
+/*
+ * TYPE A [N]为ASCII模式，数据连接上的行尾为CRLF；TYPE I和TYPE L 8为二进制模式，按原样传输
+ */
+void CFTPServer::process_type_command(int fd)
+{
+    ftp_client_t& ftp_client = get_client(fd);
+    std::string type = ftp_client.control_argument;
+    std::transform(type.begin(), type.end(), type.begin(), ::toupper);
+    if (type != "A" && type != "A N" && type != "I" && type != "L 8")
+    {
+        send_response(fd, "504 TYPE %s not supported", type.c_str());
+        return;
+    }
+    ftp_client.is_ascii = type[0] == 'A';
+    send_response(fd, "200 type set to %c", ftp_client.is_ascii ? 'A' : 'I');
+}
+
+/*
+ * tls_required时数据传输必须PROT P，不满足时回复错误并返回false
+ */
+bool CFTPServer::check_data_protection(int fd)
+{
+    if (m_config.tls_required && !get_client(fd).is_prot_private)
+    {
+        send_response(fd, "521 data connection must be protected, send PROT P");
+        return false;
+    }
+    return true;
+}
+
+/*
+ * 传输开始前取得分发之后才建立的数据连接
+ * PROT P时数据连接在第一次传输前握手，同一个数据连接之后的传输复用
+ * 握手期间记录data_progress，客户端不握手时由主循环按停滞的传输处理
+ */
+bool CFTPServer::secure_data_connection(ftp_io_job_t& job)
+{
+    ftp_client_t& ftp_client = *job.client;
+    if (job.data_fd == -1)
+    {
+        pthread_mutex_lock(&m_pthread_mutex);
+        job.data_fd = ftp_client.data_fd;
+        job.data_ssl = ftp_client.data_ssl;
+        pthread_mutex_unlock(&m_pthread_mutex);
+    }
+    if (!ftp_client.is_prot_private || job.data_ssl != NULL)
+    {
+        return true;
+    }
+    if (job.data_fd == -1)
+    {
+        return false;
+    }
+
+    ftp_client.data_progress = monotonic_seconds();
+    SSL* ssl = m_tls.accept(job.data_fd);
+    ftp_client.data_progress = 0;
+    if (ssl == NULL)
+    {
+        std::cout << "TLS handshake on data connection failed" << std::endl;
+        close_data_connection(job);
+        return false;
+    }
+    pthread_mutex_lock(&m_pthread_mutex);
+    job.data_ssl = ssl;
+    ftp_client.data_ssl = ssl;
+    pthread_mutex_unlock(&m_pthread_mutex);
+    return true;
+}
+
+/*
+ * 被动模式，服务器发送地址和端口给客户端，客户端链接
+ */
+void CFTPServer::process_pasv_command(int fd)
+{
+    if (!check_data_idle(fd))
+    {
+        return;
+    }
+    if (m_data_listen_fd == -1)
+    {
+        if (!create_data_listen_socket())
+        {
+            send_response(fd, "fail to convert to pasv mode, please retry");
+            return;
+        }
+    }
+
+    /* 记录PASV的时间，超时没有数据连接时主循环删除地址映射 */
+    ftp_client_t& ftp_client = get_client(fd);
+    pthread_mutex_lock(&m_pthread_mutex);
+    m_address_map[ftp_client.ip_address] = fd;
+    remove_pasv(ftp_client.ip_address, fd);
+    m_pasv_queue[ftp_client.ip_address].push_back(fd);
+    ftp_client.pasv_time = monotonic_seconds();
+    /* 应答中的地址优先使用pasv_address，否则使用客户端连接到的本端地址 */
+    std::string address = m_config.pasv_address;
+    pthread_mutex_unlock(&m_pthread_mutex);
+
+    if (address.empty())
+    {
+        struct sockaddr_in localaddr;
+        socklen_t len = sizeof(localaddr);
+        if (getsockname(fd, (struct sockaddr*)&localaddr, &len) == 0)
+            address = parse_ip_address(localaddr);
+        else
+            address = m_config.bind_address;
+    }
+    std::replace(address.begin(), address.end(), '.', ',');
+
+    int p1, p2;
+    p1 = m_config.data_port / 256;
+    p2 = m_config.data_port % 256;
+    send_response(fd, "(%s,%d,%d)", address.c_str(), p1, p2);
+}
+
+/* 
+ * 主动模式，需要服务器链接客户端地址和端口
+ */
+void CFTPServer::process_port_command(int fd)
+{
+    int h1, h2, h3, h4, p1, p2;
+    char ch;
+
+    if (!check_data_idle(fd))
+    {
+        return;
+    }
+
+    std::stringstream oss(get_client(fd).control_argument);
+    oss >> h1 >> ch >> h2 >> ch >> h3 >> ch >> h4 >> ch >> p1 >> ch >> p2 >> ch;
+
+    std::cout << h1 << h2 << h3 << h4 << ":" << p1 * 256 + p2 << std::endl;
+
+    int port = p1 * 256 + p2;
+    oss.str("");
+    oss.clear();
+    oss << h1 << "." << h2 << "." << h3 << "." << h4;
+    std::string ip_address = oss.str();
+
+    struct sockaddr_in servaddr;
+    bzero(&servaddr, sizeof(servaddr));
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_port = htons(port);
+    inet_pton(AF_INET, ip_address.c_str(), &servaddr.sin_addr);
+
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0)
+    {
+        std::string response = "fail to convert to port pattern, create data socket error";
+        send_control(fd, response.c_str(), response.size());
+        return;
+    }
+
+    /* 主动模式的数据连接由服务器发起，缓冲区在connect之前设置 */
+    CSocketOption::apply_buffer(sockfd, m_config.data_socket);
+    if (connect(sockfd, (struct sockaddr*)&servaddr, sizeof(servaddr)) < 0)
+    {
+        close(sockfd);
+        std::string response = "fail to connect to port pattern, connect to client error";
+        send_control(fd, response.c_str(), response.size());
+        return;
+    }
+    CSocketOption::apply_connection(sockfd, m_config.data_socket);
+
+    /* connect期间开始了传输时放弃这个连接 */
+    pthread_mutex_lock(&m_pthread_mutex);
+    bool is_replaced = replace_data_connection(m_client_map[fd], sockfd);
+    pthread_mutex_unlock(&m_pthread_mutex);
+    if (!is_replaced)
+    {
+        close(sockfd);
+        send_response(fd, "425 data connection in use by a transfer, try again later");
+        return;
+    }
+
+    std::string response = "convert port pattern success";
+    send_control(fd, response.c_str(), response.size());
+}
+
+/* 
+ * 改变当前工作目录，没有实际改变，只是将工作目录存在ftp_client_t中
+ * 解决多个客户端的问题，因为每个客户端都可能改变工作目录，如果直接改变服务器的，会乱掉
+ */
+void CFTPServer::process_cwd_command(int fd)
+{
+    ftp_client_t& client = get_client(fd);
+    const std::string& change_dir = client.control_argument;
+    struct stat statinfo;
+    if (lstat(change_dir.c_str(), &statinfo) < 0 || !S_ISDIR(statinfo.st_mode))
+    {
+        send_response(fd, "change work dir error, current workdir is %s", client.current_workdir.c_str());
+    }
+    else
+    {
+        client.current_workdir.assign(change_dir);
+        send_response(fd, "change workdir success workdir is %s", change_dir.c_str());
+    }
+}
+
+/*
+ * 打印当前工作目录，直接输出ftp_client_t中记录的工作目录
+ */
+void CFTPServer::process_pwd_command(int fd)
+{
+    send_response(fd, "current workdir is %s", get_client(fd).current_workdir.c_str());
+}
+
+/*
+ * 获得文件大小
+ */
+void  CFTPServer::process_size_command(int fd)
+{
+    const std::string& filepath = make_filepath(fd, get_client(fd).control_argument);
+    struct stat fileinfo;
+    if (lstat(filepath.c_str(), &fileinfo) < 0 || !S_ISREG(fileinfo.st_mode))
+    {
+        send_response(fd, "-1");
+        return;
+    }
+    send_response(fd, "%lld", static_cast<long long>(fileinfo.st_size));
+}
+
+/*
+ * TYPE A时SIZE为RETR在数据连接上传输的字节数，要读完整个文件统计LF，交给I/O线程按时间片执行
+ */
+bool CFTPServer::process_ascii_size(ftp_io_job_t& job, size_t budget, size_t& used)
+{
+    used = 0;
+    if (!job.is_started)
+    {
+        job.is_started = true;
+        const std::string& filepath = make_filepath(job, job.argument);
+        struct stat fileinfo;
+        if (lstat(filepath.c_str(), &fileinfo) < 0 || !S_ISREG(fileinfo.st_mode) ||
+            (job.filefd = open(filepath.c_str(), O_RDONLY)) < 0)
+        {
+            send_response(job.fd, "-1");
+            return true;
+        }
+        posix_fadvise(job.filefd, 0, fileinfo.st_size, POSIX_FADV_SEQUENTIAL);
+        job.end = fileinfo.st_size;
+        job.stored = fileinfo.st_size;
+    }
+
+    std::vector<char>& buffer = command_buffer().data;
+    buffer.resize(m_recv_buffer);
+    off_t limit = std::min<off_t>(job.end, job.offset + budget);
+    while (job.offset < limit)
+    {
+        ssize_t n = pread(job.filefd, buffer.data(), std::min<off_t>(limit - job.offset, buffer.size()), job.offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0)
+        {
+            send_response(job.fd, "-1");
+            return true;
+        }
+        job.stored += CAsciiConvert::count_lf(buffer.data(), n);
+        job.offset += n;
+        used += n;
+    }
+    if (job.offset < job.end)
+    {
+        return false;
+    }
+    send_response(job.fd, "%lld", static_cast<long long>(job.stored));
+    return true;
+}
+
+/*
+ * 列出当前目录下的所有文件/目录等
+ * 目录按时间片读取，每个时间片最多读取budget字节的文件名，读完后一次回复
+ */ 
+bool CFTPServer::process_list_command(ftp_io_job_t& job, size_t budget, size_t& used)
+{
+    int fd = job.fd;
+    used = 0;
+    if (!job.is_started)
+    {
+        job.is_started = true;
+        std::string dirname = job.argument;
+
+        if (dirname.size() == 0)
+        {
+            dirname = job.workdir;
+        }
+
+        struct stat statinfo;
+        if (lstat(dirname.c_str(), &statinfo) < 0 ||
+            (S_ISDIR(statinfo.st_mode) && (job.dir = opendir(dirname.c_str())) == NULL))
+        {
+            std::string response = "fail to parse LIST command, please check argument";
+            send_control(fd, response.c_str(), response.size());
+            return true;
+        }
+
+        if (!S_ISDIR(statinfo.st_mode))
+        {
+            std::stringstream oss;
+            oss << dirname << '\t' << statinfo.st_size;
+            std::string response = oss.str();
+            send_control(fd, response.c_str(), response.size());
+            return true;
+        }
+    }
+
+    bool is_end = false;
+    while (used < budget)
+    {
+        struct dirent* entry = readdir(job.dir);
+        if (entry == NULL)
+        {
+            is_end = true;
+            break;
+        }
+        size_t length = job.listing.size();
+        job.listing += entry->d_name;
+        job.listing += '\t';
+        used += job.listing.size() - length;
+    }
+    if (!is_end)
+    {
+        return false;
+    }
+    send_control(fd, job.listing.c_str(), job.listing.size());
+    return true;
+}
+
+/*
+ * 下载文件，使用sendfile领拷贝传文件到客户端
+ */
+bool CFTPServer::process_retr_command(ftp_io_job_t& job, size_t budget, size_t& used)
+{
+    int fd = job.fd;
+    ftp_client_t& ftp_client = *job.client;
+    used = 0;
+    if (!job.is_started)
+    {
+        job.is_started = true;
+        off_t offset = job.restart;
+
+        const std::string& filepath = make_filepath(job, job.argument);
+
+        std::cout << filepath << std::endl;
+
+        int filefd = open(filepath.c_str(), O_RDONLY);
+//        std::cout << "open success" << std::endl;
+
+        struct stat statinfo;
+        if (filefd < 0 || fstat(filefd, &statinfo) < 0 || (!S_ISREG(statinfo.st_mode) && !S_ISDIR(statinfo.st_mode)))
+        {
+            if (filefd >= 0)
+                close(filefd);
+            send_response(fd, "RETR error, cannot open file");
+            return true;
+        }
+        if (S_ISDIR(statinfo.st_mode))
+        {
+            close(filefd);
+            job.is_ascii = false;
+            job.is_sparse = false;
+            job.archive = new CTarStream;
+            if (!job.archive->open_stream(filepath))
+            {
+                send_response(fd, "RETR error, cannot open directory");
+                return true;
+            }
+        }
+        else if (job.is_ascii && offset > 0)
+        {
+            close(filefd);
+            send_response(fd, "RETR error, REST not supported in ASCII mode");
+            return true;
+        }
+        else
+        {
+            /* TYPE A逐块转换行尾后发送，不用稀疏格式和O_DIRECT；目录的tar流总是按二进制发送 */
+            job.filefd = filefd;
+            job.is_sparse = job.is_sparse && !job.is_ascii;
+            job.bypass = cache_policy(filepath, statinfo.st_size);
+            enable_bypass(job, !job.is_ascii);
+        }
+        if (!check_data_protection(fd))
+        {
+            return true;
+        }
+        send_response(fd, job.archive != NULL ? "retr archive" : "retr parse success");
+        if (!secure_data_connection(job))
+        {
+            return true;
+        }
+
+        /*
+         * 开启data_cork时块与块之间不会发出不满的报文段，结束时关闭以发出剩余数据
+         * 打包时头部和小文件交替发送，总是开启
+         */
+        job.is_cork = (m_config.data_socket.is_cork || job.archive != NULL) && CSocketOption::set_cork(job.data_fd, true);
+        /* 目录打包的大小事先不知道，按批量任务处理 */
+        set_io_class(job, job.archive != NULL ? -1 : statinfo.st_size);
+        job.offset = offset;
+        job.end = statinfo.st_size;
+        job.dropped = offset & ~(FTP_BYPASS_DROP_ALIGN - 1);
+        ftp_client.data_progress = monotonic_seconds();
+    }
+    if (job.archive != NULL)
+    {
+        return send_archive(job, budget, used);
+    }
+
+    /* 这个时间片最多发送budget字节，分块sendfile，每块之后记录进度，主循环据此判断传输是否停滞 */
+    off_t start = job.offset;
+    off_t limit = std::min<off_t>(job.end, job.offset + budget);
+    off_t skipped = 0;
+    bool is_failed = false;
+    while (job.offset < limit)
+    {
+        /* 稀疏传输时跳过的空洞不计入时间片 */
+        if (job.is_sparse && job.record_left == 0)
+        {
+            off_t position = job.offset;
+            if (!send_sparse_header(job))
+            {
+                is_failed = true;
+                break;
+            }
+            skipped += job.offset - position;
+            limit = std::min<off_t>(job.end, limit + job.offset - position);
+            continue;
+        }
+        size_t chunk = std::min<off_t>(limit - job.offset, m_sendfile_chunk);
+        if (job.is_sparse)
+        {
+            chunk = std::min<off_t>(chunk, job.record_left);
+        }
+        ssize_t n;
+        if (job.is_ascii)
+            n = send_ascii_chunk(job, job.filefd, &job.offset, chunk);
+        else if (job.bypass == FTP_BYPASS_DIRECT)
+            n = send_direct_chunk(job, job.filefd, &job.offset, chunk);
+        else
+            n = send_file_chunk(job, job.filefd, &job.offset, chunk);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0)
+        {
+            is_failed = true;
+            break;
+        }
+        if (job.is_sparse)
+        {
+            job.record_left -= n;
+        }
+        ftp_client.data_progress = monotonic_seconds();
+    }
+    used = job.offset - start - skipped;
+    if (!is_failed && job.offset < job.end)
+    {
+        drop_cache(job, job.offset - FTP_BYPASS_SENDLAG);
+        return false;
+    }
+
+    /* 结束时仍在套接字缓冲区中的尾部丢弃不掉，最多留下套接字缓冲区大小的页 */
+    drop_cache(job, job.offset);
+    ftp_client.data_progress = 0;
+    if (job.is_cork)
+    {
+        CSocketOption::set_cork(job.data_fd, false);
+    }
+    return true;
+}
+
+/*
+ * 查找下一段数据并发送它的头部，之前的空洞直接跳过；文件结尾是空洞时发送长度为0的段，job.offset到达文件结尾
+ */
+bool CFTPServer::send_sparse_header(ftp_io_job_t& job)
+{
+    off_t data, hole;
+    CSparse::next_extent(job.filefd, job.offset, job.end, data, hole);
+    char header[SPARSE_HEADER_SIZE];
+    CSparse::encode_header(header, data, hole - data);
+    if (!send_data(job, header, sizeof(header)))
+    {
+        return false;
+    }
+    job.offset = data;
+    job.record_left = hole - data;
+    return true;
+}
+
+/*
+ * 发送目录的tar流，头部和填充从内存发送，文件内容用sendfile，每个时间片最多发送budget字节
+ * 流的长度事先不知道，客户端按tar的块结构读到结尾的两个全0块为止
+ */
+bool CFTPServer::send_archive(ftp_io_job_t& job, size_t budget, size_t& used)
+{
+    ftp_client_t& ftp_client = *job.client;
+    tar_segment_t segment;
+    bool is_failed = false;
+    bool is_end = false;
+    while (used < budget)
+    {
+        if (!job.archive->peek(segment))
+        {
+            is_end = true;
+            break;
+        }
+
+        size_t length = std::min(segment.length, budget - used);
+        ssize_t n;
+        if (segment.data != NULL)
+        {
+            n = send_data(job, segment.data, length) ? static_cast<ssize_t>(length) : -1;
+        }
+        else
+        {
+            off_t offset = segment.offset;
+            n = send_file_chunk(job, segment.filefd, &offset, std::min<size_t>(length, m_sendfile_chunk));
+            if (n == 0)
+            {
+                /* 文件在打包过程中变短，剩余部分补0 */
+                job.archive->fill_zero();
+                continue;
+            }
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0)
+        {
+            is_failed = true;
+            break;
+        }
+        job.archive->consume(n);
+        used += n;
+        ftp_client.data_progress = monotonic_seconds();
+    }
+    if (!is_failed && !is_end)
+    {
+        return false;
+    }
+
+    std::cout << "archive " << job.archive->get_file_count() << " files" << (is_failed ? " interrupted" : "") << std::endl;
+    ftp_client.data_progress = 0;
+    if (job.is_cork)
+    {
+        CSocketOption::set_cork(job.data_fd, false);
+    }
+    return true;
+}
+
+/*
+ * 发送文件的一块，明文和kTLS时使用sendfile，kTLS不可用时读到缓冲区由OpenSSL加密发送
+ */
+ssize_t CFTPServer::send_file_chunk(ftp_io_job_t& job, int filefd, off_t* offset, size_t chunk)
+{
+    if (job.data_ssl == NULL || CTLSContext::is_ktls_send(job.data_ssl))
+    {
+        return sendfile(job.data_fd, filefd, offset, chunk);
+    }
+
+    std::vector<char>& buffer = command_buffer().data;
+    buffer.resize(m_recv_buffer);
+    ssize_t n = pread(filefd, buffer.data(), std::min(chunk, buffer.size()), *offset);
+    if (n <= 0)
+    {
+        return n;
+    }
+    if (CTLSContext::send(job.data_ssl, job.data_fd, buffer.data(), n) != n)
+    {
+        return -1;
+    }
+    *offset += n;
+    return n;
+}
+
+/*
+ * O_DIRECT读取包含[*offset, *offset + chunk)的对齐块到线程的对齐缓冲区，再发送其中需要的部分
+ */
+ssize_t CFTPServer::send_direct_chunk(ftp_io_job_t& job, int filefd, off_t* offset, size_t chunk)
+{
+    char* buffer = direct_buffer();
+    if (buffer == NULL)
+    {
+        return -1;
+    }
+    off_t start = *offset & ~static_cast<off_t>(FTP_DIRECT_ALIGN - 1);
+    size_t skip = *offset - start;
+    size_t length = std::min(skip + chunk, FTP_DIRECT_BUFFER);
+    length = (length + FTP_DIRECT_ALIGN - 1) & ~(FTP_DIRECT_ALIGN - 1);
+    ssize_t n = pread(filefd, buffer, length, start);
+    if (n <= static_cast<ssize_t>(skip))
+    {
+        return n < 0 ? n : 0;
+    }
+    size_t count = std::min(static_cast<size_t>(n) - skip, chunk);
+    if (!send_data(job, buffer + skip, count))
+    {
+        return -1;
+    }
+    *offset += count;
+    return count;
+}
+
+/*
+ * TYPE A：读取文件的一块，LF转换成CRLF后发送，返回读取的文件字节数，时间片按文件字节计算
+ */
+ssize_t CFTPServer::send_ascii_chunk(ftp_io_job_t& job, int filefd, off_t* offset, size_t chunk)
+{
+    ftp_command_buffer_t& buffer = command_buffer();
+    buffer.data.resize(m_recv_buffer);
+    buffer.ascii.resize(buffer.data.size() * 2);
+    ssize_t n = pread(filefd, buffer.data.data(), std::min(chunk, buffer.data.size()), *offset);
+    if (n <= 0)
+    {
+        return n;
+    }
+    size_t length = CAsciiConvert::to_crlf(buffer.data.data(), n, buffer.ascii.data());
+    if (!send_data(job, buffer.ascii.data(), length))
+    {
+        return -1;
+    }
+    *offset += n;
+    return n;
+}
+
+/*
+ * 按cache_bypass_size和cache_bypass_paths判断这次传输是否绕过页缓存
+ */
+FTP_CACHE_BYPASS CFTPServer::cache_policy(const std::string& filepath, off_t size)
+{
+    pthread_mutex_lock(&m_pthread_mutex);
+    FTP_CACHE_BYPASS bypass = m_config.cache_bypass;
+    off_t bypass_size = m_config.cache_bypass_size;
+    std::vector<std::string> paths = m_config.cache_bypass_paths;
+    pthread_mutex_unlock(&m_pthread_mutex);
+
+    if (bypass == FTP_BYPASS_OFF || (bypass_size > 0 && size >= bypass_size))
+    {
+        return bypass;
+    }
+    char resolved[PATH_MAX];
+    if (paths.empty() || realpath(filepath.c_str(), resolved) == NULL)
+    {
+        return FTP_BYPASS_OFF;
+    }
+    for (size_t i = 0; i < paths.size(); ++i)
+    {
+        size_t length = paths[i].size();
+        if (strncmp(resolved, paths[i].c_str(), length) == 0 && (resolved[length] == '/' || length == 1))
+        {
+            return bypass;
+        }
+    }
+    return FTP_BYPASS_OFF;
+}
+
+/*
+ * direct需要文件系统支持O_DIRECT并且起始偏移对齐，否则退回dontneed；dontneed时加大预读
+ */
+void CFTPServer::enable_bypass(ftp_io_job_t& job, bool is_aligned)
+{
+    if (job.bypass == FTP_BYPASS_DIRECT)
+    {
+        int flags = fcntl(job.filefd, F_GETFL);
+        if (!is_aligned || flags < 0 || fcntl(job.filefd, F_SETFL, flags | O_DIRECT) < 0)
+        {
+            job.bypass = FTP_BYPASS_DONTNEED;
+        }
+    }
+    if (job.bypass == FTP_BYPASS_DONTNEED)
+    {
+        posix_fadvise(job.filefd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+}
+
+/*
+ * dontneed时丢弃[job.dropped, end)的页缓存，按FTP_BYPASS_DROP_ALIGN对齐，到达文件结尾时丢弃到结尾
+ */
+void CFTPServer::drop_cache(ftp_io_job_t& job, off_t end)
+{
+    if (end < job.end)
+    {
+        end &= ~(FTP_BYPASS_DROP_ALIGN - 1);
+    }
+    if (job.bypass != FTP_BYPASS_DONTNEED || end <= job.dropped)
+    {
+        return;
+    }
+    posix_fadvise(job.filefd, job.dropped, end < job.end ? end - job.dropped : 0, POSIX_FADV_DONTNEED);
+    job.dropped = end;
+}
+
+/*
+ * 每个I/O线程一个对齐缓冲区，O_DIRECT读写都经过它，分配失败时返回NULL
+ */
+char* CFTPServer::direct_buffer()
+{
+    ftp_command_buffer_t& buffer = command_buffer();
+    if (buffer.direct == NULL && posix_memalign(reinterpret_cast<void**>(&buffer.direct), FTP_DIRECT_ALIGN, FTP_DIRECT_BUFFER) != 0)
+    {
+        perror("alloc direct buffer error");
+        buffer.direct = NULL;
+    }
+    return buffer.direct;
+}
+
+/*
+ * 上传文件，服务器接受数据
+ * 如果之前收到REST，则从偏移量处继续写入，不截断已有的文件
+ */
+bool CFTPServer::process_stor_command(ftp_io_job_t& job, size_t budget, size_t& used)
+{
+    return store_file(job, false, budget, used);
+}
+
+/*
+ * 追加上传，数据写到文件末尾
+ */
+bool CFTPServer::process_appe_command(ftp_io_job_t& job, size_t budget, size_t& used)
+{
+    return store_file(job, true, budget, used);
+}
+
+/*
+ * 参数格式为 文件名<本次传输的字节数>
+ * 传输中断时记录到m_partial_map中，客户端可以用SIZE/XCRC确认已有部分后REST续传
+ * 每个时间片最多接收budget字节，接收完或者中断时回复结果
+ */
+bool CFTPServer::store_file(ftp_io_job_t& job, bool is_append, size_t budget, size_t& used)
+{
+    used = 0;
+    if (!job.is_started)
+    {
+        job.is_started = true;
+        if (!start_store(job, is_append))
+        {
+            return true;
+        }
+    }
+
+    ftp_client_t& ftp_client = *job.client;
+    std::vector<char>& message = command_buffer().data;
+    message.resize(m_recv_buffer);
+    off_t limit = std::min<off_t>(job.end, job.received + budget);
+    off_t start = job.received;
+    off_t skipped = 0;
+    bool is_failed = false;
+    if (job.bypass == FTP_BYPASS_DIRECT)
+    {
+        is_failed = !recv_direct(job, limit);
+    }
+    while (job.bypass != FTP_BYPASS_DIRECT && job.received < limit)
+    {
+        if (job.is_sparse && job.record_left == 0)
+        {
+            off_t position = job.received;
+            if (!recv_sparse_header(job))
+            {
+                close_data_connection(job);
+                is_failed = true;
+                break;
+            }
+            skipped += job.received - position;
+            limit = std::min<off_t>(job.end, limit + job.received - position);
+            continue;
+        }
+        off_t want = std::min<off_t>(message.size(), limit - job.received);
+        if (job.is_sparse)
+        {
+            want = std::min(want, job.record_left);
+        }
+        int n = CTLSContext::recv(job.data_ssl, job.data_fd, message.data(), want);
+        if (n <= 0)
+        {
+            close_data_connection(job);
+            is_failed = true;
+            break;
+        }
+
+        /* 写入失败时客户端还在发送，关闭数据连接让它停止，下一次传输使用新的连接 */
+        if (job.is_ascii ? !write_ascii(job, message.data(), n, job.received + n == job.end)
+                         : pwrite(job.filefd, message.data(), n, job.offset + job.received) != n)
+        {
+            close_data_connection(job);
+            is_failed = true;
+            break;
+        }
+        job.received += n;
+        if (job.is_sparse)
+        {
+            job.record_left -= n;
+        }
+        ftp_client.data_progress = monotonic_seconds();
+        write_behind(job);
+    }
+    used = job.received - start - skipped;
+    if (!is_failed && job.received < job.end)
+    {
+        return false;
+    }
+
+    /* 稀疏传输以空洞结尾时文件还没有到达最终大小 */
+    struct stat statinfo;
+    if (job.is_sparse && job.received == job.end && fstat(job.filefd, &statinfo) == 0 &&
+        statinfo.st_size < job.offset + job.end && ftruncate(job.filefd, job.offset + job.end) < 0)
+    {
+        job.received = statinfo.st_size - job.offset;
+    }
+
+    /* dontneed时等待剩余部分写回后丢弃，之后的fdatasync也不用再写这些页 */
+    if (job.bypass == FTP_BYPASS_DONTNEED)
+    {
+        sync_file_range(job.filefd, job.written_back, 0,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(job.filefd, job.written_back & ~(FTP_BYPASS_DROP_ALIGN - 1), 0, POSIX_FADV_DONTNEED);
+    }
+
+    /* 完整接收的文件按store_sync同步之后才回复，组提交时由同步线程回复 */
+    ftp_client.data_progress = 0;
+    int store_sync = m_store_sync;
+    if (job.received == job.end && store_sync == FTP_SYNC_GROUP)
+    {
+        job.is_deferred = true;
+        return true;
+    }
+    if (job.received == job.end && store_sync == FTP_SYNC_DATA)
+    {
+        job.sync_error = fdatasync(job.filefd) < 0 ? errno : 0;
+        if (job.sync_error == 0 && job.is_created)
+        {
+            job.sync_error = CGroupCommit::sync_directory(CGroupCommit::parent_directory(job.filepath));
+        }
+    }
+    finish_store(job);
+    return true;
+}
+
+/*
+ * 每写入store_writebehind字节发起这一段的写回，并等待上一段写回完成，
+ * 大文件上传时脏页不会堆积到内核的阈值后集中写回，结束时的fdatasync只剩最后两段
+ */
+void CFTPServer::write_behind(ftp_io_job_t& job)
+{
+    off_t writebehind = m_store_writebehind;
+    if (job.bypass == FTP_BYPASS_DONTNEED && writebehind == 0)
+    {
+        writebehind = FTP_BYPASS_WRITEBEHIND;
+    }
+    off_t written = job.offset + (job.is_ascii ? job.stored : job.received);
+    if (writebehind == 0 || written - job.writeback < writebehind)
+    {
+        return;
+    }
+    if (job.writeback > job.written_back)
+    {
+        sync_file_range(job.filefd, job.written_back, job.writeback - job.written_back,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        /* 写回完成的页是干净的，dontneed时可以丢弃，起点向前对齐，上次跨过边界的大页folio这次一起丢弃 */
+        if (job.bypass == FTP_BYPASS_DONTNEED)
+        {
+            off_t start = job.written_back & ~(FTP_BYPASS_DROP_ALIGN - 1);
+            posix_fadvise(job.filefd, start, job.writeback - start, POSIX_FADV_DONTNEED);
+        }
+        job.written_back = job.writeback;
+    }
+    sync_file_range(job.filefd, job.writeback, written - job.writeback, SYNC_FILE_RANGE_WRITE);
+    job.writeback = written;
+}
+
+/*
+ * TYPE A：CRLF转换成LF后写到上次写入的位置之后，块末尾的CR留到下一块，is_end时一起写入
+ */
+bool CFTPServer::write_ascii(ftp_io_job_t& job, const char* buffer, size_t length, bool is_end)
+{
+    std::vector<char>& ascii = command_buffer().ascii;
+    ascii.resize(length + 1);
+    size_t n = CAsciiConvert::to_lf(buffer, length, ascii.data(), job.pending_cr);
+    if (is_end)
+    {
+        n += CAsciiConvert::finish_lf(ascii.data() + n, job.pending_cr);
+    }
+    if (pwrite(job.filefd, ascii.data(), n, job.offset + job.stored) != static_cast<ssize_t>(n))
+    {
+        return false;
+    }
+    job.stored += n;
+    return true;
+}
+
+/*
+ * 接收下一段的头部，之前的空洞落在文件已有的内容中时（REST续传）打洞，在文件结尾之后的空洞不需要处理
+ */
+bool CFTPServer::recv_sparse_header(ftp_io_job_t& job)
+{
+    char header[SPARSE_HEADER_SIZE];
+    off_t base = job.task == FTP_IO_APPE ? job.offset : 0;
+    off_t position = job.offset + job.received;
+    off_t offset, length;
+    if (!recv_data(job, header, sizeof(header)) ||
+        !CSparse::decode_header(header, position - base, job.offset + job.end - base, offset, length))
+    {
+        return false;
+    }
+    offset += base;
+    struct stat statinfo;
+    if (offset > position && fstat(job.filefd, &statinfo) == 0 && statinfo.st_size > position &&
+        !CSparse::punch_hole(job.filefd, position, std::min<off_t>(offset, statinfo.st_size) - position))
+    {
+        return false;
+    }
+    job.received = offset - job.offset;
+    job.record_left = length;
+    return true;
+}
+
+/*
+ * O_DIRECT接收：数据收进线程的对齐缓冲区，缓冲区满时整块写入；时间片结束时写入对齐的部分，
+ * 不足一个对齐块的尾部保存在job.carry中，下一个时间片放回缓冲区开头；传输结束或者中断时尾部经过页缓存写入
+ */
+bool CFTPServer::recv_direct(ftp_io_job_t& job, off_t limit)
+{
+    char* buffer = direct_buffer();
+    if (buffer == NULL)
+    {
+        close_data_connection(job);
+        return false;
+    }
+    size_t fill = job.carry.size();
+    memcpy(buffer, job.carry.data(), fill);
+    job.carry.clear();
+    bool is_success = true;
+    while (job.received < limit)
+    {
+        int n = CTLSContext::recv(job.data_ssl, job.data_fd, buffer + fill,
+                                  std::min<off_t>(FTP_DIRECT_BUFFER - fill, limit - job.received));
+        if (n <= 0)
+        {
+            close_data_connection(job);
+            is_success = false;
+            break;
+        }
+        fill += n;
+        job.received += n;
+        job.client->data_progress = monotonic_seconds();
+        if (fill == FTP_DIRECT_BUFFER)
+        {
+            if (!write_direct(job, buffer, fill, job.offset + job.received - fill))
+            {
+                close_data_connection(job);
+                return false;
+            }
+            fill = 0;
+        }
+    }
+
+    off_t position = job.offset + job.received - fill;
+    size_t aligned = fill & ~(FTP_DIRECT_ALIGN - 1);
+    if (aligned > 0 && !write_direct(job, buffer, aligned, position))
+    {
+        close_data_connection(job);
+        return false;
+    }
+    fill -= aligned;
+    position += aligned;
+    if (is_success && job.received < job.end)
+    {
+        job.carry.assign(buffer + aligned, fill);
+        return true;
+    }
+
+    /* 最后不对齐的部分关闭O_DIRECT后写入 */
+    int flags = fcntl(job.filefd, F_GETFL);
+    if (fill > 0 && (flags < 0 || fcntl(job.filefd, F_SETFL, flags & ~O_DIRECT) < 0 ||
+                     !write_direct(job, buffer + aligned, fill, position)))
+    {
+        close_data_connection(job);
+        return false;
+    }
+    return is_success;
+}
+
+/*
+ * 写入失败时把已接收的字节数改为实际写入的字节数，续传记录和回复中的大小与文件一致
+ */
+bool CFTPServer::write_direct(ftp_io_job_t& job, const char* buffer, size_t length, off_t position)
+{
+    while (length > 0)
+    {
+        ssize_t n = pwrite(job.filefd, buffer, length, position);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0)
+        {
+            job.received = position - job.offset;
+            return false;
+        }
+        buffer += n;
+        length -= n;
+        position += n;
+    }
+    return true;
+}
+
+/*
+ * 关闭文件并回复上传结果，同步失败时数据可能没有落盘，按失败回复，客户端可以重新上传
+ */
+void CFTPServer::finish_store(ftp_io_job_t& job)
+{
+    int fd = job.fd;
+    close(job.filefd);
+    job.filefd = -1;
+
+    std::stringstream result;
+    pthread_mutex_lock(&m_pthread_mutex);
+    if (job.sync_error != 0)
+    {
+        m_partial_map.erase(job.filepath);
+        result << "STOR error, sync failed: " << strerror(job.sync_error);
+    }
+    else if (job.received < job.end && job.is_ascii)
+    {
+        m_partial_map.erase(job.filepath);
+        result << "store incomplete, received " << job.received << " of " << job.end
+               << ", REST not supported in ASCII mode, store again";
+    }
+    else if (job.received < job.end)
+    {
+        m_partial_map[job.filepath] = job.offset + job.end;
+        result << "store incomplete, received " << job.offset + job.received << " of " << job.offset + job.end
+               << ", send REST " << job.offset + job.received << " to resume";
+    }
+    else
+    {
+        m_partial_map.erase(job.filepath);
+        result << "store file success " << job.offset + (job.is_ascii ? job.stored : job.received);
+    }
+    pthread_mutex_unlock(&m_pthread_mutex);
+
+    std::string response = result.str();
+    send_control(fd, response.c_str(), response.size());
+}
+
+/*
+ * 组提交线程中调用，回复之后结束任务，会话在此之前因为pending_tasks不会被回收
+ */
+void CFTPServer::on_store_commit(void* context, void* arg, int error)
+{
+    CFTPServer* ftp_server = static_cast<CFTPServer*>(context);
+    ftp_io_job_t* job = static_cast<ftp_io_job_t*>(arg);
+    int fd = job->fd;
+    job->sync_error = error;
+    ftp_server->finish_store(*job);
+    delete job;
+    ftp_server->finish_task(fd);
+}
+
+/*
+ * 解析参数、打开文件并回复客户端开始发送，失败时已经回复错误
+ */
+bool CFTPServer::start_store(ftp_io_job_t& job, bool is_append)
+{
+    int fd = job.fd;
+    off_t offset = job.restart;
+
+    std::string filename;
+    off_t filesize;
+    if (!parse_store_argument(job.argument, filename, filesize))
+    {
+        std::string response = "STOR error, please check argument";
+        send_control(fd, response.c_str(), response.size());
+        return false;
+    }
+    std::cout << filename << std::endl;
+
+    std::string filepath = job.workdir + "/" + filename;
+
+    /* TYPE A转换后的字节数和网络上的不同，不能按偏移续传 */
+    bool is_ascii = job.is_ascii;
+    if (is_ascii && offset > 0)
+    {
+        std::string response = "STOR error, REST not supported in ASCII mode";
+        send_control(fd, response.c_str(), response.size());
+        return false;
+    }
+
+    /* tls_required时在打开文件之前检查，拒绝的STOR不会截断已有的文件 */
+    if (!check_data_protection(fd))
+    {
+        return false;
+    }
+
+    /* REST续传的偏移不能超过已有文件的大小，在打开之前检查，被拒绝的STOR不会新建空文件 */
+    struct stat statinfo;
+    if (!is_append && offset > 0 && (stat(filepath.c_str(), &statinfo) < 0 || offset > statinfo.st_size))
+    {
+        std::string response = "STOR error, restart offset beyond end of file";
+        send_control(fd, response.c_str(), response.size());
+        return false;
+    }
+
+    /* 稀疏传输按偏移写入才能留下空洞，追加时不用O_APPEND，偏移为打开时的文件大小 */
+    int flags = O_WRONLY | O_CREAT;
+    if (is_append)
+    {
+        if (!job.is_sparse)
+            flags |= O_APPEND;
+    }
+    else if (offset == 0)
+    {
+        flags |= O_TRUNC;
+    }
+
+    /* 先以O_EXCL打开区分是否新建了文件，新建的文件同步时还要同步目录项 */
+    int filefd = open(filepath.c_str(), flags | O_EXCL, 0644);
+    job.is_created = filefd >= 0;
+    if (filefd < 0 && errno == EEXIST)
+    {
+        filefd = open(filepath.c_str(), flags, 0644);
+    }
+    if (filefd < 0)
+    {
+        std::string response = "STOR error, cannot open file";
+        send_control(fd, response.c_str(), response.size());
+        return false;
+    }
+    job.filefd = filefd;
+
+    /* 检查之后文件被截断或者删除时仍然拒绝，删除的文件被这里新建，拒绝时删掉 */
+    fstat(filefd, &statinfo);
+    if (is_append)
+    {
+        offset = statinfo.st_size;
+    }
+    else if (offset > statinfo.st_size)
+    {
+        if (job.is_created)
+            unlink(filepath.c_str());
+        std::string response = "STOR error, restart offset beyond end of file";
+        send_control(fd, response.c_str(), response.size());
+        return false;
+    }
+
+    std::string response = "recv command success, start store file";
+    send_control(fd, response.c_str(), response.size());
+    if (!secure_data_connection(job))
+    {
+        return false;
+    }
+
+    job.offset = offset;
+    job.end = filesize;
+    job.received = 0;
+    job.filepath = filepath;
+    job.writeback = offset;
+    job.written_back = offset;
+    job.pending_cr = false;
+    job.stored = 0;
+    job.is_sparse = job.is_sparse && !is_ascii;
+    job.record_left = 0;
+    job.bypass = cache_policy(filepath, offset + filesize);
+    enable_bypass(job, offset % FTP_DIRECT_ALIGN == 0 && !job.is_sparse && !is_ascii);
+    job.client->data_progress = monotonic_seconds();
+    return true;
+}
+
+/*
+ * SITE CPFR 源文件 / SITE CPTO 目标文件：在服务器上复制文件，数据不经过网络
+ * CPFR只记录源文件，CPTO交给I/O线程按时间片复制，复制过程中回复进度
+ */
+void CFTPServer::process_site_command(int fd)
+{
+    ftp_client_t& ftp_client = get_client(fd);
+    std::string argument = ftp_client.control_argument;
+    std::string::size_type idx = argument.find(' ');
+    std::string command = argument.substr(0, idx);
+    std::string filename = idx == std::string::npos ? "" : argument.substr(idx + 1);
+    std::transform(command.begin(), command.end(), command.begin(), ::toupper);
+
+    if (command != "CPFR" && command != "CPTO")
+    {
+        send_response(fd, "504 SITE %s not supported", command.c_str());
+        return;
+    }
+    if (filename.empty())
+    {
+        send_response(fd, "501 SITE %s requires a file name", command.c_str());
+        return;
+    }
+
+    if (command == "CPFR")
+    {
+        const std::string& filepath = make_filepath(fd, filename);
+        struct stat statinfo;
+        if (stat(filepath.c_str(), &statinfo) < 0 || !S_ISREG(statinfo.st_mode))
+        {
+            ftp_client.copy_from.clear();
+            send_response(fd, "550 %s: no such file", filename.c_str());
+            return;
+        }
+        ftp_client.copy_from = filepath;
+        send_response(fd, "350 file exists, ready for destination name");
+        return;
+    }
+
+    if (ftp_client.copy_from.empty())
+    {
+        send_response(fd, "503 send SITE CPFR first");
+        return;
+    }
+    ftp_client.control_argument = filename;
+    dispatch_io(fd, FTP_IO_COPY);
+}
+
+/*
+ * 打开源文件，在目标目录中创建临时文件，文件系统支持reflink时直接共享数据块，一次完成
+ */
+bool CFTPServer::start_copy(ftp_io_job_t& job)
+{
+    int fd = job.fd;
+    const std::string& source = job.source;
+    if (source.empty())
+    {
+        send_response(fd, "503 send SITE CPFR first");
+        return false;
+    }
+    std::string target = make_filepath(job, job.argument);
+
+    struct stat source_stat;
+    int filefd = open(source.c_str(), O_RDONLY);
+    if (filefd < 0 || fstat(filefd, &source_stat) < 0 || !S_ISREG(source_stat.st_mode))
+    {
+        if (filefd >= 0)
+            close(filefd);
+        send_response(fd, "550 cannot open source file");
+        return false;
+    }
+    job.filefd = filefd;
+    set_io_class(job, source_stat.st_size);
+
+    /* 目标是目录时复制到目录中的同名文件 */
+    struct stat target_stat;
+    if (stat(target.c_str(), &target_stat) == 0 && S_ISDIR(target_stat.st_mode))
+    {
+        target += source.substr(source.find_last_of('/'));
+    }
+    if (stat(target.c_str(), &target_stat) == 0 &&
+        target_stat.st_dev == source_stat.st_dev && target_stat.st_ino == source_stat.st_ino)
+    {
+        send_response(fd, "553 source and destination are the same file");
+        return false;
+    }
+
+    job.tmppath = target + ".XXXXXX";
+    job.outfd = mkstemp(&job.tmppath[0]);
+    if (job.outfd < 0)
+    {
+        job.tmppath.clear();
+        send_response(fd, "553 cannot create destination file");
+        return false;
+    }
+    fchmod(job.outfd, source_stat.st_mode & 0777);
+
+    job.filepath = target;
+    job.offset = 0;
+    job.end = source_stat.st_size;
+    job.reported = monotonic_seconds();
+    send_response(fd, "150 copying %lld bytes", static_cast<long long>(job.end));
+
+    if (job.end > 0 && ioctl(job.outfd, FICLONE, job.filefd) == 0)
+    {
+        job.offset = job.end;
+    }
+    return true;
+}
+
+/*
+ * 每个时间片最多复制budget字节，复制完成后临时文件rename为目标文件，目标文件不会出现不完整的内容
+ */
+bool CFTPServer::process_copy_command(ftp_io_job_t& job, size_t budget, size_t& used)
+{
+    used = 0;
+    int fd = job.fd;
+    if (!job.is_started)
+    {
+        job.is_started = true;
+        if (!start_copy(job))
+        {
+            return true;
+        }
+    }
+
+    off_t start = job.offset;
+    off_t limit = std::min<off_t>(job.end, job.offset + budget);
+    bool is_failed = false;
+    while (job.offset < limit)
+    {
+        size_t chunk = std::min<off_t>(limit - job.offset, m_sendfile_chunk);
+        ssize_t n = copy_file_chunk(job.filefd, job.outfd, job.offset, chunk);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0)
+        {
+            /* 源文件在复制过程中被截断 */
+            if (n == 0)
+                errno = EIO;
+            is_failed = true;
+            break;
+        }
+        job.offset += n;
+    }
+    used = job.offset - start;
+
+    long now = monotonic_seconds();
+    if (!is_failed && job.offset < job.end)
+    {
+        if (now - job.reported >= FTP_COPY_REPORT_INTERVAL)
+        {
+            job.reported = now;
+            send_response(fd, "150 copied %lld of %lld bytes",
+                          static_cast<long long>(job.offset), static_cast<long long>(job.end));
+        }
+        return false;
+    }
+
+    if (is_failed || rename(job.tmppath.c_str(), job.filepath.c_str()) < 0)
+    {
+        send_response(fd, "451 copy failed after %lld bytes: %s", static_cast<long long>(job.offset), strerror(errno));
+        return true;
+    }
+    job.tmppath.clear();
+    send_response(fd, "250 copy complete, %lld bytes", static_cast<long long>(job.end));
+    return true;
+}
+
+/*
+ * 在内核中复制文件的一段，同一个文件系统上copy_file_range可能直接共享数据块，
+ * 不支持时（跨文件系统或者内核太旧）退回sendfile，都不经过用户态缓冲区
+ */
+ssize_t CFTPServer::copy_file_chunk(int infd, int outfd, off_t offset, size_t length)
+{
+    off_t in_offset = offset;
+    off_t out_offset = offset;
+    ssize_t n = copy_file_range(infd, &in_offset, outfd, &out_offset, length, 0);
+    if (n >= 0 || (errno != EXDEV && errno != ENOSYS && errno != EOPNOTSUPP && errno != EINVAL))
+    {
+        return n;
+    }
+
+    if (lseek(outfd, offset, SEEK_SET) < 0)
+    {
+        return -1;
+    }
+    return sendfile(outfd, infd, &in_offset, length);
+}
+
+/*
+ * RNFR 原文件名 / RNTO 新文件名：rename是原子的，目标文件已经存在时被替换，不能跨文件系统
+ */
+void CFTPServer::process_rnfr_command(int fd)
+{
+    ftp_client_t& ftp_client = get_client(fd);
+    const std::string& filepath = make_filepath(fd, ftp_client.control_argument);
+    struct stat statinfo;
+    if (ftp_client.control_argument.empty() || lstat(filepath.c_str(), &statinfo) < 0)
+    {
+        ftp_client.rename_from.clear();
+        send_response(fd, "550 %s: no such file or directory", ftp_client.control_argument.c_str());
+        return;
+    }
+    ftp_client.rename_from = filepath;
+    send_response(fd, "350 ready for RNTO");
+}
+
+void CFTPServer::process_rnto_command(int fd)
+{
+    ftp_client_t& ftp_client = get_client(fd);
+    std::string source;
+    source.swap(ftp_client.rename_from);
+    if (source.empty())
+    {
+        send_response(fd, "503 send RNFR first");
+        return;
+    }
+    if (ftp_client.control_argument.empty())
+    {
+        send_response(fd, "501 RNTO requires a file name");
+        return;
+    }
+
+    const std::string& target = make_filepath(fd, ftp_client.control_argument);
+    if (rename(source.c_str(), target.c_str()) < 0)
+    {
+        send_response(fd, "553 rename failed: %s", strerror(errno));
+        return;
+    }
+    /* 未完成的上传记录跟随文件改名，之后仍然可以REST续传 */
+    pthread_mutex_lock(&m_pthread_mutex);
+    std::map<std::string, off_t>::iterator it = m_partial_map.find(source);
+    if (it != m_partial_map.end())
+    {
+        off_t size = it->second;
+        m_partial_map.erase(it);
+        m_partial_map[target] = size;
+    }
+    pthread_mutex_unlock(&m_pthread_mutex);
+    send_response(fd, "250 rename successful");
+}
+
+/*
+ * XUNTAR [目录]：数据连接上接收tar流，解包到指定目录（默认当前目录），所有文件只需要一条命令和一个数据连接
+ * 接收和解析按时间片进行，小文件收齐后交给I/O线程池并行写入，全部写完后回复一次汇总结果
+ */
+bool CFTPServer::process_untar_command(ftp_io_job_t& job, size_t budget, size_t& used)
+{
+    used = 0;
+    int fd = job.fd;
+    if (!job.is_started)
+    {
+        job.is_started = true;
+        if (!start_untar(job))
+        {
+            return true;
+        }
+    }
+
+    ftp_client_t& ftp_client = *job.client;
+    std::vector<char>& message = command_buffer().data;
+    message.resize(m_recv_buffer);
+    bool is_failed = false;
+    bool is_invalid = false;
+    while (used < budget && !job.extract->is_finished())
+    {
+        int n = CTLSContext::recv(job.data_ssl, job.data_fd, message.data(), message.size());
+        if (n <= 0)
+        {
+            close_data_connection(job);
+            is_failed = true;
+            break;
+        }
+        used += n;
+        ftp_client.data_progress = monotonic_seconds();
+
+        is_invalid = !job.extract->feed(message.data(), n);
+        for (size_t i = job.extract->take_queued(); i > 0; --i)
+        {
+            job.extract->acquire();
+            CTask* task = new CTask(&CFTPServer::process_untar_write, {static_cast<void*>(job.extract)});
+            m_io_pool.add_task(task, ftp_client.node);
+        }
+        if (is_invalid)
+        {
+            /* 后面的数据无法解析，关闭数据连接让客户端停止发送 */
+            close_data_connection(job);
+            is_failed = true;
+            break;
+        }
+    }
+    if (!is_failed && !job.extract->is_finished())
+    {
+        return false;
+    }
+
+    job.extract->finish();
+    ftp_client.data_progress = 0;
+    tar_extract_stats_t stats = job.extract->get_stats();
+    std::cout << "untar " << stats.files << " files " << stats.bytes << " bytes" << (is_failed ? " interrupted" : "") << std::endl;
+    if (!is_failed && stats.errors == 0)
+    {
+        send_response(fd, "store archive success, %ld files %ld directories %ld links %lld bytes, %ld skipped",
+                      stats.files, stats.directories, stats.links, static_cast<long long>(stats.bytes), stats.skipped);
+    }
+    else
+    {
+        send_response(fd, "store archive %s, %ld files %ld directories %ld links %lld bytes, %ld errors%s%s",
+                      is_invalid ? "invalid" : (is_failed ? "incomplete" : "finished with errors"),
+                      stats.files, stats.directories, stats.links, static_cast<long long>(stats.bytes), stats.errors,
+                      stats.errors > 0 ? ", first error " : "", stats.error.c_str());
+    }
+    return true;
+}
+
+bool CFTPServer::start_untar(ftp_io_job_t& job)
+{
+    int fd = job.fd;
+    std::string root = job.argument.empty() ? job.workdir : make_filepath(job, job.argument);
+    job.extract = new CTarExtract;
+    if (!job.extract->open_extract(root))
+    {
+        send_response(fd, "XUNTAR error, no such directory");
+        return false;
+    }
+    if (!check_data_protection(fd))
+    {
+        return false;
+    }
+    send_response(fd, "recv command success, start store archive");
+    if (!secure_data_connection(job))
+    {
+        return false;
+    }
+    job.filepath = root;
+    job.client->data_progress = monotonic_seconds();
+    return true;
+}
+
+/*
+ * I/O线程池中写入一个解包出来的小文件，任务和文件不一一对应，取到的是写队列中最前面的文件
+ */
+void CFTPServer::process_untar_write(void** args)
+{
+    CTarExtract* extract = static_cast<CTarExtract*>(args[0]);
+    extract->write_next();
+    extract->release();
+}
+
+/*
+ * 解析STOR/APPE/XDEDUP的参数 文件名<字节数>，文件名去掉路径部分
+ */
+bool CFTPServer::parse_store_argument(const std::string& argument, std::string& filename, off_t& size)
+{
+    std::string::size_type front_idx = argument.find_first_of("<", 0);
+    std::string::size_type back_idx = argument.find_first_of(">", 0);
+    if (front_idx == std::string::npos || back_idx == std::string::npos || back_idx < front_idx)
+    {
+        return false;
+    }
+    std::string::size_type tmp = argument.find_last_of('/', front_idx);
+    tmp = (tmp == std::string::npos) ? 0 : tmp + 1;
+    filename = argument.substr(tmp, front_idx - tmp);
+    size = strtoll(argument.c_str() + front_idx + 1, NULL, 10);
+    return true;
+}
+
+/*
+ * 从数据连接接收length字节，每次接收后记录进度
+ */
+bool CFTPServer::recv_data(ftp_io_job_t& job, char* buffer, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t n = CTLSContext::recv(job.data_ssl, job.data_fd, buffer, length);
+        if (n <= 0)
+        {
+            return false;
+        }
+        buffer += n;
+        length -= n;
+        job.client->data_progress = monotonic_seconds();
+    }
+    return true;
+}
+
+bool CFTPServer::send_data(ftp_io_job_t& job, const char* buffer, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t n = CTLSContext::send(job.data_ssl, job.data_fd, buffer, length);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0)
+        {
+            return false;
+        }
+        buffer += n;
+        length -= n;
+        job.client->data_progress = monotonic_seconds();
+    }
+    return true;
+}
+
+/*
+ * 去重上传，参数格式为 文件名<清单字节数>
+ * 1. 客户端在数据连接上发送分块清单，每行为 分块SHA-256 分块长度
+ * 2. 服务器回复 missing 缺失分块数 列表字节数，并在数据连接上发送分块库中没有的分块序号，空格分隔
+ * 3. 客户端按序号顺序只发送缺失的分块，服务器校验后存入分块库
+ * 4. 服务器按清单拼接出文件，之后RETR/SIZE/HASH和普通上传的文件没有区别
+ * 每个阶段都按时间片进行，拼接时先写到同目录的临时文件，完成后rename覆盖目标文件
+ */
+bool CFTPServer::process_xdedup_command(ftp_io_job_t& job, size_t budget, size_t& used)
+{
+    used = 0;
+    if (!job.is_started)
+    {
+        job.is_started = true;
+        if (!start_xdedup(job))
+        {
+            return true;
+        }
+    }
+
+    int fd = job.fd;
+    ftp_dedup_t& dedup = *job.dedup;
+    if (dedup.phase == FTP_DEDUP_MANIFEST && !recv_manifest(job, budget, used))
+    {
+        return true;
+    }
+    if (dedup.phase == FTP_DEDUP_CHUNKS && !recv_chunks(job, budget, used))
+    {
+        return true;
+    }
+    if (dedup.phase != FTP_DEDUP_ASSEMBLE)
+    {
+        return false;
+    }
+
+    while (used < budget && dedup.next < dedup.chunks.size())
+    {
+        off_t position = job.offset;
+        if (!m_chunk_store.append_chunk(dedup.chunks[dedup.next], job.outfd, job.offset))
+        {
+            send_response(fd, "XDEDUP error, cannot create file");
+            return true;
+        }
+        used += job.offset - position;
+        ++dedup.next;
+    }
+    if (dedup.next < dedup.chunks.size())
+    {
+        return false;
+    }
+    if (fchmod(job.outfd, 0644) < 0 || rename(job.tmppath.c_str(), job.filepath.c_str()) < 0)
+    {
+        send_response(fd, "XDEDUP error, cannot create file");
+        return true;
+    }
+    job.tmppath.clear();
+
+    pthread_mutex_lock(&m_pthread_mutex);
+    m_partial_map.erase(job.filepath);
+    pthread_mutex_unlock(&m_pthread_mutex);
+
+    send_response(fd, "store file success %lld, uploaded %zu of %zu chunks",
+                  static_cast<long long>(job.offset), dedup.missing.size(), dedup.chunks.size());
+    return true;
+}
+
+bool CFTPServer::start_xdedup(ftp_io_job_t& job)
+{
+    int fd = job.fd;
+    if (!m_chunk_store.is_enabled())
+    {
+        send_response(fd, "502 XDEDUP not enabled, configure chunk_store");
+        return false;
+    }
+
+    std::string filename;
+    off_t manifest_size;
+    if (!parse_store_argument(job.argument, filename, manifest_size) || filename.empty() ||
+        manifest_size < 0 || manifest_size > static_cast<off_t>(CHUNK_MANIFEST_MAX))
+    {
+        send_response(fd, "XDEDUP error, please check argument");
+        return false;
+    }
+    if (!check_data_protection(fd))
+    {
+        return false;
+    }
+    send_response(fd, "recv command success, start store manifest");
+    if (!secure_data_connection(job))
+    {
+        return false;
+    }
+
+    job.filepath = make_filepath(job, filename);
+    job.dedup = new ftp_dedup_t;
+    job.dedup->manifest.resize(manifest_size);
+    job.client->data_progress = monotonic_seconds();
+    return true;
+}
+
+/*
+ * 每个时间片接收清单的budget字节，收齐后回复缺失的分块并进入CHUNKS阶段，失败时已经回复错误并返回false
+ */
+bool CFTPServer::recv_manifest(ftp_io_job_t& job, size_t budget, size_t& used)
+{
+    int fd = job.fd;
+    ftp_client_t& ftp_client = *job.client;
+    ftp_dedup_t& dedup = *job.dedup;
+    size_t length = std::min(dedup.manifest.size() - dedup.received, budget);
+    if (!recv_data(job, dedup.manifest.data() + dedup.received, length))
+    {
+        ftp_client.data_progress = 0;
+        close_data_connection(job);
+        send_response(fd, "XDEDUP error, manifest incomplete");
+        return false;
+    }
+    dedup.received += length;
+    used += length;
+    if (dedup.received < dedup.manifest.size())
+    {
+        return true;
+    }
+
+    if (!CChunkStore::parse_manifest(dedup.manifest.data(), dedup.manifest.size(), dedup.chunks))
+    {
+        ftp_client.data_progress = 0;
+        close_data_connection(job);
+        send_response(fd, "XDEDUP error, invalid manifest");
+        return false;
+    }
+    std::vector<char>().swap(dedup.manifest);
+    dedup.received = 0;
+
+    /* 同一个文件中重复的分块只请求一次 */
+    std::set<std::string> requested;
+    std::stringstream list;
+    for (size_t i = 0; i < dedup.chunks.size(); ++i)
+    {
+        if (!m_chunk_store.has_chunk(dedup.chunks[i].digest) && requested.insert(dedup.chunks[i].digest).second)
+        {
+            list << (dedup.missing.empty() ? "" : " ") << i;
+            dedup.missing.push_back(i);
+        }
+    }
+    std::string missing_list = list.str();
+    send_response(fd, "missing %zu %zu", dedup.missing.size(), missing_list.size());
+    if (!send_data(job, missing_list.data(), missing_list.size()))
+    {
+        ftp_client.data_progress = 0;
+        close_data_connection(job);
+        return false;
+    }
+    used += missing_list.size();
+    dedup.phase = FTP_DEDUP_CHUNKS;
+    dedup.next = 0;
+    return true;
+}
+
+/*
+ * 每个时间片接收完整的缺失分块，直到用完budget，全部收齐后创建临时文件并进入ASSEMBLE阶段
+ * 分块不拆开接收，一个时间片最多超出budget不到一个分块；失败时已经回复错误并返回false
+ */
+bool CFTPServer::recv_chunks(ftp_io_job_t& job, size_t budget, size_t& used)
+{
+    int fd = job.fd;
+    ftp_client_t& ftp_client = *job.client;
+    ftp_dedup_t& dedup = *job.dedup;
+    std::vector<char>& buffer = command_buffer().data;
+    buffer.resize(std::max<size_t>(m_recv_buffer, CHUNK_MAX_SIZE));
+    while (used < budget && dedup.next < dedup.missing.size())
+    {
+        const chunk_info_t& chunk = dedup.chunks[dedup.missing[dedup.next]];
+        if (!recv_data(job, buffer.data(), chunk.length))
+        {
+            ftp_client.data_progress = 0;
+            close_data_connection(job);
+            send_response(fd, "XDEDUP error, received %zu of %zu chunks", dedup.next, dedup.missing.size());
+            return false;
+        }
+        if (!m_chunk_store.put_chunk(chunk.digest, buffer.data(), chunk.length))
+        {
+            /* 剩余的分块还在数据连接中，关闭数据连接丢弃 */
+            ftp_client.data_progress = 0;
+            close_data_connection(job);
+            send_response(fd, "XDEDUP error, chunk %zu digest mismatch or store failed", dedup.missing[dedup.next]);
+            return false;
+        }
+        used += chunk.length;
+        ++dedup.next;
+    }
+    if (dedup.next < dedup.missing.size())
+    {
+        return true;
+    }
+    ftp_client.data_progress = 0;
+
+    job.tmppath = job.filepath + ".XXXXXX";
+    job.outfd = mkstemp(&job.tmppath[0]);
+    if (job.outfd < 0)
+    {
+        job.tmppath.clear();
+        send_response(fd, "XDEDUP error, cannot create file");
+        return false;
+    }
+    dedup.phase = FTP_DEDUP_ASSEMBLE;
+    dedup.next = 0;
+    job.offset = 0;
+    return true;
+}
+
+/*
+ * 增量下载，参数格式为 文件名<签名字节数> 块大小
+ * 客户端在数据连接上发送本地旧文件的块签名，服务器按RETR的方式打开文件，只发送块引用和不匹配的数据
+ * 结束后在控制连接上回复文件大小、数据量和SHA-256，客户端据此校验重建的文件
+ * 签名的接收和编码都按时间片进行，SHA-256在编码读文件时一起计算
+ */
+bool CFTPServer::process_xdelta_command(ftp_io_job_t& job, size_t budget, size_t& used)
+{
+    used = 0;
+    if (!job.is_started)
+    {
+        job.is_started = true;
+        if (!start_xdelta(job))
+        {
+            return true;
+        }
+    }
+
+    int fd = job.fd;
+    ftp_client_t& ftp_client = *job.client;
+    ftp_delta_t& delta = *job.delta;
+    if (delta.encoder == NULL)
+    {
+        size_t length = std::min(delta.signatures.size() - delta.received, budget);
+        std::vector<delta_signature_t> signatures;
+        if (!recv_data(job, delta.signatures.data() + delta.received, length) ||
+            (delta.received + length == delta.signatures.size() &&
+             !CDelta::parse_signatures(delta.signatures.data(), delta.signatures.size(), signatures)))
+        {
+            ftp_client.data_progress = 0;
+            close_data_connection(job);
+            send_response(fd, "XDELTA error, signatures incomplete");
+            return true;
+        }
+        delta.received += length;
+        used += length;
+        if (delta.received < delta.signatures.size())
+        {
+            return false;
+        }
+        std::vector<char>().swap(delta.signatures);
+        delta.args[0] = this;
+        delta.args[1] = &job;
+        delta.encoder = new CDeltaEncoder(job.filefd, job.end, delta.block, signatures, on_delta_write, delta.args);
+        if (used >= budget)
+        {
+            return false;
+        }
+    }
+
+    struct timespec cpu_start, cpu_end;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_start);
+    size_t encoded = 0;
+    bool ret = delta.encoder->encode(budget - used, encoded);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+    delta.cpu_ns += (cpu_end.tv_sec - cpu_start.tv_sec) * 1000000000L + (cpu_end.tv_nsec - cpu_start.tv_nsec);
+    used += encoded;
+    if (ret && !delta.encoder->is_finished())
+    {
+        return false;
+    }
+
+    ftp_client.data_progress = 0;
+    if (!ret)
+    {
+        close_data_connection(job);
+        send_response(fd, "XDELTA error, transfer interrupted");
+        return true;
+    }
+
+    const delta_stat_t& stat = delta.encoder->get_stat();
+    std::cout << "delta " << job.filepath << ": literal " << stat.literal_bytes << ", matched " << stat.matched_bytes
+              << ", cpu " << delta.cpu_ns / 1000000 << " ms" << std::endl;
+
+    std::string digest = delta.encoder->sha256();
+    send_response(fd, "delta success %lld literal %lld matched %lld sha256 %s",
+                  static_cast<long long>(job.end), static_cast<long long>(stat.literal_bytes),
+                  static_cast<long long>(stat.matched_bytes), digest.empty() ? "-1" : digest.c_str());
+    return true;
+}
+
+bool CFTPServer::start_xdelta(ftp_io_job_t& job)
+{
+    int fd = job.fd;
+    std::string filename;
+    off_t signature_size;
+    std::string::size_type back_idx = job.argument.find('>');
+    size_t block = back_idx == std::string::npos ? 0 : strtoul(job.argument.c_str() + back_idx + 1, NULL, 10);
+    if (!parse_store_argument(job.argument, filename, signature_size) || filename.empty() ||
+        block < DELTA_MIN_BLOCK || block > DELTA_MAX_BLOCK || signature_size < 0 ||
+        signature_size % DELTA_SIGNATURE_SIZE != 0 || signature_size / DELTA_SIGNATURE_SIZE > static_cast<off_t>(DELTA_MAX_BLOCKS))
+    {
+        send_response(fd, "XDELTA error, please check argument");
+        return false;
+    }
+
+    job.filepath = make_filepath(job, filename);
+    job.filefd = open(job.filepath.c_str(), O_RDONLY);
+    struct stat statinfo;
+    if (job.filefd < 0 || fstat(job.filefd, &statinfo) < 0 || !S_ISREG(statinfo.st_mode))
+    {
+        send_response(fd, "XDELTA error, cannot open file");
+        return false;
+    }
+    if (!check_data_protection(fd))
+    {
+        return false;
+    }
+    send_response(fd, "recv command success, start delta");
+    if (!secure_data_connection(job))
+    {
+        return false;
+    }
+
+    job.end = statinfo.st_size;
+    job.delta = new ftp_delta_t;
+    job.delta->block = block;
+    job.delta->signatures.resize(signature_size);
+    job.client->data_progress = monotonic_seconds();
+    return true;
+}
+
+bool CFTPServer::on_delta_write(void* arg, const char* buffer, size_t length)
+{
+    void** args = static_cast<void**>(arg);
+    CFTPServer* ftp_server = static_cast<CFTPServer*>(args[0]);
+    ftp_io_job_t* job = static_cast<ftp_io_job_t*>(args[1]);
+    return ftp_server->send_data(*job, buffer, length);
+}
+
+/*
+ * 打开文件开始计算哈希，结果在m_hash_cache中时直接得到，失败时回复-1
+ */
+bool CFTPServer::start_hash(ftp_io_job_t& job, const std::string& filepath, HASH_ALGORITHM algorithm, off_t start, off_t end)
+{
+    job.hash = new hash_job_t(algorithm);
+    if (!m_hash_cache.open_job(filepath, start, end, *job.hash))
+    {
+        send_response(job.fd, "-1");
+        return false;
+    }
+    return true;
+}
+
+/*
+ * 计算哈希的一个时间片，还没有算完时返回false；读文件失败时回复-1并返回true
+ */
+bool CFTPServer::update_hash(ftp_io_job_t& job, size_t budget, size_t& used)
+{
+    used = 0;
+    if (job.hash->is_done)
+    {
+        return true;
+    }
+    if (!m_hash_cache.update_job(*job.hash, budget, command_buffer().data, used))
+    {
+        send_response(job.fd, "-1");
+        return true;
+    }
+    return job.hash->is_done;
+}
+
+/*
+ * 计算文件指定区间的CRC32，参数格式为 文件名 [起始偏移 [结束偏移]]
+ * 续传前客户端用它校验两端已有的部分是否一致，只需要传输缺失的尾部
+ * 文件仍在m_partial_map中（上传未完成）时在结果后附加 partial
+ */
+bool CFTPServer::process_xcrc_command(ftp_io_job_t& job, size_t budget, size_t& used)
+{
+    int fd = job.fd;
+    used = 0;
+    if (!job.is_started)
+    {
+        job.is_started = true;
+        std::stringstream oss(job.argument);
+        std::string filename;
+        off_t start = 0;
+        off_t end = -1;
+        oss >> filename >> start >> end;
+
+        job.filepath = make_filepath(job, filename);
+        if (!start_hash(job, job.filepath, HASH_CRC32, start, end))
+        {
+            return true;
+        }
+    }
+    if (!update_hash(job, budget, used))
+    {
+        return false;
+    }
+    if (!job.hash->is_done)
+    {
+        return true;
+    }
+
+    std::string response = job.hash->digest;
+    pthread_mutex_lock(&m_pthread_mutex);
+    if (m_partial_map.count(job.filepath))
+    {
+        response += " partial";
+    }
+    pthread_mutex_unlock(&m_pthread_mutex);
+
+    send_control(fd, response.c_str(), response.size());
+    return true;
+}
+
+/*
+ * 计算文件哈希，参数格式为 算法 文件名 [起始偏移 [结束偏移]]
+ * 算法支持CRC32、CRC32C、XXH64、SHA-256，结果缓存在m_hash_cache中，文件未修改时重复查询不再读盘
+ * 返回 算法 起始-结束 哈希值
+ */
+bool CFTPServer::process_hash_command(ftp_io_job_t& job, size_t budget, size_t& used)
+{
+    int fd = job.fd;
+    used = 0;
+    if (!job.is_started)
+    {
+        job.is_started = true;
+        std::stringstream oss(job.argument);
+        std::string algorithm_name;
+        std::string filename;
+        off_t start = 0;
+        off_t end = -1;
+        oss >> algorithm_name >> filename >> start >> end;
+
+        HASH_ALGORITHM algorithm;
+        if (!CChecksum::parse_algorithm(algorithm_name, algorithm))
+        {
+            std::string response = "-1";
+            send_control(fd, response.c_str(), response.size());
+            return true;
+        }
+        if (!start_hash(job, make_filepath(job, filename), algorithm, start, end))
+        {
+            return true;
+        }
+    }
+    if (!update_hash(job, budget, used))
+    {
+        return false;
+    }
+    if (!job.hash->is_done)
+    {
+        return true;
+    }
+
+    std::stringstream result;
+    result << CChecksum::algorithm_name(job.hash->key.algorithm) << " " << job.hash->key.start << "-"
+           << job.hash->key.end << " " << job.hash->digest;
+    std::string response = result.str();
+    send_control(fd, response.c_str(), response.size());
+    return true;
+}
+
+/*
+ * 整个文件的SHA-256，只返回哈希值
+ */
+bool CFTPServer::process_xsha256_command(ftp_io_job_t& job, size_t budget, size_t& used)
+{
+    used = 0;
+    if (!job.is_started)
+    {
+        job.is_started = true;
+        if (!start_hash(job, make_filepath(job, job.argument), HASH_SHA256, 0, -1))
+        {
+            return true;
+        }
+    }
+    if (!update_hash(job, budget, used))
+    {
+        return false;
+    }
+    if (job.hash->is_done)
+    {
+        send_control(job.fd, job.hash->digest.c_str(), job.hash->digest.size());
+    }
+    return true;
+}
+
+void CFTPServer::process_quit_command(int fd)
+{
+    send_response(fd, "Quit success!");
+    mark_session_closed(fd);
 }
\ No newline at end of file
@@ -3,14 +3,34 @@
 #include "epoll.h"
 #include "socket.h"
 #include "ftp_client_t.h"
+#include "checksum.h"
+#include "hash_cache.h"
+#include "timer_wheel.h"
+#include "handoff.h"
+#include "config.h"
+#include "tls.h"
+#include "chunk_store.h"
+#include "delta.h"
+#include "transfer_scheduler.h"
+#include "tar_stream.h"
+#include "tar_extract.h"
+#include "group_commit.h"
+#include "sparse.h"
+#include "ascii.h"
 
 #include "../threadpool/threadpool.h"
 #include "../threadpool/task.h"
+#include "../threadpool/object_pool.h"
 
 #include <unistd.h>
 #include <sys/time.h>
 #include <sys/sendfile.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 #include <fcntl.h>
 #include <dirent.h>
 #include <pthread.h>
@@ -18,6 +38,7 @@
 #include <string.h>
 #include <cstdlib>
 #include <cerrno>
+#include <cstdarg>
 
 #include <pthread.h>
 
@@ -25,21 +46,258 @@
 #include <sstream>
 #include <fstream>
 #include <queue>
+#include <deque>
 #include <map>
+#include <set>
 #include <vector>
+#include <algorithm>
+#include <atomic>
 
-const int PORT = 9999;
-const int DATA_PORT = 8888;
-const std::string IP = "192.168.221.128";
-const int MAX_LISTEN_NUMBER = 10;
-const int FTP_PTHREAD_NUMBER = 6;
+/* 旧的内核头文件中没有FICLONE */
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
 
 const std::string WELCOME_CLIENT = "Welcome to use FTP server!";
 
+/* 会话有命令在执行或者有未应答的PASV时，定时器检查的间隔，单位秒 */
+const long FTP_SESSION_CHECK = 10;
+/* 控制连接TLS握手的超时时间，单位秒 */
+const long FTP_TLS_HANDSHAKE_TIMEOUT = 30;
+/*
+ * 监听套接字的事件，边缘触发，每次事件accept到EAGAIN
+ * EPOLLEXCLUSIVE：热重启期间新旧进程的epoll中都有同一个监听套接字，新连接只唤醒其中一个
+ */
+const unsigned int FTP_LISTEN_EVENTS = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE;
+
+/* recv_client_command()没有接收到命令，也不是连接关闭 */
+const int FTP_RECV_NONE = -2;
+
+/* 热重启时交接空闲会话的结果：已经交给新进程，新进程还没有开始监听、稍后重试，不能交接、按普通退出关闭 */
+enum FTP_HANDOFF_RESULT
+{
+    FTP_HANDOFF_DONE,
+    FTP_HANDOFF_RETRY,
+    FTP_HANDOFF_FAILED
+};
+
+/* 读写文件内容的命令，由工作线程解析后交给磁盘I/O线程池执行 */
+enum FTP_IO_TASK
+{
+    FTP_IO_RETR,
+    FTP_IO_STOR,
+    FTP_IO_APPE,
+    FTP_IO_LIST,
+    FTP_IO_XCRC,
+    FTP_IO_HASH,
+    FTP_IO_XSHA256,
+    FTP_IO_XDEDUP,
+    FTP_IO_XDELTA,
+    FTP_IO_COPY,
+    FTP_IO_UNTAR,
+    FTP_IO_SIZE
+};
+
+/* XDEDUP的阶段：接收清单，接收分块库中缺失的分块，按清单拼接文件 */
+enum FTP_DEDUP_PHASE
+{
+    FTP_DEDUP_MANIFEST,
+    FTP_DEDUP_CHUNKS,
+    FTP_DEDUP_ASSEMBLE
+};
+
+struct ftp_dedup_t
+{
+    FTP_DEDUP_PHASE phase;
+    std::vector<char> manifest;
+    size_t received;
+    std::vector<chunk_info_t> chunks;
+    /* missing为缺失分块在chunks中的序号；next在CHUNKS阶段为missing中下一个要接收的，在ASSEMBLE阶段为chunks中下一个要拼接的 */
+    std::vector<size_t> missing;
+    size_t next;
+
+    ftp_dedup_t() : phase(FTP_DEDUP_MANIFEST), received(0), next(0)
+    {
+    }
+};
+
+/* XDELTA先按时间片接收签名，收齐后创建encoder；args为on_delta_write()的参数，cpu_ns为编码累计的CPU时间 */
+struct ftp_delta_t
+{
+    size_t block;
+    std::vector<char> signatures;
+    size_t received;
+    CDeltaEncoder* encoder;
+    void* args[2];
+    long cpu_ns;
+
+    ftp_delta_t() : block(0), received(0), encoder(NULL), cpu_ns(0)
+    {
+    }
+
+    ~ftp_delta_t()
+    {
+        delete encoder;
+    }
+};
+
+/*
+ * 交给调度器的I/O任务，每次调度只执行一个时间片，最多处理budget字节，状态保存在这里
+ */
+struct ftp_io_job_t : public sched_job_t
+{
+    int fd;
+    FTP_IO_TASK task;
+    /*
+     * 分发时从会话中取得的命令参数、工作目录、REST偏移和CPFR的源文件，排队期间到达的命令修改会话不影响这个任务
+     * client在任务结束之前不会被删除，只用来记录传输进度
+     */
+    ftp_client_t* client;
+    std::string argument;
+    std::string workdir;
+    off_t restart;
+    std::string source;
+    int user_weight;
+    /*
+     * 使用数据连接的任务，分发时取得会话的数据连接，会话的is_transferring在任务结束之前阻止PASV/PORT/PROT更换它，新的传输命令等任务结束后再执行
+     * 数据连接在任务开始前才建立时data_fd为-1，开始时再从会话中取得；握手和关闭时同时更新会话
+     */
+    bool is_transfer;
+    int data_fd;
+    SSL* data_ssl;
+    bool is_started;
+    int filefd;
+    /* RETR为下一次发送的位置；STOR/APPE为写入的起始位置；TYPE A的SIZE为下一次统计的位置 */
+    off_t offset;
+    /* RETR和SIZE为文件大小；STOR/APPE为本次上传的字节数 */
+    off_t end;
+    /* STOR/APPE已经接收的字节数 */
+    off_t received;
+    /* store_writebehind：已经发起写回的位置和已经等到写回完成的位置 */
+    off_t writeback;
+    off_t written_back;
+    /* 交给组提交线程，同步完成后由它回复并结束任务；is_created为STOR新建了文件，同步时还要同步所在目录 */
+    bool is_deferred;
+    bool is_created;
+    int sync_error;
+    /* 绕过页缓存的方式；dontneed时RETR已经丢弃缓存的位置；direct时STOR不足一个对齐块、留到下一个时间片写入的数据 */
+    FTP_CACHE_BYPASS bypass;
+    off_t dropped;
+    std::string carry;
+    /* MODE H时按稀疏格式传输，record_left为当前数据段还没有传输的字节数 */
+    bool is_sparse;
+    off_t record_left;
+    /*
+     * TYPE A时转换行尾，STOR的received为网络上的字节数，stored为转换后写入文件的字节数，pending_cr为上一块末尾的CR
+     * SIZE的stored为已经统计部分按TYPE A发送的字节数
+     */
+    bool is_ascii;
+    bool pending_cr;
+    off_t stored;
+    bool is_cork;
+    std::string filepath;
+    /* RETR的参数是目录时打包成tar流发送 */
+    CTarStream* archive;
+    /* XUNTAR接收的tar流，写队列中的文件可能在任务结束后才写完，用release()释放 */
+    CTarExtract* extract;
+    /* SITE CPTO写入的临时文件，复制完成后rename为filepath，任务中途结束时删除 */
+    int outfd;
+    std::string tmppath;
+    long reported;
+    /* XCRC/HASH/XSHA256按时间片计算的哈希 */
+    hash_job_t* hash;
+    /* LIST按时间片读取的目录，已经读到的文件名保存在listing中，读完后一次回复 */
+    DIR* dir;
+    std::string listing;
+    ftp_dedup_t* dedup;
+    ftp_delta_t* delta;
+
+    ftp_io_job_t(int client_fd, FTP_IO_TASK io_task) : fd(client_fd), task(io_task), client(NULL), restart(0), user_weight(1),
+                                                       is_transfer(io_task == FTP_IO_RETR || io_task == FTP_IO_STOR ||
+                                                                   io_task == FTP_IO_APPE || io_task == FTP_IO_XDEDUP ||
+                                                                   io_task == FTP_IO_XDELTA || io_task == FTP_IO_UNTAR),
+                                                       data_fd(-1), data_ssl(NULL), is_started(false), filefd(-1),
+                                                       offset(0), end(0), received(0), writeback(0), written_back(0),
+                                                       is_deferred(false), is_created(false),
+                                                       sync_error(0), bypass(FTP_BYPASS_OFF), dropped(0),
+                                                       is_sparse(false), record_left(0), is_ascii(false),
+                                                       pending_cr(false), stored(0), is_cork(false),
+                                                       archive(NULL), extract(NULL), outfd(-1), reported(0),
+                                                       hash(NULL), dir(NULL), dedup(NULL), delta(NULL)
+    {
+        flow = client_fd;
+        weight = 1;
+        is_interactive = false;
+    }
+
+    ~ftp_io_job_t()
+    {
+        if (filefd >= 0)
+            close(filefd);
+        delete archive;
+        if (extract != NULL)
+            extract->release();
+        if (outfd >= 0)
+            close(outfd);
+        if (!tmppath.empty())
+            unlink(tmppath.c_str());
+        delete hash;
+        if (dir != NULL)
+            closedir(dir);
+        delete dedup;
+        delete delta;
+    }
+};
+
+/* O_DIRECT读写的偏移、长度和缓冲区地址的对齐要求，以及每个线程的对齐缓冲区大小 */
+const size_t FTP_DIRECT_ALIGN = 4096;
+const size_t FTP_DIRECT_BUFFER = 1024 * 1024;
+/* cache_bypass为dontneed并且没有配置store_writebehind时，STOR按这个间隔写回并丢弃页缓存 */
+const off_t FTP_BYPASS_WRITEBEHIND = 8 * 1024 * 1024;
+/* dontneed按这个粒度丢弃页缓存，页缓存使用的大页folio最大2M，只有整个落在范围内的folio才会被丢弃 */
+const off_t FTP_BYPASS_DROP_ALIGN = 2 * 1024 * 1024;
+/* dontneed时RETR只丢弃发送位置之前这么多字节以外的页，还在套接字缓冲区中的页被引用，丢弃不掉 */
+const off_t FTP_BYPASS_SENDLAG = 16 * 1024 * 1024;
+
+/* SITE CPTO复制过程中两次进度回复的最小间隔，单位秒 */
+const long FTP_COPY_REPORT_INTERVAL = 1;
+
+const int FTP_COMMAND_BUFFER = 1024;
+const int FTP_RESPONSE_BUFFER = 4096;
+
+/*
+ * 每个工作线程复用的命令缓冲区，字符串只在第一次增长时分配，之后assign复用容量
+ */
+struct ftp_command_buffer_t
+{
+    char message[FTP_COMMAND_BUFFER];
+    char response[FTP_RESPONSE_BUFFER];
+    std::string command;
+    std::string filepath;
+    /* STOR接收缓冲区，大小由recv_buffer配置 */
+    std::vector<char> data;
+    /* TYPE A转换行尾的输出缓冲区，大小为data的两倍 */
+    std::vector<char> ascii;
+    /* O_DIRECT读写使用的FTP_DIRECT_BUFFER字节对齐缓冲区，第一次使用时分配 */
+    char* direct;
+
+    ftp_command_buffer_t() : direct(NULL)
+    {
+    }
+
+    ~ftp_command_buffer_t()
+    {
+        free(direct);
+    }
+};
+
+/* 会话表的节点从内存池分配 */
+typedef std::map<int, ftp_client_t, std::less<int>, CPoolAllocator<std::pair<const int, ftp_client_t> > > client_map_t;
+
 class CFTPServer
 {
 public:
-    CFTPServer();
+    CFTPServer(const CConfig& config);
     ~CFTPServer();
 
     void run();
@@ -48,36 +306,151 @@ private:
     bool create_control_listen_socket();
     bool create_data_listen_socket();
     bool create_epoll();
+    bool create_timer();
+    bool create_signal();
+    bool create_tls();
+    bool create_chunk_store();
+    bool inherit_listen_sockets();
 
     bool close_epoll();
 
     void init_current_workdir();
 
     std::string parse_ip_address(struct sockaddr_in& addr);
-    std::string recv_client_command(int fd);
+    int recv_client_command(int fd, char* message, size_t length);
 
-    static void handle(int);
+    void send_response(int fd, const char* format, ...) __attribute__((format(printf, 3, 4)));
+    ssize_t send_control(int fd, const char* buffer, size_t length);
+    void close_data_connection(ftp_client_t& ftp_client);
+    void close_data_connection(ftp_io_job_t& job);
+    bool replace_data_connection(ftp_client_t& ftp_client, int data_fd);
+    bool check_data_idle(int fd);
+    bool check_data_protection(int fd);
+    bool secure_data_connection(ftp_io_job_t& job);
+    ssize_t send_file_chunk(ftp_io_job_t& job, int filefd, off_t* offset, size_t chunk);
+    ssize_t send_direct_chunk(ftp_io_job_t& job, int filefd, off_t* offset, size_t chunk);
+    ssize_t send_ascii_chunk(ftp_io_job_t& job, int filefd, off_t* offset, size_t chunk);
+    FTP_CACHE_BYPASS cache_policy(const std::string& filepath, off_t size);
+    void enable_bypass(ftp_io_job_t& job, bool is_aligned);
+    void drop_cache(ftp_io_job_t& job, off_t end);
+    static char* direct_buffer();
+    bool recv_data(ftp_io_job_t& job, char* buffer, size_t length);
+    bool send_data(ftp_io_job_t& job, const char* buffer, size_t length);
+    static bool parse_store_argument(const std::string& argument, std::string& filename, off_t& size);
+    static bool on_delta_write(void* arg, const char* buffer, size_t length);
+    const std::string& make_filepath(int fd, const std::string& filename);
+    const std::string& make_filepath(const ftp_io_job_t& job, const std::string& filename);
+    static ftp_command_buffer_t& command_buffer();
+
+    ftp_client_t& get_client(int fd);
+    int accept_client(int listen_fd, struct sockaddr_in& clientaddr);
+    void accept_control_connection();
+    void accept_data_connection();
+    void add_control_connection(int clientfd, struct sockaddr_in& clientaddr);
+    ftp_client_t& init_session(int clientfd, const std::string& ip_address);
+    void add_data_connection(int clientfd, struct sockaddr_in& clientaddr);
+    void dispatch_command(int fd);
+    void finish_task(int fd);
+    void mark_session_closed(int fd);
+    void close_session(int fd);
+    void erase_session(client_map_t::iterator it);
+    void remove_pasv(const std::string& ip_address, int fd);
+
+    void process_timer();
+    void check_session(int fd);
+    static void on_session_timer(timer_node_t* node, void* arg);
+    static long monotonic_seconds();
+
+    void process_signal();
+    void reload_config();
+    void apply_affinity();
+    void stop_pools();
+    static int incoming_node(int fd);
+    void process_handoff();
+    FTP_HANDOFF_RESULT handoff_session(int fd);
+    bool adopt_session(handoff_request_t& request);
+    void start_drain();
+    bool drain_sessions();
 
 private:
     void process_quit_command(int fd);
     void process_pasv_command(int fd);
-    void process_list_command(int fd);
+    bool process_list_command(ftp_io_job_t& job, size_t budget, size_t& used);
     void process_pwd_command(int fd);
     void process_user_command(int fd);
     void process_pass_command(int fd);
     void process_size_command(int fd);
+    bool process_ascii_size(ftp_io_job_t& job, size_t budget, size_t& used);
     void process_cwd_command(int fd);
     void process_port_command(int fd);
-    void process_stor_command(int fd);
+    bool process_stor_command(ftp_io_job_t& job, size_t budget, size_t& used);
     void process_rest_command(int fd);
+    bool process_appe_command(ftp_io_job_t& job, size_t budget, size_t& used);
+    bool process_xcrc_command(ftp_io_job_t& job, size_t budget, size_t& used);
+    bool process_hash_command(ftp_io_job_t& job, size_t budget, size_t& used);
+    bool process_xsha256_command(ftp_io_job_t& job, size_t budget, size_t& used);
+    bool start_hash(ftp_io_job_t& job, const std::string& filepath, HASH_ALGORITHM algorithm, off_t start, off_t end);
+    bool update_hash(ftp_io_job_t& job, size_t budget, size_t& used);
+    void process_auth_command(int fd);
+    void process_pbsz_command(int fd);
+    void process_prot_command(int fd);
+    void process_mode_command(int fd);
+    void process_type_command(int fd);
+    bool process_xdedup_command(ftp_io_job_t& job, size_t budget, size_t& used);
+    bool start_xdedup(ftp_io_job_t& job);
+    bool recv_manifest(ftp_io_job_t& job, size_t budget, size_t& used);
+    bool recv_chunks(ftp_io_job_t& job, size_t budget, size_t& used);
+    bool process_xdelta_command(ftp_io_job_t& job, size_t budget, size_t& used);
+    bool start_xdelta(ftp_io_job_t& job);
+    void process_site_command(int fd);
+    void process_rnfr_command(int fd);
+    void process_rnto_command(int fd);
+    bool process_copy_command(ftp_io_job_t& job, size_t budget, size_t& used);
     void process_other_command(int fd);
-    void process_retr_command(int fd);
+    bool process_retr_command(ftp_io_job_t& job, size_t budget, size_t& used);
+    bool send_archive(ftp_io_job_t& job, size_t budget, size_t& used);
+    bool send_sparse_header(ftp_io_job_t& job);
+    bool process_untar_command(ftp_io_job_t& job, size_t budget, size_t& used);
+
+    bool store_file(ftp_io_job_t& job, bool is_append, size_t budget, size_t& used);
+    bool start_store(ftp_io_job_t& job, bool is_append);
+    void write_behind(ftp_io_job_t& job);
+    bool recv_sparse_header(ftp_io_job_t& job);
+    bool write_ascii(ftp_io_job_t& job, const char* buffer, size_t length, bool is_end);
+    bool recv_direct(ftp_io_job_t& job, off_t limit);
+    bool write_direct(ftp_io_job_t& job, const char* buffer, size_t length, off_t position);
+    void finish_store(ftp_io_job_t& job);
+    static void on_store_commit(void* context, void* arg, int error);
+    bool start_copy(ftp_io_job_t& job);
+    static ssize_t copy_file_chunk(int infd, int outfd, off_t offset, size_t length);
+    bool start_untar(ftp_io_job_t& job);
+    static void process_untar_write(void** args);
 
-    static void process_command(std::vector<void*> args);
+    void execute_command(int fd);
+    static void process_command(void** args);
+    void dispatch_io(int fd, FTP_IO_TASK io_task);
+    void classify_io(ftp_io_job_t& job);
+    void set_io_class(ftp_io_job_t& job, off_t size);
+    void schedule_io();
+    bool execute_io_command(ftp_io_job_t& job, size_t budget, size_t& used);
+    static void process_io_command(void** args);
 
 private:
     int m_control_listen_fd;
     int m_data_listen_fd;
+    int m_timer_fd;
+    int m_signal_fd;
+    /* 预留的文件描述符，fd用完时关闭它来accept并立即关闭新连接，避免连接一直留在监听队列中 */
+    int m_reserve_fd;
+    long m_accept_dropped;
+
+    /* m_config由主循环修改，工作线程使用的参数复制到原子变量中，pasv_address受m_pthread_mutex保护 */
+    CConfig m_config_loader;
+    ftp_config_t m_config;
+    std::atomic<off_t> m_sendfile_chunk;
+    std::atomic<size_t> m_recv_buffer;
+    std::atomic<int> m_store_sync;
+    std::atomic<off_t> m_store_writebehind;
 
     CEpoll m_epoll;
 
@@ -85,8 +458,36 @@ private:
 
     std::string m_current_workdir;
     
-    std::map<int, ftp_client_t> m_client_map;
+    /* 会话表的插入、删除和查找受m_pthread_mutex保护，只有主循环会删除会话 */
+    client_map_t m_client_map;
     std::map<std::string, int> m_address_map;
+    /* 每个地址等待数据连接的PASV会话，按PASV的顺序匹配数据连接，同一地址的多个会话可以同时建立数据连接 */
+    std::map<std::string, std::deque<int> > m_pasv_queue;
+    /* 未传输完成的上传文件：文件路径 -> 期望的完整大小，用于REST+STOR续传 */
+    std::map<std::string, off_t> m_partial_map;
+
+    CHashCache m_hash_cache;
+    CTLSContext m_tls;
+    CChunkStore m_chunk_store;
+
+    CTimerWheel m_timer_wheel;
+    long m_reaped_idle;
+    long m_reaped_stalled;
+    long m_reaped_pasv;
+
+    CHandoff m_handoff;
+    /* 监听套接字已经交给新进程，退出过程中空闲会话也交给它，新进程没有响应时改回false */
+    bool m_is_handed_off;
+    bool m_is_running;
+    bool m_is_draining;
+    long m_drain_deadline;
 
     CThreadPool m_pthread_pool;
+    /* 磁盘I/O线程池，和解析命令的m_pthread_pool分开，慢速磁盘只阻塞文件传输 */
+    CThreadPool m_io_pool;
+    std::atomic<size_t> m_io_queue_limit;
+    /* 线程池中的每个任务从调度器取出一个时间片执行，interactive_weight和user_weights受m_pthread_mutex保护 */
+    CTransferScheduler m_scheduler;
+    /* store_sync为group时同步上传完成的文件 */
+    CGroupCommit m_group_commit;
 };
\ No newline at end of file
@@ -0,0 +1,309 @@
+#include "ftp_session.h"
+
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdlib>
+#include <sstream>
+#include <algorithm>
+
+static double elapsed_seconds(const struct timespec& start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+CFTPSession::CFTPSession() : m_tls(NULL)
+{
+
+}
+
+CFTPSession::~CFTPSession()
+{
+    close();
+}
+
+/*
+ * 连接并登录，tls不为NULL时AUTH TLS之后PROT P，数据连接也加密
+ */
+bool CFTPSession::open(const std::string& host, int port, const std::string& username, const std::string& password, CTLSContext* tls)
+{
+    close();
+    m_tls = tls;
+    if (!m_control_socket.create_socket() || !m_control_socket.connect_socket(host, port))
+    {
+        m_control_socket.close_socket();
+        return false;
+    }
+    socket_profile_t control_profile;
+    control_profile.is_nodelay = true;
+    CSocketOption::apply_connection(m_control_socket.get_fd(), control_profile);
+
+    std::string response;
+    if (m_control_socket.recv_message(response) <= 0)
+    {
+        close();
+        return false;
+    }
+
+    if (m_tls != NULL)
+    {
+        if (!command("AUTH TLS\r\n", response) || response.compare(0, 3, "234") != 0)
+        {
+            close();
+            return false;
+        }
+        SSL* ssl = m_tls->connect(m_control_socket.get_fd());
+        if (ssl == NULL)
+        {
+            close();
+            return false;
+        }
+        m_control_socket.set_tls(ssl);
+        if (!command("PBSZ 0\r\n", response) || !command("PROT P\r\n", response) || response.compare(0, 3, "200") != 0)
+        {
+            close();
+            return false;
+        }
+    }
+
+    return command("USER " + username + "\r\n", response) && command("PASS " + password + "\r\n", response);
+}
+
+/*
+ * PASV并连接数据端口，服务器按PASV的顺序匹配同一地址的数据连接，
+ * 同一地址的多个会话同时建立数据连接时调用者需要保证PASV和connect成对串行执行
+ */
+bool CFTPSession::open_data_channel()
+{
+    std::string response;
+    if (!command("PASV\r\n", response))
+        return false;
+
+    std::stringstream oss(response);
+    int h1 = -1, h2, h3, h4, p1, p2;
+    char ch;
+    oss >> ch >> h1 >> ch >> h2 >> ch >> h3 >> ch >> h4 >> ch >> p1 >> ch >> p2;
+    if (!oss || h1 < 0)
+        return false;
+
+    std::stringstream address;
+    address << h1 << "." << h2 << "." << h3 << "." << h4;
+
+    m_data_socket.close_socket();
+    if (!m_data_socket.create_socket() || !m_data_socket.connect_socket(address.str(), p1 * 256 + p2))
+    {
+        m_data_socket.close_socket();
+        return false;
+    }
+    return true;
+}
+
+void CFTPSession::close()
+{
+    if (m_control_socket.get_fd() != -1)
+    {
+        m_control_socket.send_message("QUIT\r\n");
+        m_control_socket.close_socket();
+    }
+    if (m_data_socket.get_fd() != -1)
+    {
+        m_data_socket.close_socket();
+    }
+}
+
+/*
+ * 下载到transfer.local_path，先SIZE得到长度，数据连接上正好接收这么多字节
+ */
+bool CFTPSession::retrieve(ftp_transfer_t& transfer)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    transfer.bytes = 0;
+
+    std::string response;
+    if (!command("SIZE " + transfer.remote_name + "\r\n", response))
+    {
+        fail(transfer, "control connection lost", true);
+        return false;
+    }
+    long long file_size = strtoll(response.c_str(), NULL, 10);
+    if (file_size < 0)
+    {
+        fail(transfer, "no such file", false);
+        return false;
+    }
+
+    int filefd = ::open(transfer.local_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (filefd < 0)
+    {
+        fail(transfer, "cannot open local file", false);
+        return false;
+    }
+    if (!command("RETR " + transfer.remote_name + "\r\n", response) || response != "retr parse success" ||
+        !secure_data_channel())
+    {
+        ::close(filefd);
+        unlink(transfer.local_path.c_str());
+        fail(transfer, response, !is_open());
+        return false;
+    }
+
+    if (m_buffer.size() < static_cast<size_t>(FTP_RECV_BUFFER))
+    {
+        m_buffer.resize(FTP_RECV_BUFFER);
+    }
+    while (transfer.bytes < file_size)
+    {
+        int n = m_data_socket.recv_buffer(m_buffer.data(), std::min<long long>(m_buffer.size(), file_size - transfer.bytes));
+        if (n <= 0 || pwrite(filefd, m_buffer.data(), n, transfer.bytes) != n)
+        {
+            break;
+        }
+        transfer.bytes += n;
+    }
+    ::close(filefd);
+
+    transfer.seconds = elapsed_seconds(start);
+    if (transfer.bytes < file_size)
+    {
+        /* 数据连接上可能还有没读完的数据，关闭后由调用者重新建立 */
+        fail(transfer, "data connection lost", true);
+        return false;
+    }
+    transfer.is_success = true;
+    transfer.message = response;
+    return true;
+}
+
+/*
+ * 上传transfer.local_path，明文和kTLS时sendfile，用户态TLS时经过缓冲区
+ */
+bool CFTPSession::store(ftp_transfer_t& transfer)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    transfer.bytes = 0;
+
+    int filefd = ::open(transfer.local_path.c_str(), O_RDONLY);
+    struct stat statinfo;
+    if (filefd < 0 || fstat(filefd, &statinfo) < 0 || !S_ISREG(statinfo.st_mode))
+    {
+        if (filefd >= 0)
+            ::close(filefd);
+        fail(transfer, "cannot open local file", false);
+        return false;
+    }
+
+    std::stringstream oss;
+    oss << "STOR " << transfer.remote_name << "<" << statinfo.st_size << ">\r\n";
+    std::string response;
+    if (!command(oss.str(), response) || response.compare(0, 20, "recv command success") != 0 || !secure_data_channel())
+    {
+        ::close(filefd);
+        fail(transfer, response, !is_open());
+        return false;
+    }
+
+    off_t offset = 0;
+    SSL* ssl = m_data_socket.get_tls();
+    bool is_buffer = ssl != NULL && !CTLSContext::is_ktls_send(ssl);
+    if (is_buffer && m_buffer.size() < static_cast<size_t>(FTP_RECV_BUFFER))
+    {
+        m_buffer.resize(FTP_RECV_BUFFER);
+    }
+    while (offset < statinfo.st_size)
+    {
+        ssize_t n;
+        if (is_buffer)
+        {
+            n = pread(filefd, m_buffer.data(), std::min<off_t>(m_buffer.size(), statinfo.st_size - offset), offset);
+            if (n > 0 && !send_data(m_buffer.data(), n))
+                n = -1;
+            if (n > 0)
+                offset += n;
+        }
+        else
+        {
+            n = sendfile(m_data_socket.get_fd(), filefd, &offset, statinfo.st_size - offset);
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+    }
+    ::close(filefd);
+    transfer.bytes = offset;
+
+    if (offset < statinfo.st_size)
+    {
+        /* 关闭数据连接让服务器结束接收，再读取它的应答 */
+        m_data_socket.close_socket();
+        command("", response);
+        fail(transfer, "data connection lost", true);
+        return false;
+    }
+    if (!command("", response))
+    {
+        fail(transfer, "control connection lost", true);
+        return false;
+    }
+    transfer.seconds = elapsed_seconds(start);
+    transfer.is_success = response.compare(0, 18, "store file success") == 0;
+    transfer.message = response;
+    return transfer.is_success;
+}
+
+/*
+ * 发送一条命令并接收一条应答，control为空时只接收，控制连接出错时关闭整个会话
+ */
+bool CFTPSession::command(const std::string& control, std::string& response)
+{
+    response.clear();
+    if ((!control.empty() && m_control_socket.send_message(control) <= 0) || m_control_socket.recv_message(response) <= 0)
+    {
+        m_control_socket.close_socket();
+        m_data_socket.close_socket();
+        return false;
+    }
+    return true;
+}
+
+bool CFTPSession::secure_data_channel()
+{
+    if (m_tls == NULL || m_data_socket.get_tls() != NULL)
+        return true;
+
+    SSL* ssl = m_tls->connect(m_data_socket.get_fd());
+    if (ssl == NULL)
+        return false;
+    m_data_socket.set_tls(ssl);
+    return true;
+}
+
+bool CFTPSession::send_data(const char* buffer, size_t length)
+{
+    while (length > 0)
+    {
+        int n = m_data_socket.send_buffer(buffer, length);
+        if (n <= 0) return false;
+        buffer += n;
+        length -= n;
+    }
+    return true;
+}
+
+/*
+ * 记录失败原因，is_broken时关闭数据连接，下一次传输前重新建立
+ */
+void CFTPSession::fail(ftp_transfer_t& transfer, const std::string& message, bool is_broken)
+{
+    transfer.is_success = false;
+    transfer.message = message;
+    if (is_broken)
+    {
+        m_data_socket.close_socket();
+    }
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "constant.h"
+#include "socket.h"
+#include "sockopt.h"
+
+#include <sys/types.h>
+#include <string>
+#include <vector>
+
+/* 一次传输的请求和结果，type为FTP_COMMAND_RETR或FTP_COMMAND_STOR */
+struct ftp_transfer_t
+{
+    int type;
+    std::string remote_name;
+    std::string local_path;
+
+    bool is_success;
+    off_t bytes;
+    double seconds;
+    /* 服务器的最后一条应答或者本地的错误原因 */
+    std::string message;
+
+    ftp_transfer_t() : type(FTP_COMMAND_RETR), is_success(false), bytes(0), seconds(0)
+    {
+    }
+};
+
+/*
+ * 不带交互输出的FTP会话，登录之后控制连接和数据连接在多次传输之间保持
+ * 不是线程安全的，同一时间只能由一个线程使用，多个会话由CFTPClientPool管理
+ */
+class CFTPSession
+{
+public:
+    CFTPSession();
+    ~CFTPSession();
+
+    bool open(const std::string& host, int port, const std::string& username, const std::string& password, CTLSContext* tls);
+    bool open_data_channel();
+    void close();
+    bool is_open()
+    {
+        return m_control_socket.get_fd() != -1;
+    }
+    bool has_data_channel()
+    {
+        return m_data_socket.get_fd() != -1;
+    }
+
+    bool retrieve(ftp_transfer_t& transfer);
+    bool store(ftp_transfer_t& transfer);
+
+private:
+    bool command(const std::string& control, std::string& response);
+    bool secure_data_channel();
+    bool send_data(const char* buffer, size_t length);
+    void fail(ftp_transfer_t& transfer, const std::string& message, bool is_broken);
+
+private:
+    CSocket m_control_socket;
+    CSocket m_data_socket;
+    CTLSContext* m_tls;
+    std::vector<char> m_buffer;
+};
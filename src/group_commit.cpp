@@ -0,0 +1,186 @@
+#include "group_commit.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <cerrno>
+#include <cstdio>
+#include <map>
+
+CGroupCommit::CGroupCommit() : m_callback(NULL), m_context(NULL), m_is_started(false), m_first_time(0), m_wait(0),
+                               m_done(false)
+{
+    m_stats.batches = 0;
+    m_stats.files = 0;
+    pthread_mutex_init(&m_mutex, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&m_cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+CGroupCommit::~CGroupCommit()
+{
+    stop();
+    pthread_mutex_destroy(&m_mutex);
+    pthread_cond_destroy(&m_cond);
+}
+
+bool CGroupCommit::start(commit_callback_t callback, void* context)
+{
+    m_callback = callback;
+    m_context = context;
+    m_done = false;
+    if (pthread_create(&m_thread_id, NULL, process_commit, this) != 0)
+    {
+        perror("create group commit thread error");
+        return false;
+    }
+    m_is_started = true;
+    return true;
+}
+
+void CGroupCommit::set_wait(long wait)
+{
+    pthread_mutex_lock(&m_mutex);
+    m_wait = wait;
+    pthread_mutex_unlock(&m_mutex);
+}
+
+void CGroupCommit::add(int fd, const std::string& directory, void* arg)
+{
+    commit_entry_t entry;
+    entry.fd = fd;
+    entry.directory = directory;
+    entry.arg = arg;
+    pthread_mutex_lock(&m_mutex);
+    if (m_queue.empty())
+    {
+        m_first_time = now_ms();
+    }
+    m_queue.push_back(entry);
+    pthread_cond_signal(&m_cond);
+    pthread_mutex_unlock(&m_mutex);
+}
+
+void CGroupCommit::stop()
+{
+    if (!m_is_started)
+    {
+        return;
+    }
+    pthread_mutex_lock(&m_mutex);
+    m_done = true;
+    pthread_cond_signal(&m_cond);
+    pthread_mutex_unlock(&m_mutex);
+    pthread_join(m_thread_id, NULL);
+    m_is_started = false;
+}
+
+group_commit_stats_t CGroupCommit::get_stats()
+{
+    pthread_mutex_lock(&m_mutex);
+    group_commit_stats_t stats = m_stats;
+    pthread_mutex_unlock(&m_mutex);
+    return stats;
+}
+
+std::string CGroupCommit::parent_directory(const std::string& filepath)
+{
+    std::string::size_type pos = filepath.rfind('/');
+    if (pos == std::string::npos)
+    {
+        return ".";
+    }
+    return pos == 0 ? "/" : filepath.substr(0, pos);
+}
+
+int CGroupCommit::sync_directory(const std::string& directory)
+{
+    int dirfd = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if (dirfd < 0)
+    {
+        return errno;
+    }
+    int error = fsync(dirfd) < 0 ? errno : 0;
+    close(dirfd);
+    return error;
+}
+
+/*
+ * 先对整批文件发起写回，磁盘可以合并和并行处理这些写入，之后的fdatasync大多只需要等待已经发出的I/O，
+ * 文件都同步之后再同步新建文件所在的目录，全部完成后才回调
+ */
+void CGroupCommit::commit(const std::vector<commit_entry_t>& batch)
+{
+    for (size_t i = 0; i < batch.size(); ++i)
+    {
+        sync_file_range(batch[i].fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+    }
+    std::vector<int> errors(batch.size());
+    std::map<std::string, int> directories;
+    for (size_t i = 0; i < batch.size(); ++i)
+    {
+        errors[i] = fdatasync(batch[i].fd) < 0 ? errno : 0;
+        if (errors[i] == 0 && !batch[i].directory.empty())
+        {
+            directories[batch[i].directory] = 0;
+        }
+    }
+    for (std::map<std::string, int>::iterator it = directories.begin(); it != directories.end(); ++it)
+    {
+        it->second = sync_directory(it->first);
+    }
+    for (size_t i = 0; i < batch.size(); ++i)
+    {
+        if (errors[i] == 0 && !batch[i].directory.empty())
+        {
+            errors[i] = directories[batch[i].directory];
+        }
+        m_callback(m_context, batch[i].arg, errors[i]);
+    }
+}
+
+long CGroupCommit::now_ms()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+void* CGroupCommit::process_commit(void* args)
+{
+    CGroupCommit* group = static_cast<CGroupCommit*>(args);
+    std::vector<commit_entry_t> batch;
+    pthread_mutex_lock(&group->m_mutex);
+    while (!group->m_done || !group->m_queue.empty())
+    {
+        if (group->m_queue.empty())
+        {
+            pthread_cond_wait(&group->m_cond, &group->m_mutex);
+            continue;
+        }
+
+        /* 第一个文件到达后等待wait毫秒或者凑满一批，退出时不再等待 */
+        long deadline = group->m_first_time + group->m_wait;
+        if (!group->m_done && group->m_queue.size() < GROUP_COMMIT_BATCH && now_ms() < deadline)
+        {
+            struct timespec ts;
+            ts.tv_sec = deadline / 1000;
+            ts.tv_nsec = (deadline % 1000) * 1000000;
+            pthread_cond_timedwait(&group->m_cond, &group->m_mutex, &ts);
+            continue;
+        }
+
+        batch.swap(group->m_queue);
+        ++group->m_stats.batches;
+        group->m_stats.files += batch.size();
+        pthread_mutex_unlock(&group->m_mutex);
+        group->commit(batch);
+        batch.clear();
+        pthread_mutex_lock(&group->m_mutex);
+    }
+    pthread_mutex_unlock(&group->m_mutex);
+    return NULL;
+}
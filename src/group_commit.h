@@ -0,0 +1,73 @@
+#pragma once
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+
+/* 一批最多同步这么多个文件，到达后不再等待 */
+const size_t GROUP_COMMIT_BATCH = 256;
+
+/* 同步完成的回调，error为0表示成功，否则为fdatasync或者目录fsync的errno */
+typedef void (*commit_callback_t)(void* context, void* arg, int error);
+
+struct group_commit_stats_t
+{
+    size_t batches;
+    size_t files;
+};
+
+/*
+ * 组提交：上传完成的文件交给专门的线程，第一个文件到达后再等待wait毫秒收集同时完成的上传，
+ * wait为0时不等待，同步一批的过程中完成的上传组成下一批，
+ * 一批文件先全部sync_file_range发起写回，再逐个fdatasync，ext4等日志文件系统上一批只需要一次日志提交，
+ * 新建的文件还要fsync所在目录才能保证目录项落盘，同一批中相同的目录只同步一次，
+ * 同步完成后对每个文件调用回调，调用者在回调中回复客户端
+ */
+class CGroupCommit
+{
+public:
+    CGroupCommit();
+    ~CGroupCommit();
+
+    bool start(commit_callback_t callback, void* context);
+    void set_wait(long wait);
+    /* directory非空时文件是新建的，同步文件后还要同步这个目录 */
+    void add(int fd, const std::string& directory, void* arg);
+    /* 同步完已经加入的文件后结束线程 */
+    void stop();
+    group_commit_stats_t get_stats();
+    /* 文件所在的目录 */
+    static std::string parent_directory(const std::string& filepath);
+    /* fsync目录，成功返回0，否则返回errno */
+    static int sync_directory(const std::string& directory);
+
+private:
+    struct commit_entry_t
+    {
+        int fd;
+        std::string directory;
+        void* arg;
+    };
+
+    void commit(const std::vector<commit_entry_t>& batch);
+    static long now_ms();
+    static void* process_commit(void* args);
+
+private:
+    commit_callback_t m_callback;
+    void* m_context;
+    pthread_t m_thread_id;
+    bool m_is_started;
+
+    /* 以下受m_mutex保护 */
+    std::vector<commit_entry_t> m_queue;
+    /* 队列中第一个文件加入的时间，CLOCK_MONOTONIC毫秒 */
+    long m_first_time;
+    long m_wait;
+    bool m_done;
+    group_commit_stats_t m_stats;
+
+    pthread_mutex_t m_mutex;
+    pthread_cond_t m_cond;
+};
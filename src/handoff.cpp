@@ -0,0 +1,323 @@
+#include "handoff.h"
+
+#include <sys/time.h>
+#include <vector>
+
+/* 交接套接字的监听队列长度 */
+static const int HANDOFF_BACKLOG = 128;
+
+CHandoff::CHandoff() : m_listen_fd(-1), m_path("")
+{
+
+}
+
+CHandoff::~CHandoff()
+{
+    close_handoff(false);
+}
+
+/*
+ * 删除旧进程留下的路径后重新绑定，之后的热重启由本进程交出监听套接字
+ */
+bool CHandoff::listen_handoff(const std::string& path)
+{
+    struct sockaddr_un addr;
+    if (path.size() >= sizeof(addr.sun_path))
+    {
+        return false;
+    }
+
+    m_listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (m_listen_fd < 0)
+    {
+        return false;
+    }
+
+    bzero(&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+    /* 旧进程交出会话时会连续连接，队列要能容纳 */
+    unlink(path.c_str());
+    if (bind(m_listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(m_listen_fd, HANDOFF_BACKLOG) < 0)
+    {
+        close(m_listen_fd);
+        m_listen_fd = -1;
+        return false;
+    }
+    m_path = path;
+    return true;
+}
+
+/*
+ * is_unlink为false用于已经交出监听套接字的情况，路径已经属于新进程
+ */
+bool CHandoff::close_handoff(bool is_unlink)
+{
+    if (m_listen_fd == -1)
+    {
+        return true;
+    }
+    if (is_unlink)
+    {
+        unlink(m_path.c_str());
+    }
+    int ret = close(m_listen_fd);
+    m_listen_fd = -1;
+    return ret == 0;
+}
+
+/*
+ * 对方连接后马上发送请求，超时没有收到的请求type为0，由调用者丢弃
+ */
+bool CHandoff::accept_request(handoff_request_t& request)
+{
+    request.connfd = -1;
+    request.type = 0;
+    request.state.clear();
+    request.count = 0;
+    if (m_listen_fd == -1)
+    {
+        return false;
+    }
+
+    int connfd;
+    do
+    {
+        connfd = accept4(m_listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    } while (connfd < 0 && errno == EINTR);
+    if (connfd < 0)
+    {
+        return false;
+    }
+    set_timeout(connfd);
+    request.connfd = connfd;
+
+    std::string data;
+    int count = recv_fds(connfd, data, request.fds, HANDOFF_MAX_FDS);
+    if (count >= 0 && !data.empty())
+    {
+        request.type = data[0];
+        request.state.assign(data, 1, std::string::npos);
+        request.count = count;
+    }
+    return true;
+}
+
+/*
+ * 把监听套接字交给新进程，路径此时已经被新进程重新绑定，不能unlink
+ */
+bool CHandoff::send_listen_fds(handoff_request_t& request, const int* fds, int count)
+{
+    return count > 0 && send_fds(request.connfd, std::string(1, HANDOFF_LISTEN), fds, count);
+}
+
+bool CHandoff::reply_session(handoff_request_t& request, bool is_adopted)
+{
+    char reply = is_adopted ? 1 : 0;
+    return send(request.connfd, &reply, sizeof(reply), MSG_NOSIGNAL) == sizeof(reply);
+}
+
+/*
+ * 调用者取走的套接字在fds中置为-1，其余的在这里关闭
+ */
+void CHandoff::finish_request(handoff_request_t& request)
+{
+    for (int i = 0; i < request.count; ++i)
+    {
+        if (request.fds[i] != -1)
+            close(request.fds[i]);
+    }
+    request.count = 0;
+    if (request.connfd != -1)
+    {
+        close(request.connfd);
+        request.connfd = -1;
+    }
+}
+
+/*
+ * 新进程启动时调用，返回收到的套接字个数，旧进程不存在时返回-1
+ */
+int CHandoff::request_listen_fds(const std::string& path, int* fds, int max_count)
+{
+    int sockfd = connect_path(path, false);
+    if (sockfd < 0)
+    {
+        return -1;
+    }
+
+    /* 旧进程在主循环中处理请求，这里阻塞等待 */
+    std::string data;
+    int count = -1;
+    if (send_fds(sockfd, std::string(1, HANDOFF_LISTEN), NULL, 0))
+    {
+        count = recv_fds(sockfd, data, fds, max_count);
+    }
+    close(sockfd);
+    if (count > 0 && data != std::string(1, HANDOFF_LISTEN))
+    {
+        for (int i = 0; i < count; ++i)
+            close(fds[i]);
+        count = -1;
+    }
+    return count;
+}
+
+/*
+ * 旧进程调用，把会话的套接字和状态交给新进程，新进程接管后本进程关闭自己的副本即可
+ * 新进程收到监听套接字之后才绑定路径，在这之前连接会失败，调用者稍后重试
+ */
+int CHandoff::send_session(const std::string& path, const int* fds, int count, const std::string& state)
+{
+    if (state.size() + 1 > HANDOFF_MAX_STATE)
+    {
+        return 0;
+    }
+    int sockfd = connect_path(path, true);
+    if (sockfd < 0)
+    {
+        return -1;
+    }
+
+    if (!send_fds(sockfd, std::string(1, HANDOFF_SESSION) + state, fds, count))
+    {
+        close(sockfd);
+        return 0;
+    }
+    char reply = 0;
+    ssize_t n = recv(sockfd, &reply, sizeof(reply), 0);
+    close(sockfd);
+    return n != sizeof(reply) || reply == 1 ? 1 : 0;
+}
+
+int CHandoff::connect_path(const std::string& path, bool is_timeout)
+{
+    struct sockaddr_un addr;
+    if (path.size() >= sizeof(addr.sun_path))
+    {
+        return -1;
+    }
+
+    int sockfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sockfd < 0)
+    {
+        return -1;
+    }
+    if (is_timeout)
+    {
+        set_timeout(sockfd);
+    }
+
+    bzero(&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+    if (connect(sockfd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+/*
+ * 交接会话时双方都在主循环中同步等待，超时后放弃，不会让两个进程互相卡住
+ */
+void CHandoff::set_timeout(int sockfd)
+{
+    struct timeval timeout;
+    timeout.tv_sec = HANDOFF_TIMEOUT_MS / 1000;
+    timeout.tv_usec = (HANDOFF_TIMEOUT_MS % 1000) * 1000;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+bool CHandoff::send_fds(int sockfd, const std::string& data, const int* fds, int count)
+{
+    if (count < 0 || count > HANDOFF_MAX_FDS || data.empty())
+    {
+        return false;
+    }
+
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    bzero(control, sizeof(control));
+
+    struct iovec iov;
+    iov.iov_base = const_cast<char*>(data.data());
+    iov.iov_len = data.size();
+
+    struct msghdr msg;
+    bzero(&msg, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (count > 0)
+    {
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+
+        struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int) * count);
+        memcpy(CMSG_DATA(cm), fds, sizeof(int) * count);
+    }
+
+    ssize_t n;
+    do
+    {
+        n = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    return n == static_cast<ssize_t>(data.size());
+}
+
+/*
+ * 返回收到的套接字个数，消息没有携带套接字时为0，出错返回-1
+ */
+int CHandoff::recv_fds(int sockfd, std::string& data, int* fds, int max_count)
+{
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    std::vector<char> buffer(HANDOFF_MAX_STATE);
+    struct iovec iov;
+    iov.iov_base = buffer.data();
+    iov.iov_len = buffer.size();
+
+    struct msghdr msg;
+    bzero(&msg, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    do
+    {
+        n = recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0)
+    {
+        return -1;
+    }
+    data.assign(buffer.data(), n);
+
+    struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+    if (cm == NULL)
+    {
+        return 0;
+    }
+    if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+    {
+        return -1;
+    }
+
+    int count = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    int* received = reinterpret_cast<int*>(CMSG_DATA(cm));
+    for (int i = 0; i < count; ++i)
+    {
+        if (i < max_count)
+            fds[i] = received[i];
+        else
+            close(received[i]);
+    }
+    return count < max_count ? count : max_count;
+}
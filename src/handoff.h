@@ -0,0 +1,73 @@
+#pragma once
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <string.h>
+#include <cerrno>
+#include <string>
+
+const int HANDOFF_MAX_FDS = 4;
+/* 会话状态的最大字节数，等待对方处理请求的超时时间 */
+const size_t HANDOFF_MAX_STATE = 16 * 1024;
+const int HANDOFF_TIMEOUT_MS = 1000;
+
+/* 请求的第一个字节：新进程请求监听套接字，旧进程交出一个空闲会话 */
+const char HANDOFF_LISTEN = 'L';
+const char HANDOFF_SESSION = 'S';
+
+/* 从交接套接字收到的一个请求，fds为随请求传来的套接字，没有被取走的由finish_request()关闭 */
+struct handoff_request_t
+{
+    int connfd;
+    char type;
+    std::string state;
+    int fds[HANDOFF_MAX_FDS];
+    int count;
+};
+
+/*
+ * 热重启时通过Unix域套接字传递监听套接字
+ * 旧进程一直监听m_path，新进程启动时连接它，用SCM_RIGHTS收到监听套接字后直接使用
+ * 内核中的监听队列不变，重启期间到达的连接不会被拒绝
+ * 新进程随后在同一路径上监听，旧进程把空闲会话的控制连接和数据连接连同会话状态逐个交给新进程
+ * 使用SOCK_SEQPACKET，一次sendmsg就是一个请求，不用处理消息边界
+ */
+class CHandoff
+{
+public:
+    CHandoff();
+    ~CHandoff();
+
+    bool listen_handoff(const std::string& path);
+    bool close_handoff(bool is_unlink);
+    int get_fd() const
+    {
+        return m_listen_fd;
+    }
+
+    /* 接受一个请求，没有等待中的连接时返回false */
+    bool accept_request(handoff_request_t& request);
+    bool send_listen_fds(handoff_request_t& request, const int* fds, int count);
+    /* 回复会话请求，is_adopted为false时旧进程自己关闭会话 */
+    bool reply_session(handoff_request_t& request, bool is_adopted);
+    void finish_request(handoff_request_t& request);
+
+    static int request_listen_fds(const std::string& path, int* fds, int max_count);
+    /*
+     * 返回1表示新进程已经接管，0表示新进程拒绝或者请求没有发出，-1表示新进程还没有开始监听
+     * 请求发出后等不到应答时新进程已经收到套接字，可能已经在使用，按已接管处理，本进程不能再回复
+     */
+    static int send_session(const std::string& path, const int* fds, int count, const std::string& state);
+
+private:
+    static int connect_path(const std::string& path, bool is_timeout);
+    static void set_timeout(int sockfd);
+    static bool send_fds(int sockfd, const std::string& data, const int* fds, int count);
+    static int recv_fds(int sockfd, std::string& data, int* fds, int max_count);
+
+private:
+    int m_listen_fd;
+    std::string m_path;
+};
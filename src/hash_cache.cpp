@@ -0,0 +1,166 @@
+#include "hash_cache.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <algorithm>
+
+bool hash_cache_key_t::operator<(const hash_cache_key_t& other) const
+{
+    if (ino != other.ino) return ino < other.ino;
+    if (dev != other.dev) return dev < other.dev;
+    if (mtime_sec != other.mtime_sec) return mtime_sec < other.mtime_sec;
+    if (mtime_nsec != other.mtime_nsec) return mtime_nsec < other.mtime_nsec;
+    if (size != other.size) return size < other.size;
+    if (algorithm != other.algorithm) return algorithm < other.algorithm;
+    if (start != other.start) return start < other.start;
+    return end < other.end;
+}
+
+CHashCache::CHashCache(size_t capacity) : m_capacity(capacity)
+{
+    pthread_mutex_init(&m_mutex, NULL);
+}
+
+CHashCache::~CHashCache()
+{
+    pthread_mutex_destroy(&m_mutex);
+}
+
+/*
+ * 打开文件并确定区间[start, end)，end小于0表示到文件末尾
+ * 键取自打开后的fstat，保证计算的内容和缓存的键是同一个文件
+ */
+bool CHashCache::open_job(const std::string& filepath, off_t start, off_t end, hash_job_t& job)
+{
+    job.fd = open(filepath.c_str(), O_RDONLY);
+    if (job.fd < 0)
+    {
+        return false;
+    }
+
+    struct stat statinfo;
+    if (fstat(job.fd, &statinfo) < 0 || !S_ISREG(statinfo.st_mode))
+    {
+        return false;
+    }
+    if (end < 0)
+    {
+        end = statinfo.st_size;
+    }
+    if (start < 0 || end < start || end > statinfo.st_size)
+    {
+        return false;
+    }
+
+    job.key.dev = statinfo.st_dev;
+    job.key.ino = statinfo.st_ino;
+    job.key.mtime_sec = statinfo.st_mtim.tv_sec;
+    job.key.mtime_nsec = statinfo.st_mtim.tv_nsec;
+    job.key.size = statinfo.st_size;
+    job.key.algorithm = job.hasher.get_algorithm();
+    job.key.start = start;
+    job.key.end = end;
+
+    if (lookup(job.key, job.digest))
+    {
+        close(job.fd);
+        job.fd = -1;
+        job.is_done = true;
+        return true;
+    }
+
+    clock_gettime(CLOCK_REALTIME_COARSE, &job.started);
+    job.position = start;
+    posix_fadvise(job.fd, start, end - start, POSIX_FADV_SEQUENTIAL);
+    return true;
+}
+
+bool CHashCache::update_job(hash_job_t& job, size_t budget, std::vector<char>& buffer, size_t& used)
+{
+    off_t end = std::min<off_t>(job.key.end, job.position + budget);
+    used = end - job.position;
+    if (!CChecksum::hash_range(job.fd, job.hasher, job.position, end, buffer))
+    {
+        return false;
+    }
+    job.position = end;
+    if (job.position == job.key.end)
+    {
+        finish_job(job);
+    }
+    return true;
+}
+
+/*
+ * 计算完成后再次fstat，mtime或大小改变说明计算期间文件被写入，结果只返回不缓存
+ * 文件的mtime取自内核的粗粒度时钟，开始计算时mtime还没有早于这个时钟的文件，之后的写入可能不改变mtime，也不缓存
+ */
+void CHashCache::finish_job(hash_job_t& job)
+{
+    job.digest = job.hasher.final_hex();
+    job.is_done = true;
+
+    struct stat after;
+    bool is_unchanged = fstat(job.fd, &after) == 0 && after.st_size == job.key.size &&
+                        after.st_mtim.tv_sec == job.key.mtime_sec && after.st_mtim.tv_nsec == job.key.mtime_nsec &&
+                        (job.key.mtime_sec < job.started.tv_sec ||
+                         (job.key.mtime_sec == job.started.tv_sec && job.key.mtime_nsec < job.started.tv_nsec));
+    close(job.fd);
+    job.fd = -1;
+    if (is_unchanged)
+    {
+        insert(job.key, job.digest);
+    }
+}
+
+bool CHashCache::lookup(const hash_cache_key_t& key, std::string& digest)
+{
+    pthread_mutex_lock(&m_mutex);
+    std::map<hash_cache_key_t, std::string>::iterator it = m_cache.find(key);
+    bool is_found = (it != m_cache.end());
+    if (is_found)
+    {
+        digest = it->second;
+    }
+    pthread_mutex_unlock(&m_mutex);
+    return is_found;
+}
+
+/*
+ * 超过容量时按插入顺序淘汰最旧的结果
+ */
+void CHashCache::insert(const hash_cache_key_t& key, const std::string& digest)
+{
+    pthread_mutex_lock(&m_mutex);
+    if (m_cache.find(key) == m_cache.end())
+    {
+        m_order.push_back(key);
+    }
+    m_cache[key] = digest;
+    evict();
+    pthread_mutex_unlock(&m_mutex);
+}
+
+/*
+ * 修改容量，缩小时立即淘汰多出的结果，容量为0时不缓存
+ */
+void CHashCache::set_capacity(size_t capacity)
+{
+    pthread_mutex_lock(&m_mutex);
+    m_capacity = capacity;
+    evict();
+    pthread_mutex_unlock(&m_mutex);
+}
+
+/*
+ * 调用者持有m_mutex
+ */
+void CHashCache::evict()
+{
+    while (m_order.size() > m_capacity)
+    {
+        m_cache.erase(m_order.front());
+        m_order.pop_front();
+    }
+}
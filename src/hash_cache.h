@@ -0,0 +1,87 @@
+#pragma once
+
+#include "checksum.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+
+const size_t HASH_CACHE_CAPACITY = 4096;
+
+struct hash_cache_key_t
+{
+    dev_t dev;
+    ino_t ino;
+    time_t mtime_sec;
+    long mtime_nsec;
+    off_t size;
+    HASH_ALGORITHM algorithm;
+    off_t start;
+    off_t end;
+
+    bool operator<(const hash_cache_key_t& other) const;
+};
+
+/*
+ * 分多次计算的哈希，open_job()打开文件并查找缓存，命中时is_done为true；
+ * 之后每次update_job()从position继续计算，算到key.end时得到digest，文件没有被修改时放入缓存
+ */
+struct hash_job_t
+{
+    int fd;
+    hash_cache_key_t key;
+    /* 开始计算时内核的粗粒度时钟，mtime不早于它的文件之后的写入可能不改变mtime，结果不缓存 */
+    struct timespec started;
+    off_t position;
+    CHasher hasher;
+    std::string digest;
+    bool is_done;
+
+    hash_job_t(HASH_ALGORITHM algorithm) : fd(-1), position(0), hasher(algorithm), is_done(false)
+    {
+    }
+
+    ~hash_job_t()
+    {
+        if (fd >= 0)
+            close(fd);
+    }
+};
+
+/*
+ * 哈希结果缓存，以(设备, inode, mtime, 文件大小, 算法, 区间)为键
+ * 文件被修改后mtime或大小改变，旧的结果自然失效
+ */
+class CHashCache
+{
+public:
+    CHashCache(size_t capacity = HASH_CACHE_CAPACITY);
+    ~CHashCache();
+
+    /* end小于0表示到文件末尾，job.key.end为实际的结束偏移 */
+    bool open_job(const std::string& filepath, off_t start, off_t end, hash_job_t& job);
+    /* 最多计算budget字节，used为实际计算的字节数，读文件失败时返回false */
+    bool update_job(hash_job_t& job, size_t budget, std::vector<char>& buffer, size_t& used);
+
+    void set_capacity(size_t capacity);
+
+    bool lookup(const hash_cache_key_t& key, std::string& digest);
+    void insert(const hash_cache_key_t& key, const std::string& digest);
+
+private:
+    void finish_job(hash_job_t& job);
+    void evict();
+
+private:
+    size_t m_capacity;
+    std::map<hash_cache_key_t, std::string> m_cache;
+    std::deque<hash_cache_key_t> m_order;
+
+    pthread_mutex_t m_mutex;
+};
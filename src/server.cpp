@@ -2,9 +2,16 @@
 
 #include <iostream>
 
-int main()
+int main(int argc, char* argv[])
 {
-    CFTPServer ftp_server;
+    CConfig config;
+    if (!config.parse_args(argc, argv))
+    {
+        CConfig::usage(argv[0]);
+        return 1;
+    }
+
+    CFTPServer ftp_server(config);
     ftp_server.run();
     return 0;
 }
\ No newline at end of file
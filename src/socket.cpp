@@ -1,6 +1,6 @@
 #include "socket.h"
 
-CSocket::CSocket(int fd) : m_sockfd(fd)
+CSocket::CSocket(int fd) : m_sockfd(fd), m_ssl(NULL)
 {
 
 }
@@ -28,6 +28,9 @@ bool CSocket::create_socket()
 
 bool CSocket::close_socket()
 {
+    CTLSContext::release(m_ssl);
+    m_ssl = NULL;
+
     int close_ret = 0;
     if (m_sockfd)
     {
@@ -131,25 +134,51 @@ bool CSocket::set_socket_blocking()
 int CSocket::recv_message(std::string& message)
 {
     char msg[FTP_DEFAULT_BUFFER];
-    bzero(msg, sizeof(msg));
 
-    int n = recv(m_sockfd, msg, sizeof(msg), 0);
-    if (n < 0)
+    int n = recv_buffer(msg, sizeof(msg));
+    if (n > 0)
     {
-        return -1;
+        message.assign(msg, n);
     }
-    else if (n == 0)
+    return n;
+}
+
+int CSocket::send_message(const std::string& message)
+{
+    return send_buffer(message.c_str(), message.size());
+}
+
+/*
+ * 直接接收到调用者提供的缓冲区中，不清零也不拷贝到std::string
+ * 下载等大数据量的路径应该使用这个接口并复用缓冲区
+ */
+int CSocket::recv_buffer(char* buffer, size_t length, int flags)
+{
+    if (m_ssl != NULL)
     {
-        return 0;
+        return CTLSContext::recv(m_ssl, m_sockfd, buffer, length);
     }
-    else
+
+    int n;
+    do
     {
-        message.assign(msg, n);
-        return n;
+        n = recv(m_sockfd, buffer, length, flags);
+    } while (n < 0 && errno == EINTR);
+
+    return n < 0 ? -1 : n;
+}
+
+int CSocket::send_buffer(const char* buffer, size_t length, int flags)
+{
+    if (m_ssl != NULL)
+    {
+        return CTLSContext::send(m_ssl, m_sockfd, buffer, length);
     }
+    return send(m_sockfd, buffer, length, flags);
 }
 
-int CSocket::send_message(const std::string& message)
+void CSocket::set_tls(SSL* ssl)
 {
-    return send(m_sockfd, message.c_str(), message.size(), MSG_NOSIGNAL);
+    CTLSContext::release(m_ssl);
+    m_ssl = ssl;
 }
\ No newline at end of file
@@ -1,5 +1,7 @@
 #pragma once
 
+#include "tls.h"
+
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
@@ -11,6 +13,7 @@
 #include <iostream>
 
 const int FTP_DEFAULT_BUFFER = 0xffff;
+const int FTP_RECV_BUFFER = 0x40000;
 
 class CSocket 
 {
@@ -41,6 +44,17 @@ public:
     int recv_message(std::string& message);
     int send_message(const std::string& message);
 
+    int recv_buffer(char* buffer, size_t length, int flags = 0);
+    int send_buffer(const char* buffer, size_t length, int flags = MSG_NOSIGNAL);
+
+    /* 设置后收发经过TLS，关闭套接字时释放 */
+    void set_tls(SSL* ssl);
+    SSL* get_tls()
+    {
+        return m_ssl;
+    }
+
 private:
     int m_sockfd;
+    SSL* m_ssl;
 };
\ No newline at end of file
@@ -0,0 +1,178 @@
+#include "sockopt.h"
+
+#include <cstdlib>
+#include <cstdio>
+#include <cerrno>
+#include <fcntl.h>
+
+socket_profile_t::socket_profile_t() : send_buffer(0), recv_buffer(0), is_nodelay(false), is_cork(false),
+                                       notsent_lowat(0), congestion(""), busy_poll(0), defer_accept(0)
+{
+
+}
+
+static bool set_int_option(int fd, int level, int name, int value)
+{
+    return setsockopt(fd, level, name, &value, sizeof(value)) == 0;
+}
+
+static bool parse_int(const std::string& value, long min_value, long max_value, int& result)
+{
+    if (value.empty())
+    {
+        return false;
+    }
+
+    char* end = NULL;
+    errno = 0;
+    long number = strtol(value.c_str(), &end, 10);
+    if (errno != 0 || *end != '\0' || number < min_value || number > max_value)
+    {
+        return false;
+    }
+    result = static_cast<int>(number);
+    return true;
+}
+
+static bool parse_bool(const std::string& value, bool& result)
+{
+    if (value == "1" || value == "on" || value == "yes" || value == "true")
+        result = true;
+    else if (value == "0" || value == "off" || value == "no" || value == "false")
+        result = false;
+    else
+        return false;
+    return true;
+}
+
+/*
+ * 监听套接字的选项在bind之前设置，失败的选项打印原因后继续，返回是否全部成功
+ */
+bool CSocketOption::apply_listen(int fd, const socket_profile_t& profile)
+{
+    bool ret = true;
+    /* 主循环每次事件都accept到EAGAIN，监听套接字必须是非阻塞的 */
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0 || fcntl(fd, F_SETFD, FD_CLOEXEC) < 0)
+    {
+        perror("fcntl O_NONBLOCK");
+        ret = false;
+    }
+    if (!set_int_option(fd, SOL_SOCKET, SO_REUSEADDR, 1))
+    {
+        perror("setsockopt SO_REUSEADDR");
+        ret = false;
+    }
+    if (!apply_buffer(fd, profile))
+    {
+        perror("setsockopt SO_SNDBUF/SO_RCVBUF");
+        ret = false;
+    }
+    if (profile.defer_accept > 0 && !set_int_option(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, profile.defer_accept))
+    {
+        perror("setsockopt TCP_DEFER_ACCEPT");
+        ret = false;
+    }
+    if (!profile.congestion.empty() &&
+        setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, profile.congestion.c_str(), profile.congestion.size()) < 0)
+    {
+        perror(("setsockopt TCP_CONGESTION " + profile.congestion).c_str());
+        ret = false;
+    }
+    return ret;
+}
+
+bool CSocketOption::apply_buffer(int fd, const socket_profile_t& profile)
+{
+    bool ret = true;
+    if (profile.send_buffer > 0 && !set_int_option(fd, SOL_SOCKET, SO_SNDBUF, profile.send_buffer))
+    {
+        ret = false;
+    }
+    if (profile.recv_buffer > 0 && !set_int_option(fd, SOL_SOCKET, SO_RCVBUF, profile.recv_buffer))
+    {
+        ret = false;
+    }
+    return ret;
+}
+
+/*
+ * 每个连接建立后调用，监听套接字上已经报告过错误，这里失败时不再打印
+ */
+bool CSocketOption::apply_connection(int fd, const socket_profile_t& profile)
+{
+    bool ret = true;
+    if (profile.is_nodelay && !set_int_option(fd, IPPROTO_TCP, TCP_NODELAY, 1))
+    {
+        ret = false;
+    }
+    if (profile.notsent_lowat > 0 && !set_int_option(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, profile.notsent_lowat))
+    {
+        ret = false;
+    }
+    if (!profile.congestion.empty() &&
+        setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, profile.congestion.c_str(), profile.congestion.size()) < 0)
+    {
+        ret = false;
+    }
+#ifdef SO_BUSY_POLL
+    if (profile.busy_poll > 0 && !set_int_option(fd, SOL_SOCKET, SO_BUSY_POLL, profile.busy_poll))
+    {
+        ret = false;
+    }
+#endif
+    return ret;
+}
+
+/*
+ * TCP_CORK打开时只发送满的报文段，关闭时立即发出剩余的数据
+ */
+bool CSocketOption::set_cork(int fd, bool is_cork)
+{
+    return set_int_option(fd, IPPROTO_TCP, TCP_CORK, is_cork ? 1 : 0);
+}
+
+/*
+ * 设置阻塞套接字收发的超时时间，0表示不超时
+ */
+bool CSocketOption::set_timeout(int fd, long seconds)
+{
+    struct timeval timeout;
+    timeout.tv_sec = seconds;
+    timeout.tv_usec = 0;
+    return setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == 0 &&
+           setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) == 0;
+}
+
+/*
+ * 解析配置项，key是去掉control_/data_前缀之后的部分
+ */
+bool CSocketOption::set_value(const std::string& key, const std::string& value, socket_profile_t& profile)
+{
+    if (key == "send_buffer")
+        return parse_int(value, 0, 1L << 30, profile.send_buffer);
+    else if (key == "recv_buffer")
+        return parse_int(value, 0, 1L << 30, profile.recv_buffer);
+    else if (key == "nodelay")
+        return parse_bool(value, profile.is_nodelay);
+    else if (key == "cork")
+        return parse_bool(value, profile.is_cork);
+    else if (key == "notsent_lowat")
+        return parse_int(value, 0, 1L << 30, profile.notsent_lowat);
+    else if (key == "busy_poll")
+        return parse_int(value, 0, 1000000, profile.busy_poll);
+    else if (key == "defer_accept")
+        return parse_int(value, 0, 3600, profile.defer_accept);
+    else if (key == "congestion")
+    {
+        /* 内核中拥塞控制算法名最长16字节，算法是否可用在setsockopt时检查 */
+        if (value.size() >= 16)
+        {
+            return false;
+        }
+        profile.congestion = value;
+        return true;
+    }
+
+    return false;
+}
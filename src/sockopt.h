@@ -0,0 +1,44 @@
+#pragma once
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/time.h>
+#include <string>
+
+/*
+ * 一组套接字选项，控制连接和数据连接各用一组
+ * 数值为0表示不设置，使用内核默认值（缓冲区为0时保留内核的自动调整）
+ */
+struct socket_profile_t
+{
+    int send_buffer;
+    int recv_buffer;
+    bool is_nodelay;
+    bool is_cork;
+    int notsent_lowat;
+    std::string congestion;
+    int busy_poll;
+    int defer_accept;
+
+    socket_profile_t();
+};
+
+/*
+ * 把socket_profile_t应用到套接字上
+ *  监听套接字：非阻塞、SO_REUSEADDR、缓冲区、TCP_DEFER_ACCEPT、拥塞控制，accept出的连接继承缓冲区和拥塞控制
+ *  连接：TCP_NODELAY、TCP_NOTSENT_LOWAT、拥塞控制、SO_BUSY_POLL
+ * 缓冲区要在listen/connect之前设置，窗口扩大因子在握手时确定
+ */
+class CSocketOption
+{
+public:
+    static bool apply_listen(int fd, const socket_profile_t& profile);
+    static bool apply_buffer(int fd, const socket_profile_t& profile);
+    static bool apply_connection(int fd, const socket_profile_t& profile);
+    static bool set_cork(int fd, bool is_cork);
+    static bool set_timeout(int fd, long seconds);
+
+    static bool set_value(const std::string& key, const std::string& value, socket_profile_t& profile);
+};
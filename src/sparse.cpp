@@ -0,0 +1,83 @@
+#include "sparse.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <cerrno>
+#include <algorithm>
+
+/* 打洞不支持时用来写0的缓冲区 */
+static const char SPARSE_ZERO[64 * 1024] = {0};
+
+/*
+ * 不支持SEEK_DATA的文件系统上lseek返回EINVAL，整个文件当作一段数据
+ */
+void CSparse::next_extent(int fd, off_t position, off_t end, off_t& data, off_t& hole)
+{
+    data = lseek(fd, position, SEEK_DATA);
+    if (data < 0)
+    {
+        data = errno == ENXIO ? end : position;
+        hole = end;
+        return;
+    }
+    if (data >= end)
+    {
+        data = end;
+        hole = end;
+        return;
+    }
+    hole = lseek(fd, data, SEEK_HOLE);
+    if (hole < 0 || hole > end)
+    {
+        hole = end;
+    }
+}
+
+void CSparse::encode_header(char* header, off_t offset, off_t length)
+{
+    for (int i = 0; i < 8; ++i)
+    {
+        header[i] = static_cast<char>(static_cast<uint64_t>(offset) >> (i * 8));
+        header[8 + i] = static_cast<char>(static_cast<uint64_t>(length) >> (i * 8));
+    }
+}
+
+bool CSparse::decode_header(const char* header, off_t position, off_t end, off_t& offset, off_t& length)
+{
+    uint64_t value_offset = 0;
+    uint64_t value_length = 0;
+    for (int i = 0; i < 8; ++i)
+    {
+        value_offset |= uint64_t(static_cast<unsigned char>(header[i])) << (i * 8);
+        value_length |= uint64_t(static_cast<unsigned char>(header[8 + i])) << (i * 8);
+    }
+    if (value_offset < static_cast<uint64_t>(position) || value_offset > static_cast<uint64_t>(end) ||
+        value_length > static_cast<uint64_t>(end) - value_offset)
+    {
+        return false;
+    }
+    offset = static_cast<off_t>(value_offset);
+    length = static_cast<off_t>(value_length);
+    return true;
+}
+
+bool CSparse::punch_hole(int fd, off_t offset, off_t length)
+{
+    if (length <= 0 || fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0)
+    {
+        return true;
+    }
+    while (length > 0)
+    {
+        ssize_t n = pwrite(fd, SPARSE_ZERO, std::min<off_t>(length, sizeof(SPARSE_ZERO)), offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0)
+        {
+            return false;
+        }
+        offset += n;
+        length -= n;
+    }
+    return true;
+}
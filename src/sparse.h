@@ -0,0 +1,24 @@
+#pragma once
+
+#include <sys/types.h>
+
+/*
+ * MODE H（稀疏传输）时数据连接上的格式：若干段，每段为 头部 + 数据
+ * 头部16字节：这段数据在文件中的偏移8字节 + 长度8字节，小端
+ * 上一段结尾到这段偏移之间是空洞，不传输；文件结尾的空洞用长度为0、偏移为文件结尾的段表示
+ * 偏移为发送方文件中的偏移，APPE时从0开始，接收方加上追加的起始位置（服务器上原文件的大小）
+ * 接收方写到的位置等于文件大小（RETR为SIZE的结果，STOR为参数中的字节数加上续传偏移）时传输结束
+ */
+const size_t SPARSE_HEADER_SIZE = 16;
+
+class CSparse
+{
+public:
+    /* 用SEEK_DATA/SEEK_HOLE查找position之后的第一段数据[data, hole)，没有数据时两者都为end */
+    static void next_extent(int fd, off_t position, off_t end, off_t& data, off_t& hole);
+    static void encode_header(char* header, off_t offset, off_t length);
+    /* 检查这段在[position, end)之内，偏移不能后退 */
+    static bool decode_header(const char* header, off_t position, off_t end, off_t& offset, off_t& length);
+    /* 文件已有的内容中[offset, offset + length)变成空洞，文件系统不支持打洞时写0 */
+    static bool punch_hole(int fd, off_t offset, off_t length);
+};
@@ -0,0 +1,633 @@
+#include "tar_extract.h"
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <limits.h>
+#include <cerrno>
+#include <algorithm>
+
+CTarExtract::CTarExtract() : m_refs(1), m_header_fill(0), m_zero_blocks(0), m_consumed(0), m_body(TAR_BODY_SKIP), m_left(0), m_padding(0),
+                             m_filefd(-1), m_file_offset(0), m_file(NULL), m_name(NULL), m_new_count(0),
+                             m_queued_bytes(0), m_writing(0)
+{
+    m_stats.files = 0;
+    m_stats.directories = 0;
+    m_stats.links = 0;
+    m_stats.skipped = 0;
+    m_stats.errors = 0;
+    m_stats.bytes = 0;
+    pthread_mutex_init(&m_mutex, NULL);
+    pthread_cond_init(&m_cond, NULL);
+}
+
+CTarExtract::~CTarExtract()
+{
+    if (m_filefd >= 0)
+    {
+        close(m_filefd);
+    }
+    delete m_file;
+    for (size_t i = 0; i < m_queue.size(); ++i)
+    {
+        delete m_queue[i];
+    }
+    pthread_mutex_destroy(&m_mutex);
+    pthread_cond_destroy(&m_cond);
+}
+
+bool CTarExtract::open_extract(const std::string& root)
+{
+    struct stat statinfo;
+    if (stat(root.c_str(), &statinfo) < 0 || !S_ISDIR(statinfo.st_mode))
+    {
+        return false;
+    }
+    m_root = root;
+    m_dirs.insert("");
+    return true;
+}
+
+void CTarExtract::acquire()
+{
+    ++m_refs;
+}
+
+void CTarExtract::release()
+{
+    if (--m_refs == 0)
+    {
+        delete this;
+    }
+}
+
+/*
+ * 返回false表示流的格式错误，之后的数据无法解析；单个条目创建失败只计入错误数
+ */
+bool CTarExtract::feed(const char* data, size_t length)
+{
+    while (length > 0 && !is_finished())
+    {
+        size_t n;
+        if (m_zero_blocks >= 2)
+        {
+            n = std::min<size_t>(TAR_RECORD - m_consumed % TAR_RECORD, length);
+        }
+        else if (m_left > 0)
+        {
+            n = std::min<off_t>(m_left, length);
+            write_body(data, n);
+            m_left -= n;
+            if (m_left == 0)
+            {
+                end_body();
+            }
+        }
+        else if (m_padding > 0)
+        {
+            n = std::min(m_padding, length);
+            m_padding -= n;
+        }
+        else
+        {
+            n = std::min(TAR_BLOCK - m_header_fill, length);
+            memcpy(m_header + m_header_fill, data, n);
+            m_header_fill += n;
+            if (m_header_fill == TAR_BLOCK)
+            {
+                m_header_fill = 0;
+                if (!process_header())
+                {
+                    return false;
+                }
+            }
+        }
+        data += n;
+        length -= n;
+        m_consumed += n;
+    }
+    return true;
+}
+
+/*
+ * 校验和按校验和字段为8个空格计算，有的实现按有符号字节求和，两种都接受
+ */
+bool CTarExtract::process_header()
+{
+    if (CTarStream::is_zero_block(m_header))
+    {
+        ++m_zero_blocks;
+        return true;
+    }
+    m_zero_blocks = 0;
+
+    unsigned int sum = 0;
+    int signed_sum = 0;
+    for (size_t i = 0; i < TAR_BLOCK; ++i)
+    {
+        char c = (i >= 148 && i < 156) ? ' ' : m_header[i];
+        sum += static_cast<unsigned char>(c);
+        signed_sum += static_cast<signed char>(c);
+    }
+    unsigned long long checksum = parse_octal(m_header + 148, 8);
+    off_t size;
+    if ((checksum != sum && checksum != static_cast<unsigned long long>(signed_sum)) ||
+        !CTarStream::parse_size(m_header, size))
+    {
+        add_error("archive", EINVAL);
+        return false;
+    }
+
+    char type = m_header[156];
+    m_body = TAR_BODY_SKIP;
+    m_left = size;
+    m_padding = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+    if (type == 'L' || type == 'K')
+    {
+        if (size > PATH_MAX * 4)
+        {
+            add_error("archive", ENAMETOOLONG);
+            return false;
+        }
+        m_name = type == 'L' ? &m_long_name : &m_long_link;
+        m_name->clear();
+        m_body = TAR_BODY_NAME;
+        return true;
+    }
+    /* pax扩展头部中的属性不使用 */
+    if (type == 'x' || type == 'g')
+    {
+        return true;
+    }
+
+    std::string name = m_long_name;
+    if (name.empty())
+    {
+        name = get_field(m_header, 100);
+        if (memcmp(m_header + 257, "ustar\0", 6) == 0 && m_header[345] != '\0')
+        {
+            name = get_field(m_header + 345, 155) + "/" + name;
+        }
+    }
+    std::string linkname = m_long_link.empty() ? get_field(m_header + 157, 100) : m_long_link;
+    m_long_name.clear();
+    m_long_link.clear();
+
+    std::string path;
+    if (!clean_name(name, path))
+    {
+        pthread_mutex_lock(&m_mutex);
+        ++m_stats.skipped;
+        pthread_mutex_unlock(&m_mutex);
+        return true;
+    }
+    /* 不保留setuid/setgid/sticky，新建文件的权限再经过umask */
+    mode_t mode = parse_octal(m_header + 100, 8) & 0777;
+    time_t mtime = (m_header[136] & 0x80) ? 0 : parse_octal(m_header + 136, 12);
+
+    switch (type)
+    {
+    case '0':
+    case '\0':
+    case '7':
+        start_file(path, mode, mtime, size);
+        if (m_left == 0)
+        {
+            end_body();
+        }
+        break;
+    case '5':
+        if (!path.empty() && make_directory(path))
+        {
+            pthread_mutex_lock(&m_mutex);
+            ++m_stats.directories;
+            pthread_mutex_unlock(&m_mutex);
+        }
+        break;
+    case '2':
+        make_symlink(path, linkname);
+        break;
+    case '1':
+        make_hardlink(path, linkname);
+        break;
+    default:
+        /* 设备、管道等不解包 */
+        pthread_mutex_lock(&m_mutex);
+        ++m_stats.skipped;
+        pthread_mutex_unlock(&m_mutex);
+        break;
+    }
+    return true;
+}
+
+/*
+ * 小文件在写队列有空间时收进内存，否则打开文件边收边写
+ */
+void CTarExtract::start_file(const std::string& name, mode_t mode, time_t mtime, off_t size)
+{
+    if (name.empty() || !make_parent(name))
+    {
+        return;
+    }
+
+    m_file = new tar_file_t;
+    m_file->path = m_root + "/" + name;
+    m_file->mode = mode;
+    m_file->mtime = mtime;
+
+    pthread_mutex_lock(&m_mutex);
+    bool is_queued = size <= TAR_PARALLEL_FILE && m_queued_bytes + size <= TAR_WRITE_QUEUE;
+    if (is_queued)
+    {
+        m_queued_bytes += size;
+    }
+    pthread_mutex_unlock(&m_mutex);
+
+    if (is_queued)
+    {
+        m_file->data.reserve(size);
+        m_body = TAR_BODY_BUFFER;
+        return;
+    }
+
+    m_filefd = open_file(m_file->path, mode);
+    if (m_filefd < 0)
+    {
+        add_error(name, errno);
+        delete m_file;
+        m_file = NULL;
+        return;
+    }
+    m_file_offset = 0;
+    m_body = TAR_BODY_FILE;
+}
+
+void CTarExtract::write_body(const char* data, size_t length)
+{
+    if (m_body == TAR_BODY_BUFFER)
+    {
+        m_file->data.append(data, length);
+    }
+    else if (m_body == TAR_BODY_NAME)
+    {
+        m_name->append(data, length);
+    }
+    else if (m_body == TAR_BODY_FILE)
+    {
+        while (length > 0)
+        {
+            ssize_t n = pwrite(m_filefd, data, length, m_file_offset);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0)
+            {
+                /* 剩余内容丢弃，文件删除，不留下不完整的文件 */
+                add_error(m_file->path.substr(m_root.size() + 1), n < 0 ? errno : ENOSPC);
+                close(m_filefd);
+                m_filefd = -1;
+                unlink(m_file->path.c_str());
+                delete m_file;
+                m_file = NULL;
+                m_body = TAR_BODY_SKIP;
+                return;
+            }
+            data += n;
+            length -= n;
+            m_file_offset += n;
+        }
+    }
+}
+
+void CTarExtract::end_body()
+{
+    if (m_body == TAR_BODY_NAME)
+    {
+        /* 长文件名以'\0'结尾 */
+        m_name->resize(strnlen(m_name->c_str(), m_name->size()));
+    }
+    else if (m_body == TAR_BODY_BUFFER)
+    {
+        pthread_mutex_lock(&m_mutex);
+        m_queue.push_back(m_file);
+        pthread_mutex_unlock(&m_mutex);
+        m_file = NULL;
+        ++m_new_count;
+    }
+    else if (m_body == TAR_BODY_FILE)
+    {
+        set_mtime(m_filefd, m_file->mtime);
+        int error = close(m_filefd) < 0 ? errno : 0;
+        m_filefd = -1;
+        pthread_mutex_lock(&m_mutex);
+        if (error == 0)
+        {
+            ++m_stats.files;
+            m_stats.bytes += m_file_offset;
+        }
+        pthread_mutex_unlock(&m_mutex);
+        if (error != 0)
+        {
+            add_error(m_file->path.substr(m_root.size() + 1), error);
+        }
+        delete m_file;
+        m_file = NULL;
+    }
+    m_body = TAR_BODY_SKIP;
+}
+
+size_t CTarExtract::take_queued()
+{
+    size_t count = m_new_count;
+    m_new_count = 0;
+    return count;
+}
+
+/*
+ * 从写队列取出一个文件写入，队列为空时返回false，可以在多个线程中同时调用
+ */
+bool CTarExtract::write_next()
+{
+    pthread_mutex_lock(&m_mutex);
+    if (m_queue.empty())
+    {
+        pthread_mutex_unlock(&m_mutex);
+        return false;
+    }
+    tar_file_t* file = m_queue.front();
+    m_queue.pop_front();
+    ++m_writing;
+    pthread_mutex_unlock(&m_mutex);
+
+    bool is_success = write_file(*file);
+    int error = errno;
+
+    pthread_mutex_lock(&m_mutex);
+    --m_writing;
+    m_queued_bytes -= file->data.size();
+    if (is_success)
+    {
+        ++m_stats.files;
+        m_stats.bytes += file->data.size();
+    }
+    if (m_writing == 0)
+    {
+        pthread_cond_broadcast(&m_cond);
+    }
+    pthread_mutex_unlock(&m_mutex);
+
+    if (!is_success)
+    {
+        add_error(file->path.substr(m_root.size() + 1), error);
+    }
+    delete file;
+    return true;
+}
+
+/*
+ * 在调用线程中写完队列中剩余的文件，再等待其他线程正在写的文件
+ */
+void CTarExtract::finish()
+{
+    while (write_next())
+    {
+    }
+    pthread_mutex_lock(&m_mutex);
+    while (m_writing > 0)
+    {
+        pthread_cond_wait(&m_cond, &m_mutex);
+    }
+    pthread_mutex_unlock(&m_mutex);
+}
+
+tar_extract_stats_t CTarExtract::get_stats()
+{
+    pthread_mutex_lock(&m_mutex);
+    tar_extract_stats_t stats = m_stats;
+    pthread_mutex_unlock(&m_mutex);
+    return stats;
+}
+
+/*
+ * 已经存在的文件（不是目录）被替换
+ */
+void CTarExtract::make_symlink(const std::string& name, const std::string& target)
+{
+    if (name.empty() || target.empty() || !make_parent(name))
+    {
+        return;
+    }
+    std::string path = m_root + "/" + name;
+    if (symlink(target.c_str(), path.c_str()) < 0 && (errno != EEXIST || unlink(path.c_str()) < 0 ||
+                                                      symlink(target.c_str(), path.c_str()) < 0))
+    {
+        add_error(name, errno);
+        return;
+    }
+    pthread_mutex_lock(&m_mutex);
+    ++m_stats.links;
+    pthread_mutex_unlock(&m_mutex);
+}
+
+/*
+ * 硬链接的目标是包中前面的文件，它可能还在写队列中，先写完队列
+ * 目标的父目录从root开始逐级O_NOFOLLOW打开，包中前面创建的指向root之外的符号链接不会被经过
+ */
+void CTarExtract::make_hardlink(const std::string& name, const std::string& target)
+{
+    std::string target_path;
+    if (name.empty() || !clean_name(target, target_path) || target_path.empty() || !make_parent(name))
+    {
+        add_error(name, EINVAL);
+        return;
+    }
+    finish();
+
+    std::string base;
+    int dirfd = open_parent(target_path, base);
+    if (dirfd < 0)
+    {
+        add_error(name, errno);
+        return;
+    }
+    std::string path = m_root + "/" + name;
+    if (linkat(dirfd, base.c_str(), AT_FDCWD, path.c_str(), 0) < 0 &&
+        (errno != EEXIST || unlink(path.c_str()) < 0 || linkat(dirfd, base.c_str(), AT_FDCWD, path.c_str(), 0) < 0))
+    {
+        add_error(name, errno);
+        close(dirfd);
+        return;
+    }
+    close(dirfd);
+    pthread_mutex_lock(&m_mutex);
+    ++m_stats.links;
+    pthread_mutex_unlock(&m_mutex);
+}
+
+/*
+ * 逐级创建目录，已经存在的每一级用lstat确认是目录而不是符号链接
+ */
+bool CTarExtract::make_directory(const std::string& name)
+{
+    if (m_dirs.count(name) > 0)
+    {
+        return true;
+    }
+    if (!make_parent(name))
+    {
+        return false;
+    }
+
+    std::string path = m_root + "/" + name;
+    struct stat statinfo;
+    if (mkdir(path.c_str(), 0755) < 0 &&
+        (errno != EEXIST || lstat(path.c_str(), &statinfo) < 0 || !S_ISDIR(statinfo.st_mode)))
+    {
+        add_error(name, errno == EEXIST ? ENOTDIR : errno);
+        return false;
+    }
+    m_dirs.insert(name);
+    return true;
+}
+
+bool CTarExtract::make_parent(const std::string& name)
+{
+    std::string::size_type idx = name.find_last_of('/');
+    return idx == std::string::npos || make_directory(name.substr(0, idx));
+}
+
+/*
+ * 打开name的父目录，每一级用O_NOFOLLOW | O_DIRECTORY，是符号链接或者不是目录时失败，base为最后一级的名字
+ */
+int CTarExtract::open_parent(const std::string& name, std::string& base)
+{
+    int dirfd = open(m_root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    std::string::size_type start = 0;
+    std::string::size_type end;
+    while (dirfd >= 0 && (end = name.find('/', start)) != std::string::npos)
+    {
+        int fd = openat(dirfd, name.substr(start, end - start).c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        int error = errno;
+        close(dirfd);
+        errno = error;
+        dirfd = fd;
+        start = end + 1;
+    }
+    base = name.substr(start);
+    return dirfd;
+}
+
+void CTarExtract::add_error(const std::string& name, int error)
+{
+    pthread_mutex_lock(&m_mutex);
+    if (m_stats.errors++ == 0)
+    {
+        m_stats.error = name + ": " + strerror(error);
+    }
+    pthread_mutex_unlock(&m_mutex);
+}
+
+/*
+ * 去掉空的和.组成部分，有..时返回false；开头的/去掉，按相对root的路径处理
+ */
+bool CTarExtract::clean_name(const std::string& name, std::string& path)
+{
+    path.clear();
+    std::string::size_type start = 0;
+    while (start <= name.size())
+    {
+        std::string::size_type end = name.find('/', start);
+        if (end == std::string::npos)
+        {
+            end = name.size();
+        }
+        std::string part = name.substr(start, end - start);
+        start = end + 1;
+        if (part.empty() || part == ".")
+        {
+            continue;
+        }
+        if (part == "..")
+        {
+            return false;
+        }
+        if (!path.empty())
+        {
+            path += "/";
+        }
+        path += part;
+    }
+    return true;
+}
+
+/*
+ * O_NOFOLLOW：已经存在的同名符号链接被删除后重新创建，不会写到链接指向的文件
+ * 权限只在创建时经过umask设置，已经存在的文件保持原来的权限
+ */
+int CTarExtract::open_file(const std::string& path, mode_t mode)
+{
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC;
+    int fd = open(path.c_str(), flags, mode);
+    if (fd < 0 && errno == ELOOP && unlink(path.c_str()) == 0)
+    {
+        fd = open(path.c_str(), flags, mode);
+    }
+    return fd;
+}
+
+bool CTarExtract::write_file(const tar_file_t& file)
+{
+    int fd = open_file(file.path, file.mode);
+    if (fd < 0)
+    {
+        return false;
+    }
+    size_t written = 0;
+    while (written < file.data.size())
+    {
+        ssize_t n = pwrite(fd, file.data.data() + written, file.data.size() - written, written);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0)
+        {
+            if (n == 0)
+                errno = ENOSPC;
+            int error = errno;
+            close(fd);
+            unlink(file.path.c_str());
+            errno = error;
+            return false;
+        }
+        written += n;
+    }
+    set_mtime(fd, file.mtime);
+    return close(fd) == 0;
+}
+
+bool CTarExtract::set_mtime(int fd, time_t mtime)
+{
+    struct timespec times[2];
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1].tv_sec = mtime;
+    times[1].tv_nsec = 0;
+    return futimens(fd, times) == 0;
+}
+
+std::string CTarExtract::get_field(const char* field, size_t width)
+{
+    return std::string(field, strnlen(field, width));
+}
+
+unsigned long long CTarExtract::parse_octal(const char* field, size_t width)
+{
+    unsigned long long value = 0;
+    size_t i = 0;
+    while (i < width && field[i] == ' ')
+    {
+        ++i;
+    }
+    for (; i < width && field[i] >= '0' && field[i] <= '7'; ++i)
+    {
+        value = (value << 3) | (field[i] - '0');
+    }
+    return value;
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include "tar_stream.h"
+
+#include <pthread.h>
+#include <atomic>
+#include <deque>
+#include <set>
+#include <string>
+
+/* 不超过这么大的文件先收进内存，由I/O线程池并行写入 */
+const off_t TAR_PARALLEL_FILE = 256 * 1024;
+/* 内存中等待写入的文件内容最多这么多字节，超过后新文件由接收线程直接写入 */
+const size_t TAR_WRITE_QUEUE = 32 * 1024 * 1024;
+
+struct tar_extract_stats_t
+{
+    long files;
+    long directories;
+    long links;
+    /* 路径不安全或者类型不支持而没有解包的条目 */
+    long skipped;
+    long errors;
+    off_t bytes;
+    /* 第一个错误 */
+    std::string error;
+};
+
+/*
+ * 把接收到的tar流解包到root目录，格式和CTarStream生成的相同（GNU tar，也接受ustar的prefix字段）
+ * 数据按任意长度分段交给feed()，目录、符号链接和大文件在feed()中直接创建和写入，
+ * 小文件收齐后放进写队列，由调用者安排线程调用write_next()并行写入，finish()写完剩余文件并等待写入结束
+ *
+ * 路径中的..和开头的/被拒绝，父目录逐级lstat确认是真正的目录，不会经过包中的符号链接写到root之外，
+ * 硬链接的目标也逐级O_NOFOLLOW打开，不会链接到root之外的文件；文件权限去掉setuid/setgid/sticky，新建时经过umask
+ * 写队列中的任务可能比上传任务活得久，用引用计数管理：创建时为1，每个引用acquire()，用完release()
+ */
+class CTarExtract
+{
+public:
+    CTarExtract();
+
+    bool open_extract(const std::string& root);
+    bool feed(const char* data, size_t length);
+    /* 结尾的两个全0块之后还要读到TAR_RECORD的边界，记录中剩余的填充不解析 */
+    bool is_finished() const
+    {
+        return m_zero_blocks >= 2 && m_consumed % TAR_RECORD == 0;
+    }
+    /* 上次调用之后进入写队列的文件数 */
+    size_t take_queued();
+    bool write_next();
+    void finish();
+    tar_extract_stats_t get_stats();
+
+    void acquire();
+    void release();
+
+private:
+    ~CTarExtract();
+
+    struct tar_file_t
+    {
+        std::string path;
+        mode_t mode;
+        time_t mtime;
+        std::string data;
+    };
+
+    enum TAR_BODY
+    {
+        TAR_BODY_SKIP,
+        TAR_BODY_FILE,
+        TAR_BODY_BUFFER,
+        TAR_BODY_NAME
+    };
+
+    bool process_header();
+    void start_file(const std::string& name, mode_t mode, time_t mtime, off_t size);
+    void write_body(const char* data, size_t length);
+    void end_body();
+    void make_symlink(const std::string& name, const std::string& target);
+    void make_hardlink(const std::string& name, const std::string& target);
+    bool make_directory(const std::string& name);
+    bool make_parent(const std::string& name);
+    int open_parent(const std::string& name, std::string& base);
+    void add_error(const std::string& name, int error);
+
+    static bool clean_name(const std::string& name, std::string& path);
+    static int open_file(const std::string& path, mode_t mode);
+    static bool write_file(const tar_file_t& file);
+    static bool set_mtime(int fd, time_t mtime);
+    static std::string get_field(const char* field, size_t width);
+    static unsigned long long parse_octal(const char* field, size_t width);
+
+private:
+    std::atomic<int> m_refs;
+    std::string m_root;
+    /* 已经确认过的目录，相对root的路径，""为root */
+    std::set<std::string> m_dirs;
+
+    char m_header[TAR_BLOCK];
+    size_t m_header_fill;
+    int m_zero_blocks;
+    /* feed()已经处理的字节数 */
+    off_t m_consumed;
+    std::string m_long_name;
+    std::string m_long_link;
+
+    /* 当前条目的内容：剩余字节数、之后的填充字节数 */
+    TAR_BODY m_body;
+    off_t m_left;
+    size_t m_padding;
+    /* TAR_BODY_FILE直接写入的文件 */
+    int m_filefd;
+    off_t m_file_offset;
+    tar_file_t* m_file;
+    std::string* m_name;
+    size_t m_new_count;
+
+    /* 以下受m_mutex保护 */
+    std::deque<tar_file_t*> m_queue;
+    size_t m_queued_bytes;
+    int m_writing;
+    tar_extract_stats_t m_stats;
+
+    pthread_mutex_t m_mutex;
+    pthread_cond_t m_cond;
+};
@@ -0,0 +1,406 @@
+#include "tar_stream.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <limits.h>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+
+/* fill_zero()时用来补齐的0 */
+static const char TAR_ZERO[64 * 1024] = {0};
+
+CTarStream::CTarStream() : m_buffer_offset(0), m_filefd(-1), m_file_offset(0), m_file_left(0),
+                           m_is_zero_fill(false), m_is_finished(false), m_file_count(0),
+                           m_stream_size(0)
+{
+
+}
+
+CTarStream::~CTarStream()
+{
+    if (m_filefd >= 0)
+    {
+        close(m_filefd);
+    }
+    while (!m_frames.empty())
+    {
+        pop_directory();
+    }
+}
+
+/*
+ * 包中的路径以目录名开头，例如打包/data/logs得到 logs/、logs/a.txt ...
+ */
+bool CTarStream::open_stream(const std::string& path)
+{
+    struct stat statinfo;
+    if (stat(path.c_str(), &statinfo) < 0 || !S_ISDIR(statinfo.st_mode))
+    {
+        return false;
+    }
+
+    std::string root(path);
+    while (root.size() > 1 && root[root.size() - 1] == '/')
+    {
+        root.erase(root.size() - 1);
+    }
+    std::string::size_type idx = root.find_last_of('/');
+    std::string name = idx == std::string::npos ? root : root.substr(idx + 1);
+    if (name.empty() || name == "." || name == "..")
+    {
+        name = "archive";
+    }
+
+    add_header(name + "/", statinfo, '5', "");
+    return push_directory(root, name + "/");
+}
+
+/*
+ * 没有文件内容等待发送时，后面连续的头部（目录、空文件、符号链接）和上一个文件的填充一起放进缓冲区，一次发送
+ */
+bool CTarStream::peek(tar_segment_t& segment)
+{
+    if (m_file_left == 0)
+    {
+        if (m_buffer_offset == m_buffer.size())
+        {
+            m_buffer.clear();
+            m_buffer_offset = 0;
+        }
+        while (m_file_left == 0 && m_buffer.size() - m_buffer_offset < TAR_HEADER_BATCH && advance())
+        {
+        }
+    }
+
+    if (m_buffer_offset < m_buffer.size())
+    {
+        segment.data = m_buffer.data() + m_buffer_offset;
+        segment.filefd = -1;
+        segment.offset = 0;
+        segment.length = m_buffer.size() - m_buffer_offset;
+        return true;
+    }
+    if (m_file_left > 0)
+    {
+        segment.data = m_is_zero_fill ? TAR_ZERO : NULL;
+        segment.filefd = m_filefd;
+        segment.offset = m_file_offset;
+        segment.length = m_is_zero_fill ? std::min<off_t>(m_file_left, sizeof(TAR_ZERO)) : m_file_left;
+        return true;
+    }
+    return false;
+}
+
+/*
+ * 文件内容发送完时关闭文件，补齐到块大小的0放入缓冲区
+ */
+void CTarStream::consume(size_t length)
+{
+    m_stream_size += length;
+    if (m_buffer_offset < m_buffer.size())
+    {
+        m_buffer_offset += length;
+        return;
+    }
+
+    m_file_offset += length;
+    m_file_left -= length;
+    if (m_file_left == 0)
+    {
+        close(m_filefd);
+        m_filefd = -1;
+        m_is_zero_fill = false;
+        m_buffer.clear();
+        m_buffer_offset = 0;
+        add_padding(m_file_offset);
+    }
+}
+
+void CTarStream::fill_zero()
+{
+    m_is_zero_fill = true;
+}
+
+/*
+ * 生成下一个条目的头部，目录遍历结束时生成两个全0块作为结尾，之后返回false
+ */
+bool CTarStream::advance()
+{
+    while (!m_frames.empty())
+    {
+        tar_frame_t& frame = m_frames.back();
+        if (frame.index >= frame.entries.size())
+        {
+            pop_directory();
+            continue;
+        }
+
+        tar_entry_t& entry = frame.entries[frame.index++];
+        open_ahead(frame);
+        std::string name = frame.prefix + entry.name;
+        const struct stat& statinfo = entry.statinfo;
+        if (S_ISDIR(statinfo.st_mode))
+        {
+            std::string path = frame.path + "/" + entry.name;
+            add_header(name + "/", statinfo, '5', "");
+            /* 打不开的目录只保留目录本身 */
+            push_directory(path, name + "/");
+            return true;
+        }
+        else if (S_ISREG(statinfo.st_mode))
+        {
+            if (entry.filefd < 0)
+            {
+                continue;
+            }
+            add_header(name, statinfo, '0', "");
+            m_filefd = entry.filefd;
+            entry.filefd = -1;
+            m_file_offset = 0;
+            m_file_left = statinfo.st_size;
+            ++m_file_count;
+            if (m_file_left == 0)
+            {
+                close(m_filefd);
+                m_filefd = -1;
+            }
+            return true;
+        }
+        else if (S_ISLNK(statinfo.st_mode))
+        {
+            char target[PATH_MAX];
+            ssize_t n = readlink((frame.path + "/" + entry.name).c_str(), target, sizeof(target));
+            if (n <= 0)
+            {
+                continue;
+            }
+            add_header(name, statinfo, '2', std::string(target, n));
+            return true;
+        }
+        /* 设备、管道、套接字不打包 */
+    }
+
+    if (m_is_finished)
+    {
+        return false;
+    }
+    m_is_finished = true;
+    /* 结尾的两个全0块，再用0补齐到TAR_RECORD */
+    off_t size = m_stream_size + (m_buffer.size() - m_buffer_offset) + TAR_BLOCK * 2;
+    m_buffer.resize(m_buffer.size() + TAR_BLOCK * 2 + (TAR_RECORD - size % TAR_RECORD) % TAR_RECORD, 0);
+    return true;
+}
+
+/*
+ * 一次读出目录的全部条目，按inode顺序stat，inode相邻的文件在磁盘上通常也相邻
+ */
+bool CTarStream::push_directory(const std::string& path, const std::string& prefix)
+{
+    DIR* dir = opendir(path.c_str());
+    if (dir == NULL)
+    {
+        return false;
+    }
+
+    std::vector<std::pair<ino_t, std::string> > names;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        {
+            continue;
+        }
+        names.push_back(std::make_pair(entry->d_ino, std::string(entry->d_name)));
+    }
+    std::sort(names.begin(), names.end());
+
+    tar_frame_t frame;
+    frame.prefix = prefix;
+    frame.path = path;
+    frame.index = 0;
+    frame.entries.reserve(names.size());
+    for (size_t i = 0; i < names.size(); ++i)
+    {
+        tar_entry_t item;
+        item.name = names[i].second;
+        item.filefd = -1;
+        if (fstatat(dirfd(dir), item.name.c_str(), &item.statinfo, AT_SYMLINK_NOFOLLOW) == 0)
+        {
+            frame.entries.push_back(item);
+        }
+    }
+    closedir(dir);
+
+    m_frames.push_back(frame);
+    open_ahead(m_frames.back());
+    return true;
+}
+
+void CTarStream::pop_directory()
+{
+    tar_frame_t& frame = m_frames.back();
+    for (size_t i = frame.index; i < frame.entries.size(); ++i)
+    {
+        if (frame.entries[i].filefd >= 0)
+        {
+            close(frame.entries[i].filefd);
+        }
+    }
+    m_frames.pop_back();
+}
+
+/*
+ * 保证当前位置之后的TAR_READAHEAD个普通文件已经打开，新打开的文件通知内核预读
+ * 预读在后台进行，发送当前文件时后面的小文件已经在页缓存中
+ */
+void CTarStream::open_ahead(tar_frame_t& frame)
+{
+    size_t count = 0;
+    for (size_t i = frame.index; i < frame.entries.size() && count < TAR_READAHEAD; ++i)
+    {
+        tar_entry_t& entry = frame.entries[i];
+        if (!S_ISREG(entry.statinfo.st_mode))
+        {
+            continue;
+        }
+        ++count;
+        if (entry.filefd >= 0)
+        {
+            continue;
+        }
+        entry.filefd = open((frame.path + "/" + entry.name).c_str(), O_RDONLY | O_CLOEXEC);
+        if (entry.filefd >= 0 && entry.statinfo.st_size > 0)
+        {
+            posix_fadvise(entry.filefd, 0, entry.statinfo.st_size, POSIX_FADV_WILLNEED);
+        }
+    }
+}
+
+void CTarStream::add_header(const std::string& name, const struct stat& statinfo, char type, const std::string& linkname)
+{
+    if (name.size() > 100)
+    {
+        add_long_name('L', name);
+    }
+    if (linkname.size() > 100)
+    {
+        add_long_name('K', linkname);
+    }
+
+    char header[TAR_BLOCK];
+    memset(header, 0, sizeof(header));
+    put_string(header, 100, name);
+    put_number(header + 100, 8, statinfo.st_mode & 07777);
+    put_number(header + 108, 8, statinfo.st_uid);
+    put_number(header + 116, 8, statinfo.st_gid);
+    put_number(header + 124, 12, type == '0' ? statinfo.st_size : 0);
+    put_number(header + 136, 12, statinfo.st_mtime > 0 ? statinfo.st_mtime : 0);
+    header[156] = type;
+    put_string(header + 157, 100, linkname);
+    add_block(header);
+}
+
+/*
+ * GNU扩展：超过100字节的文件名或者链接目标放在类型为L/K的伪条目中，紧跟在真正的头部之前
+ */
+void CTarStream::add_long_name(char type, const std::string& name)
+{
+    char header[TAR_BLOCK];
+    memset(header, 0, sizeof(header));
+    put_string(header, 100, "././@LongLink");
+    put_number(header + 100, 8, 0);
+    put_number(header + 108, 8, 0);
+    put_number(header + 116, 8, 0);
+    put_number(header + 124, 12, name.size() + 1);
+    put_number(header + 136, 12, 0);
+    header[156] = type;
+    add_block(header);
+
+    m_buffer.insert(m_buffer.end(), name.begin(), name.end());
+    m_buffer.push_back('\0');
+    add_padding(name.size() + 1);
+}
+
+/*
+ * 填写GNU格式的magic和校验和后追加到缓冲区，校验和按校验和字段为8个空格计算
+ */
+void CTarStream::add_block(char* header)
+{
+    memcpy(header + 257, "ustar  ", 8);
+    memset(header + 148, ' ', 8);
+    unsigned int sum = 0;
+    for (size_t i = 0; i < TAR_BLOCK; ++i)
+    {
+        sum += static_cast<unsigned char>(header[i]);
+    }
+    snprintf(header + 148, 8, "%06o", sum);
+    header[155] = ' ';
+    m_buffer.insert(m_buffer.end(), header, header + TAR_BLOCK);
+}
+
+void CTarStream::add_padding(off_t size)
+{
+    size_t padding = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+    m_buffer.resize(m_buffer.size() + padding, 0);
+}
+
+void CTarStream::put_string(char* field, size_t width, const std::string& value)
+{
+    memcpy(field, value.c_str(), std::min(width, value.size()));
+}
+
+/*
+ * 能放下时写成以'\0'结尾的八进制，否则用GNU的base-256：首字节0x80，其余字节为大端整数
+ */
+void CTarStream::put_number(char* field, size_t width, unsigned long long value)
+{
+    if (value < (1ULL << (3 * (width - 1))))
+    {
+        snprintf(field, width, "%0*llo", static_cast<int>(width - 1), value);
+        return;
+    }
+    memset(field, 0, width);
+    field[0] = static_cast<char>(0x80);
+    for (size_t i = width - 1; i > 0 && value > 0; --i)
+    {
+        field[i] = static_cast<char>(value & 0xff);
+        value >>= 8;
+    }
+}
+
+bool CTarStream::parse_size(const char* header, off_t& size)
+{
+    const unsigned char* field = reinterpret_cast<const unsigned char*>(header + 124);
+    if (field[0] & 0x80)
+    {
+        unsigned long long value = 0;
+        for (size_t i = 1; i < 12; ++i)
+        {
+            value = (value << 8) | field[i];
+        }
+        size = static_cast<off_t>(value);
+        return size >= 0;
+    }
+
+    char octal[13];
+    memcpy(octal, header + 124, 12);
+    octal[12] = '\0';
+    char* end = NULL;
+    size = static_cast<off_t>(strtoull(octal, &end, 8));
+    return end != octal && (*end == '\0' || *end == ' ');
+}
+
+bool CTarStream::is_zero_block(const char* block)
+{
+    for (size_t i = 0; i < TAR_BLOCK; ++i)
+    {
+        if (block[i] != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+
+const size_t TAR_BLOCK = 512;
+/* 包的总长度补齐到记录大小（tar默认的20个块），接收方读到记录结尾为止，数据连接上不留下多余的字节 */
+const size_t TAR_RECORD = 20 * TAR_BLOCK;
+/* 头部在缓冲区中攒到这么多字节后发送 */
+const size_t TAR_HEADER_BATCH = 64 * 1024;
+/* 当前文件之后预先打开并发出readahead的普通文件数 */
+const size_t TAR_READAHEAD = 16;
+
+/*
+ * 输出流的一段：data不为NULL时是内存中的头部和填充，否则是文件filefd从offset开始的length字节
+ */
+struct tar_segment_t
+{
+    const char* data;
+    int filefd;
+    off_t offset;
+    size_t length;
+};
+
+/*
+ * 边遍历目录边生成GNU tar流，不生成临时文件，文件内容由调用者用sendfile直接发送
+ * 每个目录的条目一次读出并stat，普通文件按inode排序，减少小文件的磁盘寻道；
+ * 当前文件之后的TAR_READAHEAD个文件提前打开并posix_fadvise(WILLNEED)，内核在发送当前文件时并行读入
+ *
+ * 用法：peek()取当前一段，发送n字节后consume(n)，peek()返回false时结束
+ * 文件在打包过程中变短时调用fill_zero()，剩余部分用0补齐，保证头部中的大小和内容一致
+ */
+class CTarStream
+{
+public:
+    CTarStream();
+    ~CTarStream();
+
+    bool open_stream(const std::string& path);
+    bool peek(tar_segment_t& segment);
+    void consume(size_t length);
+    void fill_zero();
+
+    off_t get_file_count() const
+    {
+        return m_file_count;
+    }
+
+    /* 解析头部的大小字段，八进制或者GNU的base-256 */
+    static bool parse_size(const char* header, off_t& size);
+    static bool is_zero_block(const char* block);
+
+private:
+    struct tar_entry_t
+    {
+        std::string name;
+        struct stat statinfo;
+        int filefd;
+    };
+
+    struct tar_frame_t
+    {
+        /* 在包中的目录名，以'/'结尾 */
+        std::string prefix;
+        std::string path;
+        std::vector<tar_entry_t> entries;
+        size_t index;
+    };
+
+    bool advance();
+    bool push_directory(const std::string& path, const std::string& prefix);
+    void pop_directory();
+    void open_ahead(tar_frame_t& frame);
+    void add_header(const std::string& name, const struct stat& statinfo, char type, const std::string& linkname);
+    void add_long_name(char type, const std::string& name);
+    void add_block(char* header);
+    void add_padding(off_t size);
+
+    static void put_string(char* field, size_t width, const std::string& value);
+    static void put_number(char* field, size_t width, unsigned long long value);
+
+private:
+    std::vector<tar_frame_t> m_frames;
+    /* 等待发送的头部和填充 */
+    std::vector<char> m_buffer;
+    size_t m_buffer_offset;
+    /* 正在发送内容的文件，-1表示没有 */
+    int m_filefd;
+    off_t m_file_offset;
+    off_t m_file_left;
+    bool m_is_zero_fill;
+    bool m_is_finished;
+    off_t m_file_count;
+    /* 已经consume()的字节数 */
+    off_t m_stream_size;
+};
@@ -0,0 +1,161 @@
+#include "timer_wheel.h"
+
+CTimerWheel::CTimerWheel() : m_current(0)
+{
+    for (int i = 0; i < TIMER_NEAR_SIZE; ++i)
+    {
+        list_init(&m_near[i]);
+    }
+    for (int level = 0; level < TIMER_LEVELS; ++level)
+    {
+        for (int i = 0; i < TIMER_LEVEL_SIZE; ++i)
+        {
+            list_init(&m_levels[level][i]);
+        }
+    }
+}
+
+CTimerWheel::~CTimerWheel()
+{
+
+}
+
+void CTimerWheel::list_init(timer_node_t* head)
+{
+    head->prev = head;
+    head->next = head;
+}
+
+void CTimerWheel::list_append(timer_node_t* head, timer_node_t* node)
+{
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+void CTimerWheel::list_remove(timer_node_t* node)
+{
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = NULL;
+    node->next = NULL;
+}
+
+bool CTimerWheel::is_active(const timer_node_t* node) const
+{
+    return node->next != NULL;
+}
+
+/*
+ * timeout个tick之后到期，已经在时间轮中的节点会先被取消
+ */
+void CTimerWheel::add_timer(timer_node_t* node, uint64_t timeout)
+{
+    if (is_active(node))
+    {
+        list_remove(node);
+    }
+    node->expire = m_current + (timeout == 0 ? 1 : timeout);
+    link(node);
+}
+
+void CTimerWheel::cancel_timer(timer_node_t* node)
+{
+    if (is_active(node))
+    {
+        list_remove(node);
+    }
+}
+
+/*
+ * 根据剩余时间放到对应层的槽中
+ */
+void CTimerWheel::link(timer_node_t* node)
+{
+    uint64_t expire = node->expire;
+    uint64_t delta = expire > m_current ? expire - m_current : 0;
+
+    if (delta < static_cast<uint64_t>(TIMER_NEAR_SIZE))
+    {
+        list_append(&m_near[expire & (TIMER_NEAR_SIZE - 1)], node);
+        return;
+    }
+
+    int shift = TIMER_NEAR_BITS;
+    for (int level = 0; level < TIMER_LEVELS; ++level)
+    {
+        uint64_t range = 1ULL << (shift + TIMER_LEVEL_BITS);
+        if (delta < range || level == TIMER_LEVELS - 1)
+        {
+            if (delta >= range)
+            {
+                /* 超出时间轮范围的放到最高层的最远处，下放时会重新计算 */
+                expire = m_current + range - 1;
+            }
+            list_append(&m_levels[level][(expire >> shift) & (TIMER_LEVEL_SIZE - 1)], node);
+            return;
+        }
+        shift += TIMER_LEVEL_BITS;
+    }
+}
+
+/*
+ * 把高层一个槽中的节点按剩余时间重新放到低层
+ */
+void CTimerWheel::cascade(int level, int idx)
+{
+    timer_node_t pending;
+    list_init(&pending);
+    timer_node_t* head = &m_levels[level][idx];
+    if (head->next == head)
+    {
+        return;
+    }
+    pending.next = head->next;
+    pending.prev = head->prev;
+    pending.next->prev = &pending;
+    pending.prev->next = &pending;
+    list_init(head);
+
+    while (pending.next != &pending)
+    {
+        timer_node_t* node = pending.next;
+        list_remove(node);
+        link(node);
+    }
+}
+
+/*
+ * 前进ticks个tick，对每个到期的节点调用callback，节点在回调前已经从时间轮中移除
+ * 回调中可以重新add_timer
+ */
+void CTimerWheel::tick(uint64_t ticks, timer_callback_t callback, void* arg)
+{
+    while (ticks--)
+    {
+        ++m_current;
+        if ((m_current & (TIMER_NEAR_SIZE - 1)) == 0)
+        {
+            uint64_t t = m_current >> TIMER_NEAR_BITS;
+            for (int level = 0; level < TIMER_LEVELS; ++level)
+            {
+                int idx = t & (TIMER_LEVEL_SIZE - 1);
+                cascade(level, idx);
+                if (idx != 0)
+                {
+                    break;
+                }
+                t >>= TIMER_LEVEL_BITS;
+            }
+        }
+
+        timer_node_t* head = &m_near[m_current & (TIMER_NEAR_SIZE - 1)];
+        while (head->next != head)
+        {
+            timer_node_t* node = head->next;
+            list_remove(node);
+            callback(node, arg);
+        }
+    }
+}
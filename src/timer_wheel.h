@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+const int TIMER_NEAR_BITS = 8;
+const int TIMER_LEVEL_BITS = 6;
+const int TIMER_LEVELS = 3;
+const int TIMER_NEAR_SIZE = 1 << TIMER_NEAR_BITS;
+const int TIMER_LEVEL_SIZE = 1 << TIMER_LEVEL_BITS;
+
+/*
+ * 定时器节点，嵌入到使用者的结构体中，加入和取消都不需要分配内存
+ */
+struct timer_node_t
+{
+    timer_node_t* prev;
+    timer_node_t* next;
+    uint64_t expire;
+    int fd;
+
+    timer_node_t() : prev(NULL), next(NULL), expire(0), fd(-1)
+    {
+    }
+};
+
+typedef void (*timer_callback_t)(timer_node_t* node, void* arg);
+
+/*
+ * 分层时间轮，第0层256个槽，之后每层64个槽，每个tick为1秒时可以覆盖约194天
+ * 加入、取消定时器O(1)，每个tick只处理到期的槽，高层的槽在低层转完一圈时下放一次
+ * 不是线程安全的，只在epoll主循环中使用
+ */
+class CTimerWheel
+{
+public:
+    CTimerWheel();
+    ~CTimerWheel();
+
+    void add_timer(timer_node_t* node, uint64_t timeout);
+    void cancel_timer(timer_node_t* node);
+    bool is_active(const timer_node_t* node) const;
+
+    void tick(uint64_t ticks, timer_callback_t callback, void* arg);
+
+    uint64_t get_current() const
+    {
+        return m_current;
+    }
+
+private:
+    void link(timer_node_t* node);
+    void cascade(int level, int idx);
+
+    static void list_init(timer_node_t* head);
+    static void list_append(timer_node_t* head, timer_node_t* node);
+    static void list_remove(timer_node_t* node);
+
+private:
+    uint64_t m_current;
+    timer_node_t m_near[TIMER_NEAR_SIZE];
+    timer_node_t m_levels[TIMER_LEVELS][TIMER_LEVEL_SIZE];
+};
@@ -0,0 +1,242 @@
+#include "tls.h"
+
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <openssl/x509v3.h>
+#include <cerrno>
+#include <iostream>
+
+CTLSContext::CTLSContext() : m_ctx(NULL), m_is_verify(false)
+{
+
+}
+
+CTLSContext::~CTLSContext()
+{
+    if (m_ctx != NULL)
+    {
+        SSL_CTX_free(m_ctx);
+    }
+}
+
+/*
+ * kTLS只支持AES-GCM等少数套件
+ * OpenSSL 3.2之前TLS 1.3只能卸载发送方向，为了让接收方向也走内核，开启kTLS时限制为TLS 1.2
+ */
+bool CTLSContext::init_context(const SSL_METHOD* method, bool is_ktls)
+{
+    m_ctx = SSL_CTX_new(method);
+    if (m_ctx == NULL)
+    {
+        ERR_print_errors_fp(stderr);
+        return false;
+    }
+    SSL_CTX_set_min_proto_version(m_ctx, TLS1_2_VERSION);
+    SSL_CTX_set_mode(m_ctx, SSL_MODE_AUTO_RETRY);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    /* 对端不发close_notify直接关闭连接时按正常结束处理 */
+    SSL_CTX_set_options(m_ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+
+    if (is_ktls)
+    {
+#ifdef SSL_OP_ENABLE_KTLS
+        SSL_CTX_set_options(m_ctx, SSL_OP_ENABLE_KTLS);
+        SSL_CTX_set_cipher_list(m_ctx, "ECDHE+AESGCM");
+#if OPENSSL_VERSION_NUMBER < 0x30200000L
+        SSL_CTX_set_max_proto_version(m_ctx, TLS1_2_VERSION);
+#endif
+#endif
+    }
+    return true;
+}
+
+bool CTLSContext::create_server(const std::string& cert_file, const std::string& key_file, bool is_ktls)
+{
+    if (!init_context(TLS_server_method(), is_ktls))
+    {
+        return false;
+    }
+    /* 数据连接每次传输都要握手，不发送会话票据，避免kTLS接收方向遇到握手后的消息 */
+    SSL_CTX_set_options(m_ctx, SSL_OP_NO_TICKET);
+
+    if (SSL_CTX_use_certificate_chain_file(m_ctx, cert_file.c_str()) != 1 ||
+        SSL_CTX_use_PrivateKey_file(m_ctx, key_file.c_str(), SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(m_ctx) != 1)
+    {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(m_ctx);
+        m_ctx = NULL;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * 默认校验服务器证书链和证书中的主机名/IP，失败时握手失败；关闭校验只能防止被动窃听，打印警告
+ */
+bool CTLSContext::create_client(bool is_ktls, const std::string& host, const std::string& ca_file, bool is_verify)
+{
+    if (!init_context(TLS_client_method(), is_ktls))
+    {
+        return false;
+    }
+    m_host = host;
+    m_is_verify = is_verify;
+    if (!is_verify)
+    {
+        std::cerr << "WARNING: TLS certificate verification disabled, the connection is open to man-in-the-middle attacks"
+                  << std::endl;
+        SSL_CTX_set_verify(m_ctx, SSL_VERIFY_NONE, NULL);
+        return true;
+    }
+
+    int ret = ca_file.empty() ? SSL_CTX_set_default_verify_paths(m_ctx)
+                              : SSL_CTX_load_verify_locations(m_ctx, ca_file.c_str(), NULL);
+    if (ret != 1)
+    {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(m_ctx);
+        m_ctx = NULL;
+        return false;
+    }
+    SSL_CTX_set_verify(m_ctx, SSL_VERIFY_PEER, NULL);
+    return true;
+}
+
+SSL* CTLSContext::accept(int fd)
+{
+    return handshake(fd, true);
+}
+
+SSL* CTLSContext::connect(int fd)
+{
+    return handshake(fd, false);
+}
+
+/*
+ * 在阻塞套接字上完成握手，失败返回NULL
+ */
+SSL* CTLSContext::handshake(int fd, bool is_server)
+{
+    if (m_ctx == NULL)
+    {
+        return NULL;
+    }
+
+    SSL* ssl = SSL_new(m_ctx);
+    if (ssl == NULL)
+    {
+        return NULL;
+    }
+    SSL_set_fd(ssl, fd);
+
+    /* host是IP地址时和证书中的IP比较，否则和DNS名字比较 */
+    if (!is_server && m_is_verify)
+    {
+        unsigned char address[sizeof(struct in6_addr)];
+        bool is_ip = inet_pton(AF_INET, m_host.c_str(), address) == 1 || inet_pton(AF_INET6, m_host.c_str(), address) == 1;
+        X509_VERIFY_PARAM* param = SSL_get0_param(ssl);
+        X509_VERIFY_PARAM_set_hostflags(param, X509_CHECK_FLAG_NO_PARTIAL_WILDCARDS);
+        int ret = is_ip ? X509_VERIFY_PARAM_set1_ip_asc(param, m_host.c_str()) : SSL_set1_host(ssl, m_host.c_str());
+        if (ret != 1)
+        {
+            SSL_free(ssl);
+            return NULL;
+        }
+        if (!is_ip)
+        {
+            SSL_set_tlsext_host_name(ssl, m_host.c_str());
+        }
+    }
+
+    int ret = is_server ? SSL_accept(ssl) : SSL_connect(ssl);
+    if (ret != 1)
+    {
+        ERR_print_errors_fp(stderr);
+        if (!is_server && SSL_get_verify_result(ssl) != X509_V_OK)
+        {
+            std::cerr << "certificate verify failed: " << X509_verify_cert_error_string(SSL_get_verify_result(ssl)) << std::endl;
+        }
+        SSL_free(ssl);
+        return NULL;
+    }
+    return ssl;
+}
+
+/*
+ * ssl为NULL或者发送方向已经交给内核时直接send，否则由OpenSSL加密
+ */
+ssize_t CTLSContext::send(SSL* ssl, int fd, const void* buffer, size_t length)
+{
+    if (ssl == NULL || is_ktls_send(ssl))
+    {
+        return ::send(fd, buffer, length, MSG_NOSIGNAL);
+    }
+
+    size_t written = 0;
+    int ret = SSL_write_ex(ssl, buffer, length, &written);
+    return ret == 1 ? static_cast<ssize_t>(written) : -1;
+}
+
+/*
+ * 返回0表示对端关闭，包括收到close_notify
+ */
+ssize_t CTLSContext::recv(SSL* ssl, int fd, void* buffer, size_t length)
+{
+    if (ssl == NULL || is_ktls_recv(ssl))
+    {
+        ssize_t n;
+        do
+        {
+            n = ::recv(fd, buffer, length, 0);
+        } while (n < 0 && errno == EINTR);
+        return n;
+    }
+
+    size_t readbytes = 0;
+    if (SSL_read_ex(ssl, buffer, length, &readbytes) == 1)
+    {
+        return static_cast<ssize_t>(readbytes);
+    }
+    return SSL_get_error(ssl, 0) == SSL_ERROR_ZERO_RETURN ? 0 : -1;
+}
+
+/*
+ * 不阻塞地判断是否有数据可读，OpenSSL缓冲区中已经解密的数据也算
+ */
+bool CTLSContext::is_readable(SSL* ssl, int fd)
+{
+    if (ssl != NULL && SSL_pending(ssl) > 0)
+    {
+        return true;
+    }
+    char ch;
+    ssize_t n;
+    do
+    {
+        n = ::recv(fd, &ch, 1, MSG_PEEK | MSG_DONTWAIT);
+    } while (n < 0 && errno == EINTR);
+    return n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+}
+
+bool CTLSContext::is_ktls_send(SSL* ssl)
+{
+    return ssl != NULL && BIO_get_ktls_send(SSL_get_wbio(ssl)) > 0;
+}
+
+bool CTLSContext::is_ktls_recv(SSL* ssl)
+{
+    return ssl != NULL && BIO_get_ktls_recv(SSL_get_rbio(ssl)) > 0;
+}
+
+/*
+ * 只释放TLS状态，不发送close_notify，套接字由调用者关闭
+ */
+void CTLSContext::release(SSL* ssl)
+{
+    if (ssl != NULL)
+    {
+        SSL_free(ssl);
+    }
+}
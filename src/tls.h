@@ -0,0 +1,45 @@
+#pragma once
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <sys/types.h>
+#include <string>
+
+/*
+ * TLS上下文，服务器和客户端各一个，用于控制连接(AUTH TLS)和数据连接(PROT P)
+ * 开启kTLS时握手之后由内核加解密，套接字上可以继续使用send/recv/sendfile/splice，
+ * 内核不支持时退回OpenSSL在用户态加解密
+ */
+class CTLSContext
+{
+public:
+    CTLSContext();
+    ~CTLSContext();
+
+    bool create_server(const std::string& cert_file, const std::string& key_file, bool is_ktls);
+    /* 客户端连接的都是host，is_verify时用ca_file（为空时用系统默认的CA）校验证书链和host */
+    bool create_client(bool is_ktls, const std::string& host, const std::string& ca_file, bool is_verify);
+    bool is_enabled() const
+    {
+        return m_ctx != NULL;
+    }
+
+    SSL* accept(int fd);
+    SSL* connect(int fd);
+
+    static ssize_t send(SSL* ssl, int fd, const void* buffer, size_t length);
+    static ssize_t recv(SSL* ssl, int fd, void* buffer, size_t length);
+    static bool is_readable(SSL* ssl, int fd);
+    static bool is_ktls_send(SSL* ssl);
+    static bool is_ktls_recv(SSL* ssl);
+    static void release(SSL* ssl);
+
+private:
+    bool init_context(const SSL_METHOD* method, bool is_ktls);
+    SSL* handshake(int fd, bool is_server);
+
+private:
+    SSL_CTX* m_ctx;
+    std::string m_host;
+    bool m_is_verify;
+};
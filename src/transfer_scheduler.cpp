@@ -0,0 +1,125 @@
+#include "transfer_scheduler.h"
+
+#include <algorithm>
+
+CTransferScheduler::CTransferScheduler() : m_quantum(SCHED_QUANTUM), m_count(0)
+{
+    pthread_mutex_init(&m_mutex, NULL);
+}
+
+CTransferScheduler::~CTransferScheduler()
+{
+    pthread_mutex_destroy(&m_mutex);
+}
+
+void CTransferScheduler::set_quantum(size_t quantum)
+{
+    pthread_mutex_lock(&m_mutex);
+    m_quantum = quantum;
+    pthread_mutex_unlock(&m_mutex);
+}
+
+size_t CTransferScheduler::get_quantum()
+{
+    pthread_mutex_lock(&m_mutex);
+    size_t quantum = m_quantum;
+    pthread_mutex_unlock(&m_mutex);
+    return quantum;
+}
+
+/*
+ * 新任务排在所属队列的末尾，队列原来为空并且没有任务在执行时进入轮转
+ */
+bool CTransferScheduler::push(sched_job_t* job)
+{
+    pthread_mutex_lock(&m_mutex);
+    flow_t& flow = m_flows[job->flow];
+    bool is_new = flow.jobs.empty() && !flow.is_busy;
+    if (is_new)
+    {
+        flow.deficit = 0;
+    }
+    flow.jobs.push_back(job);
+    ++m_count;
+    if (is_new)
+    {
+        activate(job->flow, job->is_interactive);
+    }
+    pthread_mutex_unlock(&m_mutex);
+    return is_new;
+}
+
+/*
+ * 取出轮转最前面的队列的队头任务，budget为这次可以处理的字节数，没有可以执行的任务时返回NULL
+ */
+sched_job_t* CTransferScheduler::pop(size_t& budget)
+{
+    pthread_mutex_lock(&m_mutex);
+    if (m_active.empty())
+    {
+        pthread_mutex_unlock(&m_mutex);
+        return NULL;
+    }
+
+    flow_t& flow = m_flows[m_active.front()];
+    m_active.pop_front();
+    sched_job_t* job = flow.jobs.front();
+    flow.jobs.pop_front();
+    flow.is_busy = true;
+    flow.deficit += m_quantum * (job->weight > 0 ? job->weight : 1);
+    budget = flow.deficit;
+    pthread_mutex_unlock(&m_mutex);
+    return job;
+}
+
+/*
+ * 任务用掉了used字节，没有结束时放回队头，队列还有任务时排到轮转末尾
+ */
+bool CTransferScheduler::complete(sched_job_t* job, size_t used, bool is_done)
+{
+    pthread_mutex_lock(&m_mutex);
+    std::map<int, flow_t>::iterator it = m_flows.find(job->flow);
+    flow_t& flow = it->second;
+    flow.is_busy = false;
+    flow.deficit -= std::min(used, flow.deficit);
+    if (is_done)
+    {
+        --m_count;
+    }
+    else
+    {
+        flow.jobs.push_front(job);
+    }
+
+    bool is_active = !flow.jobs.empty();
+    if (is_active)
+    {
+        activate(job->flow, false);
+    }
+    else
+    {
+        m_flows.erase(it);
+    }
+    pthread_mutex_unlock(&m_mutex);
+    return is_active;
+}
+
+size_t CTransferScheduler::size()
+{
+    pthread_mutex_lock(&m_mutex);
+    size_t count = m_count;
+    pthread_mutex_unlock(&m_mutex);
+    return count;
+}
+
+void CTransferScheduler::activate(int flow, bool is_front)
+{
+    if (is_front)
+    {
+        m_active.push_front(flow);
+    }
+    else
+    {
+        m_active.push_back(flow);
+    }
+}
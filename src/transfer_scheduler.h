@@ -0,0 +1,72 @@
+#pragma once
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <map>
+#include <list>
+#include <deque>
+
+/* 每轮每个队列获得的基本字节数 */
+const size_t SCHED_QUANTUM = 256 * 1024;
+
+/*
+ * 等待调度的一个任务，由调用者分配和释放，调度器只保存指针
+ * flow相同的任务属于同一个队列，同一时间最多执行其中一个，服务器中flow就是会话的控制连接fd
+ */
+struct sched_job_t
+{
+    int flow;
+    /* 每轮获得weight个quantum */
+    int weight;
+    /* 交互类任务（小文件、LIST）所在的队列变为非空时排到轮转的最前面 */
+    bool is_interactive;
+};
+
+/*
+ * 数据传输的调度器，按队列做加权赤字轮转(DRR)
+ * 队列轮到时赤字加上quantum * weight，取出队头任务，本次最多处理赤字这么多字节，
+ * 用完时间片没有结束的任务放回队头，队列排到轮转的末尾，赤字的剩余部分留到下一轮
+ * 队列为空时赤字清零，空闲的队列不能攒下时间片
+ *
+ * pop()和complete()之间任务所在的队列不参与轮转，保证同一个会话的数据连接不会被两个线程同时使用
+ * push()和complete()返回true时有一个队列进入了轮转，调用者应该再安排一个线程来pop()
+ */
+class CTransferScheduler
+{
+public:
+    CTransferScheduler();
+    ~CTransferScheduler();
+
+    void set_quantum(size_t quantum);
+    size_t get_quantum();
+
+    bool push(sched_job_t* job);
+    sched_job_t* pop(size_t& budget);
+    bool complete(sched_job_t* job, size_t used, bool is_done);
+
+    /* 等待执行和正在执行的任务数 */
+    size_t size();
+
+private:
+    struct flow_t
+    {
+        std::deque<sched_job_t*> jobs;
+        size_t deficit;
+        bool is_busy;
+
+        flow_t() : deficit(0), is_busy(false)
+        {
+        }
+    };
+
+    void activate(int flow, bool is_front);
+
+private:
+    size_t m_quantum;
+    size_t m_count;
+    std::map<int, flow_t> m_flows;
+    /* 有任务等待并且没有任务在执行的队列，按轮转顺序 */
+    std::list<int> m_active;
+
+    pthread_mutex_t m_mutex;
+};
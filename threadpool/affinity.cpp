@@ -0,0 +1,136 @@
+#include "affinity.h"
+
+#include <sched.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <fstream>
+
+/*
+ * 解析 0-3,8 这样的列表，空字符串得到空列表
+ */
+bool CAffinity::parse_cpu_list(const std::string& value, std::vector<int>& cpus)
+{
+    std::vector<int> result;
+    std::string::size_type begin = 0;
+    while (begin < value.size())
+    {
+        std::string::size_type end = value.find(',', begin);
+        if (end == std::string::npos)
+        {
+            end = value.size();
+        }
+        std::string item = value.substr(begin, end - begin);
+        begin = end + 1;
+        if (item.empty() || item.find_first_not_of("0123456789-") != std::string::npos)
+        {
+            return false;
+        }
+
+        char* tail = NULL;
+        long first = strtol(item.c_str(), &tail, 10);
+        long last = first;
+        if (*tail == '-')
+        {
+            last = strtol(tail + 1, &tail, 10);
+        }
+        if (*tail != '\0' || first < 0 || last < first || last >= CPU_SETSIZE)
+        {
+            return false;
+        }
+        for (long cpu = first; cpu <= last; ++cpu)
+        {
+            result.push_back(static_cast<int>(cpu));
+        }
+    }
+    cpus.swap(result);
+    return true;
+}
+
+/*
+ * 创建线程之前设置，线程从第一条指令开始就在这个CPU上运行，它分配并首先写入的内存由内核放在本地节点
+ */
+bool CAffinity::set_thread_cpu(pthread_attr_t* attr, int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_attr_setaffinity_np(attr, sizeof(set), &set) == 0;
+}
+
+/*
+ * cpu小于0时解除绑定，允许在所有CPU上运行
+ */
+bool CAffinity::pin_thread(pthread_t thread, int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (cpu >= 0)
+    {
+        CPU_SET(cpu, &set);
+    }
+    else
+    {
+        for (int i = 0; i < CPU_SETSIZE; ++i)
+        {
+            CPU_SET(i, &set);
+        }
+    }
+    int ret = pthread_setaffinity_np(thread, sizeof(set), &set);
+    if (ret != 0)
+    {
+        errno = ret;
+        perror("pthread_setaffinity_np");
+        return false;
+    }
+    return true;
+}
+
+int CAffinity::cpu_node(int cpu)
+{
+    const std::vector<int>& nodes = topology();
+    if (cpu < 0 || cpu >= static_cast<int>(nodes.size()))
+    {
+        return 0;
+    }
+    return nodes[cpu];
+}
+
+int CAffinity::current_node()
+{
+    return cpu_node(sched_getcpu());
+}
+
+/*
+ * CPU编号到节点编号的表，第一次使用时读取，之后不再变化
+ */
+const std::vector<int>& CAffinity::topology()
+{
+    static const std::vector<int> nodes = load_topology();
+    return nodes;
+}
+
+std::vector<int> CAffinity::load_topology()
+{
+    std::vector<int> nodes;
+    /* 节点编号可能不连续，逐个尝试 */
+    for (int node = 0; node < AFFINITY_MAX_NODES; ++node)
+    {
+        std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        std::string line;
+        std::vector<int> cpus;
+        if (!file || !std::getline(file, line) || !parse_cpu_list(line, cpus))
+        {
+            continue;
+        }
+        for (size_t i = 0; i < cpus.size(); ++i)
+        {
+            if (cpus[i] >= static_cast<int>(nodes.size()))
+            {
+                nodes.resize(cpus[i] + 1, 0);
+            }
+            nodes[cpus[i]] = node;
+        }
+    }
+    return nodes;
+}
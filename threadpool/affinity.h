@@ -0,0 +1,26 @@
+#pragma once
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+const int AFFINITY_MAX_NODES = 64;
+
+/*
+ * CPU亲和性和NUMA拓扑，拓扑从/sys/devices/system/node读取，读不到时当作只有一个节点0
+ * CPU列表的格式和内核相同，例如 0-3,8,10-11
+ */
+class CAffinity
+{
+public:
+    static bool parse_cpu_list(const std::string& value, std::vector<int>& cpus);
+    static bool set_thread_cpu(pthread_attr_t* attr, int cpu);
+    static bool pin_thread(pthread_t thread, int cpu);
+
+    static int cpu_node(int cpu);
+    static int current_node();
+
+private:
+    static const std::vector<int>& topology();
+    static std::vector<int> load_topology();
+};
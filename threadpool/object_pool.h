@@ -0,0 +1,207 @@
+#pragma once
+
+#include <pthread.h>
+#include <cstddef>
+#include <new>
+#include <vector>
+
+const size_t POOL_BLOCKS_PER_SLAB = 256;
+const size_t POOL_LOCAL_CACHE = 64;
+
+/*
+ * 定长内存池，按slab批量向系统申请内存，释放的块挂在空闲链表上复用
+ * 每个线程有一个本地缓存，分配和释放先走本地缓存，不需要加锁
+ * 本地缓存满了或者空了才和全局空闲链表批量交换，稳态下完全不经过全局malloc
+ */
+template <size_t BLOCK_SIZE>
+class CFixedPool
+{
+public:
+    static CFixedPool& instance()
+    {
+        static CFixedPool pool;
+        return pool;
+    }
+
+    void* allocate()
+    {
+        local_cache_t& cache = local_cache();
+        if (cache.head == NULL)
+        {
+            refill(cache);
+        }
+        block_t* block = cache.head;
+        cache.head = block->next;
+        --cache.count;
+        return block;
+    }
+
+    void deallocate(void* p)
+    {
+        if (p == NULL)
+        {
+            return;
+        }
+        local_cache_t& cache = local_cache();
+        block_t* block = static_cast<block_t*>(p);
+        block->next = cache.head;
+        cache.head = block;
+        if (++cache.count > POOL_LOCAL_CACHE * 2)
+        {
+            flush(cache, POOL_LOCAL_CACHE);
+        }
+    }
+
+    size_t slab_count()
+    {
+        pthread_mutex_lock(&m_mutex);
+        size_t count = m_slabs.size();
+        pthread_mutex_unlock(&m_mutex);
+        return count;
+    }
+
+private:
+    union block_t
+    {
+        block_t* next;
+        std::max_align_t align;
+        char data[BLOCK_SIZE];
+    };
+
+    struct local_cache_t
+    {
+        block_t* head;
+        size_t count;
+
+        local_cache_t() : head(NULL), count(0)
+        {
+        }
+
+        ~local_cache_t()
+        {
+            CFixedPool::instance().flush(*this, 0);
+        }
+    };
+
+    CFixedPool() : m_free_list(NULL)
+    {
+        pthread_mutex_init(&m_mutex, NULL);
+    }
+
+    ~CFixedPool()
+    {
+        for (size_t i = 0; i < m_slabs.size(); ++i)
+        {
+            ::operator delete(m_slabs[i]);
+        }
+        pthread_mutex_destroy(&m_mutex);
+    }
+
+    static local_cache_t& local_cache()
+    {
+        static thread_local local_cache_t cache;
+        return cache;
+    }
+
+    /* 从全局空闲链表取一批块到本地缓存，全局也空了就新申请一个slab */
+    void refill(local_cache_t& cache)
+    {
+        pthread_mutex_lock(&m_mutex);
+        if (m_free_list == NULL)
+        {
+            block_t* slab = static_cast<block_t*>(::operator new(sizeof(block_t) * POOL_BLOCKS_PER_SLAB));
+            m_slabs.push_back(slab);
+            for (size_t i = 0; i < POOL_BLOCKS_PER_SLAB; ++i)
+            {
+                slab[i].next = m_free_list;
+                m_free_list = &slab[i];
+            }
+        }
+        while (m_free_list != NULL && cache.count < POOL_LOCAL_CACHE)
+        {
+            block_t* block = m_free_list;
+            m_free_list = block->next;
+            block->next = cache.head;
+            cache.head = block;
+            ++cache.count;
+        }
+        pthread_mutex_unlock(&m_mutex);
+    }
+
+    /* 把本地缓存中超过keep个的块还给全局空闲链表 */
+    void flush(local_cache_t& cache, size_t keep)
+    {
+        pthread_mutex_lock(&m_mutex);
+        while (cache.count > keep)
+        {
+            block_t* block = cache.head;
+            cache.head = block->next;
+            block->next = m_free_list;
+            m_free_list = block;
+            --cache.count;
+        }
+        pthread_mutex_unlock(&m_mutex);
+    }
+
+private:
+    block_t* m_free_list;
+    std::vector<block_t*> m_slabs;
+    pthread_mutex_t m_mutex;
+};
+
+/*
+ * 基于CFixedPool的STL分配器，单个对象（例如std::map的节点）从内存池分配
+ * 一次申请多个对象时退回全局operator new
+ */
+template <typename T>
+class CPoolAllocator
+{
+public:
+    typedef T value_type;
+
+    template <typename U>
+    struct rebind
+    {
+        typedef CPoolAllocator<U> other;
+    };
+
+    CPoolAllocator()
+    {
+    }
+
+    template <typename U>
+    CPoolAllocator(const CPoolAllocator<U>&)
+    {
+    }
+
+    T* allocate(size_t n)
+    {
+        if (n == 1)
+        {
+            return static_cast<T*>(CFixedPool<sizeof(T)>::instance().allocate());
+        }
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, size_t n)
+    {
+        if (n == 1)
+        {
+            CFixedPool<sizeof(T)>::instance().deallocate(p);
+            return;
+        }
+        ::operator delete(p);
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const CPoolAllocator<T>&, const CPoolAllocator<U>&)
+{
+    return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const CPoolAllocator<T>&, const CPoolAllocator<U>&)
+{
+    return false;
+}
@@ -1,10 +1,17 @@
 #include "task.h"
 
-void (*CTask::process_task)(std::vector<void*>);
-
-CTask::CTask(void (*p_task)(std::vector<void*>), std::vector<void*>args) : m_args(args)
+CTask::CTask(task_function_t p_task, std::initializer_list<void*> args) : m_process_task(p_task), m_next(NULL), m_node(-1), m_enqueue_time(0)
 {
-    process_task = p_task;
+    int i = 0;
+    for (void* arg : args)
+    {
+        if (i >= MAX_TASK_ARGS) break;
+        m_args[i++] = arg;
+    }
+    while (i < MAX_TASK_ARGS)
+    {
+        m_args[i++] = NULL;
+    }
 }
 
 CTask::~CTask()
@@ -14,5 +21,15 @@ CTask::~CTask()
 
 void CTask::run()
 {
-    process_task(m_args);
-}
\ No newline at end of file
+    m_process_task(m_args);
+}
+
+void* CTask::operator new(size_t size)
+{
+    return CFixedPool<sizeof(CTask)>::instance().allocate();
+}
+
+void CTask::operator delete(void* p)
+{
+    CFixedPool<sizeof(CTask)>::instance().deallocate(p);
+}
@@ -1,23 +1,45 @@
 #pragma once
 
+#include "object_pool.h"
+
 #include <iostream>
 #include <unistd.h>
 #include <sys/types.h>
 #include <vector>
 #include <cstring>
+#include <initializer_list>
 #include <sys/socket.h>
 
+const int MAX_TASK_ARGS = 4;
+
+typedef void (*task_function_t)(void** args);
+
+/*
+ * 参数保存在定长数组中，CTask本身从内存池分配，创建和销毁任务都不经过全局malloc
+ */
 class CTask 
 {
 public:
-    CTask(void (*p_task)(std::vector<void*>), std::vector<void*>args);
+    CTask(task_function_t p_task, std::initializer_list<void*> args);
 
     ~CTask();
 
     void run();
 
+    static void* operator new(size_t size);
+    static void operator delete(void* p);
+
 private:
-    static void (*process_task)(std::vector<void*>);
+    friend class CThreadPool;
+
+    task_function_t m_process_task;
+
+    void* m_args[MAX_TASK_ARGS];
 
-    std::vector<void*> m_args;
-};
\ No newline at end of file
+    /* 线程池任务队列的侵入式链表指针，入队不需要额外分配节点 */
+    CTask* m_next;
+    /* 希望在哪个NUMA节点的线程上执行，-1表示不限 */
+    int m_node;
+    /* 入队时间，CLOCK_MONOTONIC毫秒，线程池据此判断排队是否太久 */
+    long m_enqueue_time;
+};
@@ -1,58 +1,312 @@
 #include "threadpool.h"
 
-CThreadPool::CThreadPool() : m_done(false)
+#include <algorithm>
+#include <cerrno>
+#include <time.h>
+
+CThreadPool::CThreadPool() : m_is_monitor(false), m_is_monitor_waiting(false), m_task_head(NULL), m_task_tail(NULL), m_task_count(0), m_retire_count(0),
+                             m_idle_count(0), m_min_threads(0), m_max_threads(0), m_grow_wait(THREADPOOL_GROW_WAIT),
+                             m_idle_timeout(THREADPOOL_IDLE_TIMEOUT), m_spawned(0), m_retired(0), m_done(false)
 {
     pthread_mutex_init(&m_thread_mutex, NULL);
-    pthread_cond_init(&m_thread_cond, NULL);
+
+    /* 超时等待使用CLOCK_MONOTONIC，修改系统时间不影响线程的伸缩 */
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&m_thread_cond, &attr);
+    pthread_cond_init(&m_monitor_cond, &attr);
+    pthread_condattr_destroy(&attr);
 }
 
 CThreadPool::~CThreadPool()
 {
+    stop();
     pthread_mutex_destroy(&m_thread_mutex);
     pthread_cond_destroy(&m_thread_cond);
-    for (int thread_id : m_thread_ids) 
+    pthread_cond_destroy(&m_monitor_cond);
+}
+
+/*
+ * max_threads小于min_threads时线程数固定为min_threads
+ */
+void CThreadPool::run(int min_threads, int max_threads)
+{
+    pthread_mutex_lock(&m_thread_mutex);
+    m_min_threads = min_threads;
+    m_max_threads = std::max(min_threads, max_threads);
+    create_threads(min_threads);
+    if (!m_is_monitor && pthread_create(&m_monitor_id, NULL, process_monitor, static_cast<void*>(this)) == 0)
     {
-        pthread_cancel(thread_id);
+        m_is_monitor = true;
     }
+    pthread_mutex_unlock(&m_thread_mutex);
 }
 
-void CThreadPool::run(int thread_number)
+/*
+ * 调整上下限，线程数少于下限时先取消还没有退出的线程再创建，多于上限时由空闲线程领取退出名额
+ * 正在执行任务的线程做完当前任务后才会退出，上下限之间的线程空闲超时后退出
+ */
+void CThreadPool::resize(int min_threads, int max_threads)
 {
-    while (thread_number--)
+    pthread_mutex_lock(&m_thread_mutex);
+    if (is_stop())
+    {
+        pthread_mutex_unlock(&m_thread_mutex);
+        return;
+    }
+    m_min_threads = min_threads;
+    m_max_threads = std::max(min_threads, max_threads);
+    int current = live_threads();
+    if (min_threads > current)
+    {
+        int revive = std::min(m_retire_count, min_threads - current);
+        m_retire_count -= revive;
+        create_threads(min_threads - current - revive);
+    }
+    else if (m_max_threads < current)
+    {
+        m_retire_count += current - m_max_threads;
+        pthread_cond_broadcast(&m_thread_cond);
+    }
+    /* 上限提高后排队的任务可能需要更多线程 */
+    pthread_cond_signal(&m_monitor_cond);
+    pthread_mutex_unlock(&m_thread_mutex);
+}
+
+/*
+ * 单位为毫秒，grow_wait为0时不自动增加线程，idle_timeout为0时空闲线程不退出
+ */
+void CThreadPool::set_timeout(long grow_wait, long idle_timeout)
+{
+    pthread_mutex_lock(&m_thread_mutex);
+    m_grow_wait = grow_wait;
+    m_idle_timeout = idle_timeout;
+    /* 唤醒等待中的线程，按新的超时时间重新等待 */
+    pthread_cond_broadcast(&m_thread_cond);
+    pthread_cond_signal(&m_monitor_cond);
+    pthread_mutex_unlock(&m_thread_mutex);
+}
+
+int CThreadPool::get_thread_number()
+{
+    pthread_mutex_lock(&m_thread_mutex);
+    int thread_number = live_threads();
+    pthread_mutex_unlock(&m_thread_mutex);
+    return thread_number;
+}
+
+/*
+ * 排队等待执行的任务数，不包括正在执行的任务
+ */
+size_t CThreadPool::get_task_count()
+{
+    pthread_mutex_lock(&m_thread_mutex);
+    size_t task_count = m_task_count;
+    pthread_mutex_unlock(&m_thread_mutex);
+    return task_count;
+}
+
+thread_pool_stats_t CThreadPool::get_stats()
+{
+    pthread_mutex_lock(&m_thread_mutex);
+    thread_pool_stats_t stats;
+    stats.threads = live_threads();
+    stats.idle_threads = m_idle_count;
+    stats.task_count = m_task_count;
+    stats.spawned = m_spawned;
+    stats.retired = m_retired;
+    pthread_mutex_unlock(&m_thread_mutex);
+    return stats;
+}
+
+/*
+ * 调用者持有m_thread_mutex
+ */
+int CThreadPool::live_threads() const
+{
+    return static_cast<int>(m_thread_ids.size()) - m_retire_count;
+}
+
+/*
+ * 调用者持有m_thread_mutex
+ * 配置了CPU时线程创建时就绑定，线程局部的缓冲区在绑定之后第一次写入，分配在本地NUMA节点
+ */
+void CThreadPool::create_threads(int thread_number)
+{
+    join_exited();
+    while (thread_number-- > 0)
     {
         pthread_t tid;
-        pthread_create(&tid, NULL, process_task, static_cast<void*>(this));
-        pthread_detach(tid);
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (!m_cpus.empty())
+        {
+            CAffinity::set_thread_cpu(&attr, m_cpus[m_thread_ids.size() % m_cpus.size()]);
+        }
+        int ret = pthread_create(&tid, &attr, process_task, static_cast<void*>(this));
+        if (ret != 0 && !m_cpus.empty())
+        {
+            /* CPU不存在或者不在本进程允许的范围内，不绑定 */
+            ret = pthread_create(&tid, NULL, process_task, static_cast<void*>(this));
+        }
+        pthread_attr_destroy(&attr);
+        if (ret != 0)
+        {
+            break;
+        }
         m_thread_ids.push_back(tid);
     }
 }
 
+/*
+ * 重新绑定已有的线程，之后创建的线程按新的列表绑定，列表为空时解除绑定
+ */
+void CThreadPool::set_cpus(const std::vector<int>& cpus)
+{
+    pthread_mutex_lock(&m_thread_mutex);
+    if (cpus != m_cpus)
+    {
+        m_cpus = cpus;
+        for (size_t i = 0; i < m_thread_ids.size(); ++i)
+        {
+            CAffinity::pin_thread(m_thread_ids[i], m_cpus.empty() ? -1 : m_cpus[i % m_cpus.size()]);
+        }
+    }
+    pthread_mutex_unlock(&m_thread_mutex);
+}
+
+/*
+ * 当前线程从线程表移到退出表，释放锁之后不再访问线程池，调用者持有m_thread_mutex
+ */
+void CThreadPool::exit_thread()
+{
+    std::vector<pthread_t>::iterator it = m_thread_ids.begin();
+    while (it != m_thread_ids.end() && !pthread_equal(*it, pthread_self()))
+    {
+        ++it;
+    }
+    if (it != m_thread_ids.end())
+    {
+        m_thread_ids.erase(it);
+    }
+    m_exited_ids.push_back(pthread_self());
+}
+
+/*
+ * 调用者持有m_thread_mutex，退出表中的线程已经释放了锁，join不会等待太久
+ */
+void CThreadPool::join_exited()
+{
+    for (size_t i = 0; i < m_exited_ids.size(); ++i)
+    {
+        pthread_join(m_exited_ids[i], NULL);
+    }
+    m_exited_ids.clear();
+}
+
+long CThreadPool::now_ms()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void wait_until(pthread_cond_t* cond, pthread_mutex_t* mutex, long deadline, int* ret)
+{
+    struct timespec ts;
+    ts.tv_sec = deadline / 1000;
+    ts.tv_nsec = (deadline % 1000) * 1000000;
+    *ret = pthread_cond_timedwait(cond, mutex, &ts);
+}
+
 void* CThreadPool::process_task(void* arg)
 {
     CThreadPool* thread_pool = static_cast<CThreadPool*>(arg);
-    while (!thread_pool->is_stop())
+    pthread_mutex_lock(&thread_pool->m_thread_mutex);
+    while (true)
     {
-        pthread_testcancel();
-
-        pthread_mutex_lock(&thread_pool->m_thread_mutex);
-        while (thread_pool->m_tasks.size() == 0)
+        if (thread_pool->is_stop())
+        {
+            break;
+        }
+        if (thread_pool->m_retire_count > 0)
         {
-            pthread_cond_wait(&thread_pool->m_thread_cond, &thread_pool->m_thread_mutex);
-            if (thread_pool->is_stop())
+            --thread_pool->m_retire_count;
+            thread_pool->exit_thread();
+            break;
+        }
+        if (thread_pool->m_task_count == 0)
+        {
+            /* 只有超过下限的线程才会空闲超时，避免线程数降到下限以下 */
+            bool is_elastic = thread_pool->m_idle_timeout > 0 && thread_pool->live_threads() > thread_pool->m_min_threads;
+            int ret = 0;
+            ++thread_pool->m_idle_count;
+            if (is_elastic)
+                wait_until(&thread_pool->m_thread_cond, &thread_pool->m_thread_mutex, now_ms() + thread_pool->m_idle_timeout, &ret);
+            else
+                pthread_cond_wait(&thread_pool->m_thread_cond, &thread_pool->m_thread_mutex);
+            --thread_pool->m_idle_count;
+
+            if (ret == ETIMEDOUT && thread_pool->m_task_count == 0 && !thread_pool->is_stop() &&
+                thread_pool->live_threads() > thread_pool->m_min_threads)
             {
-                pthread_mutex_unlock(&thread_pool->m_thread_mutex);
-                pthread_exit(NULL);
-                return NULL;
+                ++thread_pool->m_retired;
+                thread_pool->exit_thread();
+                break;
             }
+            continue;
         }
 
-        CTask* task = thread_pool->get_task();
+        CTask* task = thread_pool->get_task(CAffinity::current_node());
         pthread_mutex_unlock(&thread_pool->m_thread_mutex);
         task->run();
         delete task;
+        pthread_mutex_lock(&thread_pool->m_thread_mutex);
     }
+    pthread_mutex_unlock(&thread_pool->m_thread_mutex);
+    return NULL;
+}
+
+/*
+ * 没有空闲线程并且队头任务等待超过m_grow_wait时增加一个线程，之后至少再过m_grow_wait才会继续增加，
+ * 突发的任务使线程数逐步增加，不会一次创建到上限；队列为空或者已经到达上限时等待add_task()唤醒
+ */
+void* CThreadPool::process_monitor(void* arg)
+{
+    CThreadPool* thread_pool = static_cast<CThreadPool*>(arg);
+    pthread_mutex_lock(&thread_pool->m_thread_mutex);
+    while (!thread_pool->is_stop())
+    {
+        long grow_wait = thread_pool->m_grow_wait;
+        if (grow_wait <= 0 || thread_pool->m_task_count == 0 || thread_pool->live_threads() >= thread_pool->m_max_threads)
+        {
+            thread_pool->m_is_monitor_waiting = true;
+            pthread_cond_wait(&thread_pool->m_monitor_cond, &thread_pool->m_thread_mutex);
+            thread_pool->m_is_monitor_waiting = false;
+            continue;
+        }
 
-    pthread_exit(NULL);
+        int ret = 0;
+        long now = now_ms();
+        long deadline = thread_pool->m_task_head->m_enqueue_time + grow_wait;
+        if (now >= deadline)
+        {
+            size_t thread_number = thread_pool->m_thread_ids.size();
+            if (thread_pool->m_idle_count == 0)
+            {
+                thread_pool->create_threads(1);
+            }
+            if (thread_pool->m_thread_ids.size() > thread_number)
+            {
+                ++thread_pool->m_spawned;
+            }
+            deadline = now + grow_wait;
+        }
+        wait_until(&thread_pool->m_monitor_cond, &thread_pool->m_thread_mutex, deadline, &ret);
+    }
+    pthread_mutex_unlock(&thread_pool->m_thread_mutex);
+    return NULL;
 }
 
 bool CThreadPool::is_stop() const
@@ -60,31 +314,101 @@ bool CThreadPool::is_stop() const
     return m_done == true;
 }
 
+/*
+ * 不再执行排队的任务，等待正在执行的任务完成后join所有线程，排队的任务被删除
+ * 不能在线程池自己的线程中调用
+ */
 void CThreadPool::stop()
 {
+    pthread_mutex_lock(&m_thread_mutex);
+    if (m_done)
+    {
+        pthread_mutex_unlock(&m_thread_mutex);
+        return;
+    }
+    /* m_done之后线程表不再变化 */
     m_done = true;
     pthread_cond_broadcast(&m_thread_cond);
+    pthread_cond_signal(&m_monitor_cond);
+    std::vector<pthread_t> thread_ids(m_thread_ids);
+    thread_ids.insert(thread_ids.end(), m_exited_ids.begin(), m_exited_ids.end());
+    m_thread_ids.clear();
+    m_exited_ids.clear();
+    m_retire_count = 0;
+    pthread_mutex_unlock(&m_thread_mutex);
+
+    if (m_is_monitor)
+    {
+        pthread_join(m_monitor_id, NULL);
+        m_is_monitor = false;
+    }
+    for (size_t i = 0; i < thread_ids.size(); ++i)
+    {
+        pthread_join(thread_ids[i], NULL);
+    }
+
+    while (m_task_head != NULL)
+    {
+        CTask* task = m_task_head;
+        m_task_head = task->m_next;
+        delete task;
+    }
+    m_task_tail = NULL;
+    m_task_count = 0;
 }
 
-void CThreadPool::add_task(CTask* task)
+/*
+ * node为任务数据所在的NUMA节点，该节点上的线程优先执行，其他线程空闲时照样可以取走
+ * 监视线程在等待唤醒时通知它开始计时，排队太久时增加线程
+ */
+void CThreadPool::add_task(CTask* task, int node)
 {
+    task->m_node = node;
+    task->m_enqueue_time = now_ms();
     pthread_mutex_lock(&m_thread_mutex);
-    bool is_signal = false;
-    if (m_tasks.size() == 0)
-        is_signal = true;
+    task->m_next = NULL;
+    if (m_task_tail == NULL)
+        m_task_head = task;
+    else
+        m_task_tail->m_next = task;
+    m_task_tail = task;
+    ++m_task_count;
 
-    m_tasks.push(task);
-
-    if (is_signal)
+    if (m_idle_count > 0)
     {
         pthread_cond_signal(&m_thread_cond);
     }
+    if (m_is_monitor_waiting)
+    {
+        pthread_cond_signal(&m_monitor_cond);
+    }
     pthread_mutex_unlock(&m_thread_mutex);
 }
 
-CTask* CThreadPool::get_task()
+/*
+ * 调用者持有m_thread_mutex，队列不为空
+ */
+CTask* CThreadPool::get_task(int node)
 {
-    CTask* task = m_tasks.front();
-    m_tasks.pop();
+    CTask* prev = NULL;
+    CTask* task = m_task_head;
+    for (int i = 0; i < THREADPOOL_NODE_SCAN && task != NULL && task->m_node != -1 && task->m_node != node; ++i)
+    {
+        prev = task;
+        task = task->m_next;
+    }
+    if (task == NULL || (task->m_node != -1 && task->m_node != node))
+    {
+        prev = NULL;
+        task = m_task_head;
+    }
+
+    if (prev == NULL)
+        m_task_head = task->m_next;
+    else
+        prev->m_next = task->m_next;
+    if (m_task_tail == task)
+        m_task_tail = prev;
+    --m_task_count;
     return task;
-}
\ No newline at end of file
+}
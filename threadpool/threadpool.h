@@ -1,32 +1,88 @@
 #pragma once
 
 #include "task.h"
+#include "affinity.h"
 #include <pthread.h>
 #include <iostream>
 #include <queue>
 #include <vector>
 
-class CThreadPool 
+/* 取任务时在队列前面这么多个任务中找本节点的任务，找不到时取队头 */
+const int THREADPOOL_NODE_SCAN = 8;
+/* 队头任务等待超过这么多毫秒并且没有空闲线程时增加一个线程 */
+const long THREADPOOL_GROW_WAIT = 20;
+/* 超过最小线程数的线程空闲这么多毫秒后退出 */
+const long THREADPOOL_IDLE_TIMEOUT = 60 * 1000;
+
+struct thread_pool_stats_t
+{
+    int threads;
+    int idle_threads;
+    size_t task_count;
+    /* 因为排队太久而增加的线程数和空闲超时退出的线程数，从run()开始累计 */
+    size_t spawned;
+    size_t retired;
+};
+
+/*
+ * 线程数在[min_threads, max_threads]之间伸缩
+ * 监视线程在队头任务等待超过grow_wait并且没有空闲线程时增加线程，工作线程空闲超过idle_timeout时退出
+ * 退出的线程由stop()或者下一次创建线程时join，stop()返回时所有线程都已经结束
+ */
+class CThreadPool
 {
 public:
     CThreadPool();
     ~CThreadPool();
 
-    void run(int thread_number = 10);
+    void run(int min_threads = 10, int max_threads = 0);
+    void resize(int min_threads, int max_threads = 0);
+    void set_timeout(long grow_wait, long idle_timeout);
+    int get_thread_number();
+    size_t get_task_count();
+    thread_pool_stats_t get_stats();
     void stop();
-    void add_task(CTask* task);
+    void add_task(CTask* task, int node = -1);
+    void set_cpus(const std::vector<int>& cpus);
 
 private:
     bool is_stop() const;
-    CTask* get_task();
+    int live_threads() const;
+    CTask* get_task(int node);
+    void create_threads(int thread_number);
+    void exit_thread();
+    void join_exited();
+    static long now_ms();
     static void* process_task(void* args);
+    static void* process_monitor(void* args);
 
 private:
     std::vector<pthread_t> m_thread_ids;
-    std::queue<CTask*> m_tasks;
+    /* 已经退出还没有join的线程 */
+    std::vector<pthread_t> m_exited_ids;
+    pthread_t m_monitor_id;
+    bool m_is_monitor;
+    /* 监视线程在没有超时的等待中，需要add_task()唤醒 */
+    bool m_is_monitor_waiting;
+
+    CTask* m_task_head;
+    CTask* m_task_tail;
+    size_t m_task_count;
+    /* 等待退出的线程数，resize()缩小线程池时空闲线程领取后退出 */
+    int m_retire_count;
+    int m_idle_count;
+    int m_min_threads;
+    int m_max_threads;
+    long m_grow_wait;
+    long m_idle_timeout;
+    size_t m_spawned;
+    size_t m_retired;
+    /* 第i个线程绑定到m_cpus[i % size]，为空时不绑定 */
+    std::vector<int> m_cpus;
 
     pthread_mutex_t m_thread_mutex;
     pthread_cond_t m_thread_cond;
+    pthread_cond_t m_monitor_cond;
 
     bool m_done;
-};
\ No newline at end of file
+};